@@ -1,8 +1,5 @@
 #version 450 core
 
-#define MAX_LIGHTS_PER_TILE 1023
-#define WORK_GROUP_SIZE 16
-
 layout (location = 0) out vec4 finalColor;
 
 uniform sampler2D diffuseTex;
@@ -26,25 +23,45 @@ uniform float specularExp;
 uniform float opacity;
 
 
-struct PointLightToGPU {
-	vec4 position_and_radius;
-	vec4 color_and_luminance;
+// The scene's PointLightPool as it is, one array of positions and one of colors
+layout(std430, binding = 0) readonly buffer PointLightPositions {
+	vec4 pointLightPositions[]; // position_and_radius
+};
+layout(std430, binding = 4) readonly buffer PointLightColors {
+	vec4 pointLightColors[]; // color_and_luminance
+};
+
+// Falls off from full at cos_inner to nothing at cos_outer, luminance comes from the color
+struct SpotLightToGPU {
+	vec4 position_and_range;
+	vec4 direction_and_cos_outer;
+	vec4 color_and_cos_inner;
 };
-layout(std430, binding = 0) buffer PointLights {
-	PointLightToGPU pointLights[];
+layout(std430, binding = 3) readonly buffer SpotLights {
+	SpotLightToGPU spotLights[];
 };
 
-// each tile supports 1023 unique point lights
-struct Tile {
-	uint pointLightIndices[MAX_LIGHTS_PER_TILE]; // 1023 point lights supported
-	uint numLights;
+// Each froxel's lights from offset on in clusterLightIndices, numPointLights point light
+// indices then numSpotLights spot light indices
+struct Cluster {
+	uint offset;
+	uint numPointLights;
+	uint numSpotLights;
+};
+layout(std430, binding = 1) readonly buffer Clusters {
+	Cluster clusters[];
 };
-layout(std430, binding = 1) readonly buffer LightTiles {
-	Tile lightTiles[];
+layout(std430, binding = 2) readonly buffer ClusterLightIndices {
+	uint clusterLightIndices[];
 };
 
 uniform vec3 camPos;
-uniform ivec2 numTiles;
+uniform mat4 view;
+
+// Froxels along x, y and depth, and the log depth to slice mapping LightClusters builds with
+uniform uvec3 numClusters;
+uniform float clusterScale;
+uniform float clusterBias;
 
 uniform vec3 directionalLightDir;
 uniform vec3 directionalLightCol;
@@ -104,19 +121,21 @@ void main() {
 
 vec3 calculatePointLights(vec3 eye, vec3 n, vec4 d, vec3 spec, float specExp, vec2 screenCoords) {
 
-	// First, calculate which tile this fragment is in
-	ivec2 tileCoord = ivec2(screenCoords.x * numTiles.x, screenCoords.y * numTiles.y);
-	int oneDimTileCoord = tileCoord.y * numTiles.x + tileCoord.x;
+	// First, calculate which froxel this fragment is in
+	float viewDepth = -(view * vec4(fragPos, 1.0)).z;
+	uvec2 tile = uvec2(clamp(ivec2(screenCoords * vec2(numClusters.xy)), ivec2(0), ivec2(numClusters.xy) - 1));
+	uint slice = uint(clamp(int(floor(log(viewDepth) * clusterScale + clusterBias)), 0, int(numClusters.z) - 1));
+	Cluster cluster = clusters[(slice * numClusters.y + tile.y) * numClusters.x + tile.x];
 	
 	vec3 outColor = vec3(0, 0, 0);
 
 	// For each pointLight, run through and add up calculations
-	for (int i = 0; i < lightTiles[oneDimTileCoord].numLights; i++) {
-		uint index = lightTiles[oneDimTileCoord].pointLightIndices[i];
+	for (uint i = 0; i < cluster.numPointLights; i++) {
+		uint index = clusterLightIndices[cluster.offset + i];
 
 		// Cache since ssbo access is slow (only two acceses instead of 4
-		vec4 position_and_radius = pointLights[index].position_and_radius;
-		vec4 color_and_luminance = pointLights[index].color_and_luminance;
+		vec4 position_and_radius = pointLightPositions[index];
+		vec4 color_and_luminance = pointLightColors[index];
 
 		vec3 lightDir = normalize(position_and_radius.xyz - fragPos);
 
@@ -139,6 +158,37 @@ vec3 calculatePointLights(vec3 eye, vec3 n, vec4 d, vec3 spec, float specExp, ve
 		}
 	}
 
+	// Then the froxel's spot lights, the same but faded out towards the edge of their cone
+	for (uint i = 0; i < cluster.numSpotLights; i++) {
+		uint index = clusterLightIndices[cluster.offset + cluster.numPointLights + i];
+
+		vec4 position_and_range = spotLights[index].position_and_range;
+		vec4 direction_and_cos_outer = spotLights[index].direction_and_cos_outer;
+		vec4 color_and_cos_inner = spotLights[index].color_and_cos_inner;
+
+		vec3 lightDir = normalize(position_and_range.xyz - fragPos);
+		float dist = length(position_and_range.xyz - fragPos);
+		float cone = smoothstep(direction_and_cos_outer.w, max(color_and_cos_inner.w, direction_and_cos_outer.w + 0.0001), dot(-lightDir, direction_and_cos_outer.xyz));
+
+		float ndotL = max(dot(n, lightDir), 0.0);
+		if (ndotL > 0.0 && cone > 0.0 && dist < position_and_range.w) {
+			// diffuse
+			vec3 diffuseColor = d.rgb * color_and_cos_inner.rgb * ndotL;
+
+			// specular
+			vec3 h = normalize(lightDir + eye);
+			float exponent = pow(max(dot(h, n), 0.0), specExp);
+			vec3 specularColor = spec * exponent;
+
+			// attenuation
+			float luminance = dot(color_and_cos_inner.rgb, vec3(0.3, 0.6, 0.1));
+			float attenuation = cone * luminance / (1 + 1 * dist + 2 * dist * dist);
+
+			outColor += diffuseColor * attenuation; // diffuse
+			outColor += specularColor * attenuation; // specular
+		}
+	}
+
 	return outColor;
 }
 
@@ -13,6 +13,9 @@ void luaSetup(sol::state& L);
 // output functionName(lua_State* luaState);
 
 int addPointLight(const float&, const float&, const float&, const float&, const float&, const float&);
+int placePointLight(const int&, const float&, const float&, const float&);
+int setPointLightColor(const int&, const float&, const float&, const float&);
+int removePointLight(const int&);
 int addDirectionalLight(const float&, const float&, const float&, const float&, const float&, const float&);
 int addModel();
 int addInstance(const std::string&);
@@ -21,4 +24,8 @@ int scaleInstance(const int&, const float&, const float&, const float&);
 int rotateInstance(const int&, const float&, const float&);
 int rotateSunX(const int&, const float&);
 
+// Flat arrays in and out so a whole batch costs one call
+int raycast(const sol::table&, const sol::table&, const float&);
+sol::object raycastResults(const int&, sol::this_state);
+
 #endif // LUA_SUPPORT_H_
\ No newline at end of file
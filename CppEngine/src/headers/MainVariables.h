@@ -2,7 +2,9 @@
 // Holds main function variables and include statements
 
 #include <SDL.h>
+#include <algorithm>
 #include <ostream>
+#include <thread>
 #include "glad/glad.h"
 #include "SDL_Static_Helper.h"
 
@@ -15,8 +17,11 @@
 #include "Globals.h"
 #include "Camera.h"
 #include "Scene.h"
+#include "Raycaster.h"
 
 #include "Configuration.h"
+#include "JobSystem.h"
+#include "TileFarm.h"
 
 #include "lua-5.3.5/src/lua.hpp"
 #include "LuaSupport.h"
@@ -51,6 +56,7 @@ SDL_GLContext context;
 Camera* mainCamera;
 Scene* mainScene;
 BVH* bvh;
+Raycaster* raycaster;
 
 // Helper functions
 int Init();
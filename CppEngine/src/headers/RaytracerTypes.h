@@ -0,0 +1,166 @@
+#ifndef RAYTRACER_TYPES_H_
+#define RAYTRACER_TYPES_H_
+
+#define GLM_FORCE_RADIANS
+#include "glm/glm.hpp"
+
+#include <cstdint>
+
+// Mirrors the structs in rayTrace.comp so the CPU and GPU tracers read the same
+
+#define RAY_MAX_DIST 10000000.0f
+#define SMALL_NUMBER 0.0001f
+#define REALLY_SMALL_NUMBER 0.0000001f
+#define NO_HIT 0xFFFFFFFF
+
+/***** * * * * * CPU * * * * * *****/
+
+struct Ray {
+	glm::vec3 pos;
+	glm::vec3 dir;
+	float tMax;
+};
+
+// What traversal records. Shading attributes are only fetched once for the closest hit,
+// where the shader fetches them for every triangle it hits along the way.
+struct TriangleHit {
+	uint32_t triangleIndex = NO_HIT;
+	float u = 0;
+	float v = 0;
+};
+
+struct Intersection {
+	glm::vec3 point;
+	glm::vec3 normal;
+	glm::vec2 uvs;
+	uint32_t materialIndex;
+	uint32_t triangleIndex;
+
+	// Ray cone footprint at the hit and the texture independent part of its LOD, CPU only
+	float coneWidth;
+	float surfaceLOD;
+};
+
+// Primary hit attributes the denoiser filters by. A miss has depth RAY_MAX_DIST, a zero normal
+// and white albedo.
+struct PixelFeatures {
+	glm::vec3 position;
+	glm::vec3 normal;
+	glm::vec3 albedo;
+	// Distance along the primary ray
+	float depth;
+};
+
+// What light resampling needs to weigh a light at a primary hit. A miss has depth RAY_MAX_DIST.
+struct ShadingSurface {
+	glm::vec3 position;
+	glm::vec3 normal;
+	glm::vec3 baseDiffuse;
+	glm::vec3 baseSpecular;
+	float specularExponent;
+	// Distance along the primary ray
+	float depth;
+};
+
+// One light picked out of a stream of weighted candidates, "Spatiotemporal reservoir resampling
+// for real-time ray tracing with dynamic direct lighting" (Bitterli et al. 2020)
+struct LightReservoir {
+	uint32_t light = NO_HIT;
+	// Target function of light at the surface the reservoir belongs to
+	float targetPdf = 0;
+	float weightSum = 0;
+	// Candidates seen, fractional once history is capped
+	float count = 0;
+	// What the light's unshadowed contribution is scaled by. Zero when the light was found shadowed.
+	float contributionWeight = 0;
+};
+
+// What one pixel's rays cost. Only counted with PROFILING, while CPURayTracer::ShowRayStats is on.
+struct RayCounters {
+	uint32_t nodesVisited = 0;
+	uint32_t aabbTests = 0;
+	uint32_t triangleTests = 0;
+	uint32_t shadowRays = 0;
+	// Reflection rays traced after the primary one
+	uint32_t bounces = 0;
+	// Candidate hits on alpha tested triangles, and how many of those had to read the texture
+	uint32_t alphaTests = 0;
+	uint32_t alphaFetches = 0;
+};
+
+// Which RayCounters member a ray stats heatmap shows
+enum class RayStat : uint32_t {
+	None,
+	NodesVisited,
+	AABBTests,
+	TriangleTests,
+	ShadowRays,
+	Bounces,
+	AlphaTests,
+	AlphaFetches,
+	Count
+};
+
+// What a gameplay raycast gets back. t is negative on a miss.
+struct RaycastHit {
+	float t = -1.0f;
+	uint32_t triangleIndex = NO_HIT;
+	uint32_t instanceIndex = NO_HIT;
+	uint32_t materialIndex = NO_HIT;
+};
+
+// A reflection waiting for its bounce to be traced in the wavefront path
+struct QueuedRay {
+	Ray ray;
+	glm::vec3 multiplier;
+	float coneWidth = 0;
+	uint32_t pixel = NO_HIT;
+};
+
+// Structure of arrays packet of N rays for SIMD traversal. N is a multiple of 4 so each
+// lane group lines up with one SSE register.
+template <uint32_t N>
+struct alignas(16) RayPacket {
+	static_assert(N % 4 == 0 && N <= 32, "Ray packets are built from groups of 4 lanes and masked with 32 bits");
+
+	float posX[N]; float posY[N]; float posZ[N];
+	float dirX[N]; float dirY[N]; float dirZ[N];
+	float tMax[N];
+
+	// Results
+	uint32_t triangleIndex[N];
+	float u[N]; float v[N];
+
+	void SetRay(uint32_t lane, const Ray& ray) {
+		posX[lane] = ray.pos.x; posY[lane] = ray.pos.y; posZ[lane] = ray.pos.z;
+		dirX[lane] = ray.dir.x; dirY[lane] = ray.dir.y; dirZ[lane] = ray.dir.z;
+		tMax[lane] = ray.tMax;
+		triangleIndex[lane] = NO_HIT;
+		u[lane] = 0; v[lane] = 0;
+	}
+
+	Ray GetRay(uint32_t lane) const {
+		Ray ray;
+		ray.pos = glm::vec3(posX[lane], posY[lane], posZ[lane]);
+		ray.dir = glm::vec3(dirX[lane], dirY[lane], dirZ[lane]);
+		ray.tMax = tMax[lane];
+		return ray;
+	}
+
+	TriangleHit GetHit(uint32_t lane) const {
+		TriangleHit hit;
+		hit.triangleIndex = triangleIndex[lane];
+		hit.u = u[lane];
+		hit.v = v[lane];
+		return hit;
+	}
+
+	void SetHit(uint32_t lane, const Ray& ray, const TriangleHit& hit) {
+		tMax[lane] = ray.tMax;
+		triangleIndex[lane] = hit.triangleIndex;
+		u[lane] = hit.u;
+		v[lane] = hit.v;
+	}
+};
+
+#endif // RAYTRACER_TYPES_H_
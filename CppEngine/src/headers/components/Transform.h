@@ -30,9 +30,12 @@ public:
     void SetPosition(const glm::vec3& p) { 
         position = p;
         model = glm::translate(model, position);
+        modelVersion += 1;
     }
 
     glm::mat4 model;
+    // Goes up whenever model changes, so whoever caches something off of it can tell when to redo it
+    uint32_t modelVersion = 0;
 
     glm::vec3 position;
     glm::vec3 rotation;
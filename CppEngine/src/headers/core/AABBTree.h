@@ -0,0 +1,236 @@
+#ifndef AABB_TREE_H_
+#define AABB_TREE_H_
+
+#define GLM_FORCE_RADIANS
+#include "glm/glm.hpp"
+
+#include "FrustumCuller.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+#define AABB_TREE_NULL 0xFFFFFFFF
+// What PlaneMask gives back for a box behind a plane
+#define AABB_TREE_OUTSIDE 0xFFFFFFFF
+// A leaf's fat box reaches this fraction of its size, plus AABB_TREE_FAT_MIN, past its bounds on
+// every side, so small moves don't take it out of the tree
+#define AABB_TREE_FAT_MARGIN 0.1f
+#define AABB_TREE_FAT_MIN 0.05f
+// Deep enough for any tree the balancing lets through
+#define AABB_TREE_STACK_SIZE 128
+
+	/*
+	 * AABB Tree:
+	 *		Dynamic bounding volume tree over world space boxes, for culling and spatial queries
+	 *		that reject whole subtrees at once. Leaves keep the box they were given and a fat box
+	 *		around it, and Move only takes a leaf out and puts it back in when its box leaves
+	 *		the fat one. New leaves go next to the sibling that grows the tree's surface area
+	 *		the least, and every node on the way back up is rotated to keep the tree balanced.
+	 *		Leaves are found by the proxy Insert hands back, which stays the same until Remove.
+	*/
+class AABBTree {
+public:
+	AABBTree() {}
+	~AABBTree() {}
+
+	// item is handed back by queries. Returns the leaf's proxy.
+	uint32_t Insert(const glm::vec3& boundsMin, const glm::vec3& boundsMax, uint32_t item);
+	void Remove(uint32_t proxy);
+	// Returns true when the leaf had to be put back in somewhere else
+	bool Move(uint32_t proxy, const glm::vec3& boundsMin, const glm::vec3& boundsMax);
+
+	uint32_t Item(uint32_t proxy) const { return nodes[proxy].item; }
+	// The box the leaf was last given, not its fat box
+	const glm::vec3& BoundsMin(uint32_t proxy) const { return nodes[proxy].boundsMin; }
+	const glm::vec3& BoundsMax(uint32_t proxy) const { return nodes[proxy].boundsMax; }
+	uint32_t Count() const { return leafCount; }
+	uint32_t Height() const { return root == AABB_TREE_NULL ? 0 : nodes[root].height; }
+
+	// Calls f(item) for every leaf whose box passes the same plane test FrustumCuller does.
+	// planes are 6 planes facing in. Subtrees fully in front of a plane stop testing it, and
+	// subtrees in front of all 6 are taken whole. Leaves that still straddle a plane are
+	// tested 4 at a time with FrustumCuller::Visible4, so f isn't called in tree order.
+	// Returns how many boxes were tested.
+	template <typename F>
+	uint32_t QueryFrustum(const glm::vec4* planes, F f) const;
+	// Calls f(item) for every leaf whose box overlaps [boundsMin, boundsMax]
+	template <typename F>
+	void QueryBox(const glm::vec3& boundsMin, const glm::vec3& boundsMax, F f) const;
+
+	// 10,000 up to 1,000,000 boxes scattered around eye, culled through the tree against
+	// FrustumCuller's flat loop, and moving 1% of them a frame
+	static void Benchmark(const glm::vec4* planes, const glm::vec3& eye, uint32_t iterations);
+
+private:
+	struct Node {
+		// Internal nodes only use the fat box
+		glm::vec3 fatMin; glm::vec3 fatMax;
+		glm::vec3 boundsMin; glm::vec3 boundsMax;
+		// Next free node while the node is free
+		uint32_t parent;
+		uint32_t child1; uint32_t child2;
+		// Leaves are 0
+		uint32_t height;
+		uint32_t item;
+
+		bool IsLeaf() const { return child1 == AABB_TREE_NULL; }
+	};
+
+	// Bit j set for each plane the box straddles, out of those in mask.
+	// AABB_TREE_OUTSIDE when it's behind one of them.
+	static uint32_t PlaneMask(const glm::vec3& boxMin, const glm::vec3& boxMax, const glm::vec4* planes, uint32_t mask);
+
+	uint32_t AllocateNode();
+	void FreeNode(uint32_t index);
+	void InsertLeaf(uint32_t leaf);
+	void RemoveLeaf(uint32_t leaf);
+	// Rotates a grandchild up if a's children differ in height by more than 1. Returns
+	// whichever node is now where a was.
+	uint32_t Balance(uint32_t a);
+	// Fat box and height from both children
+	void Refit(uint32_t index);
+
+	std::vector<Node> nodes;
+	uint32_t root = AABB_TREE_NULL;
+	uint32_t freeList = AABB_TREE_NULL;
+	uint32_t leafCount = 0;
+};
+
+inline uint32_t AABBTree::PlaneMask(const glm::vec3& boxMin, const glm::vec3& boxMax, const glm::vec4* planes, uint32_t mask) {
+	uint32_t straddled = 0;
+	for (uint32_t j = 0; j < 6; j += 1) {
+		if ((mask & (1u << j)) == 0) {
+			continue;
+		}
+
+		// Most positive corner, summed in the same order FrustumCuller does. Anything a box
+		// holds comes out no less positive on its own, which is what lets a parent decide for
+		// its whole subtree, and lets its leaves skip the planes it's in front of.
+		const glm::vec4& p = planes[j];
+		float most = std::max(boxMin.x * p.x, boxMax.x * p.x)
+			+ std::max(boxMin.y * p.y, boxMax.y * p.y)
+			+ std::max(boxMin.z * p.z, boxMax.z * p.z)
+			+ p.w;
+		if (!(most > 0)) {
+			return AABB_TREE_OUTSIDE;
+		}
+
+		float least = std::min(boxMin.x * p.x, boxMax.x * p.x)
+			+ std::min(boxMin.y * p.y, boxMax.y * p.y)
+			+ std::min(boxMin.z * p.z, boxMax.z * p.z)
+			+ p.w;
+		if (!(least > 0)) {
+			straddled |= 1u << j;
+		}
+	}
+	return straddled;
+}
+
+template <typename F>
+uint32_t AABBTree::QueryFrustum(const glm::vec4* planes, F f) const {
+	if (root == AABB_TREE_NULL) {
+		return 0;
+	}
+
+	FrustumCuller::Planes4 splat;
+	FrustumCuller::SplatPlanes(planes, splat);
+	// Straddling leaves wait here, a lane each, until there are 4 to test
+	float batchMin[3][4] = {};
+	float batchMax[3][4] = {};
+	uint32_t batchItems[4];
+	uint32_t batched = 0;
+	auto flush = [&]() {
+		int visible = FrustumCuller::Visible4(splat, batchMin[0], batchMin[1], batchMin[2], batchMax[0], batchMax[1], batchMax[2]);
+		for (uint32_t lane = 0; lane < batched; lane += 1) {
+			if (visible & (1 << lane)) {
+				f(batchItems[lane]);
+			}
+		}
+		batched = 0;
+	};
+
+	// Each node goes on with the planes its parent straddled, 0 once it's fully inside
+	uint32_t stack[AABB_TREE_STACK_SIZE];
+	uint32_t masks[AABB_TREE_STACK_SIZE];
+	uint32_t size = 1;
+	stack[0] = root;
+	masks[0] = 0x3F;
+
+	uint32_t tested = 0;
+	while (size > 0) {
+		size -= 1;
+		const Node& node = nodes[stack[size]];
+		uint32_t mask = masks[size];
+
+		if (node.IsLeaf()) {
+			if (mask == 0) {
+				f(node.item);
+				continue;
+			}
+
+			tested += 1;
+			for (uint32_t axis = 0; axis < 3; axis += 1) {
+				batchMin[axis][batched] = node.boundsMin[axis];
+				batchMax[axis][batched] = node.boundsMax[axis];
+			}
+			batchItems[batched] = node.item;
+			batched += 1;
+			if (batched == 4) {
+				flush();
+			}
+			continue;
+		}
+
+		if (mask != 0) {
+			tested += 1;
+			mask = PlaneMask(node.fatMin, node.fatMax, planes, mask);
+			if (mask == AABB_TREE_OUTSIDE) {
+				continue;
+			}
+		}
+
+		assert(size + 2 <= AABB_TREE_STACK_SIZE);
+		stack[size] = node.child1; masks[size] = mask; size += 1;
+		stack[size] = node.child2; masks[size] = mask; size += 1;
+	}
+
+	if (batched > 0) {
+		flush();
+	}
+	return tested;
+}
+
+template <typename F>
+void AABBTree::QueryBox(const glm::vec3& boundsMin, const glm::vec3& boundsMax, F f) const {
+	if (root == AABB_TREE_NULL) {
+		return;
+	}
+
+	uint32_t stack[AABB_TREE_STACK_SIZE];
+	uint32_t size = 1;
+	stack[0] = root;
+
+	while (size > 0) {
+		size -= 1;
+		const Node& node = nodes[stack[size]];
+
+		const glm::vec3& nodeMin = node.IsLeaf() ? node.boundsMin : node.fatMin;
+		const glm::vec3& nodeMax = node.IsLeaf() ? node.boundsMax : node.fatMax;
+		if (glm::any(glm::lessThan(nodeMax, boundsMin)) || glm::any(glm::greaterThan(nodeMin, boundsMax))) {
+			continue;
+		}
+
+		if (node.IsLeaf()) {
+			f(node.item);
+			continue;
+		}
+
+		assert(size + 2 <= AABB_TREE_STACK_SIZE);
+		stack[size] = node.child1; size += 1;
+		stack[size] = node.child2; size += 1;
+	}
+}
+
+#endif // AABB_TREE_H_
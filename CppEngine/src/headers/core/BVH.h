@@ -4,11 +4,14 @@
 
 #include "BVHTypes.h"
 #include "RenderTypes.h"
+#include "RaytracerTypes.h"
 
 #include <vector>
 #include "MemoryAllocator.h"
 
 class Model;
+class CacheSimulator;
+class OpacityMicromap;
 
 // This is a BVH class based off of the BVH chapter in the PBRT textbook
 // http://www.pbr-book.org/3ed-2018/Primitives_and_Intersection_Acceleration/Bounding_Volume_Hierarchies.html
@@ -23,6 +26,16 @@ public:
 		SplitMethod splitMethod
 	);
 
+	// Wraps a tree someone else built and flattened, like a tile farm worker reading the
+	// scene out of its mapping. Nodes and parents are copied, the geometry is not.
+	BVH(
+		const LinearBVHNode* nodes,
+		const uint32_t* parents,
+		uint32_t numNodes,
+		const GPUVertex* gpuVertices,
+		const GPUTriangle* gpuTriangles
+	);
+
 	~BVH() {}
 
 	BVHNode* RecursiveBuild(
@@ -34,7 +47,8 @@ public:
 		std::vector<GPUTriangle>& orderedGPUTriangles
 	);
 
-	uint32_t FlattenBVHTree(BVHNode* node, uint32_t* offset);
+	// Also records each node's parent. The root's parent is NO_HIT.
+	uint32_t FlattenBVHTree(BVHNode* node, uint32_t* offset, uint32_t parentOffset = NO_HIT);
 
 	void CreateBVHLeafNode(
 		BVHNode* node,
@@ -51,11 +65,71 @@ public:
 
 	std::vector<LinearBVHNode> GetLinearBVH() const;
 	uint32_t GetBVHSize() const;
+	const std::vector<uint32_t>& GetParents() const { return _parents; }
+
+	// CPU traversal, see BVHTraversal.cpp
+	// Closest hit. Mirrors BVHIntersect in rayTrace.comp, shortening ray.tMax as it goes.
+	bool Intersect(Ray& ray, TriangleHit& hit) const;
+
+	// Same result as Intersect with only BVH_SHORT_STACK_SIZE entries of stack per ray. Once
+	// the stack runs dry after dropping entries, the way on is found through parent links.
+	bool IntersectShortStack(Ray& ray, TriangleHit& hit) const;
+
+	// Closest hit for N coherent rays at once (N = 4, 8 or 16)
+	template <uint32_t N>
+	void IntersectPacket(RayPacket<N>& packet) const;
+
+	// Any hit within ray.tMax, for shadow rays. Stops at the first triangle it finds and never
+	// fetches shading attributes.
+	bool Occluded(const Ray& ray) const;
+	// Batched version, rays heading the same way are traced together as SIMD packets
+	void Occluded(const Ray* rays, uint32_t count, bool* occluded) const;
+
+	// Feeds every node, triangle and vertex the calling thread reads during traversal to
+	// simulator. Only hooked up with PROFILING. Pass nullptr to stop.
+	static void SetCacheSimulator(CacheSimulator* simulator);
+	// Adds every node the calling thread visits, every box and triangle it tests, to counters.
+	// Only hooked up with PROFILING. Pass nullptr to stop.
+	static void SetRayCounters(RayCounters* counters);
+	// The calling thread's counters, for the tracer to add its own rays to. nullptr if none.
+	static RayCounters* GetRayCounters();
+
+	// Hits on triangles with an alpha texture are alpha tested against micromap, which has to
+	// be baked over this BVH's triangles. nullptr treats every triangle as opaque.
+	void SetOpacityMicromap(const OpacityMicromap* micromap) { _opacity = micromap; }
+	const OpacityMicromap* GetOpacityMicromap() const { return _opacity; }
 
 private:
+	bool IntersectSubtree(Ray& ray, TriangleHit& hit, uint32_t rootNode) const;
+	bool IntersectTriangle(uint32_t triangleIndex, Ray& ray, TriangleHit& hit) const;
+	// Climbs from node to the first ancestor it is the near child of and returns the far child
+	// next to it. False once the root is reached.
+	bool NextFarSibling(uint32_t node, const glm::ivec3& dirIsNeg, uint32_t& sibling) const;
+	bool OccludedSubtree(const Ray& ray, const glm::vec3& invDir, uint32_t rootNode) const;
+	bool OccludedTriangle(uint32_t triangleIndex, const Ray& ray) const;
+	// True if a hit at barycentrics u, v lands on a transparent part of an alpha tested triangle
+	bool PassesThrough(uint32_t triangleIndex, float u, float v) const;
+
+	template <uint32_t N>
+	uint32_t IntersectPacketAABB(const LinearBVHNode& node, const RayPacket<N>& packet, const float* invX, const float* invY, const float* invZ, uint32_t mask) const;
+	// Returns which lanes hit
+	template <uint32_t N>
+	uint32_t IntersectPacketTriangle(uint32_t triangleIndex, RayPacket<N>& packet, uint32_t mask) const;
+	// Returns which of the active lanes are blocked
+	template <uint32_t N>
+	uint32_t OccludedPacket(RayPacket<N>& packet, uint32_t activeMask) const;
+
 	const uint32_t _maxPrimsPerNode;
 	const SplitMethod _splitMethod;
 	std::vector<LinearBVHNode> _nodes;
+	// Parent of each node in _nodes. Kept out of LinearBVHNode so the GPU layout stays as is.
+	// A node's sibling is parent + 1 or the parent's offset, whichever it isn't.
+	std::vector<uint32_t> _parents;
+
+	// Geometry the nodes index into. Owned by the AssetManager.
+	const GPUVertex* _vertices = nullptr;
+	const GPUTriangle* _triangles = nullptr;
+	const OpacityMicromap* _opacity = nullptr;
 };
 
 #endif // BVH_H_
\ No newline at end of file
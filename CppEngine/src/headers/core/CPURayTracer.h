@@ -0,0 +1,386 @@
+#ifndef CPU_RAY_TRACER_H_
+#define CPU_RAY_TRACER_H_
+
+#define GLM_FORCE_RADIANS
+#include "glm/glm.hpp"
+
+#include "RenderTypes.h"
+#include "RaytracerTypes.h"
+#include "LightBVH.h"
+#include "LightTree.h"
+#include "TiledTexture.h"
+
+#include <vector>
+
+class BVH;
+class Denoiser;
+class OpacityMicromap;
+
+#define CPU_TILE_SIZE 16
+// 1 main ray. 2 reflection bounces.
+#define CPU_RAY_DEPTH 3
+
+// Progressive mode. A tile is done once the relative standard error of its pixels drops
+// below the threshold, or it runs out of samples.
+#define PROGRESSIVE_MIN_SAMPLES 4
+#define PROGRESSIVE_MAX_SAMPLES 256
+#define PROGRESSIVE_MAX_SAMPLES_PER_FRAME 4
+#define PROGRESSIVE_ERROR_THRESHOLD 0.01f
+
+// Reservoir resampled lighting. Candidates drawn per primary hit, neighbours merged into each
+// pixel and how far away they are picked from, and how many times more candidates than a fresh
+// reservoir the history can count for. Light tree candidates cost a walk down the tree each but
+// are picked far better, so hits draw fewer of them.
+#define RESTIR_CANDIDATES 32
+#define RESTIR_TREE_CANDIDATES 4
+#define RESTIR_SPATIAL_NEIGHBOURS 4
+#define RESTIR_SPATIAL_RADIUS 16
+#define RESTIR_HISTORY_LIMIT 20
+
+// Lightcuts. A cut stops being refined once no cluster in it could be off by more than this
+// fraction of the total, or it holds this many clusters.
+#define LIGHTCUT_ERROR_RATIO 0.02f
+#define LIGHTCUT_MAX_SIZE 256
+
+// Ray stats histograms bucket per pixel counts by powers of two, 0, 1, 2-3, 4-7 and so on.
+// The last bucket takes everything past it.
+#define RAY_STATS_HISTOGRAM_BUCKETS 16
+
+	/*
+	 * CPU Ray Tracer:
+	 *		Traces the same image as rayTrace.comp on the CPU so we can try out traversal
+	 *		and sampling ideas without fighting the driver. Work is split into screen tiles
+	 *		handed out by the JobSystem. With RAY_PACKET_SIZE > 0, primary rays are traced
+	 *		as SIMD packets over small pixel blocks, everything after that is single rays.
+	 *		With CPU_WAVEFRONT, reflections are queued per bounce and traced in batches sorted
+	 *		by direction octant and origin cell instead of straight after their primary ray.
+	 *		With CPU_PROGRESSIVE, jittered samples are accumulated for as long as the camera and
+	 *		lights stay put, and only tiles that are still noisy get traced.
+	 *		Shadow rays only ask whether anything is in the way, point lights included,
+	 *		which the shader doesn't shadow at all. The tree's spot lights are only shaded
+	 *		by the shader so far, here their leaf indices are skipped.
+	 *		Textures come from the CPU copies in MaterialTextures, with the mip level picked from
+	 *		a ray cone per pixel. Without SetTextures every texture reads as white.
+	 *		With CPU_DENOISE, every hit shades a single point light picked at random and the
+	 *		noisy frame goes through the Denoiser along with its normals, depths and albedos.
+	 *		With CPU_TRACE_INTERVAL > 1, only a rotating subset of pixels is traced each frame
+	 *		and the others are reprojected from the last frame, clamped to their traced neighbours.
+	 *		With CPU_RESTIR, point lights come from SetManyLights instead of the tree. Every hit
+	 *		resamples a fixed number of candidates down to one light, and primary hits also merge
+	 *		the reservoirs of their last frame and of a few neighbours, so the shadow ray count
+	 *		doesn't grow with the number of lights. Candidates come from a LightBVH over those
+	 *		lights, which favours the ones close to and facing each hit. With CPU_LIGHTCUTS, the
+	 *		same tree is cut into clusters instead, each shaded as one light, until no cluster
+	 *		could be off by more than LIGHTCUT_ERROR_RATIO of the total.
+	 *		With PROFILING, ShowRayStats counts what every pixel's rays cost and shows one of
+	 *		the counts as a heatmap in place of the image.
+	*/
+class CPURayTracer {
+public:
+	CPURayTracer(
+		const BVH* sceneBVH,
+		const GPUVertex* gpuVertices,
+		const GPUTriangle* gpuTriangles,
+		const GPUMaterial* gpuMaterials,
+		uint32_t renderWidth,
+		uint32_t renderHeight
+	);
+	~CPURayTracer();
+
+	// Lights and the light tree the shader reads, see RayTracingSystem::Setup. Call again
+	// whenever the tree is rebuilt.
+	void SetLights(
+		const PointLightToGPU* lights,
+		const LightTreeView& tree,
+		const glm::vec3& sceneMin,
+		const glm::vec3& sceneMax
+	);
+	void SetDirectionalLight(const glm::vec3& direction, const glm::vec3& color);
+	void SetCamera(const glm::mat4& inverseProj, const glm::mat4& inverseView, const glm::vec3& cameraPos);
+	// One entry per GPU material
+	void SetTextures(const MaterialTextures* materialTextures);
+	// Every light reservoir resampling and lightcuts pick from, any number of them. Builds the
+	// light tree over them.
+	void SetManyLights(const PointLightToGPU* lights, uint32_t count);
+	// The lights given to SetManyLights moved or changed. Refits the light tree, or rebuilds it
+	// once it gets too loose.
+	void UpdateManyLights();
+
+	// Traces a frame into pixels. Blocks until every tile is done. Returns false if nothing
+	// was traced, which only happens once progressive mode has converged.
+	bool Render();
+
+	// Throw away accumulated samples. Camera and light changes made through the setters are
+	// picked up on their own, call this for anything else that changes the image.
+	void ResetAccumulation();
+
+	// RGBA8, bottom row first, ready for glTexSubImage2D
+	const uint32_t* GetPixels() const { return pixels.data(); }
+
+	// Traces only these tiles, depth first on the calling thread, and copies each into output,
+	// which is laid out like GetPixels. Times every tile if tileMicroseconds is given. For
+	// TileFarm workers, which are processes of their own without the JobSystem's threads.
+	void RenderTiles(const uint32_t* tileIndices, uint32_t count, uint32_t* output, uint32_t* tileMicroseconds = nullptr);
+	// Tiles are CPU_TILE_SIZE squares numbered row by row from the bottom left
+	uint32_t NumTiles() const { return numTilesX * numTilesY; }
+
+	// Frames count node visits, box, triangle and alpha tests, shadow rays and bounces per pixel and
+	// show stat as a heatmap instead of whatever mode we're in. They are traced depth first with
+	// single primary rays, since a packet's rays belong to different pixels. Does nothing without
+	// PROFILING. None goes back to the usual frames.
+	void ShowRayStats(RayStat stat);
+	RayStat ShownRayStat() const { return rayStat; }
+	// Totals, per pixel averages, maximums and histograms of every count in the last counted frame
+	void PrintRayStats() const;
+	// A heatmap of every count in the last counted frame, as binary PPMs named prefix followed
+	// by the count. Returns false if any of them couldn't be written.
+	bool WriteRayStatsHeatmaps(const char* prefix) const;
+
+	// Primary ray throughput of single rays against each packet width over a full frame. Also
+	// checks BVH::IntersectShortStack against the full stack.
+	void BenchmarkPrimaryRays(uint32_t iterations);
+	// Frame time of depth first against wavefront, plus rays/s and simulated cache misses
+	// of the first bounce traced in pixel order against sorted order
+	void BenchmarkBounces(uint32_t iterations);
+	// Frame time and shadow rays/s with closest hit shadow rays against any hit occlusion
+	void BenchmarkShadows(uint32_t iterations);
+	// Primary and directional shadow rays alpha tested against the texture on every hit, then
+	// through micromap, which has to be the one our BVH uses. Counts the texture reads it saves.
+	void BenchmarkOpacityMicromap(OpacityMicromap* micromap, uint32_t iterations);
+	// Diffuse lookups from primary and reflection hits with linear textures against tiled ones
+	void BenchmarkTextures(uint32_t iterations);
+	// Denoiser stage timings, SIMD against scalar, and the error of one light frames before and
+	// after denoising, against every light shaded
+	void BenchmarkDenoiser(uint32_t iterations);
+	// Frame time and error against full resolution for every trace interval, over a short
+	// camera move
+	void BenchmarkUpsampling(uint32_t frames);
+	// Frame time and lighting error of one candidate, resampled candidates and resampled with
+	// temporal and spatial reuse, for 32, 1,000 and 100,000 random lights
+	void BenchmarkManyLights(uint32_t frames);
+	// Light tree build times on one thread and across the JobSystem, refits and rebuilds after
+	// lights move, and a check of Sample's pdfs against Pdf
+	void BenchmarkLightBVH(uint32_t iterations);
+
+	// Timings (microseconds)
+	long long traceTime = 0;
+
+	// Progressive stats for the last frame
+	uint32_t tilesTraced = 0;
+	uint32_t tilesConverged = 0;
+
+private:
+	// What FinishPrimary does with a primary hit
+	enum class PrimaryMode {
+		Write,		// Shade the whole path and write the pixel
+		Queue,		// Shade the hit, queue its reflection for the wavefront
+		Accumulate,	// Shade the whole path and add it to the progressive buffer
+		Denoise,	// Shade the whole path and keep it and the hit's features for the denoiser
+		Sparse,		// Shade the whole path and keep it and the hit distance for upsampling
+		Resample	// Shade the whole path but the hit's point lights, keep its surface and light candidates
+	};
+
+	// One count over a whole frame
+	struct RayStatSummary {
+		uint64_t total = 0;
+		uint32_t max = 0;
+		// What the heatmap goes up to, so a few extreme pixels don't wash out the rest
+		uint32_t percentile99 = 0;
+		uint32_t histogram[RAY_STATS_HISTOGRAM_BUCKETS] = {};
+	};
+
+	struct ProgressiveTile {
+		uint32_t samples = 0;
+		float error = 0;
+	};
+
+	// Alias table entry for drawing lights, "A Linear Algorithm For Generating Random Numbers
+	// With a Given Distribution" (Vose 1991)
+	struct LightAlias {
+		float threshold = 1;
+		uint32_t alias = 0;
+	};
+
+	// jitter is the sub pixel position in [0, 1)
+	Ray PrimaryRay(uint32_t x, uint32_t y, const glm::vec2& jitter = glm::vec2(0.0f)) const;
+
+	void RenderDepthFirst();
+	void RenderWavefront();
+	bool RenderProgressive();
+	void RenderDenoised();
+	void RenderUpsampled(uint32_t interval);
+	void RenderResampled();
+
+	void TracePrimaryRays();
+	// Single rays or packets, depending on RAY_PACKET_SIZE
+	void TracePrimaryTile(uint32_t tileIndex, const glm::vec2& jitter = glm::vec2(0.0f));
+	void TraceTile(uint32_t tileIndex, const glm::vec2& jitter = glm::vec2(0.0f));
+	template <uint32_t N>
+	void TracePacketTile(uint32_t tileIndex, const glm::vec2& jitter = glm::vec2(0.0f));
+	void FinishPrimary(uint32_t x, uint32_t y, const Ray& ray, const TriangleHit& hit);
+
+	// Primary hits already found, follows reflections and shades. Not clamped.
+	glm::vec3 Shade(Ray ray, TriangleHit hit, bool primaryPointLights = true) const;
+	// Lighting at a single hit. Returns true with the reflected ray and its weight if the surface is specular.
+	// coneWidth goes in as the ray cone's width at the ray origin and comes out as its width at the hit.
+	bool ShadeHit(const Ray& ray, const TriangleHit& hit, float& coneWidth, glm::vec3& color, Ray& reflection, glm::vec3& reflectance, bool pointLighting = true) const;
+	void GetIntersection(const Ray& ray, const TriangleHit& hit, Intersection& intersection, float coneWidth = 0.0f) const;
+	// Material colors with textures applied, like the top of PointLighting in rayTrace.comp
+	void SurfaceColors(const Intersection& intersection, glm::vec3& baseDiffuse, glm::vec3& baseSpecular) const;
+
+	// Wavefront, see CPURayTracerWavefront.cpp
+	void CompactQueue(std::vector<QueuedRay>& queue) const;
+	void SortQueue();
+	void TraceQueue(bool queueReflections);
+	void TraceQueueRange(uint32_t begin, uint32_t end, bool queueReflections);
+	void ResolveRadiance();
+
+	// Progressive, see CPURayTracerProgressive.cpp
+	bool SceneChanged();
+	uint32_t SamplesThisFrame(const ProgressiveTile& tile) const;
+	void TraceProgressiveTile(uint32_t tileIndex, uint32_t numSamples);
+
+	// Denoised, see CPURayTracerDenoised.cpp
+	void TraceNoisyFrame(bool oneLight);
+	void StoreFeatures(uint32_t pixel, const Ray& ray, const TriangleHit& hit);
+	glm::mat4 ViewProjection() const;
+
+	// Upsampled, see CPURayTracerUpsampled.cpp
+	void AllocateUpsampleBuffers();
+	bool IsTraced(uint32_t x, uint32_t y, uint32_t interval, uint32_t phase) const;
+	void TraceSparseFrame(uint32_t interval, uint32_t phase);
+	void TraceSparseTile(uint32_t tileIndex, uint32_t interval, uint32_t phase);
+	void ReconstructRows(uint32_t begin, uint32_t end, uint32_t interval, uint32_t phase);
+
+	// Resampled and lightcuts, see CPURayTracerResampled.cpp
+	void AllocateResampleBuffers();
+	// Luminance proportional alias table over manyLights
+	void BuildLightAliases();
+	void StoreSurface(uint32_t pixel, const Ray& ray, const TriangleHit& hit);
+	// Streams candidates drawn from the light tree or the alias table into a reservoir
+	LightReservoir SampleLights(const ShadingSurface& surface, uint32_t& seed) const;
+	// Luminance of the light's unshadowed contribution
+	float TargetPdf(uint32_t light, const ShadingSurface& surface) const;
+	bool LightVisible(const PointLightToGPU& light, const ShadingSurface& surface) const;
+	void ResampleTemporalRows(uint32_t begin, uint32_t end);
+	void ResampleSpatialRows(uint32_t begin, uint32_t end);
+	void ShadeResampledRows(uint32_t begin, uint32_t end);
+	// Point lighting at reflection hits, which have no reservoirs to reuse
+	glm::vec3 ResampledPointLighting(const Intersection& intersection, const glm::vec3& baseDiffuse, const glm::vec3& baseSpecular) const;
+	// Shadowed lighting from every light in the tree through one cut, and how many clusters it took
+	glm::vec3 LightcutLighting(const ShadingSurface& surface, uint32_t* cutSize = nullptr) const;
+	// Benchmark lights spread through the scene bounds with totalLuminance between them
+	std::vector<PointLightToGPU> RandomLights(uint32_t count, float totalLuminance, uint32_t& seed) const;
+	// Of the lights given to SetManyLights, or 32 if there are none
+	float ManyLightsLuminance() const;
+
+	// Ray stats, see CPURayTracerStats.cpp
+	void RenderRayStats();
+	void SummarizeRayStats();
+
+	glm::vec3 DirectionalLighting(const Intersection& intersection, const glm::vec3& baseDiffuse, const glm::vec3& baseSpecular) const;
+	glm::vec3 PointLighting(const Intersection& intersection, const glm::vec3& baseDiffuse, const glm::vec3& baseSpecular) const;
+	// Unshadowed diffuse and specular of one point light, dir is unit length towards it
+	glm::vec3 PointLightColor(const PointLightToGPU& light, const ShadingSurface& surface, const glm::vec3& dir, float dist) const;
+	// Which of count lights a hit at point samples this frame
+	uint32_t PickLight(const glm::vec3& point, uint32_t count) const;
+	// Random bits for a hit at point, different every frame
+	uint32_t HitSeed(const glm::vec3& point) const;
+	// Any hit shadow test, or a full closest hit trace when closestHitShadows is set
+	bool Shadowed(const Ray& ray) const;
+	void Shadowed(const Ray* rays, uint32_t count, bool* occluded) const;
+
+	void WritePixel(uint32_t x, uint32_t y, const glm::vec3& color);
+
+	template <uint32_t N>
+	long long TimePrimaryPackets() const;
+	long long TimePrimaryRays(bool shortStack = false) const;
+
+	const BVH* bvh;
+	const GPUVertex* vertices;
+	const GPUTriangle* triangles;
+	const GPUMaterial* materials;
+	const MaterialTextures* textures = nullptr;
+
+	const PointLightToGPU* pointLights = nullptr;
+	LightTreeView pointLightTree;
+	glm::vec3 minBounds; glm::vec3 maxBounds;
+
+	glm::vec3 directionalLightDir; glm::vec3 directionalLightCol;
+	glm::mat4 invProj; glm::mat4 invView; glm::vec3 camPos;
+	// Angle between neighbouring primary rays, how fast ray cones widen
+	float pixelSpreadAngle = 0;
+
+	uint32_t width; uint32_t height;
+	uint32_t numTilesX; uint32_t numTilesY;
+
+	std::vector<uint32_t> pixels;
+
+	PrimaryMode primaryMode = PrimaryMode::Write;
+	// Only for comparing against Occluded in BenchmarkShadows
+	bool closestHitShadows = false;
+
+	// Wavefront
+	std::vector<glm::vec3> radiance;
+	std::vector<QueuedRay> rayQueue;
+	std::vector<QueuedRay> nextRayQueue;
+	std::vector<uint64_t> sortKeys;
+
+	// Progressive. Per pixel rgb sum of samples and sum of squared luminance.
+	std::vector<glm::vec4> accumulation;
+	std::vector<ProgressiveTile> progressiveTiles;
+	std::vector<uint32_t> activeTiles;
+	bool accumulationDirty = true;
+
+	// What the accumulated samples were traced with
+	glm::mat4 lastInvProj; glm::mat4 lastInvView;
+	glm::vec3 lastDirectionalLightDir; glm::vec3 lastDirectionalLightCol;
+
+	// Denoised. Unclamped shaded color and primary hit features per pixel.
+	Denoiser* denoiser = nullptr;
+	std::vector<glm::vec3> noisyColor;
+	std::vector<PixelFeatures> features;
+	// Shade one random point light per hit instead of all of them, reseeded every frame
+	bool sampleOneLight = false;
+	uint32_t frameIndex = 0;
+
+	// Upsampled. Only pixels traced this frame are valid in sparseColor and sparseDepth.
+	std::vector<glm::vec3> sparseColor;
+	std::vector<float> sparseDepth;
+	std::vector<glm::vec3> upsampleHistory;
+	std::vector<glm::vec3> upsampleOutput;
+	uint32_t upsamplePhase = 0;
+	bool upsampleHistoryValid = false;
+	// What the upsampled or resampled history was traced with
+	glm::mat4 lastViewProj;
+
+	// Resampled. Lights with their luminance proportional pdfs, and per pixel surfaces and
+	// reservoirs for this frame and the last.
+	const PointLightToGPU* manyLights = nullptr;
+	uint32_t numManyLights = 0;
+	std::vector<float> lightPdfs;
+	std::vector<LightAlias> lightAliases;
+	LightBVH lightTree;
+	std::vector<glm::vec3> resampleColor;
+	std::vector<glm::vec3> directLighting;
+	std::vector<ShadingSurface> surfaces;
+	std::vector<ShadingSurface> lastSurfaces;
+	std::vector<LightReservoir> reservoirs;
+	std::vector<LightReservoir> lastReservoirs;
+	std::vector<LightReservoir> spatialReservoirs;
+	uint32_t resampleCandidates = RESTIR_CANDIDATES;
+	uint32_t treeCandidates = RESTIR_TREE_CANDIDATES;
+	// Draw treeCandidates from lightTree instead of resampleCandidates from the alias table
+	bool sampleLightTree = true;
+	bool lightcuts = CPU_LIGHTCUTS;
+	bool resampleTemporal = true;
+	bool resampleSpatial = true;
+	bool reservoirHistoryValid = false;
+
+	// Ray stats. Per pixel counts of the last counted frame, and their summaries.
+	RayStat rayStat = RayStat::None;
+	std::vector<RayCounters> rayCounters;
+	RayStatSummary rayStatSummaries[static_cast<uint32_t>(RayStat::Count)];
+};
+
+#endif // CPU_RAY_TRACER_H_
@@ -19,6 +19,8 @@ public:
 
     void Update(const float&);
 	void UpdateFrustumPlanes();
+	// The 6 planes of projView facing in, in frustumPlanes' order
+	static void ExtractFrustumPlanes(const glm::mat4& projView, glm::vec4* planes);
 
     Camera operator=(const Camera&);
 
@@ -0,0 +1,106 @@
+#ifndef DENOISER_H_
+#define DENOISER_H_
+
+#define GLM_FORCE_RADIANS
+#include "glm/glm.hpp"
+
+#include "RaytracerTypes.h"
+
+#include <vector>
+
+// Filter passes, each one spreads its 5x5 taps twice as far apart as the last
+#define DENOISER_ITERATIONS 5
+// Edge stopping, smaller stops harder. Luminance is in standard deviations of the center pixel's
+// lighting, depth is relative to the center pixel's.
+#define DENOISER_SIGMA_LUMINANCE 4.0f
+#define DENOISER_SIGMA_NORMAL 0.3f
+#define DENOISER_SIGMA_DEPTH 0.05f
+// Keeps albedo division from blowing up on black surfaces
+#define DENOISER_MIN_ALBEDO 0.01f
+
+// Temporal. A history sample is reused when the surface it saw is within this fraction of the
+// hit distance and faces about the same way.
+#define DENOISER_REPROJECT_DISTANCE 0.05f
+#define DENOISER_REPROJECT_NORMAL 0.9f
+// Never weight the new frame less than this, so lighting changes still come through
+#define DENOISER_MIN_BLEND 0.1f
+
+	/*
+	 * Denoiser:
+	 *		Edge avoiding à-trous wavelet filter for low sample CPU ray traced frames, from
+	 *		"Edge-Avoiding À-Trous Wavelet Transform for fast Global Illumination Filtering"
+	 *		(Dammertz et al. 2010). Lighting is divided by albedo before filtering so texture
+	 *		detail survives, and the primary hit's normal and depth keep the blur from crossing
+	 *		geometric edges. Luminance differences are measured against each pixel's variance
+	 *		like SVGF (Schied et al. 2017), since one light samples are far too noisy for a fixed
+	 *		color sigma. With temporal on, every pixel is reprojected into the last frame and
+	 *		blended with what was there if it is still the same surface.
+	 *		Each channel lives in its own plane so 4 neighbouring pixels are one SSE load, and
+	 *		rows are split across the JobSystem.
+	*/
+class Denoiser {
+public:
+	Denoiser(uint32_t renderWidth, uint32_t renderHeight);
+	~Denoiser() {}
+
+	// color and features are per pixel, bottom row first like the tracer's. viewProj is what the
+	// frame was traced with, the next frame reprojects through it. output can be color.
+	void Denoise(const glm::vec3* color, const PixelFeatures* features, const glm::mat4& viewProj, glm::vec3* output);
+
+	// Throw away the history, for anything reprojection can't see (lights, materials...)
+	void ResetHistory();
+
+	bool temporal = true;
+	// The scalar filter is only kept around to check and time the SIMD one against
+	bool simd = true;
+
+	// Timings of the last Denoise (microseconds)
+	long long loadTime = 0;
+	long long temporalTime = 0;
+	long long varianceTime = 0;
+	long long filterTime = 0;
+	long long resolveTime = 0;
+
+private:
+	// One channel per plane, width * height floats each
+	struct ColorPlanes {
+		std::vector<float> r;
+		std::vector<float> g;
+		std::vector<float> b;
+		// Of the luminance
+		std::vector<float> variance;
+	};
+
+	void LoadRows(uint32_t begin, uint32_t end, const glm::vec3* color, const PixelFeatures* features);
+	void ReprojectRows(uint32_t begin, uint32_t end, const PixelFeatures* features);
+	// Luminance variance over each pixel's 3x3 neighbourhood
+	void VarianceRows(uint32_t begin, uint32_t end);
+	// One à-trous pass from colors[source] into colors[1 - source]
+	void FilterRows(uint32_t begin, uint32_t end, uint32_t step, uint32_t source);
+	void FilterPixel(uint32_t x, uint32_t y, uint32_t step, uint32_t source);
+	void FilterPixels4(uint32_t x, uint32_t y, uint32_t step, uint32_t source);
+	void ResolveRows(uint32_t begin, uint32_t end, uint32_t source, glm::vec3* output) const;
+
+	uint32_t width; uint32_t height;
+
+	// Albedo divided lighting and its variance, ping ponged between passes
+	ColorPlanes colors[2];
+	std::vector<float> normalX; std::vector<float> normalY; std::vector<float> normalZ;
+	std::vector<float> depth;
+	std::vector<glm::vec3> albedo;
+
+	// Unfiltered lighting accumulated over frames, and the surface it belongs to. Read from
+	// last and written to next, swapped every frame.
+	struct History {
+		std::vector<glm::vec3> lighting;
+		std::vector<glm::vec3> position;
+		std::vector<glm::vec3> normal;
+		std::vector<float> length;
+	};
+	History lastHistory;
+	History nextHistory;
+	glm::mat4 lastViewProj;
+	bool historyValid = false;
+};
+
+#endif // DENOISER_H_
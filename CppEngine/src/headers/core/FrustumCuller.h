@@ -0,0 +1,103 @@
+#ifndef FRUSTUM_CULLER_H_
+#define FRUSTUM_CULLER_H_
+
+#define GLM_FORCE_RADIANS
+#include "glm/glm.hpp"
+
+#include <cstdint>
+#include <vector>
+
+#include <xmmintrin.h>
+
+// Boxes per chunk before a cull is worth splitting further
+#define FRUSTUM_CULL_CHUNK_BOXES 1024
+
+	/*
+	 * Frustum Culler:
+	 *		World space boxes kept as one array per min and max axis, tested 4 at a time against
+	 *		the camera's 6 planes with SSE, split across the JobSystem. A box is kept when every
+	 *		plane has its most positive corner in front of it, the same test and the same float
+	 *		math RendererSystem did one box at a time, so the same boxes come out visible.
+	 *		Arrays are padded to a multiple of 4, padding is never visible.
+	*/
+class FrustumCuller {
+public:
+	FrustumCuller() {}
+	~FrustumCuller() {}
+
+	// Boxes from before keep their bounds, new ones start out as a point at the origin
+	void Resize(uint32_t numBoxes);
+	uint32_t Count() const { return count; }
+
+	// Safe to call from jobs for different indices at once
+	void SetBounds(uint32_t index, const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+		minX[index] = boundsMin.x; minY[index] = boundsMin.y; minZ[index] = boundsMin.z;
+		maxX[index] = boundsMax.x; maxY[index] = boundsMax.y; maxZ[index] = boundsMax.z;
+	}
+
+	// 6 planes with each component in all 4 lanes, what Visible4 tests against
+	struct Planes4 {
+		__m128 x[6]; __m128 y[6]; __m128 z[6]; __m128 w[6];
+	};
+	static void SplatPlanes(const glm::vec4* planes, Planes4& splat);
+	// Bit i set when box i of the 4 starting at each pointer is in front of every plane.
+	// AABBTree tests the leaves it can't take whole with this too.
+	static int Visible4(const Planes4& planes, const float* boxMinX, const float* boxMinY, const float* boxMinZ, const float* boxMaxX, const float* boxMaxY, const float* boxMaxZ);
+
+	// planes are Camera::frustumPlanes, 6 of them facing in
+	void Cull(const glm::vec4* planes);
+	bool Visible(uint32_t index) const { return visible[index] != 0; }
+
+	// Last Cull, in us
+	long long cullTime = 0;
+
+	// 10,000 up to 1,000,000 rotated boxes scattered around eye, their corners transformed and
+	// culled one at a time the way RendererSystem did, against 4 at a time on one thread and
+	// on every thread, and how many came out different. Then Bounds::Transform against the
+	// corners.
+	static void Benchmark(const glm::vec4* planes, const glm::vec3& eye, uint32_t iterations);
+
+private:
+	// Groups of 4 boxes [begin, end)
+	void CullGroups(const glm::vec4* planes, uint32_t begin, uint32_t end);
+
+	uint32_t count = 0;
+	std::vector<float> minX, minY, minZ;
+	std::vector<float> maxX, maxY, maxZ;
+	std::vector<uint8_t> visible;
+};
+
+inline void FrustumCuller::SplatPlanes(const glm::vec4* planes, Planes4& splat) {
+	for (uint32_t j = 0; j < 6; j += 1) {
+		splat.x[j] = _mm_set1_ps(planes[j].x);
+		splat.y[j] = _mm_set1_ps(planes[j].y);
+		splat.z[j] = _mm_set1_ps(planes[j].z);
+		splat.w[j] = _mm_set1_ps(planes[j].w);
+	}
+}
+
+inline int FrustumCuller::Visible4(const Planes4& planes, const float* boxMinX, const float* boxMinY, const float* boxMinZ, const float* boxMaxX, const float* boxMaxY, const float* boxMaxZ) {
+	const __m128 zero = _mm_setzero_ps();
+	__m128 minX4 = _mm_loadu_ps(boxMinX);
+	__m128 minY4 = _mm_loadu_ps(boxMinY);
+	__m128 minZ4 = _mm_loadu_ps(boxMinZ);
+	__m128 maxX4 = _mm_loadu_ps(boxMaxX);
+	__m128 maxY4 = _mm_loadu_ps(boxMaxY);
+	__m128 maxZ4 = _mm_loadu_ps(boxMaxZ);
+
+	// Most positive corner against each plane, summed in the same order the scalar test did
+	int mask = 0xF;
+	for (uint32_t j = 0; j < 6 && mask != 0; j += 1) {
+		__m128 val = _mm_add_ps(
+			_mm_add_ps(
+				_mm_add_ps(
+					_mm_max_ps(_mm_mul_ps(minX4, planes.x[j]), _mm_mul_ps(maxX4, planes.x[j])),
+					_mm_max_ps(_mm_mul_ps(minY4, planes.y[j]), _mm_mul_ps(maxY4, planes.y[j]))),
+				_mm_max_ps(_mm_mul_ps(minZ4, planes.z[j]), _mm_mul_ps(maxZ4, planes.z[j]))),
+			planes.w[j]);
+		mask &= _mm_movemask_ps(_mm_cmpgt_ps(val, zero));
+	}
+	return mask;
+}
+
+#endif // FRUSTUM_CULLER_H_
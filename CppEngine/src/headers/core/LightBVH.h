@@ -0,0 +1,119 @@
+#ifndef LIGHT_BVH_H_
+#define LIGHT_BVH_H_
+
+#define GLM_FORCE_RADIANS
+#include "glm/glm.hpp"
+
+#include "RaytracerTypes.h"
+#include "RenderTypes.h"
+
+#include <vector>
+
+// Light ranges this long or shorter are built and refit on a single thread
+#define LIGHT_BVH_SUBTREE_SIZE 2048
+// Update rebuilds instead of refitting once the tree's total node area has grown this many
+// times over what it was after the last build
+#define LIGHT_BVH_REBUILD_RATIO 2.0f
+
+// 80 bytes, CPU only
+struct LightBVHNode {
+	glm::vec3 boundsMin;
+	// Luminance of intensity, what sampling goes by
+	float power;
+	glm::vec3 boundsMax;
+	// Second child for interior nodes, the first is the next node. The light for leaves.
+	uint32_t offset;
+	// Summed color * luminance of every light below, and summed luminance
+	glm::vec3 intensity;
+	float luminance;
+	// Emission cone. Every light below emits within thetaO of axis, and falls off to nothing over
+	// thetaE past that. Point lights are the whole sphere, thetaO = pi and thetaE = pi / 2.
+	glm::vec3 axis;
+	float cosThetaO;
+	float cosThetaE;
+	// Light that stands in for every light below in a lightcut, picked in proportion to power
+	uint32_t representative;
+	uint32_t numLights;
+	// NO_HIT for the root
+	uint32_t parent;
+};
+
+	/*
+	 * Light BVH:
+	 *		Hierarchy over point lights with their bounds, power and emission cones summed up
+	 *		at every node, for the CPU tracer to pick lights from when there are too many to
+	 *		shade them all. Sample walks down picking children by how much they might light a
+	 *		surface, from "Importance Sampling of Many Lights with Adaptive Tree Splitting"
+	 *		(Conty Estevez and Kulla 2018) as PBRT v4 has it. ErrorBound caps what a node can add
+	 *		to a surface under the tracer's point light model, for lightcuts (Walter et al. 2005).
+	 *		There is one light per leaf and nodes are laid out depth first, so a range of n
+	 *		lights always takes 2n - 1 nodes. Lights are sorted along a Morton curve and split on
+	 *		its highest differing bit, which lets every thread build its own range of the curve
+	 *		straight into its own range of nodes.
+	*/
+class LightBVH {
+public:
+	LightBVH() {}
+	~LightBVH() {}
+
+	// lights has to outlive the tree, Refit and Update read it again
+	void Build(const PointLightToGPU* lights, uint32_t count, bool parallel = true);
+	// Lights keep their count and order but may have moved or changed. The tree keeps its shape.
+	void Refit();
+	// Refits, or rebuilds if refitting has let the tree get too loose. Returns true if it rebuilt.
+	bool Update();
+
+	// Picks a light in proportion to how much it might light a surface at point facing normal.
+	// Returns NO_HIT with a zero pdf if nothing can.
+	uint32_t Sample(const glm::vec3& point, const glm::vec3& normal, float random, float& pdf) const;
+	// Probability of Sample picking light
+	float Pdf(const glm::vec3& point, const glm::vec3& normal, uint32_t light) const;
+
+	// Largest luminance node's lights could add to surface, ignoring shadows. Only light from
+	// above the surface counts, and attenuation is 1 / (1 + d + 2d^2) like the tracer's.
+	float ErrorBound(uint32_t node, const ShadingSurface& surface) const;
+	// Every light below node lumped into its representative
+	PointLightToGPU ClusterLight(uint32_t node) const;
+
+	const std::vector<LightBVHNode>& GetNodes() const { return _nodes; }
+	uint32_t NumLights() const { return _numLights; }
+	// Summed surface area of every node's bounds, how loose the tree is
+	float Cost() const;
+
+private:
+	// A range of the sorted lights built into nodes [node, node + 2 * (end - begin) - 1)
+	struct Subtree {
+		uint32_t node;
+		uint32_t begin;
+		uint32_t end;
+		uint32_t parent;
+	};
+
+	void SortLights(bool parallel);
+	// Where [begin, end) splits, at the highest bit its Morton codes differ in
+	uint32_t FindSplit(uint32_t begin, uint32_t end) const;
+	void BuildSubtree(uint32_t node, uint32_t begin, uint32_t end, uint32_t parent);
+	void SetLeaf(uint32_t node, uint32_t light);
+	// Sums up node's two children into it
+	void SetInterior(uint32_t node);
+	void RefitSubtree(const Subtree& subtree);
+
+	float Importance(const LightBVHNode& node, const glm::vec3& point, const glm::vec3& normal) const;
+
+	const PointLightToGPU* _lights = nullptr;
+	uint32_t _numLights = 0;
+
+	std::vector<LightBVHNode> _nodes;
+	// Morton code in the high bits and light index in the low ones, sorted
+	std::vector<uint64_t> _keys;
+	std::vector<uint32_t> _leafOfLight;
+
+	// Ranges handed to separate threads, and the nodes above them in the order they were split
+	std::vector<Subtree> _subtrees;
+	std::vector<uint32_t> _topNodes;
+
+	bool _parallel = true;
+	float _builtCost = 0;
+};
+
+#endif // LIGHT_BVH_H_
@@ -0,0 +1,102 @@
+#ifndef LIGHT_CLUSTERS_H_
+#define LIGHT_CLUSTERS_H_
+
+#define GLM_FORCE_RADIANS
+#include "glm/glm.hpp"
+
+#include "RenderTypes.h"
+
+#include <cstdint>
+#include <vector>
+
+// Froxels across the screen, up it, and exponential depth slices from the near to the far plane
+#define CLUSTER_TILES_X 16
+#define CLUSTER_TILES_Y 9
+#define CLUSTER_SLICES 24
+#define NUM_CLUSTERS (CLUSTER_TILES_X * CLUSTER_TILES_Y * CLUSTER_SLICES)
+
+	/*
+	 * Light Clusters:
+	 *		Point and spot lights assigned to view frustum froxels on the CPU, every frame. A
+	 *		point light goes in every froxel whose view space box its sphere touches, a spot
+	 *		light in every one its cone does by SpotLightBounds, with no cap, and the
+	 *		froxels share one compact index list, each holding an offset and count into it,
+	 *		so memory follows how many overlaps there actually are. Lights are split across
+	 *		the JobSystem, then counted and scattered into place, so every froxel lists its
+	 *		point lights and then its spot lights, each in light order. tiledLighting.comp
+	 *		and forwardPlusTransparency.frag find a pixel's froxel the same way ClusterIndex
+	 *		does.
+	*/
+class LightClusters {
+public:
+	LightClusters() {}
+	~LightClusters() {}
+
+	// lights are each point light's position and radius, as PointLightPool keeps them. view and
+	// proj are the camera's, proj a symmetric perspective with nearPlane and farPlane
+	void Build(
+		const glm::vec4* lights,
+		uint32_t count,
+		const SpotLightToGPU* spotLights,
+		uint32_t numSpotLights,
+		const glm::mat4& view,
+		const glm::mat4& proj,
+		float nearPlane,
+		float farPlane
+	);
+
+	// NUM_CLUSTERS froxels, x fastest then y then slice
+	const std::vector<LightCluster>& GetClusters() const { return clusters; }
+	const std::vector<uint32_t>& GetLightIndices() const { return lightIndices; }
+
+	// log(viewDepth) * sliceScale + sliceBias is a view depth's slice
+	float SliceScale() const { return sliceScale; }
+	float SliceBias() const { return sliceBias; }
+	// Froxel of a view space point, the same as the shaders pick
+	uint32_t ClusterIndex(const glm::vec3& viewPos) const;
+
+	// Build times for 100 up to 100,000 random point lights in front of the camera, memory
+	// against tiles of 1023 indices, then as many spot lights against their bounding spheres,
+	// and a check that every light reaching a random point in the frustum is in that point's
+	// froxel
+	void Benchmark(const glm::mat4& view, const glm::mat4& proj, float nearPlane, float farPlane, uint32_t iterations);
+
+	// Timings (microseconds)
+	long long buildTime = 0;
+
+private:
+	// Calls emit with every froxel the view space sphere touches and touches accepts, given
+	// the froxel's view space box, in froxel order
+	template <typename Touches, typename Emit>
+	void ForEachCluster(const glm::vec3& center, float radius, Touches touches, Emit emit) const;
+	// Every froxel light touches, lights past count are spotLights
+	template <typename Emit>
+	void ForEachCluster(uint32_t light, Emit emit) const;
+
+	glm::mat4 viewMatrix = glm::mat4(1.0f);
+	// proj[0][0] and proj[1][1], view space x and y over depth to NDC
+	glm::vec2 projScale = glm::vec2(1.0f);
+	float nearDepth = 0.1f;
+	float farDepth = 1000.0f;
+	float sliceScale = 0.0f;
+	float sliceBias = 0.0f;
+	// CLUSTER_SLICES + 1 depths bounding the slices
+	float sliceDepths[CLUSTER_SLICES + 1];
+	// Each froxel's view space min and max x, and y, a little wider than the froxel itself
+	glm::vec2 tileBoundsX[CLUSTER_SLICES][CLUSTER_TILES_X];
+	glm::vec2 tileBoundsY[CLUSTER_SLICES][CLUSTER_TILES_Y];
+
+	std::vector<LightCluster> clusters;
+	std::vector<uint32_t> lightIndices;
+
+	// Only while building
+	const glm::vec4* buildLights = nullptr;
+	uint32_t buildCount = 0;
+	const SpotLightToGPU* buildSpotLights = nullptr;
+
+	// Per chunk of lights, each froxel's point light then spot light count and then where its
+	// next index of each goes, reused frame to frame
+	std::vector<std::vector<uint32_t> > chunkCounts;
+};
+
+#endif // LIGHT_CLUSTERS_H_
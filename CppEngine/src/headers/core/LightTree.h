@@ -0,0 +1,258 @@
+#ifndef LIGHT_TREE_H_
+#define LIGHT_TREE_H_
+
+#define GLM_FORCE_RADIANS
+#include "glm/glm.hpp"
+
+#include "RenderTypes.h"
+
+#include <cstdint>
+#include <vector>
+
+// A node touched by more lights than this is split into octants
+#define LIGHT_TREE_LEAF_LIGHTS 8
+// Splits stop this many levels below the root, 1024 leaves along each axis at most
+#define LIGHT_TREE_MAX_DEPTH 10
+// Changed nodes or indices closer together than this upload as one range
+#define LIGHT_TREE_UPLOAD_GAP 4
+// Update builds the whole tree again once more than 1 in this many point lights changed
+#define LIGHT_TREE_REBUILD_FRACTION 8
+
+// Elements [begin, end) of GetNodes or GetLightIndices
+struct LightTreeRange {
+	uint32_t begin;
+	uint32_t end;
+};
+
+// A built tree's arrays and root cube, all a lookup needs. Whoever holds one keeps the arrays alive.
+struct LightTreeView {
+	const LightTreeNode* nodes = nullptr;
+	const uint32_t* lightIndices = nullptr;
+	uint32_t numNodes = 0;
+	uint32_t numLightIndices = 0;
+	glm::vec3 boundsMin = glm::vec3(0.0f);
+	glm::vec3 boundsMax = glm::vec3(0.0f);
+
+	// The leaf holding point. Points outside the cube get the nearest leaf. rayTrace.comp walks
+	// the tree the same way.
+	const LightTreeNode& Leaf(const glm::vec3& point) const {
+		glm::vec3 nodeMin = boundsMin;
+		glm::vec3 nodeMax = boundsMax;
+		const LightTreeNode* node = nodes;
+		while (node->numPointLights == LIGHT_TREE_INTERIOR) {
+			glm::vec3 center = (nodeMin + nodeMax) * 0.5f;
+			uint32_t octant = 0;
+			for (uint32_t axis = 0; axis < 3; axis += 1) {
+				if (point[axis] >= center[axis]) {
+					octant |= 1 << axis;
+					nodeMin[axis] = center[axis];
+				}
+				else {
+					nodeMax[axis] = center[axis];
+				}
+			}
+			node = nodes + node->offset + octant;
+		}
+		return *node;
+	}
+};
+
+	/*
+	 * Light Tree:
+	 *		Point and spot lights culled into a sparse octree over a cube around the scene, built
+	 *		on the CPU. Spot lights only go where their cone reaches, by SpotLightBounds.
+	 *		A node splits into octants only while more than LIGHT_TREE_LEAF_LIGHTS lights
+	 *		touch it and splitting actually thins them out, so big empty stretches of a large
+	 *		world stay a handful of big leaves and crowded spots go as deep as they need to.
+	 *		Every leaf lists every light touching it, point lights then spot lights in light
+	 *		order, as a run of one compact index list shared by all leaves, so there is no per
+	 *		leaf cap. Nodes are laid out level by level with siblings together, and each level
+	 *		is split across the JobSystem. Nothing in here is specific to the ray tracer, any
+	 *		system with lights and bounds can build one and upload GetNodes and GetLightIndices
+	 *		as they are.
+	 *		Update only goes down into nodes a changed light touched before or touches now,
+	 *		keeping how many lights every node has so it can tell whether each of them still
+	 *		splits. Leaves are edited where they are, new subtrees and lists that outgrew their
+	 *		room go on the ends of the arrays, and what they leave behind is only taken back by
+	 *		the next full Build. Either way, the tree comes out the same as Build would make it.
+	*/
+class LightTree {
+public:
+	LightTree() {}
+	~LightTree() {}
+
+	// lights are each point light's position and radius, as PointLightPool keeps them. The
+	// lights only have to last through the call
+	void Build(
+		const glm::vec4* lights,
+		uint32_t count,
+		const SpotLightToGPU* spotLights,
+		uint32_t numSpotLights,
+		const glm::vec3& sceneMin,
+		const glm::vec3& sceneMax
+	);
+
+	// Catches the tree up with lights that moved, were added or were removed since the last
+	// Build or Update, keeping track of which nodes and indices came out different, so only
+	// those have to be uploaded again. dirtyLights are runs of point lights that may have
+	// changed, lights past the old or the new count are always looked at. Spot lights that
+	// changed, too many changed point lights, or too much left behind by earlier updates
+	// build the whole tree again instead.
+	void Update(
+		const glm::vec4* lights,
+		uint32_t count,
+		const SpotLightToGPU* spotLights,
+		uint32_t numSpotLights,
+		const std::vector<LightTreeRange>& dirtyLights
+	);
+	// Runs of elements the last Update changed, in order, within the current sizes
+	const std::vector<LightTreeRange>& ChangedNodes() const { return changedNodes; }
+	const std::vector<LightTreeRange>& ChangedIndices() const { return changedIndices; }
+
+	// Root first, an interior node's 8 children are together, x then y then z octant bits
+	const LightTreeNode* GetNodes() const { return nodes.data(); }
+	uint32_t NumNodes() const { return static_cast<uint32_t>(nodes.size()); }
+	const uint32_t* GetLightIndices() const { return lightIndices.data(); }
+	uint32_t NumLightIndices() const { return static_cast<uint32_t>(lightIndices.size()); }
+
+	// Only good until the next Build or Update. The root cube goes from the scene's min corner
+	// out to its longest side.
+	LightTreeView View() const;
+	const LightTreeNode& Lookup(const glm::vec3& point) const { return View().Leaf(point); }
+
+	// Build times, sizes and lookups for 1,000 up to 100,000 lights bunched up in towns across
+	// a large world, against the old 8^3 grid over the same world and a Build with
+	// scalarOctants, then the same lights as spot lights shining down, and a check that every
+	// light reaching a random point is in its leaf
+	void Benchmark(uint32_t iterations);
+	// 1%, 10% and 100% of 10,000 and 100,000 town lights drifting every frame, Update against
+	// Build, what each frame uploads, and how many frames came out different from Build
+	void BenchmarkUpdates(uint32_t frames);
+
+	// Timings (microseconds)
+	long long buildTime = 0;
+	long long updateTime = 0;
+
+	// Levels below the root of the deepest leaf since the last Build
+	uint32_t depth = 0;
+
+	// Build sorts point lights into octants 4 at a time with SSE. This does it one light at a
+	// time with the plain per-axis test instead, as a reference to check the SSE one against.
+	bool scalarOctants = false;
+	// Nodes and light indices that aren't the same as other's, element by element. Two
+	// Builds of the same lights come out identical.
+	uint32_t DifferencesFrom(const LightTree& other) const;
+
+private:
+	// A node whose children haven't been decided yet
+	struct PendingNode {
+		uint32_t node;
+		glm::vec3 boundsMin;
+		glm::vec3 boundsMax;
+		// Its lights in levelLights, in build order
+		uint32_t begin;
+		uint32_t count;
+		bool split;
+		// Lights touching each octant, then where the octant's lights start in nextLights
+		uint32_t childCounts[8];
+		// Where a leaf's lights start in lightIndices
+		uint32_t output;
+	};
+
+	// A point light Update looks at, and whether it was and is in the list of the node it's at
+	struct LightChange {
+		uint32_t light;
+		bool inOld;
+		bool inNew;
+	};
+
+	// A node Update goes down into, with its changes in changes
+	struct UpdateNode {
+		uint32_t node;
+		glm::vec3 boundsMin;
+		glm::vec3 boundsMax;
+		uint32_t levelIndex;
+		uint32_t begin;
+		uint32_t count;
+	};
+
+	// Octants of [nodeMin, nodeMax] a light in build order touches, one bit each
+	uint32_t LightOctants(uint32_t light, const glm::vec3& nodeMin, const glm::vec3& nodeMax) const;
+	// Counts the lights of pending's octants and decides whether it splits
+	void Split(PendingNode& pending, uint32_t levelIndex);
+	// It doesn't if it's small or deep enough, or splitting wouldn't take enough lights out of its octants
+	static bool Splits(uint32_t count, const uint32_t* childCounts, uint32_t levelIndex);
+	// Splits level, levelIndex below the root, and every level under it, adding the nodes and
+	// leaf lists onto the ends of the arrays
+	void SplitLevels(uint32_t levelIndex);
+
+	// Update's full Build, diffing everything against the tree before
+	void Rebuild(const glm::vec4* lights, uint32_t count, const SpotLightToGPU* spotLights, uint32_t numSpotLights);
+	// Decides again whether one node splits, with its changes applied, and queues the
+	// children its changes reach
+	void UpdateInterior(const UpdateNode& update);
+	void UpdateLeaf(const UpdateNode& update);
+	// Appends the point lights of every leaf under node, which has stopped splitting
+	void CollectLeaves(uint32_t node, std::vector<uint32_t>& points);
+	// (points - removed) + added of update's changes into updatePoints, points sorted
+	void ApplyChanges(const UpdateNode& update, const std::vector<uint32_t>& points);
+	// Spot lights in the list of the node at [nodeMin, nodeMax], levelIndex below the root
+	void SpotLightsReaching(const glm::vec3& nodeMin, const glm::vec3& nodeMax, uint32_t levelIndex, std::vector<uint32_t>& spots) const;
+	// Makes node a leaf of updatePoints and updateSpots, in its old list if they fit there,
+	// and at the end with room to grow if not
+	void WriteLeaf(uint32_t node);
+	// Sorts ranges and joins those closer than LIGHT_TREE_UPLOAD_GAP
+	static void MergeRanges(std::vector<LightTreeRange>& ranges);
+	// Appends runs where previous and current differ
+	template <typename T>
+	static void DiffRanges(const std::vector<T>& previous, const std::vector<T>& current, std::vector<LightTreeRange>& ranges);
+
+	glm::vec3 boundsMin = glm::vec3(0.0f);
+	glm::vec3 boundsMax = glm::vec3(0.0f);
+	// What the cube was made from, for building again
+	glm::vec3 sceneBoundsMin = glm::vec3(0.0f);
+	glm::vec3 sceneBoundsMax = glm::vec3(0.0f);
+
+	// Only while building. Spot lights are numbered on from the point lights.
+	const glm::vec4* buildLights = nullptr;
+	uint32_t buildCount = 0;
+	const SpotLightToGPU* buildSpotLights = nullptr;
+
+	std::vector<LightTreeNode> nodes;
+	std::vector<uint32_t> lightIndices;
+	// Lights in each node's list, and how long the list allocated to each leaf is
+	std::vector<uint32_t> nodeCounts;
+	std::vector<uint32_t> leafCapacity;
+	// Nodes and indices no node points at any more
+	uint32_t wastedNodes = 0;
+	uint32_t wastedIndices = 0;
+
+	// The lights the tree was built or updated with
+	std::vector<glm::vec4> treeLights;
+	std::vector<SpotLightToGPU> treeSpotLights;
+
+	std::vector<LightTreeRange> changedNodes;
+	std::vector<LightTreeRange> changedIndices;
+
+	// Build scratch, the nodes on the level being split and the next one, with their lights
+	std::vector<PendingNode> level;
+	std::vector<PendingNode> nextLevel;
+	std::vector<uint32_t> levelLights;
+	std::vector<uint32_t> nextLights;
+	// Octants each of levelLights touches
+	std::vector<uint8_t> octants;
+
+	// Update scratch
+	std::vector<LightTreeNode> previousNodes;
+	std::vector<uint32_t> previousIndices;
+	std::vector<uint32_t> movedLights;
+	std::vector<LightChange> changes;
+	std::vector<UpdateNode> updateStack;
+	std::vector<uint32_t> updatePoints;
+	std::vector<uint32_t> updateSpots;
+	std::vector<uint32_t> collected;
+	std::vector<uint32_t> removedLights;
+	std::vector<uint32_t> addedLights;
+};
+
+#endif // LIGHT_TREE_H_
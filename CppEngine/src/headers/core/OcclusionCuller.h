@@ -0,0 +1,92 @@
+#ifndef OCCLUSION_CULLER_H_
+#define OCCLUSION_CULLER_H_
+
+#define GLM_FORCE_RADIANS
+#include "glm/glm.hpp"
+
+#include <cstdint>
+#include <vector>
+
+// Depth buffer size, a multiple of the tile size
+#define OCCLUSION_WIDTH 256
+#define OCCLUSION_HEIGHT 128
+// Each tile is rasterized by one job. Multiples of 4 wide and of 2^(OCCLUSION_HIZ_LEVELS - 1) both ways.
+#define OCCLUSION_TILE_WIDTH 64
+#define OCCLUSION_TILE_HEIGHT 32
+#define OCCLUSION_TILES_X (OCCLUSION_WIDTH / OCCLUSION_TILE_WIDTH)
+#define OCCLUSION_TILES_Y (OCCLUSION_HEIGHT / OCCLUSION_TILE_HEIGHT)
+// The depth buffer and 4 halvings of it, down to 16x8
+#define OCCLUSION_HIZ_LEVELS 5
+
+// Meshes with more triangles than this are never occluders
+#define OCCLUSION_MAX_OCCLUDER_TRIANGLES 8192
+// Most occluders and triangles drawn into the depth buffer a frame
+#define OCCLUSION_MAX_OCCLUDERS 32
+#define OCCLUSION_TRIANGLE_BUDGET 65536
+// Fraction of the screen a mesh's bounds have to cover before it's worth drawing as an occluder
+#define OCCLUSION_MIN_OCCLUDER_AREA 0.02f
+
+	/*
+	 * Occlusion Culler:
+	 *		Small CPU depth buffer of a few big occluders, for throwing away meshes hidden behind
+	 *		them before they are drawn at all. Occluder triangles are clipped to the near plane
+	 *		and binned into screen tiles, then every tile is rasterized 4 pixels at a time with
+	 *		SSE on its own job, keeping the nearest depth, and builds its part of a max depth
+	 *		pyramid. A box is occluded when its nearest corner is behind the farthest depth
+	 *		under its screen rectangle, read from the pyramid level where that rectangle is a
+	 *		few texels across. Depth is NDC z, so nearer is smaller.
+	*/
+class OcclusionCuller {
+public:
+	OcclusionCuller();
+	~OcclusionCuller() {}
+
+	// Starts a frame seen through viewProjection, with nothing drawn
+	void Begin(const glm::mat4& viewProjection);
+	// Fraction of the screen a world box's rectangle covers, 1 when it reaches the near plane
+	float ScreenArea(const glm::vec3& boundsMin, const glm::vec3& boundsMax) const;
+	// Clips and bins a mesh's triangles for Rasterize, placed in the world by model
+	void AddOccluder(const glm::vec3* positions, const uint32_t* indices, uint32_t numIndices, const glm::mat4& model);
+	// Draws every occluder added since Begin and builds the pyramid, a job per tile
+	void Rasterize();
+
+	// True when the world box is hidden behind what was rasterized. Safe to call from jobs.
+	bool Occluded(const glm::vec3& boundsMin, const glm::vec3& boundsMax) const;
+
+	// Since Begin
+	uint32_t NumOccluders() const { return numOccluders; }
+	uint32_t NumTriangles() const { return static_cast<uint32_t>(triangles.size()); }
+	// Last Rasterize, in us
+	long long rasterTime = 0;
+
+	// A wall and a floor in front of 100,000 boxes, how long drawing them and testing the boxes
+	// takes and how many come out occluded. Boxes that reach a pixel in front of the wall and
+	// above the floor are counted again, they can be seen and should never be occluded.
+	static void Benchmark(uint32_t iterations);
+
+private:
+	// Screen space, x and y in pixels, counter clockwise
+	struct ScreenTriangle {
+		glm::vec3 v0; glm::vec3 v1; glm::vec3 v2;
+	};
+
+	// Clipped to the near plane, into 0, 1 or 2 triangles
+	void AddTriangle(const glm::vec4& a, const glm::vec4& b, const glm::vec4& c);
+	void AddScreenTriangle(const glm::vec4& a, const glm::vec4& b, const glm::vec4& c);
+	void RasterizeTile(uint32_t tile);
+	void BuildTileHiZ(uint32_t tile);
+
+	glm::mat4 projView;
+
+	std::vector<ScreenTriangle> triangles;
+	// Triangles overlapping each tile
+	std::vector<uint32_t> bins[OCCLUSION_TILES_X * OCCLUSION_TILES_Y];
+	// Level 0 is the depth buffer, each level after holds the farthest of 2x2 of the one before
+	std::vector<float> hiZ[OCCLUSION_HIZ_LEVELS];
+	// Occluder positions in clip space, reused between occluders
+	std::vector<glm::vec4> clipPositions;
+
+	uint32_t numOccluders = 0;
+};
+
+#endif // OCCLUSION_CULLER_H_
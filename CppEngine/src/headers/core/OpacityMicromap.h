@@ -0,0 +1,132 @@
+#ifndef OPACITY_MICROMAP_H_
+#define OPACITY_MICROMAP_H_
+
+#define GLM_FORCE_RADIANS
+#include "glm/glm.hpp"
+
+#include "RenderTypes.h"
+
+#include <cstdint>
+#include <vector>
+
+struct MaterialTextures;
+class TiledTexture;
+
+// Each triangle is cut into 4^level micro triangles, 2 bits of state each. Level 4 is 256
+// micro triangles in 64 bytes, a cache line per alpha tested triangle.
+#define OPACITY_MICROMAP_LEVEL 4
+
+// What a micro triangle's alpha texture says about every point in it
+enum class MicroOpacity : uint32_t {
+	Transparent = 0,
+	Opaque = 1,
+	// Some of both, the texture decides per hit
+	Unknown = 2
+};
+
+	/*
+	 * Opacity Micromap:
+	 *		Baked alpha test for the CPU tracer. Triangles whose material has an alpha texture
+	 *		are cut into a grid of micro triangles over their barycentrics, and each is marked
+	 *		transparent, opaque or unknown from every texel its bilinear footprint could read,
+	 *		so the mark holds for any point in it. Texels are counted out of a summed area table
+	 *		of each alpha texture, and a part of a triangle is only split further while it comes
+	 *		out mixed. Traversal looks the hit's micro triangle up and only samples the alpha
+	 *		texture for unknown ones. Triangles that come out all opaque or all transparent
+	 *		don't store any states. A hit passes through where alpha is under
+	 *		REALLY_SMALL_NUMBER, same as rayTrace.comp.
+	*/
+class OpacityMicromap {
+public:
+	// Triangles are in the BVH's order and textures has one entry per material. All three have
+	// to outlive the micromap, unknown micro triangles read them again.
+	OpacityMicromap(
+		const GPUVertex* gpuVertices,
+		const GPUTriangle* gpuTriangles,
+		uint32_t numTriangles,
+		const MaterialTextures* materialTextures,
+		uint32_t subdivisionLevel = OPACITY_MICROMAP_LEVEL
+	);
+	// Copies what another micromap baked over the same triangles, see Offsets and States
+	OpacityMicromap(
+		const GPUVertex* gpuVertices,
+		const GPUTriangle* gpuTriangles,
+		const MaterialTextures* materialTextures,
+		const uint32_t* bakedOffsets,
+		uint32_t numTriangles,
+		const uint32_t* bakedStates,
+		uint32_t numStates,
+		uint32_t subdivisionLevel
+	);
+	~OpacityMicromap() {}
+
+	// Whether triangle's material has an alpha texture at all
+	bool AlphaTested(uint32_t triangle) const { return offsets[triangle] != NOT_ALPHA_TESTED; }
+	// State of the micro triangle holding barycentrics u, v. Always Unknown with useMicromap off.
+	MicroOpacity Lookup(uint32_t triangle, float u, float v) const;
+	// Samples triangle's alpha texture at u, v. True if a ray would pass through there.
+	bool SampleTransparent(uint32_t triangle, float u, float v) const;
+
+	// How the micro triangles came out
+	void PrintBakeStats() const;
+
+	uint32_t Level() const { return level; }
+	// One per triangle, what Lookup reads first
+	const std::vector<uint32_t>& Offsets() const { return offsets; }
+	const std::vector<uint32_t>& States() const { return states; }
+
+	// Off samples the alpha texture on every candidate hit of an alpha tested triangle
+	bool useMicromap = true;
+
+	// Timings (microseconds)
+	long long bakeTime = 0;
+
+private:
+	// Summed area table of which texels of an alpha texture a ray passes through, bake only
+	struct TransparentTexels {
+		int32_t width = 0;
+		int32_t height = 0;
+		// (width + 1) * (height + 1), sums[y * (width + 1) + x] covers every texel below x, y
+		std::vector<uint32_t> sums;
+
+		explicit TransparentTexels(const TiledTexture* alpha);
+		// Transparent texels in x0..x1, y0..y1 inclusive, wrapping like the texture does
+		uint64_t Count(int32_t x0, int32_t y0, int32_t x1, int32_t y1) const;
+		uint64_t CountInside(int32_t x0, int32_t y0, int32_t x1, int32_t y1) const;
+	};
+
+	// offsets values that aren't an index into states
+	static const uint32_t NOT_ALPHA_TESTED = 0xFFFFFFFF;
+	static const uint32_t ALL_OPAQUE = 0xFFFFFFFE;
+	static const uint32_t ALL_TRANSPARENT = 0xFFFFFFFD;
+
+	glm::vec2 TriangleUV(uint32_t triangle, float u, float v) const;
+	// Micro triangle index of barycentrics u, v, row by row along v
+	uint32_t MicroTriangle(float u, float v) const;
+	// Classifies the part of triangle within corners, given as barycentrics, and writes every
+	// micro triangle inside it into words. parent is what the part it was split from came out as.
+	void BakeMicroTriangles(uint32_t triangle, const glm::vec2* corners, uint32_t depth, MicroOpacity parent, const TransparentTexels& texels, uint32_t* words) const;
+	MicroOpacity ClassifyMicroTriangle(uint32_t triangle, const glm::vec2* corners, const TransparentTexels& texels) const;
+
+	const GPUVertex* vertices;
+	const GPUTriangle* triangles;
+	const MaterialTextures* textures;
+
+	uint32_t level;
+	// Micro triangles along each edge, 2^level
+	uint32_t edgeSegments;
+	uint32_t wordsPerTriangle;
+
+	// First states word of each triangle, or one of the values above
+	std::vector<uint32_t> offsets;
+	// 16 micro triangles a word, 2 bits each
+	std::vector<uint32_t> states;
+
+	// Bake counts
+	uint32_t numAlphaTriangles = 0;
+	uint32_t numAllOpaque = 0;
+	uint32_t numAllTransparent = 0;
+	uint64_t microCounts[3] = {};
+};
+
+#endif // OPACITY_MICROMAP_H_
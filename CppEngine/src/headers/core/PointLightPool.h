@@ -0,0 +1,131 @@
+#ifndef POINT_LIGHT_POOL_H_
+#define POINT_LIGHT_POOL_H_
+
+#include "Globals.h"
+
+#define GLM_FORCE_RADIANS
+#include "glm/glm.hpp"
+
+#include <cstdint>
+#include <vector>
+
+// A handle's low bits are its slot, the rest the slot's generation when it was handed out.
+// Kept under 31 bits so Lua gets it back as a positive integer.
+#define POINT_LIGHT_SLOT_BITS 20
+#define POINT_LIGHT_GENERATION_BITS 11
+#define POINT_LIGHT_MAX_LIGHTS (1u << POINT_LIGHT_SLOT_BITS)
+#define POINT_LIGHT_INVALID_HANDLE 0xFFFFFFFF
+
+// What changed about a light since the last ClearDirty
+#define POINT_LIGHT_MOVED 1
+#define POINT_LIGHT_RECOLORED 2
+
+typedef uint32_t PointLightHandle;
+
+	/*
+	 * Point Light Pool:
+	 *		The scene's point lights, packed into parallel arrays with no gaps, so the
+	 *		renderers cull straight out of PositionsAndRadii and upload both arrays as they
+	 *		are, without a copy of their own. Lights are found by handle, not by index, since
+	 *		removing one moves the last light into its place. A handle stops working once its
+	 *		light is removed, and stays dead until its slot has been reused
+	 *		2^POINT_LIGHT_GENERATION_BITS times. Every change sets the light's bit in a dirty
+	 *		bitset and says what changed in its flags, until whoever uploads the lights calls
+	 *		ClearDirty.
+	*/
+class PointLightPool {
+public:
+	PointLightPool() {}
+	~PointLightPool() {}
+
+	// Luminance and radius follow from the color. POINT_LIGHT_INVALID_HANDLE once the pool is full.
+	PointLightHandle Add(const glm::vec3& position, const glm::vec3& color);
+	// These all return false and leave the pool alone for a stale handle
+	bool Remove(PointLightHandle handle);
+	bool SetPosition(PointLightHandle handle, const glm::vec3& position);
+	bool SetColor(PointLightHandle handle, const glm::vec3& color);
+	bool IsValid(PointLightHandle handle) const;
+
+	uint32_t Count() const { return static_cast<uint32_t>(positionsAndRadii.size()); }
+	// Count of each, in the same order, laid out like PointLightToGPU's two members
+	const glm::vec4* PositionsAndRadii() const { return positionsAndRadii.data(); }
+	const glm::vec4* ColorsAndLuminance() const { return colorsAndLuminance.data(); }
+	// Dirty flags of each light
+	const uint8_t* Flags() const { return flags.data(); }
+
+	// Every light's flags together, POINT_LIGHT_MOVED too when lights were added or removed
+	uint8_t DirtyFlags() const { return dirtyFlags; }
+	// Calls f(begin, end) for each run of dirty lights in order, runs with at most gap clean
+	// lights between them joined into one
+	template <typename F>
+	void ForEachDirtyRun(uint32_t gap, F f) const;
+	void ClearDirty();
+
+	// Bytes held per light, the arrays, their slots and the bitset
+	size_t BytesPerLight() const;
+
+	// Handle lookups, moves, and walking the dirty lights of 100,000 lights against diffing
+	// a copy of every light each frame, the way the renderers used to
+	static void Benchmark(uint32_t iterations);
+
+private:
+	struct Slot {
+		// Where the light is in the arrays while it's alive, the next free slot once it's not
+		uint32_t index;
+		uint32_t generation;
+	};
+
+	// The light's index, or POINT_LIGHT_INVALID_HANDLE for a stale handle
+	uint32_t Find(PointLightHandle handle) const;
+	void MarkDirty(uint32_t index, uint8_t what);
+
+	std::vector<glm::vec4, MemoryAllocator<glm::vec4> > positionsAndRadii;
+	std::vector<glm::vec4, MemoryAllocator<glm::vec4> > colorsAndLuminance;
+	std::vector<uint8_t, MemoryAllocator<uint8_t> > flags;
+	// Each light's slot, so the one moved into a removed light's place can be pointed at it
+	std::vector<uint32_t, MemoryAllocator<uint32_t> > lightSlots;
+
+	std::vector<Slot, MemoryAllocator<Slot> > slots;
+	uint32_t freeSlot = POINT_LIGHT_INVALID_HANDLE;
+
+	// One bit per light
+	std::vector<uint64_t, MemoryAllocator<uint64_t> > dirtyBits;
+	uint8_t dirtyFlags = 0;
+};
+
+template <typename F>
+void PointLightPool::ForEachDirtyRun(uint32_t gap, F f) const {
+	uint32_t begin = 0;
+	uint32_t end = 0;
+	bool open = false;
+	for (uint32_t word = 0; word < dirtyBits.size(); word += 1) {
+		uint64_t bits = dirtyBits[word];
+		for (uint32_t bit = 0; bits != 0; bit += 1, bits >>= 1) {
+			// Dirty lights are usually few and far between, skip clean bytes whole
+			while ((bits & 0xFF) == 0) {
+				bits >>= 8;
+				bit += 8;
+			}
+			if ((bits & 1) == 0) {
+				continue;
+			}
+
+			uint32_t index = word * 64 + bit;
+			if (open && index - end <= gap) {
+				end = index + 1;
+				continue;
+			}
+			if (open) {
+				f(begin, end);
+			}
+			begin = index;
+			end = index + 1;
+			open = true;
+		}
+	}
+	if (open) {
+		f(begin, end);
+	}
+}
+
+#endif // POINT_LIGHT_POOL_H_
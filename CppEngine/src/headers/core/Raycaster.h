@@ -0,0 +1,75 @@
+#ifndef RAYCASTER_H_
+#define RAYCASTER_H_
+
+#include "RenderTypes.h"
+#include "RaytracerTypes.h"
+
+#include <future>
+#include <vector>
+
+class BVH;
+
+	/*
+	 * Raycaster:
+	 *		Scene queries against the ray tracing BVH for gameplay (line of sight, picking,
+	 *		ground snapping...). Raycast answers straight away. Submit queues a batch that is
+	 *		traced on the JobSystem while the frame renders, and its hits can be read with
+	 *		GetResults the frame after. Batch ids only stay valid for that one frame.
+	*/
+class Raycaster {
+public:
+	// materialInstances maps each GPU material to the scene instance it was made for
+	Raycaster(
+		const BVH* sceneBVH,
+		const GPUTriangle* gpuTriangles,
+		const uint32_t* materialInstances
+	);
+	~Raycaster();
+
+	// Blocks until every ray is traced
+	void Raycast(const Ray* rays, uint32_t count, RaycastHit* hits) const;
+
+	// Queue rays for this frame. Returns the id to read the hits back with next frame.
+	uint32_t Submit(const Ray* rays, uint32_t count);
+	// Hits for a batch submitted last frame, in the order its rays were given. nullptr if the
+	// batch is not from last frame.
+	const RaycastHit* GetResults(uint32_t batch, uint32_t& count) const;
+
+	// Once a frame, before game code runs. Waits on last frame's batches and makes their hits readable.
+	void CollectResults();
+	// Once a frame, after game code runs. Starts tracing everything submitted this frame.
+	void TraceSubmitted();
+
+	// Timings (microseconds), of the last batches collected
+	long long traceTime = 0;
+
+private:
+	struct Batch {
+		uint32_t firstRay;
+		uint32_t numRays;
+	};
+
+	// One frame's worth of batches. Ids run from firstBatch up.
+	struct Frame {
+		uint32_t firstBatch = 0;
+		std::vector<Batch> batches;
+		std::vector<Ray> rays;
+		std::vector<RaycastHit> hits;
+
+		void Clear();
+	};
+
+	const BVH* bvh;
+	const GPUTriangle* triangles;
+	const uint32_t* instances;
+
+	// Game code writes into submitted, workers read tracing, game code reads ready
+	Frame submitted;
+	Frame tracing;
+	Frame ready;
+
+	std::future<void> tracingDone;
+	long long tracingTime = 0;
+};
+
+#endif // RAYCASTER_H_
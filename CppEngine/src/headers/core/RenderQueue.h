@@ -0,0 +1,70 @@
+#ifndef RENDER_QUEUE_H_
+#define RENDER_QUEUE_H_
+
+#include "RenderTypes.h"
+
+#include <cstdint>
+#include <vector>
+
+// Sort keys, most significant bits first:
+//		opaque:			pass | shader | material | vao | depth, front to back
+//		transparent:	pass | depth, back to front | shader | material | vao
+// Ids wider than their field only sort less well, draws still compare the real values.
+#define RENDER_KEY_PASS_BITS 2
+#define RENDER_KEY_SHADER_BITS 10
+#define RENDER_KEY_MATERIAL_BITS 16
+#define RENDER_KEY_VAO_BITS 16
+#define RENDER_KEY_DEPTH_BITS 20
+#define RENDER_KEY_STATE_BITS (RENDER_KEY_SHADER_BITS + RENDER_KEY_MATERIAL_BITS + RENDER_KEY_VAO_BITS)
+
+#define RENDER_PASS_OPAQUE 0
+#define RENDER_PASS_TRANSPARENT 1
+
+// Fewest items a job sorts before splitting the sort is worth it
+#define RENDER_QUEUE_SORT_CHUNK 4096
+
+	/*
+	 * Render Queue:
+	 *		What culling kept this frame, as a key and the index of what to draw. Sort orders the
+	 *		items by key with a least significant digit radix sort, 8 bits at a time, counting
+	 *		and scattering each chunk of items on its own job. Digits every key shares are
+	 *		skipped, which with a handful of passes and shaders is most of the top ones. The
+	 *		sort is stable, so equal keys keep the order they were pushed in.
+	*/
+class RenderQueue {
+public:
+	RenderQueue() {}
+	~RenderQueue() {}
+
+	// Shader, material and vao of a draw, what a mesh's key keeps from frame to frame
+	static uint64_t StateBits(uint32_t shader, uint32_t material, uint32_t vao);
+	// depth is 0 at the camera and 1 at the far plane, clamped in between
+	static uint64_t MakeKey(uint32_t pass, uint64_t stateBits, float depth);
+	static uint32_t KeyPass(uint64_t key) { return static_cast<uint32_t>(key >> (64 - RENDER_KEY_PASS_BITS)); }
+
+	void Clear() { items.clear(); }
+	void Push(uint64_t key, uint32_t index) { items.push_back(DrawItem{ key, index }); }
+	void Sort();
+
+	uint32_t Size() const { return static_cast<uint32_t>(items.size()); }
+	const DrawItem& operator[](uint32_t i) const { return items[i]; }
+	// First item of pass or a later one, Size() when there are none. Only once sorted.
+	uint32_t PassBegin(uint32_t pass) const;
+
+	// Last Sort, in us
+	long long sortTime = 0;
+
+	// 1,000 up to 1,000,000 draws over a few shaders, hundreds of materials and thousands of
+	// vaos, radix sorted against std::stable_sort, and how many state changes drawing them
+	// takes in the order they were pushed against sorted. Then the transparent sort the
+	// renderer did with glm::length against quantized depth keys.
+	static void Benchmark(uint32_t iterations);
+
+private:
+	std::vector<DrawItem> items;
+	std::vector<DrawItem> scratch;
+	// 256 per chunk
+	std::vector<uint32_t> counts;
+};
+
+#endif // RENDER_QUEUE_H_
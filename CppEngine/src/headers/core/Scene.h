@@ -3,9 +3,9 @@
 #define SCENE_H_
 
 #include "GameObject.h"
+#include "PointLightPool.h"
 
 #include "DirectionalLight.h"
-#include "PointLight.h"
 #include "SpotLight.h"
 
 #define GLM_FORCE_RADIANS
@@ -22,7 +22,7 @@ public:
     std::vector<GameObject*, MemoryAllocator<GameObject*> > gameObjects;
     std::vector<GameObject*, MemoryAllocator<GameObject*> > instances;
 
-    std::vector<PointLight, MemoryAllocator<PointLight> > pointLights;
+    PointLightPool pointLights;
     std::vector<DirectionalLight, MemoryAllocator<DirectionalLight> > directionalLights;
     std::vector<SpotLight, MemoryAllocator<SpotLight> > spotLights;
 
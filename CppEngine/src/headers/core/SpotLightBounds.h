@@ -0,0 +1,100 @@
+#ifndef SPOT_LIGHT_BOUNDS_H_
+#define SPOT_LIGHT_BOUNDS_H_
+
+#define GLM_FORCE_RADIANS
+#include "glm/glm.hpp"
+
+#include "RenderTypes.h"
+
+#include <algorithm>
+#include <cmath>
+
+	/*
+	 * Spot Light Bounds:
+	 *		The cone a spot light reaches, out to its range and its outer angle, and the
+	 *		tests LightClusters and LightTree cull it with. A box is checked against the
+	 *		cone's bounding sphere first, which already settles most of them, then the box's
+	 *		own bounding sphere against the cone itself. Cones wider than a half space are
+	 *		left to the bounding sphere alone.
+	*/
+struct SpotLightBounds {
+	glm::vec3 apex;
+	glm::vec3 direction;
+	float range;
+	float cosAngle;
+	float sinAngle;
+	// Smallest sphere around the cone
+	glm::vec3 sphereCenter;
+	float sphereRadius;
+
+	SpotLightBounds(const SpotLightToGPU& light) {
+		Set(glm::vec3(light.position_and_range), glm::vec3(light.direction_and_cos_outer), light.position_and_range.w, light.direction_and_cos_outer.w);
+	}
+
+	// In the space transform takes the light into, transform has no scale
+	SpotLightBounds(const SpotLightToGPU& light, const glm::mat4& transform) {
+		glm::vec3 p = glm::vec3(transform * glm::vec4(glm::vec3(light.position_and_range), 1.0f));
+		glm::vec3 d = glm::vec3(transform * glm::vec4(glm::vec3(light.direction_and_cos_outer), 0.0f));
+		Set(p, d, light.position_and_range.w, light.direction_and_cos_outer.w);
+	}
+
+	bool TouchesSphere(const glm::vec3& center, float radius) const {
+		glm::vec3 v = center - apex;
+		float along = glm::dot(v, direction);
+		if (along > range + radius) {
+			return false;
+		}
+		if (cosAngle <= 0.0f) {
+			return glm::dot(v, v) <= (range + radius) * (range + radius);
+		}
+
+		// Distance from the sphere's center out past the cone's side, and behind its apex
+		float across = std::sqrt(std::max(glm::dot(v, v) - along * along, 0.0f));
+		return along >= -radius && cosAngle * across - sinAngle * along <= radius;
+	}
+
+	bool TouchesBox(const glm::vec3& boxMin, const glm::vec3& boxMax) const {
+		float d = 0.0f;
+		for (uint32_t axis = 0; axis < 3; axis += 1) {
+			float a = std::max(boxMin[axis] - sphereCenter[axis], 0.0f) + std::max(sphereCenter[axis] - boxMax[axis], 0.0f);
+			d += a * a;
+		}
+		if (d > sphereRadius * sphereRadius) {
+			return false;
+		}
+		return TouchesSphere((boxMin + boxMax) * 0.5f, glm::length(boxMax - boxMin) * 0.5f);
+	}
+
+	// Whether the light reaches point at all, what shading cuts off at
+	bool Contains(const glm::vec3& point) const {
+		glm::vec3 v = point - apex;
+		float distSq = glm::dot(v, v);
+		return distSq <= range * range && glm::dot(v, direction) >= cosAngle * std::sqrt(distSq);
+	}
+
+private:
+	void Set(const glm::vec3& position, const glm::vec3& dir, float lightRange, float cosOuter) {
+		apex = position;
+		direction = glm::normalize(dir);
+		range = lightRange;
+		cosAngle = cosOuter;
+		sinAngle = std::sqrt(std::max(1.0f - cosOuter * cosOuter, 0.0f));
+
+		// Wider than 90 degrees the whole sphere it sweeps, wider than 45 the circle its
+		// rim is on, otherwise the sphere through its apex and rim
+		if (cosAngle <= 0.0f) {
+			sphereCenter = apex;
+			sphereRadius = range;
+		}
+		else if (cosAngle < 0.70710678f) {
+			sphereCenter = apex + direction * (cosAngle * range);
+			sphereRadius = sinAngle * range;
+		}
+		else {
+			sphereRadius = range / (2.0f * cosAngle);
+			sphereCenter = apex + direction * sphereRadius;
+		}
+	}
+};
+
+#endif // SPOT_LIGHT_BOUNDS_H_
@@ -0,0 +1,250 @@
+#ifndef TILE_FARM_H_
+#define TILE_FARM_H_
+
+#define GLM_FORCE_RADIANS
+#include "glm/glm.hpp"
+
+#include "RenderTypes.h"
+#include "LightTree.h"
+#include "TiledTexture.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class BVH;
+class OpacityMicromap;
+
+// Most tiles a worker is handed at once
+#define TILE_FARM_BATCH_SIZE 64
+// Cost balanced batches each hold about 1 / (workers * this) of the frame's cost still left, so
+// batches shrink towards the end of the frame and whoever finishes early picks up the rest
+#define TILE_FARM_BATCHES_PER_WORKER 4
+
+// Everything the workers need to build their CPURayTracer, the same as RayTracingSystem hands its own
+struct TileFarmScene {
+	const BVH* bvh = nullptr;
+	const GPUVertex* vertices = nullptr;
+	uint32_t numVertices = 0;
+	const GPUTriangle* triangles = nullptr;
+	uint32_t numTriangles = 0;
+	const GPUMaterial* materials = nullptr;
+	uint32_t numMaterials = 0;
+	// One entry per material, or nullptr
+	const MaterialTextures* textures = nullptr;
+	// Baked over bvh's triangles, or nullptr
+	const OpacityMicromap* opacityMicromap = nullptr;
+
+	const PointLightToGPU* pointLights = nullptr;
+	// The scene file has room for twice as many lights, and a tree twice this one's size
+	uint32_t numPointLights = 0;
+	// Over pointLights
+	LightTreeView lightTree;
+	glm::vec3 sceneMin = glm::vec3(0.0f);
+	glm::vec3 sceneMax = glm::vec3(0.0f);
+};
+
+	/*
+	 * Tile Farm:
+	 *		Traces CPU frames across worker processes on this machine, to get past what one
+	 *		process's threads can do. The workers are forked once at startup, before any thread
+	 *		exists, since a child only gets the thread that forked it and would hang on any lock
+	 *		another one held. Start writes the flattened scene, BVH, textures and opacity
+	 *		micromap into a temporary file and hands it to as many idle workers as it asks for,
+	 *		which map the file themselves and trace out of it, so there is one copy of the scene
+	 *		in memory however many workers there are. The frame buffer lives at the end of the
+	 *		same file and workers write their tiles straight into it.
+	 *		Each frame, tiles are sorted by what they cost last frame and cut into batches,
+	 *		which go out over a local socket per worker as workers finish their last one.
+	 *		Workers trace depth first with the light tree's point lights, whatever the CPU_ macros
+	 *		pick for the in process tracer. Point lights and the tree are copied into the file
+	 *		every frame, so they can move, and their counts go out with each batch. Needs fork,
+	 *		so there are no workers on Windows.
+	*/
+class TileFarm {
+public:
+	TileFarm() {}
+	~TileFarm();
+
+	// Forks the workers every farm draws from. Call once, first thing at startup, before SDL or
+	// the JobSystem start a thread. Returns how many there are.
+	static uint32_t ForkWorkers(uint32_t numWorkers);
+	// Tells them to quit and waits on them, once every farm is stopped
+	static void QuitWorkers();
+
+	// Returns false if the scene file couldn't be set up or there aren't numWorkers idle workers.
+	// Restarts a running farm.
+	bool Start(const TileFarmScene& farmScene, uint32_t renderWidth, uint32_t renderHeight, uint32_t numWorkers);
+	// Hands the workers back, idle
+	void Stop();
+
+	void SetCamera(const glm::mat4& inverseProj, const glm::mat4& inverseView, const glm::vec3& cameraPos);
+	void SetDirectionalLight(const glm::vec3& direction, const glm::vec3& color);
+	// Where the point lights live now. More than the scene file has room for restarts a running farm.
+	void SetPointLights(const PointLightToGPU* lights, uint32_t count);
+	// The tree over those lights, rebuilt. One that outgrew the scene file restarts a running farm.
+	void SetLightTree(const LightTreeView& lightTree);
+
+	// Traces a frame into pixels. Blocks until every tile is back. Returns false if the farm
+	// isn't running, or stops it and returns false if a worker went away.
+	bool Render();
+
+	// RGBA8, bottom row first, same as CPURayTracer::GetPixels
+	const uint32_t* GetPixels() const { return pixels; }
+	uint32_t NumWorkers() const { return static_cast<uint32_t>(workers.size()); }
+
+	// Frame time with 1 worker up to maxWorkers, with tiles split evenly against cost balanced,
+	// and how far every frame's pixels are from 1 worker's. Restarts the farm as it was after.
+	// Needs maxWorkers forked.
+	void BenchmarkScaling(uint32_t maxWorkers, uint32_t frames);
+
+	// Balance batches by measured tile cost. Otherwise every worker gets an even share of
+	// batches in tile order, decided up front.
+	bool balanceByCost = true;
+
+	// Timings (microseconds)
+	long long traceTime = 0;
+	// The busiest worker's summed tile time over the average worker's, last frame. 1 is even.
+	float imbalance = 1;
+
+private:
+	enum class CommandType : uint32_t {
+		// Followed by the scene file's descriptor
+		Load,
+		Unload,
+		Trace,
+		Quit
+	};
+
+	// Coordinator to worker. Camera and lights go with every batch.
+	struct Command {
+		CommandType type = CommandType::Trace;
+		uint32_t numTiles = 0;
+		glm::mat4 invProj;
+		glm::mat4 invView;
+		glm::vec3 camPos;
+		glm::vec3 directionalLightDir;
+		glm::vec3 directionalLightCol;
+		// How much of the scene file's light arrays this frame uses
+		uint32_t numPointLights;
+		uint32_t numTreeNodes;
+		uint32_t numTreeIndices;
+		glm::vec3 treeMin;
+		glm::vec3 treeMax;
+		uint32_t tiles[TILE_FARM_BATCH_SIZE];
+	};
+
+	// Worker to coordinator, once the batch's pixels are in the frame buffer
+	struct Reply {
+		uint32_t numTiles = 0;
+		uint32_t tiles[TILE_FARM_BATCH_SIZE];
+		uint32_t microseconds[TILE_FARM_BATCH_SIZE];
+	};
+
+	// Byte offsets into the scene file, written at its start
+	struct SceneLayout {
+		uint32_t width;
+		uint32_t height;
+		uint32_t numNodes;
+		uint32_t numVertices;
+		uint32_t numTriangles;
+		uint32_t numMaterials;
+		uint32_t numTextures;
+		// Room for this many, each frame's lights and tree fit
+		uint32_t maxPointLights;
+		uint32_t maxTreeNodes;
+		uint32_t maxTreeIndices;
+		uint32_t hasMicromap;
+		uint32_t micromapLevel;
+		uint32_t numMicromapStates;
+		uint32_t useMicromap;
+		glm::vec3 sceneMin;
+		glm::vec3 sceneMax;
+		size_t nodes;
+		size_t parents;
+		size_t vertices;
+		size_t triangles;
+		size_t materials;
+		// numTextures TextureRecords, then numMaterials MaterialRecords
+		size_t textures;
+		size_t materialTextures;
+		// numTriangles offsets, then the states
+		size_t micromapOffsets;
+		size_t micromapStates;
+		size_t pointLights;
+		size_t lightTreeNodes;
+		size_t lightTreeIndices;
+		size_t pixels;
+		size_t size;
+	};
+
+	struct TextureRecord {
+		uint32_t width;
+		uint32_t height;
+		uint32_t sRGB;
+		TextureLayout layout;
+		size_t texels;
+		size_t numTexels;
+	};
+
+	static const uint32_t NO_TEXTURE = 0xFFFFFFFF;
+
+	// Indices into the TextureRecords, NO_TEXTURE for none
+	struct MaterialRecord {
+		uint32_t diffuse;
+		uint32_t specular;
+		uint32_t normal;
+		uint32_t alpha;
+	};
+
+	struct Worker {
+		// Into the forked workers
+		uint32_t pooled = 0;
+		int socket = -1;
+		// Next batch for even splits
+		uint32_t nextBatch = 0;
+		bool busy = false;
+		bool lost = false;
+		// Summed tile time this frame
+		long long microseconds = 0;
+	};
+
+	// What a worker builds out of a scene file
+	struct WorkerScene;
+
+	bool MapScene();
+	void UnmapScene();
+	// Never returns, the worker process exits when the coordinator quits or goes away
+	static void WorkerMain(int socket);
+	// Maps the scene file and builds a tracer over it, nullptr if it couldn't
+	static WorkerScene* LoadWorkerScene(int file);
+
+	// Cuts the frame into batches, balanced by tileCosts or in tile order
+	void PlanBatches();
+	// Hands worker its next batch. False if there was none left for it.
+	bool SendBatch(Worker& worker, uint32_t& nextShared);
+	bool ReceiveReply(Worker& worker);
+
+	TileFarmScene scene;
+	uint32_t width = 0; uint32_t height = 0;
+	uint32_t numTiles = 0;
+
+	glm::mat4 invProj = glm::mat4(1.0f); glm::mat4 invView = glm::mat4(1.0f); glm::vec3 camPos = glm::vec3(0.0f);
+	glm::vec3 directionalLightDir = glm::vec3(0.0f, -1.0f, 0.0f); glm::vec3 directionalLightCol = glm::vec3(0.0f);
+
+	std::vector<Worker> workers;
+
+	// The scene file, mapped
+	int sceneFile = -1;
+	uint8_t* mapping = nullptr;
+	SceneLayout layout;
+	uint32_t* pixels = nullptr;
+
+	// Microseconds each tile took when it was last traced
+	std::vector<uint32_t> tileCosts;
+	// Batches this frame, as ranges of batchTiles
+	std::vector<uint32_t> batchTiles;
+	std::vector<uint32_t> batchStarts;
+};
+
+#endif // TILE_FARM_H_
@@ -14,14 +14,21 @@ struct SpotLight {
     glm::vec4 color;
     glm::vec4 position;
     glm::vec4 direction;
+    // Half angles in degrees, full light inside theta fading out to none at phi
     float theta;
     float phi;
+    float range;
 
     SpotLight(const glm::vec4& c, const glm::vec4& pos, const glm::vec4& d, const float& t, const float& p) : 
         color(c), position(pos), direction(d), theta(t), phi(p) {
 		type = "spotLight";
 
 		lum = .6f * color.g + .3f * color.r + .1f * color.b;
+
+		// Cut off the same way PointLight's radius is
+		float b = 2;
+		float lightLum = 0.005f;
+		range = sqrt(lum / (b * lightLum));
 	}
 };
 
@@ -18,6 +18,7 @@
 
 #include "MemoryAllocator.h"
 #include "RenderTypes.h"
+#include "TiledTexture.h"
 
 class BVH;
 class Model;
@@ -48,6 +49,10 @@ namespace AssetManager {
 	extern std::vector<GPUVertex>* gpuVertices;
 	extern std::vector<GPUTriangle>* gpuTriangles;
 	extern std::vector<GPUMaterial>* gpuMaterials;
+	// Scene instance each GPU material was made for
+	extern std::vector<uint32_t>* gpuMaterialInstances;
+	// CPU copies of each GPU material's textures, only filled with CPU_RAY_TRACING
+	extern std::vector<MaterialTextures>* cpuMaterialTextures;
 
 
 	extern GLuint nullTexture;
@@ -1,33 +1,25 @@
-
 #ifndef BOUNDS_H_
 #define BOUNDS_H_
 
 #define GLM_FORCE_RADIANS
 #include "glm/glm.hpp"
 
-#include <vector>
-#include "MemoryAllocator.h"
-
+// A mesh's box in its own space
 class Bounds {
 
 public:
 	Bounds();
 	Bounds(const float minVx, const float minVy, const float minVz,
 		const float maxVx, const float maxVy, const float maxVz);
-	Bounds* clone() const;
-
-	Bounds(const Bounds&);
-	Bounds& operator=(const Bounds& b);
 
-	void Init();
+	glm::vec3 Center() const { return (minPoint + maxPoint) * 0.5f; }
 
-	glm::vec3 Max(const glm::mat4 t);
-	glm::vec3 Min(const glm::mat4 t);
+	// Box in the space t takes this one into, around the whole transformed box. Arvo's
+	// method, each axis of the result from the columns of t, instead of transforming 8 corners.
+	void Transform(const glm::mat4& t, glm::vec3& worldMin, glm::vec3& worldMax) const;
 
-	std::vector<glm::vec4, MemoryAllocator<glm::vec4> > points;
-	float minX, minY, minZ;
-	float maxX, maxY, maxZ;
-	glm::vec3 center;
+	glm::vec3 minPoint;
+	glm::vec3 maxPoint;
 };
 
-#endif // BOUNDS_H_
\ No newline at end of file
+#endif // BOUNDS_H_
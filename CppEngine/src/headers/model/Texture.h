@@ -4,6 +4,8 @@
 
 #include "glad/glad.h"
 
+class TiledTexture;
+
 class Texture {
 public:
 	GLubyte* pixels;
@@ -13,6 +15,9 @@ public:
 
 	bool loadedToGPU = false;
 
+	// Copy for the CPU ray tracer, made before pixels are freed. Only with CPU_RAY_TRACING.
+	TiledTexture* cpuTexture = nullptr;
+
 	Texture() {}
 	~Texture();
 
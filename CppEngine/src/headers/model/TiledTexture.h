@@ -0,0 +1,106 @@
+#ifndef TILED_TEXTURE_H_
+#define TILED_TEXTURE_H_
+
+#define GLM_FORCE_RADIANS
+#include "glm/glm.hpp"
+
+#include <cstdint>
+#include <vector>
+
+class CacheSimulator;
+class Texture;
+
+// Texels per tile side. 8x8 RGBA8 is 256 bytes, 4 cache lines.
+#define TEXTURE_TILE_SIZE 8
+
+enum class TextureLayout {
+	Linear,		// Row by row, how stb hands it to us
+	Tiled		// 8x8 tiles, Morton order inside each tile
+};
+
+	/*
+	 * Tiled Texture:
+	 *		CPU copy of a Texture for the CPU ray tracer, since the GPU only has the bindless
+	 *		handle. The whole mip chain is kept as RGBA8. Tiled textures keep every bilinear
+	 *		footprint inside one or two tiles, so a lookup touches a cache line or two instead
+	 *		of two rows that can be a texture width apart. Together with the ray cone LOD,
+	 *		incoherent bounces land on small mips that stay in cache. Sampling is trilinear
+	 *		with repeat wrapping, like our GL textures.
+	*/
+class TiledTexture {
+public:
+	// channels is how many the pixels actually hold (stb was asked for rgb or grey). srgb
+	// textures are decoded to linear when sampled, same as GL_SRGB.
+	TiledTexture(const Texture* texture, uint32_t channels, bool srgb, TextureLayout textureLayout = TextureLayout::Tiled);
+	// The same texels in another layout
+	TiledTexture(const TiledTexture& source, TextureLayout textureLayout);
+	// Reads texels another TiledTexture of this size and layout made, see Texels. They have to
+	// outlive this one. The tile farm's workers read theirs out of the scene file this way.
+	TiledTexture(const uint32_t* sourceTexels, uint32_t baseWidth, uint32_t baseHeight, bool srgb, TextureLayout textureLayout);
+	~TiledTexture() {}
+
+	// texels may point into ownedTexels, a copy would point into the original's
+	TiledTexture(const TiledTexture&) = delete;
+	TiledTexture& operator=(const TiledTexture&) = delete;
+
+	// surfaceLOD is the texture independent part of the ray cone LOD (see
+	// CPURayTracer::GetIntersection), this adds the texture's own resolution.
+	glm::vec4 Sample(const glm::vec2& uv, float surfaceLOD) const;
+	// Bilinear within a single level
+	glm::vec4 SampleLevel(const glm::vec2& uv, uint32_t level) const;
+
+	// Unfiltered, with x and y wrapped like Sample does
+	glm::vec4 Texel(uint32_t level, int32_t x, int32_t y) const;
+
+	uint32_t NumLevels() const { return static_cast<uint32_t>(levels.size()); }
+	uint32_t Width(uint32_t level = 0) const { return levels[level].width; }
+	uint32_t Height(uint32_t level = 0) const { return levels[level].height; }
+	TextureLayout Layout() const { return layout; }
+	bool SRGB() const { return sRGB; }
+	// Every level's texels, back to back
+	const uint32_t* Texels() const { return texels; }
+	size_t NumTexels() const { return numTexels; }
+
+	// Feeds every texel the calling thread reads to simulator. Only hooked up with PROFILING.
+	// Pass nullptr to stop.
+	static void SetCacheSimulator(CacheSimulator* simulator);
+
+private:
+	struct MipLevel {
+		uint32_t width;
+		uint32_t height;
+		uint32_t tilesX;
+		size_t offset;
+	};
+
+	// Fills in levels and numTexels
+	void LayOutLevels(uint32_t baseWidth, uint32_t baseHeight);
+	// LayOutLevels, and room for their texels
+	void AllocateLevels(uint32_t baseWidth, uint32_t baseHeight);
+	size_t TexelIndex(const MipLevel& level, uint32_t x, uint32_t y) const;
+
+	glm::vec4 Decode(uint32_t texel) const;
+	glm::vec4 Fetch(const MipLevel& level, uint32_t x, uint32_t y) const;
+
+	// Empty for textures reading someone else's texels
+	std::vector<uint32_t> ownedTexels;
+	const uint32_t* texels = nullptr;
+	size_t numTexels = 0;
+	std::vector<MipLevel> levels;
+
+	// log2 of the base level's texel count, halved
+	float resolutionLOD;
+
+	bool sRGB;
+	TextureLayout layout;
+};
+
+// The CPU textures a material samples, nullptr reads as white
+struct MaterialTextures {
+	const TiledTexture* diffuse = nullptr;
+	const TiledTexture* specular = nullptr;
+	const TiledTexture* normal = nullptr;
+	const TiledTexture* alpha = nullptr;
+};
+
+#endif // TILED_TEXTURE_H_
@@ -15,24 +15,28 @@
 #include <vector>
 
 class ModelRenderer;
+class CPURayTracer;
+class TileFarm;
+class OpacityMicromap;
+class LightTree;
 
 class RayTracingSystem : public Systems {
 private:
 	std::vector<ModelRenderer*, MemoryAllocator<ModelRenderer*> > modelRenderers;
+	// Only with CPU_RAY_TRACING, the scene's point lights interleaved the way the CPU tracer reads them
 	std::vector<PointLightToGPU, MemoryAllocator<PointLightToGPU> > pointLightsToGPU;
-	std::vector<PointLightIndicesSSBO, MemoryAllocator<PointLightIndicesSSBO> > pointLightIndicesSSBOToGPU;
-	std::vector<PointLightIndicesUBO, MemoryAllocator<PointLightIndicesUBO> > pointLightIndicesUBOToGPU;
+	std::vector<SpotLightToGPU, MemoryAllocator<SpotLightToGPU> > spotLightsToGPU;
 	std::vector<DirectionalLightToGPU, MemoryAllocator<DirectionalLightToGPU> > directionalLightsToGPU;
 
 	glm::mat4 proj; glm::mat4 view;
 
 	GLuint verticesSSBO; GLuint triangleSSBO;
 
-	GLuint bakeLightsComputeShader; 
 	GLuint rayTraceComputeShader;
 
-	GLuint pointLightsUBO; 
-	GLuint pointLightIndicesSSBO; GLuint pointLightIndicesUBO;
+	// Point lights go up straight out of the scene's PointLightPool, positions and colors apart
+	GLuint pointPositionsSSBO; GLuint pointColorsSSBO; GLuint spotLightsSSBO;
+	GLuint lightTreeNodesSSBO; GLuint lightTreeIndicesSSBO;
 	GLuint bvhSSBO;
 	GLuint triangleLightsSSBO; GLuint materialsUBO;
 
@@ -41,6 +45,14 @@ private:
 	// Quad vert info
 	GLuint quadVAO; GLuint quadVBO;
 
+	// Point and spot light tree behind the light tree SSBOs, built on the CPU, and how many elements
+	// the SSBOs have room for
+	LightTree* lightTree = nullptr;
+	uint32_t lightTreeNodesCapacity = 0; uint32_t lightTreeIndicesCapacity = 0;
+	uint32_t pointPositionsCapacity = 0; uint32_t pointColorsCapacity = 0;
+	// Root BVH bounds
+	glm::vec3 sceneMin; glm::vec3 sceneMax;
+
 	// Uniforms
 	GLint uniDestTex;
 	GLint uniCamPos;
@@ -48,12 +60,20 @@ private:
 	GLint uniView;
 	GLint uniInvProj;
 	GLint uniInvView;
-	GLint uniNumPointLights;
 	GLint uniDirectionalLightDir;
 	GLint uniDirectionalLightCol;
 	GLint uniMinBounds;
 	GLint uniMaxBounds;
 
+	// Only used with CPU_RAY_TRACING
+	CPURayTracer* cpuRayTracer = nullptr;
+	OpacityMicromap* opacityMicromap = nullptr;
+	// Only used with CPU_TILE_FARM_WORKERS, traces instead of cpuRayTracer while it runs
+	TileFarm* tileFarm = nullptr;
+	// Last frame's ray stats keys, so holding one down only counts once
+	bool rayStatsShowKeyDown = false;
+	bool rayStatsSaveKeyDown = false;
+
 public:
 	unsigned long long uboMemory = 0;
 	unsigned long long ssboMemory = 0;
@@ -73,7 +93,9 @@ public:
 	void Update(const float&) {}
 	void Render();
 
-	void LightCull();
+	// Uploads the point lights the scene marked dirty, and when any moved rebuilds the tree and
+	// uploads only its changed nodes and indices
+	void UpdateLights();
 	void RayTrace();
 	void PostProcess();
 };
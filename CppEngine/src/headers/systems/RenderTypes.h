@@ -20,16 +20,21 @@ const float quadVerts[12] = {
 
 /***** * * * * * GPU * * * * * *****/
 
+// A froxel's lights from offset on in the cluster light index list, numPointLights point light
+// indices then numSpotLights spot light indices
 #pragma pack(push, 1)
-struct LightTile {
-	unsigned int pointLightIndices[1023]; // 1023 point lights supported
-	unsigned int numLights;
+struct LightCluster {
+	uint32_t offset;
+	uint32_t numPointLights;
+	uint32_t numSpotLights;
 };
 #pragma pack(pop)
-ASSERT_GPU_ALIGNMENT(LightTile, 4);
-ASSERT_STRUCT_UP_TO_DATE(LightTile, 1024 * 4);
+ASSERT_GPU_ALIGNMENT(LightCluster, 4);
+ASSERT_STRUCT_UP_TO_DATE(LightCluster, 12);
 
 
+// A point light interleaved, for the CPU tracer. The GPU gets PointLightPool's two arrays as
+// they are, these same two members apart.
 #pragma pack(push, 1)
 struct PointLightToGPU {
 	glm::vec4 position_and_radius;
@@ -40,22 +45,34 @@ ASSERT_GPU_ALIGNMENT(PointLightToGPU, 16);
 ASSERT_STRUCT_UP_TO_DATE(PointLightToGPU, 32);
 
 
+// numPointLights of an interior node
+#define LIGHT_TREE_INTERIOR 0xFFFFFFFF
+
+// A light tree leaf's lights from offset on in the tree's light index list, numPointLights
+// point light indices then numSpotLights spot light indices. Interior nodes have their 8
+// children from offset on instead.
 #pragma pack(push, 1)
-struct PointLightIndicesSSBO {
-	uint32_t indices[15];
-	uint32_t numLights;
+struct LightTreeNode {
+	uint32_t offset;
+	uint32_t numPointLights;
+	uint32_t numSpotLights;
 };
 #pragma pack(pop)
-ASSERT_GPU_ALIGNMENT(PointLightIndicesSSBO, 16);
-ASSERT_STRUCT_UP_TO_DATE(PointLightIndicesSSBO, 64);
+ASSERT_GPU_ALIGNMENT(LightTreeNode, 4);
+ASSERT_STRUCT_UP_TO_DATE(LightTreeNode, 12);
+
 
+// Luminance isn't stored, shaders take it from the color the same way SpotLight does. Light
+// falls off from full at cos_inner to nothing at cos_outer, cosines of the angle to direction.
 #pragma pack(push, 1)
-struct PointLightIndicesUBO {
-	glm::uvec4 indices_and_num_lights;
+struct SpotLightToGPU {
+	glm::vec4 position_and_range;
+	glm::vec4 direction_and_cos_outer;
+	glm::vec4 color_and_cos_inner;
 };
 #pragma pack(pop)
-ASSERT_GPU_ALIGNMENT(PointLightIndicesUBO, 16);
-ASSERT_STRUCT_UP_TO_DATE(PointLightIndicesUBO, 16);
+ASSERT_GPU_ALIGNMENT(SpotLightToGPU, 16);
+ASSERT_STRUCT_UP_TO_DATE(SpotLightToGPU, 48);
 
 
 #pragma pack(push, 1)
@@ -120,7 +137,6 @@ struct MeshToDraw {
 	glm::mat4 model;
 	GLuint vao;
 	GLuint shaderProgram;
-	glm::vec3 position;
 
 	~MeshToDraw() {
 		mesh = nullptr;
@@ -128,5 +144,17 @@ struct MeshToDraw {
 	}
 };
 
+// One mesh of one ModelRenderer, what frustum culling keeps or drops
+struct MeshInstance {
+	class ModelRenderer* renderer;
+	uint32_t mesh;
+};
+
+// One draw in a RenderQueue, index is what to draw in whatever array the queue was filled from
+struct DrawItem {
+	uint64_t key;
+	uint32_t index;
+};
+
 
 #endif
\ No newline at end of file
@@ -9,6 +9,10 @@
 class ModelRenderer;
 class Component;
 class Mesh;
+class LightClusters;
+class AABBTree;
+class OcclusionCuller;
+class RenderQueue;
 
 #include <vector>
 
@@ -22,10 +26,26 @@ struct GBuffer {
 class RendererSystem : public Systems {
 private:
 	std::vector<ModelRenderer*, MemoryAllocator<ModelRenderer*> > modelRenderers;
+	// Every mesh culling kept this frame, opaque and transparent, drawn in renderQueue's order
 	std::vector<MeshToDraw, MemoryAllocator<MeshToDraw> > meshesToDraw;
-	std::vector<MeshToDraw, MemoryAllocator<MeshToDraw> > transparentToDraw;
-
-	std::vector<PointLightToGPU, MemoryAllocator<PointLightToGPU> > pointLightsToGPU;
+	RenderQueue* renderQueue = nullptr;
+
+	// Every mesh of every renderer, and a tree over their world bounds that culls a subtree at a time
+	std::vector<MeshInstance, MemoryAllocator<MeshInstance> > meshInstances;
+	AABBTree* meshTree = nullptr;
+	// Each mesh's leaf in meshTree, and its shader, material and vao packed for its sort key
+	std::vector<uint32_t, MemoryAllocator<uint32_t> > meshProxies;
+	std::vector<uint64_t, MemoryAllocator<uint64_t> > meshStateBits;
+	// Transform::modelVersion each mesh's world bounds in meshTree were last found at
+	std::vector<uint32_t, MemoryAllocator<uint32_t> > boundsVersions;
+	// Meshes in the frustum this frame, then only the ones not occluded
+	std::vector<uint32_t, MemoryAllocator<uint32_t> > frustumVisible;
+
+	// Only with OCCLUSION_CULLING, and the meshes that could be occluders this frame with their screen area
+	OcclusionCuller* occlusionCuller = nullptr;
+	std::vector<std::pair<float, uint32_t>, MemoryAllocator<std::pair<float, uint32_t> > > occluderCandidates;
+
+	std::vector<SpotLightToGPU, MemoryAllocator<SpotLightToGPU> > spotLightsToGPU;
 	std::vector<DirectionalLightToGPU, MemoryAllocator<DirectionalLightToGPU> > directionalLightsToGPU;
 
 	GLubyte dummyData[4] = { 255, 255, 255, 255 };
@@ -45,8 +65,12 @@ private:
 	// Tiled lighting variables
 	GLuint tiledComputeShader;
 
-	GLuint pointLightsSSBO;
-	GLuint lightTilesSSBO; // Max of 512 lights per tile
+	// Point lights go up straight out of the scene's PointLightPool, positions and colors apart
+	GLuint pointPositionsSSBO; GLuint pointColorsSSBO; GLuint spotLightsSSBO;
+	uint32_t pointLightCapacity = 0;
+	// Point and spot lights per froxel, rebuilt on the CPU every frame
+	LightClusters* lightClusters = nullptr;
+	GLuint clustersSSBO; GLuint clusterIndicesSSBO;
 
 	// Shadows
 	GLuint shadowMapShader;
@@ -59,12 +83,16 @@ private:
 
 public:
 	int totalTriangles = 0;
+	// Programs, vaos and materials bound this frame
+	int stateChanges = 0;
 
 	// Timings
 	GLuint timeQuery;
 	long long depthPrePassTime = 0;
 	long long tileComputeTime;
-	long long cullTime; long long shadowTime;
+	long long cullTime; long long clusterTime; long long shadowTime;
+	// Part of cullTime, and how many meshes in the frustum it threw away
+	long long occlusionTime = 0; int occludedDraws = 0;
 	long long deferredToTexTime; long long deferredLightsTime;
 	long long transparentTime; long long postFXXTime;
 
@@ -79,14 +107,16 @@ public:
 
 	void OpaqueDepthPrePass();
 	void CullScene();
+	// Rasterizes the occluders among frustumVisible and removes the meshes they hide
+	void CullOccluded();
+	void UploadPointLights();
+	void BuildClusters();
 	void DrawShadows();
 	void DeferredToTexture();
 	void TiledCompute();
 	void DeferredLighting();
 	void DrawTransparent();
 	void PostProcess();
-
-	bool ShouldFrustumCull(const Mesh*, const glm::mat4&) const;
 };
 
 #endif
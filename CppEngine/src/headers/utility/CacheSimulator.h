@@ -0,0 +1,42 @@
+#ifndef CACHE_SIMULATOR_H_
+#define CACHE_SIMULATOR_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+	/*
+	 * Cache Simulator:
+	 *		A set associative LRU cache model. Hardware counters are not something we can read
+	 *		the same way on every platform, so this gives us a repeatable miss count for a given
+	 *		access pattern instead. Levels chain through nextLevel, which only sees our misses.
+	 *		Not thread safe, use one per thread.
+	*/
+class CacheSimulator {
+public:
+	CacheSimulator(uint32_t sizeBytes, uint32_t ways, CacheSimulator* next = nullptr);
+
+	// Touch every line in [address, address + bytes)
+	void Access(const void* address, size_t bytes);
+	void Reset();
+
+	float MissRate() const;
+
+	uint64_t hits = 0;
+	uint64_t misses = 0;
+
+private:
+	bool AccessLine(uint64_t line);
+
+	uint32_t numSets;
+	uint32_t numWays;
+	uint64_t clock = 0;
+
+	// numSets * numWays entries, way is the fastest changing index
+	std::vector<uint64_t> tags;
+	std::vector<uint64_t> lastUsed;
+
+	CacheSimulator* nextLevel;
+};
+
+#endif // CACHE_SIMULATOR_H_
@@ -4,15 +4,40 @@
 
 #define RAY_TRACING_ENABLED true
 #define PROFILING true
+// Run the CPU benchmarks in each system's Setup and print them before the first frame. They
+// take seconds and hundreds of MB, so PROFILING alone only times frames.
+#define RUN_BENCHMARKS false
 #define USE_NORMAL_MAPS true
+// Throw away meshes hidden behind the biggest ones on screen before they are drawn, see OcclusionCuller.h
+#define OCCLUSION_CULLING true
+
+// Trace on the CPU instead of rayTrace.comp. Only used when RAY_TRACING_ENABLED.
+#define CPU_RAY_TRACING false
+// Rays per SIMD packet for CPU primary rays (4, 8 or 16). 0 traces single rays.
+#define RAY_PACKET_SIZE 16
+// Trace CPU reflection bounces breadth first in sorted batches instead of per pixel
+#define CPU_WAVEFRONT false
+// Accumulate CPU samples while nothing moves, instead of tracing the same image every frame
+#define CPU_PROGRESSIVE false
+// Shade one random point light per CPU hit and denoise, instead of shading every light
+#define CPU_DENOISE false
+// Trace each CPU pixel once every this many frames and reproject the rest from the last one.
+// 2 is a checkerboard, 4, 9 and 16 are 2x2, 3x3 and 4x4 blocks. 1 traces every pixel.
+#define CPU_TRACE_INTERVAL 1
+// Light CPU primary hits with one reservoir resampled light each, reused across neighbours and
+// frames, instead of every light in their grid cell
+#define CPU_RESTIR false
+// Light CPU hits with a lightcut through a tree over every light instead, see CPURayTracer.h
+#define CPU_LIGHTCUTS false
+// Trace CPU frames in this many worker processes on this machine instead of the JobSystem's
+// threads, see TileFarm.h. 0 traces in process.
+#define CPU_TILE_FARM_WORKERS 0
 
 #define WORK_GROUP_SIZE_X 16
 #define WORK_GROUP_SIZE_Y 16
 #define NUM_GROUPS_X (windowWidth/WORK_GROUP_SIZE_X)
 #define NUM_GROUPS_Y (windowHeight/WORK_GROUP_SIZE_Y)
 
-#define GRID_SIZE 8
-
 #define ASSERT_GPU_ALIGNMENT(struct_name, value)\
 	static_assert(\
 		(sizeof(struct_name) % value) == 0,\
@@ -9,11 +9,13 @@
 class Camera;
 class Scene;
 class BVH;
+class Raycaster;
 
 
 extern Camera* mainCamera;
 extern Scene* mainScene;
 extern BVH* bvh;
+extern Raycaster* raycaster;
 
 extern int windowWidth;
 extern int windowHeight;
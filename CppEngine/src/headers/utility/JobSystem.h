@@ -0,0 +1,31 @@
+#ifndef JOB_SYSTEM_H_
+#define JOB_SYSTEM_H_
+
+#include <cstdint>
+#include <functional>
+#include <future>
+
+	/*
+	 * Job System:
+	 *		A small pool of worker threads for CPU side work that can be split up (ray tracing tiles,
+	 *		culling, light binning...). The calling thread always helps out, so nested ParallelFor
+	 *		calls cannot deadlock. Our MemoryManager is not thread safe, so jobs should not allocate
+	 *		through MemoryManager or MemoryAllocator vectors.
+	*/
+namespace JobSystem {
+
+	// Spin up numThreads workers. 0 uses every hardware thread except the calling one.
+	void Init(uint32_t numThreads = 0);
+	void CleanUp();
+
+	// Number of threads that can work on a ParallelFor, including the calling thread
+	uint32_t NumThreads();
+
+	// Calls func(begin, end) over [0, count) in chunks of grainSize. Returns once every chunk is done.
+	void ParallelFor(uint32_t count, uint32_t grainSize, const std::function<void(uint32_t, uint32_t)>& func);
+
+	// Queue up a single job without waiting on it. Poll or wait on the future for the result.
+	std::future<void> Submit(std::function<void()> job);
+}
+
+#endif // JOB_SYSTEM_H_
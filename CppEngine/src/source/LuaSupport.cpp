@@ -7,17 +7,24 @@
 
 #include "Scene.h"
 #include "Light.h"
-#include "PointLight.h"
 #include "DirectionalLight.h"
 #include "GameObject.h"
 #include "ModelRenderer.h"
 #include "Model.h"
 #include "Material.h"
+#include "Raycaster.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
 
 void luaSetup(sol::state& L) {
 	L.open_libraries(sol::lib::base, sol::lib::math, sol::lib::os);
 
 	L.set_function("addPointLight", &addPointLight);
+	L.set_function("placePointLight", &placePointLight);
+	L.set_function("setPointLightColor", &setPointLightColor);
+	L.set_function("removePointLight", &removePointLight);
 	L.set_function("addDirectionalLight", &addDirectionalLight);
 	L.set_function("addModel", &addModel);
 	L.set_function("addInstance", &addInstance);
@@ -25,6 +32,8 @@ void luaSetup(sol::state& L) {
 	L.set_function("scaleInstance", &scaleInstance);
 	L.set_function("rotateInstance", &rotateInstance);
 	L.set_function("rotateSunX", &rotateSunX);
+	L.set_function("raycast", &raycast);
+	L.set_function("raycastResults", &raycastResults);
 
 }
 
@@ -32,13 +41,23 @@ void luaSetup(sol::state& L) {
 // C++ implementations
 // output functionName(lua_State* luaState) {}
 
+// Point lights are handed out as handles, not indices. Once a light is removed its handle
+// stops working, the functions taking one return 0 for it instead of 1.
 int addPointLight(const float& r, const float& g, const float& b, const float& x , const float& y, const float& z) {
-	mainScene->pointLights.push_back(PointLight(
-		glm::vec3(r, g, b),
-		glm::vec4(x, y, z, 1))
-	);
+	PointLightHandle handle = mainScene->pointLights.Add(glm::vec3(x, y, z), glm::vec3(r, g, b));
+	return handle == POINT_LIGHT_INVALID_HANDLE ? -1 : static_cast<int>(handle);
+}
+
+int placePointLight(const int& handle, const float& x, const float& y, const float& z) {
+	return mainScene->pointLights.SetPosition(static_cast<PointLightHandle>(handle), glm::vec3(x, y, z)) ? 1 : 0;
+}
 
-	return static_cast<int>(mainScene->pointLights.size() - 1);
+int setPointLightColor(const int& handle, const float& r, const float& g, const float& b) {
+	return mainScene->pointLights.SetColor(static_cast<PointLightHandle>(handle), glm::vec3(r, g, b)) ? 1 : 0;
+}
+
+int removePointLight(const int& handle) {
+	return mainScene->pointLights.Remove(static_cast<PointLightHandle>(handle)) ? 1 : 0;
 }
 
 int addDirectionalLight(const float& r, const float& g, const float& b, const float& dx, const float& dy, const float& dz) {
@@ -82,4 +101,59 @@ int rotateInstance(const int& index, const float& xRot, const float& yRot) {
 int rotateSunX(const int& index, const float& angle) {
 	mainScene->directionalLights[0].direction = glm::normalize(glm::vec4(glm::rotate(glm::vec3(mainScene->directionalLights[0].direction), angle, glm::vec3(1, 0, 0)), 0));
 	return 1;
-}
\ No newline at end of file
+}
+
+// origins and directions are {x0, y0, z0, x1, y1, z1, ...}. Returns an id for raycastResults
+// next frame, or -1 if there is nothing to cast against. Zero length directions always miss.
+int raycast(const sol::table& origins, const sol::table& directions, const float& maxDistance) {
+	if (raycaster == nullptr) {
+		return -1;
+	}
+
+	static std::vector<Ray> rays;
+	rays.clear();
+
+	uint32_t numRays = static_cast<uint32_t>(std::min(origins.size(), directions.size()) / 3);
+	for (uint32_t i = 0; i < numRays; i += 1) {
+		Ray ray;
+		ray.pos = glm::vec3(origins.raw_get<float>(3 * i + 1), origins.raw_get<float>(3 * i + 2), origins.raw_get<float>(3 * i + 3));
+		glm::vec3 dir = glm::vec3(directions.raw_get_or<float>(3 * i + 1, 0.0f), directions.raw_get_or<float>(3 * i + 2, 0.0f), directions.raw_get_or<float>(3 * i + 3, 0.0f));
+		float length = glm::length(dir);
+		if (length > 0.0f && std::isfinite(length)) {
+			ray.dir = dir / length;
+			ray.tMax = maxDistance;
+		}
+		else {
+			// Nothing to normalize. A negative tMax keeps every triangle out of reach so it reads back as a miss.
+			ray.dir = glm::vec3(0, 0, 1);
+			ray.tMax = -1.0f;
+		}
+		rays.push_back(ray);
+	}
+
+	return static_cast<int>(raycaster->Submit(rays.data(), numRays));
+}
+
+// {t0, triangle0, instance0, material0, t1, ...} for each ray in the batch, -1s on a miss.
+// nil if the batch wasn't submitted last frame.
+sol::object raycastResults(const int& batch, sol::this_state luaState) {
+	uint32_t count = 0;
+	const RaycastHit* hits = raycaster ? raycaster->GetResults(static_cast<uint32_t>(batch), count) : nullptr;
+	if (hits == nullptr) {
+		return sol::make_object(luaState, sol::lua_nil);
+	}
+
+	sol::state_view L(luaState);
+	sol::table results = L.create_table(4 * count, 0);
+	for (uint32_t i = 0; i < count; i += 1) {
+		bool hit = hits[i].triangleIndex != NO_HIT;
+		results.raw_set(
+			4 * i + 1, hits[i].t,
+			4 * i + 2, hit ? static_cast<int>(hits[i].triangleIndex) : -1,
+			4 * i + 3, hit ? static_cast<int>(hits[i].instanceIndex) : -1,
+			4 * i + 4, hit ? static_cast<int>(hits[i].materialIndex) : -1
+		);
+	}
+
+	return sol::object(results);
+}
@@ -61,6 +61,7 @@ Transform::Transform(const Transform& t) {
 	this->rotation = t.rotation;
     
 	model = t.model;
+	modelVersion = t.modelVersion;
 
     this->forward = t.forward;
     this->right = t.right;
@@ -80,6 +81,7 @@ Transform& Transform::operator=(const Transform& t) {
     this->rotation = t.rotation;
 
 	model = t.model;
+	modelVersion += 1;
 
     this->forward = t.forward;
     this->right = t.right;
@@ -100,25 +102,34 @@ void Transform::UpdateRotation(const glm::vec3& rot) {
 
 void Transform::Rotate(const float& value, const glm::vec3& axis) {
 	model = glm::rotate(model, value, axis);
+	modelVersion += 1;
 }
 
 void Transform::Translate(const glm::vec3& amount) {
 	model = glm::translate(model, amount);
+	modelVersion += 1;
 }
 
 void Transform::Scale(const glm::vec3& amount) {
 	scale = amount;
 	model = glm::scale(model, scale);
+	modelVersion += 1;
 }
 
 void Transform::Update(const float& dt) {
     position += velocity * dt;
 
+	glm::mat4 previousModel = model;
+	uint32_t previousVersion = modelVersion;
+
 	model = glm::mat4(1.0);
 	Translate(position + velocity * dt);
 	Rotate(-rotation.x, glm::vec3(0, 1, 0));
 	Rotate(-rotation.y, glm::vec3(1, 0, 0));
 	Scale(scale);
+
+	// Rebuilt every frame, but only a different matrix counts as a change
+	modelVersion = (model == previousModel) ? previousVersion : previousVersion + 1;
 	
     forward = -glm::vec3(model[2]);
     up = glm::vec3(model[1]);
@@ -0,0 +1,331 @@
+#include "AABBTree.h"
+
+#include "JobSystem.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+
+namespace {
+	// Half the surface area, all the insertion cost needs
+	inline float Area(const glm::vec3& boxMin, const glm::vec3& boxMax) {
+		glm::vec3 d = boxMax - boxMin;
+		return d.x * d.y + d.y * d.z + d.z * d.x;
+	}
+
+	inline bool Contains(const glm::vec3& outerMin, const glm::vec3& outerMax, const glm::vec3& innerMin, const glm::vec3& innerMax) {
+		return glm::all(glm::lessThanEqual(outerMin, innerMin)) && glm::all(glm::lessThanEqual(innerMax, outerMax));
+	}
+}
+
+uint32_t AABBTree::Insert(const glm::vec3& boundsMin, const glm::vec3& boundsMax, uint32_t item) {
+	uint32_t leaf = AllocateNode();
+	Node& node = nodes[leaf];
+	glm::vec3 margin = (boundsMax - boundsMin) * AABB_TREE_FAT_MARGIN + AABB_TREE_FAT_MIN;
+	node.boundsMin = boundsMin;
+	node.boundsMax = boundsMax;
+	node.fatMin = boundsMin - margin;
+	node.fatMax = boundsMax + margin;
+	node.item = item;
+
+	InsertLeaf(leaf);
+	leafCount += 1;
+	return leaf;
+}
+
+void AABBTree::Remove(uint32_t proxy) {
+	assert(proxy < nodes.size() && nodes[proxy].IsLeaf());
+
+	RemoveLeaf(proxy);
+	FreeNode(proxy);
+	leafCount -= 1;
+}
+
+bool AABBTree::Move(uint32_t proxy, const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+	assert(proxy < nodes.size() && nodes[proxy].IsLeaf());
+
+	Node& node = nodes[proxy];
+	node.boundsMin = boundsMin;
+	node.boundsMax = boundsMax;
+	if (Contains(node.fatMin, node.fatMax, boundsMin, boundsMax)) {
+		return false;
+	}
+
+	RemoveLeaf(proxy);
+	glm::vec3 margin = (boundsMax - boundsMin) * AABB_TREE_FAT_MARGIN + AABB_TREE_FAT_MIN;
+	nodes[proxy].fatMin = boundsMin - margin;
+	nodes[proxy].fatMax = boundsMax + margin;
+	InsertLeaf(proxy);
+	return true;
+}
+
+uint32_t AABBTree::AllocateNode() {
+	uint32_t index = freeList;
+	if (index != AABB_TREE_NULL) {
+		freeList = nodes[index].parent;
+	}
+	else {
+		index = static_cast<uint32_t>(nodes.size());
+		nodes.push_back(Node());
+	}
+
+	Node& node = nodes[index];
+	node.parent = AABB_TREE_NULL;
+	node.child1 = AABB_TREE_NULL;
+	node.child2 = AABB_TREE_NULL;
+	node.height = 0;
+	node.item = AABB_TREE_NULL;
+	return index;
+}
+
+void AABBTree::FreeNode(uint32_t index) {
+	nodes[index].parent = freeList;
+	nodes[index].height = AABB_TREE_NULL;
+	freeList = index;
+}
+
+void AABBTree::InsertLeaf(uint32_t leaf) {
+	if (root == AABB_TREE_NULL) {
+		root = leaf;
+		nodes[root].parent = AABB_TREE_NULL;
+		return;
+	}
+
+	// Walk down to the sibling that costs the least surface area, counting what every node
+	// above it grows by on the way
+	glm::vec3 leafMin = nodes[leaf].fatMin;
+	glm::vec3 leafMax = nodes[leaf].fatMax;
+	uint32_t index = root;
+	while (!nodes[index].IsLeaf()) {
+		const Node& node = nodes[index];
+		float area = Area(node.fatMin, node.fatMax);
+		float combinedArea = Area(glm::min(node.fatMin, leafMin), glm::max(node.fatMax, leafMax));
+
+		// Making a new parent for this node and the leaf, or pushing the leaf further down
+		float cost = 2.0f * combinedArea;
+		float inheritedCost = 2.0f * (combinedArea - area);
+
+		float childCosts[2];
+		uint32_t children[2] = { node.child1, node.child2 };
+		for (uint32_t c = 0; c < 2; c += 1) {
+			const Node& child = nodes[children[c]];
+			float grown = Area(glm::min(child.fatMin, leafMin), glm::max(child.fatMax, leafMax));
+			childCosts[c] = (child.IsLeaf() ? grown : grown - Area(child.fatMin, child.fatMax)) + inheritedCost;
+		}
+
+		if (cost < childCosts[0] && cost < childCosts[1]) {
+			break;
+		}
+		index = childCosts[0] < childCosts[1] ? children[0] : children[1];
+	}
+	uint32_t sibling = index;
+
+	// New parent in place of the sibling
+	uint32_t oldParent = nodes[sibling].parent;
+	uint32_t newParent = AllocateNode();
+	nodes[newParent].parent = oldParent;
+	nodes[newParent].child1 = sibling;
+	nodes[newParent].child2 = leaf;
+	nodes[sibling].parent = newParent;
+	nodes[leaf].parent = newParent;
+
+	if (oldParent == AABB_TREE_NULL) {
+		root = newParent;
+	}
+	else if (nodes[oldParent].child1 == sibling) {
+		nodes[oldParent].child1 = newParent;
+	}
+	else {
+		nodes[oldParent].child2 = newParent;
+	}
+
+	// Fix up heights and boxes on the way back up
+	index = newParent;
+	while (index != AABB_TREE_NULL) {
+		index = Balance(index);
+		Refit(index);
+		index = nodes[index].parent;
+	}
+}
+
+void AABBTree::RemoveLeaf(uint32_t leaf) {
+	if (leaf == root) {
+		root = AABB_TREE_NULL;
+		return;
+	}
+
+	// The leaf's sibling takes its parent's place
+	uint32_t parent = nodes[leaf].parent;
+	uint32_t grandParent = nodes[parent].parent;
+	uint32_t sibling = nodes[parent].child1 == leaf ? nodes[parent].child2 : nodes[parent].child1;
+	FreeNode(parent);
+
+	if (grandParent == AABB_TREE_NULL) {
+		root = sibling;
+		nodes[sibling].parent = AABB_TREE_NULL;
+		return;
+	}
+
+	if (nodes[grandParent].child1 == parent) {
+		nodes[grandParent].child1 = sibling;
+	}
+	else {
+		nodes[grandParent].child2 = sibling;
+	}
+	nodes[sibling].parent = grandParent;
+
+	uint32_t index = grandParent;
+	while (index != AABB_TREE_NULL) {
+		index = Balance(index);
+		Refit(index);
+		index = nodes[index].parent;
+	}
+}
+
+void AABBTree::Refit(uint32_t index) {
+	Node& node = nodes[index];
+	const Node& child1 = nodes[node.child1];
+	const Node& child2 = nodes[node.child2];
+	node.fatMin = glm::min(child1.fatMin, child2.fatMin);
+	node.fatMax = glm::max(child1.fatMax, child2.fatMax);
+	node.height = 1 + std::max(child1.height, child2.height);
+}
+
+uint32_t AABBTree::Balance(uint32_t a) {
+	Node& nodeA = nodes[a];
+	if (nodeA.IsLeaf() || nodeA.height < 2) {
+		return a;
+	}
+
+	uint32_t b = nodeA.child1;
+	uint32_t c = nodeA.child2;
+	int balance = static_cast<int>(nodes[c].height) - static_cast<int>(nodes[b].height);
+	if (balance >= -1 && balance <= 1) {
+		return a;
+	}
+
+	// The taller child goes up into a's place, and a takes the shorter of its children
+	uint32_t up = balance > 1 ? c : b;
+	Node& nodeUp = nodes[up];
+	uint32_t f = nodeUp.child1;
+	uint32_t g = nodeUp.child2;
+
+	nodeUp.child1 = a;
+	nodeUp.parent = nodeA.parent;
+	nodeA.parent = up;
+	if (nodeUp.parent == AABB_TREE_NULL) {
+		root = up;
+	}
+	else if (nodes[nodeUp.parent].child1 == a) {
+		nodes[nodeUp.parent].child1 = up;
+	}
+	else {
+		nodes[nodeUp.parent].child2 = up;
+	}
+
+	uint32_t taller = nodes[f].height > nodes[g].height ? f : g;
+	uint32_t shorter = taller == f ? g : f;
+	nodeUp.child2 = taller;
+	if (balance > 1) {
+		nodeA.child2 = shorter;
+	}
+	else {
+		nodeA.child1 = shorter;
+	}
+	nodes[shorter].parent = a;
+
+	Refit(a);
+	Refit(up);
+	return up;
+}
+
+void AABBTree::Benchmark(const glm::vec4* planes, const glm::vec3& eye, uint32_t iterations) {
+	fprintf(stderr, "\nCPU AABB Tree -- %u threads, %u iterations\n", JobSystem::NumThreads(), iterations);
+
+	std::mt19937 rng(23);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+	const uint32_t counts[3] = { 10000, 100000, 1000000 };
+	for (uint32_t numBoxes : counts) {
+		// Meshes up to 4 across within 200 of the camera, the same spread FrustumCuller's benchmark uses
+		std::vector<glm::vec3> boxMin(numBoxes), boxMax(numBoxes);
+		for (uint32_t i = 0; i < numBoxes; i += 1) {
+			glm::vec3 center = eye + (glm::vec3(unit(rng), unit(rng), unit(rng)) * 2.0f - 1.0f) * 200.0f;
+			glm::vec3 extent = glm::vec3(unit(rng), unit(rng), unit(rng)) * 2.0f + 0.05f;
+			boxMin[i] = center - extent;
+			boxMax[i] = center + extent;
+		}
+
+		auto buildStart = std::chrono::high_resolution_clock::now();
+		AABBTree tree;
+		std::vector<uint32_t> proxies(numBoxes);
+		for (uint32_t i = 0; i < numBoxes; i += 1) {
+			proxies[i] = tree.Insert(boxMin[i], boxMax[i], i);
+		}
+		auto buildDone = std::chrono::high_resolution_clock::now();
+
+		FrustumCuller culler;
+		culler.Resize(numBoxes);
+		for (uint32_t i = 0; i < numBoxes; i += 1) {
+			culler.SetBounds(i, boxMin[i], boxMax[i]);
+		}
+
+		const uint32_t movedPerFrame = numBoxes / 100;
+		long long flatTime = 0;
+		long long treeTime = 0;
+		long long moveTime = 0;
+		uint64_t tested = 0;
+		uint64_t reinserted = 0;
+		uint32_t different = 0;
+		size_t numVisible = 0;
+		std::vector<uint32_t> flatVisible;
+		std::vector<uint32_t> treeVisible;
+		for (uint32_t i = 0; i < iterations; i += 1) {
+			// Some boxes drift a little, the way animated meshes do
+			auto moveStart = std::chrono::high_resolution_clock::now();
+			for (uint32_t j = 0; j < movedPerFrame; j += 1) {
+				uint32_t box = static_cast<uint32_t>(unit(rng) * numBoxes) % numBoxes;
+				glm::vec3 step = (glm::vec3(unit(rng), unit(rng), unit(rng)) * 2.0f - 1.0f) * 0.05f;
+				boxMin[box] += step;
+				boxMax[box] += step;
+				reinserted += tree.Move(proxies[box], boxMin[box], boxMax[box]) ? 1 : 0;
+			}
+			auto moveDone = std::chrono::high_resolution_clock::now();
+			for (uint32_t box = 0; box < numBoxes; box += 1) {
+				culler.SetBounds(box, boxMin[box], boxMax[box]);
+			}
+
+			// Both hand back the visible boxes, the flat loop has to look at every one to find them
+			auto flatStart = std::chrono::high_resolution_clock::now();
+			culler.Cull(planes);
+			flatVisible.clear();
+			for (uint32_t box = 0; box < numBoxes; box += 1) {
+				if (culler.Visible(box)) {
+					flatVisible.push_back(box);
+				}
+			}
+			auto flatDone = std::chrono::high_resolution_clock::now();
+
+			treeVisible.clear();
+			tested += tree.QueryFrustum(planes, [&treeVisible](uint32_t item) {
+				treeVisible.push_back(item);
+			});
+			auto treeDone = std::chrono::high_resolution_clock::now();
+
+			std::sort(treeVisible.begin(), treeVisible.end());
+
+			different += flatVisible == treeVisible ? 0 : 1;
+			numVisible = flatVisible.size();
+			moveTime += std::chrono::duration_cast<std::chrono::microseconds>(moveDone - moveStart).count();
+			flatTime += std::chrono::duration_cast<std::chrono::microseconds>(flatDone - flatStart).count();
+			treeTime += std::chrono::duration_cast<std::chrono::microseconds>(treeDone - flatDone).count();
+		}
+
+		fprintf(stderr, "CPU AABB Tree -- %u boxes, %zu visible, height %u: Build (us): %lld, flat SSE cull and walk (us): %.1f, tree cull (us): %.1f, %.1f boxes tested, %u frames different\n",
+			numBoxes, numVisible, tree.Height(), static_cast<long long>(std::chrono::duration_cast<std::chrono::microseconds>(buildDone - buildStart).count()),
+			flatTime / static_cast<float>(iterations), treeTime / static_cast<float>(iterations), tested / static_cast<float>(iterations), different);
+		fprintf(stderr, "CPU AABB Tree -- Moving %u boxes a frame (us): %.1f, %.1f put back in\n",
+			movedPerFrame, moveTime / static_cast<float>(iterations), reinserted / static_cast<float>(iterations));
+	}
+}
@@ -58,16 +58,28 @@ BVH::BVH(
 	}
 
 	gpuTriangles.swap(orderedGPUTriangles);
+	_vertices = gpuVertices.data();
+	_triangles = gpuTriangles.data();
 
 	// Flatten our BVH hierarchy for sending to the GPU
 	if (root) {
 		_nodes = std::vector<LinearBVHNode>(totalNodes);
+		_parents = std::vector<uint32_t>(totalNodes);
 		uint32_t offset = 0;
 		FlattenBVHTree(root, &offset);
 	}
 
 }
 
+BVH::BVH(
+	const LinearBVHNode* nodes,
+	const uint32_t* parents,
+	uint32_t numNodes,
+	const GPUVertex* gpuVertices,
+	const GPUTriangle* gpuTriangles
+) : _maxPrimsPerNode(255), _splitMethod(SplitMethod::SAH), _nodes(nodes, nodes + numNodes), _parents(parents, parents + numNodes),
+	_vertices(gpuVertices), _triangles(gpuTriangles) {}
+
 BVHNode* BVH::RecursiveBuild(
 	std::vector<BVHPrimitiveInfo>& primitiveInfo,
 	uint32_t start,
@@ -215,20 +227,21 @@ BVHNode* BVH::RecursiveBuild(
 }
 
 // TODO: Handle child nodes being null
-uint32_t BVH::FlattenBVHTree(BVHNode* node, uint32_t* offset) {
+uint32_t BVH::FlattenBVHTree(BVHNode* node, uint32_t* offset, uint32_t parentOffset) {
 	LinearBVHNode* linearNode = &_nodes[*offset];
 	linearNode->boundsMin = node->bounds.min;
 	linearNode->boundsMax = node->bounds.max;
 	uint32_t myOffset = (*offset)++;
+	_parents[myOffset] = parentOffset;
 	if (node->numPrimitives > 0) {
 		linearNode->offset = node->firstPrimOffset;
 		linearNode->numPrimitives_and_axis = (node->numPrimitives << 16) | (0 & 0xFFFF);
 	}
 	else {
 		linearNode->numPrimitives_and_axis = (node->numPrimitives << 16) | ((uint32_t)node->splitAxis & 0xFFFF);
-		FlattenBVHTree(node->children[0], offset);
+		FlattenBVHTree(node->children[0], offset, myOffset);
 		linearNode->offset =
-			FlattenBVHTree(node->children[1], offset);
+			FlattenBVHTree(node->children[1], offset, myOffset);
 	}
 
 	return myOffset;
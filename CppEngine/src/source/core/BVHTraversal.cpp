@@ -0,0 +1,913 @@
+#include "BVH.h"
+
+#include "CacheSimulator.h"
+#include "OpacityMicromap.h"
+
+#include <bitset>
+#include <cmath>
+
+#include <xmmintrin.h>
+
+// CPU traversal of our flattened BVH. The single ray path mirrors BVHIntersect in rayTrace.comp
+// so the CPU and GPU tracers agree, the packet path traces N rays per node visit with SSE.
+
+// A stack this deep covers any tree we build. If it does fill up we finish the far child
+// right away instead of dropping it like the shader does.
+#define BVH_STACK_SIZE 64
+
+// Per ray stack for IntersectShortStack. Small enough to live in registers on the GPU.
+#define BVH_SHORT_STACK_SIZE 4
+
+// Once fewer than this many rays in a packet are still interested in a subtree, they are
+// cheaper to finish one at a time than to keep dragging the rest of the packet along.
+#define PACKET_MIN_ACTIVE_RAYS 2
+
+#if PROFILING
+#define RECORD_ACCESS(address, bytes) if (cacheSimulator) { cacheSimulator->Access(address, bytes); }
+#define COUNT_RAY_STAT(counter, amount) if (rayCounters) { rayCounters->counter += (amount); }
+#else
+#define RECORD_ACCESS(address, bytes)
+#define COUNT_RAY_STAT(counter, amount)
+#endif
+
+namespace {
+	thread_local CacheSimulator* cacheSimulator = nullptr;
+	thread_local RayCounters* rayCounters = nullptr;
+
+	inline uint32_t CountBits(uint32_t mask) {
+		return static_cast<uint32_t>(std::bitset<32>(mask).count());
+	}
+
+	inline bool AABBIntersectRay(const LinearBVHNode& node, const Ray& ray, const glm::vec3& invDir) {
+		/* https://tavianator.com/2011/ray_box.html */
+		glm::vec3 t1 = (node.boundsMin - ray.pos) * invDir;
+		glm::vec3 t2 = (node.boundsMax - ray.pos) * invDir;
+
+		float tMin = std::fmin(t1.x, t2.x);
+		float tMax = std::fmax(t1.x, t2.x);
+
+		tMin = std::fmax(tMin, std::fmin(t1.y, t2.y));
+		tMax = std::fmin(tMax, std::fmax(t1.y, t2.y));
+
+		tMin = std::fmax(tMin, std::fmin(t1.z, t2.z));
+		tMax = std::fmin(tMax, std::fmax(t1.z, t2.z));
+
+		return (tMax >= std::fmax(0.0f, tMin)) && (tMin < ray.tMax);
+	}
+
+	// Same slab test, also handing back where the ray enters the box
+	inline bool AABBEntryDistance(const LinearBVHNode& node, const Ray& ray, const glm::vec3& invDir, float& tEntry) {
+		glm::vec3 t1 = (node.boundsMin - ray.pos) * invDir;
+		glm::vec3 t2 = (node.boundsMax - ray.pos) * invDir;
+
+		glm::vec3 tNear = glm::min(t1, t2);
+		glm::vec3 tFar = glm::max(t1, t2);
+		float tMin = std::fmax(std::fmax(tNear.x, tNear.y), tNear.z);
+		float tMax = std::fmin(std::fmin(tFar.x, tFar.y), tFar.z);
+
+		tEntry = tMin;
+		return (tMax >= std::fmax(0.0f, tMin)) && (tMin < ray.tMax);
+	}
+
+	// Lower and upper bound of (plane - origin) * invDir over every ray in a packet
+	inline void SlabInterval(float plane, float originMin, float originMax, float invMin, float invMax, float& tLow, float& tHigh) {
+		float dLow = plane - originMax;
+		float dHigh = plane - originMin;
+
+		float p0 = dLow * invMin;
+		float p1 = dLow * invMax;
+		float p2 = dHigh * invMin;
+		float p3 = dHigh * invMax;
+
+		tLow = std::fmin(std::fmin(p0, p1), std::fmin(p2, p3));
+		tHigh = std::fmax(std::fmax(p0, p1), std::fmax(p2, p3));
+	}
+
+	// Bounds of a whole packet used to throw away nodes that no ray in the packet can hit
+	// before doing per ray tests. Only valid when every ray points into the same octant.
+	struct PacketInterval {
+		glm::vec3 originMin;
+		glm::vec3 originMax;
+		glm::vec3 invMin;
+		glm::vec3 invMax;
+		glm::ivec3 dirIsNeg;
+		float tMax;
+		bool valid;
+	};
+
+	inline bool IntervalIntersect(const LinearBVHNode& node, const PacketInterval& interval) {
+		if (!interval.valid) {
+			return true;
+		}
+
+		float entry = -INFINITY;
+		float exit = INFINITY;
+		for (int32_t axis = 0; axis < 3; axis += 1) {
+			float minLow, minHigh, maxLow, maxHigh;
+			SlabInterval(node.boundsMin[axis], interval.originMin[axis], interval.originMax[axis], interval.invMin[axis], interval.invMax[axis], minLow, minHigh);
+			SlabInterval(node.boundsMax[axis], interval.originMin[axis], interval.originMax[axis], interval.invMin[axis], interval.invMax[axis], maxLow, maxHigh);
+
+			if (interval.dirIsNeg[axis]) {
+				entry = std::fmax(entry, maxLow);
+				exit = std::fmin(exit, minHigh);
+			}
+			else {
+				entry = std::fmax(entry, minLow);
+				exit = std::fmin(exit, maxHigh);
+			}
+		}
+
+		return entry <= exit && exit >= 0.0f && entry < interval.tMax;
+	}
+
+	template <uint32_t N>
+	inline uint32_t FullMask() {
+		return (N == 32) ? 0xFFFFFFFF : ((1u << N) - 1);
+	}
+
+	// Fills in the inverse directions and packet bounds. Returns false if the rays don't all
+	// point into the same octant, in which case they shouldn't be traced as a packet.
+	template <uint32_t N>
+	bool SetupPacket(const RayPacket<N>& packet, float* invX, float* invY, float* invZ, PacketInterval& interval) {
+		glm::ivec3 dirIsNeg = glm::ivec3(packet.dirX[0] < 0, packet.dirY[0] < 0, packet.dirZ[0] < 0);
+		for (uint32_t lane = 1; lane < N; lane += 1) {
+			if ((packet.dirX[lane] < 0) != (dirIsNeg.x > 0) ||
+				(packet.dirY[lane] < 0) != (dirIsNeg.y > 0) ||
+				(packet.dirZ[lane] < 0) != (dirIsNeg.z > 0)) {
+				return false;
+			}
+		}
+
+		interval.originMin = glm::vec3(INFINITY);
+		interval.originMax = glm::vec3(-INFINITY);
+		interval.invMin = glm::vec3(INFINITY);
+		interval.invMax = glm::vec3(-INFINITY);
+		interval.dirIsNeg = dirIsNeg;
+		interval.tMax = 0;
+
+		for (uint32_t lane = 0; lane < N; lane += 1) {
+			invX[lane] = 1.0f / packet.dirX[lane];
+			invY[lane] = 1.0f / packet.dirY[lane];
+			invZ[lane] = 1.0f / packet.dirZ[lane];
+
+			glm::vec3 origin = glm::vec3(packet.posX[lane], packet.posY[lane], packet.posZ[lane]);
+			glm::vec3 inv = glm::vec3(invX[lane], invY[lane], invZ[lane]);
+			interval.originMin = glm::min(interval.originMin, origin);
+			interval.originMax = glm::max(interval.originMax, origin);
+			interval.invMin = glm::min(interval.invMin, inv);
+			interval.invMax = glm::max(interval.invMax, inv);
+			interval.tMax = std::fmax(interval.tMax, packet.tMax[lane]);
+		}
+
+		// Axis aligned rays give infinite slopes which the interval math can't handle
+		interval.valid =
+			std::isfinite(interval.invMin.x) && std::isfinite(interval.invMax.x) &&
+			std::isfinite(interval.invMin.y) && std::isfinite(interval.invMax.y) &&
+			std::isfinite(interval.invMin.z) && std::isfinite(interval.invMax.z);
+
+		return true;
+	}
+
+	inline int32_t RayOctant(const Ray& ray) {
+		return (ray.dir.x < 0) | ((ray.dir.y < 0) << 1) | ((ray.dir.z < 0) << 2);
+	}
+}
+
+void BVH::SetCacheSimulator(CacheSimulator* simulator) {
+	cacheSimulator = simulator;
+}
+
+void BVH::SetRayCounters(RayCounters* counters) {
+	rayCounters = counters;
+}
+
+RayCounters* BVH::GetRayCounters() {
+	return rayCounters;
+}
+
+bool BVH::Intersect(Ray& ray, TriangleHit& hit) const {
+	if (_nodes.empty()) {
+		return false;
+	}
+
+	return IntersectSubtree(ray, hit, 0);
+}
+
+bool BVH::IntersectSubtree(Ray& ray, TriangleHit& hit, uint32_t rootNode) const {
+	bool didHit = false;
+
+	glm::vec3 invDir = glm::vec3(1.0f / ray.dir.x, 1.0f / ray.dir.y, 1.0f / ray.dir.z);
+	glm::ivec3 dirIsNeg = glm::ivec3(invDir.x < 0, invDir.y < 0, invDir.z < 0);
+
+	uint32_t toVisitOffset = 0;
+	uint32_t currentNodeIndex = rootNode;
+	uint32_t nodesToVisit[BVH_STACK_SIZE];
+
+	while (true) {
+		const LinearBVHNode& node = _nodes[currentNodeIndex];
+		RECORD_ACCESS(&node, sizeof(LinearBVHNode));
+		COUNT_RAY_STAT(nodesVisited, 1);
+		COUNT_RAY_STAT(aabbTests, 1);
+
+		// If this node intersects with our ray
+		if (AABBIntersectRay(node, ray, invDir)) {
+
+			// Leaf node. Check all triangles within this leaf node.
+			uint32_t numPrimitives = (node.numPrimitives_and_axis >> 16);
+			if (numPrimitives > 0) {
+				for (uint32_t i = 0; i < numPrimitives; i += 1) {
+					if (IntersectTriangle(node.offset + i, ray, hit)) {
+						didHit = true;
+					}
+				}
+			}
+			// Interior node. Check children nodes, using direction of ray to determine which child to check first.
+			else {
+				uint32_t nearChild = currentNodeIndex + 1;
+				uint32_t farChild = node.offset;
+				if (dirIsNeg[(node.numPrimitives_and_axis & 0xFFFF)] > 0) {
+					std::swap(nearChild, farChild);
+				}
+
+				if (toVisitOffset < BVH_STACK_SIZE) {
+					nodesToVisit[toVisitOffset++] = farChild;
+				}
+				else {
+					didHit = IntersectSubtree(ray, hit, farChild) || didHit;
+				}
+				currentNodeIndex = nearChild;
+				continue;
+			}
+		}
+
+		if (toVisitOffset == 0) {
+			break;
+		}
+		currentNodeIndex = nodesToVisit[--toVisitOffset];
+	}
+
+	return didHit;
+}
+
+bool BVH::IntersectShortStack(Ray& ray, TriangleHit& hit) const {
+	if (_nodes.empty()) {
+		return false;
+	}
+
+	bool didHit = false;
+
+	glm::vec3 invDir = glm::vec3(1.0f / ray.dir.x, 1.0f / ray.dir.y, 1.0f / ray.dir.z);
+	glm::ivec3 dirIsNeg = glm::ivec3(invDir.x < 0, invDir.y < 0, invDir.z < 0);
+
+	// Ring buffer. A push onto a full stack overwrites the oldest entry.
+	uint32_t nodesToVisit[BVH_SHORT_STACK_SIZE];
+	uint32_t stackTop = 0;
+	uint32_t stackCount = 0;
+	bool droppedEntries = false;
+
+	// Root of the subtree being walked, the last node we jumped to instead of walking down to.
+	// Every node we would still have on a full stack is the far sibling of one of its ancestors.
+	uint32_t trailNode = 0;
+	uint32_t currentNodeIndex = 0;
+
+	while (true) {
+		const LinearBVHNode& node = _nodes[currentNodeIndex];
+		RECORD_ACCESS(&node, sizeof(LinearBVHNode));
+		COUNT_RAY_STAT(nodesVisited, 1);
+		COUNT_RAY_STAT(aabbTests, 1);
+
+		if (AABBIntersectRay(node, ray, invDir)) {
+			uint32_t numPrimitives = (node.numPrimitives_and_axis >> 16);
+			if (numPrimitives > 0) {
+				for (uint32_t i = 0; i < numPrimitives; i += 1) {
+					if (IntersectTriangle(node.offset + i, ray, hit)) {
+						didHit = true;
+					}
+				}
+			}
+			else {
+				uint32_t nearChild = currentNodeIndex + 1;
+				uint32_t farChild = node.offset;
+				if (dirIsNeg[(node.numPrimitives_and_axis & 0xFFFF)] > 0) {
+					std::swap(nearChild, farChild);
+				}
+
+				if (stackCount == BVH_SHORT_STACK_SIZE) {
+					droppedEntries = true;
+				}
+				else {
+					stackCount += 1;
+				}
+				nodesToVisit[stackTop] = farChild;
+				stackTop = (stackTop + 1) % BVH_SHORT_STACK_SIZE;
+
+				currentNodeIndex = nearChild;
+				continue;
+			}
+		}
+
+		if (stackCount > 0) {
+			stackTop = (stackTop + BVH_SHORT_STACK_SIZE - 1) % BVH_SHORT_STACK_SIZE;
+			stackCount -= 1;
+			currentNodeIndex = trailNode = nodesToVisit[stackTop];
+			continue;
+		}
+
+		// The stack never overflowed, so it held everything
+		if (!droppedEntries) {
+			break;
+		}
+
+		// Restart from where the trail left off. Anything still to do is a far sibling further up.
+		if (!NextFarSibling(trailNode, dirIsNeg, currentNodeIndex)) {
+			break;
+		}
+		trailNode = currentNodeIndex;
+	}
+
+	return didHit;
+}
+
+bool BVH::NextFarSibling(uint32_t node, const glm::ivec3& dirIsNeg, uint32_t& sibling) const {
+	while (node != 0) {
+		RECORD_ACCESS(&_parents[node], sizeof(uint32_t));
+		uint32_t parentIndex = _parents[node];
+		const LinearBVHNode& parent = _nodes[parentIndex];
+		RECORD_ACCESS(&parent, sizeof(LinearBVHNode));
+		COUNT_RAY_STAT(nodesVisited, 1);
+
+		uint32_t nearChild = parentIndex + 1;
+		uint32_t farChild = parent.offset;
+		if (dirIsNeg[(parent.numPrimitives_and_axis & 0xFFFF)] > 0) {
+			std::swap(nearChild, farChild);
+		}
+
+		// Coming up out of the far child means both sides are done
+		if (node == nearChild) {
+			sibling = farChild;
+			return true;
+		}
+		node = parentIndex;
+	}
+
+	return false;
+}
+
+/* https://www.scratchapixel.com/lessons/3d-basic-rendering/ray-tracing-rendering-a-triangle/moller-trumbore-ray-triangle-intersection */
+bool BVH::IntersectTriangle(uint32_t triangleIndex, Ray& ray, TriangleHit& hit) const {
+	const GPUTriangle& triangle = _triangles[triangleIndex];
+	RECORD_ACCESS(&triangle, sizeof(GPUTriangle));
+	RECORD_ACCESS(&_vertices[triangle.indices[0]], sizeof(glm::vec4));
+	RECORD_ACCESS(&_vertices[triangle.indices[1]], sizeof(glm::vec4));
+	RECORD_ACCESS(&_vertices[triangle.indices[2]], sizeof(glm::vec4));
+	COUNT_RAY_STAT(triangleTests, 1);
+	glm::vec3 a = glm::vec3(_vertices[triangle.indices[0]].position_and_u);
+	glm::vec3 b = glm::vec3(_vertices[triangle.indices[1]].position_and_u);
+	glm::vec3 c = glm::vec3(_vertices[triangle.indices[2]].position_and_u);
+
+	glm::vec3 a_to_b = b - a;
+	glm::vec3 a_to_c = c - a;
+	glm::vec3 pVec = glm::cross(ray.dir, a_to_c);
+	float det = glm::dot(a_to_b, pVec);
+
+	// If we are parallel
+	if (std::fabs(det) < REALLY_SMALL_NUMBER) return false;
+
+	// Avoid excess divides
+	float invDet = 1.0f / det;
+
+	glm::vec3 uVec = ray.pos - a;
+	float u = glm::dot(uVec, pVec) * invDet;
+	if (u < 0.0f || u > 1.0f) return false;
+
+	glm::vec3 vVec = glm::cross(uVec, a_to_b);
+	float v = glm::dot(ray.dir, vVec) * invDet;
+	if (v < 0.0f || u + v > 1.0f) return false;
+
+	// Behind us or past our closest triangle
+	float t = glm::dot(a_to_c, vVec) * invDet;
+	if (t < 0.0f || t > ray.tMax) return false;
+
+	if (PassesThrough(triangleIndex, u, v)) return false;
+
+	ray.tMax = t;
+	hit.triangleIndex = triangleIndex;
+	hit.u = u;
+	hit.v = v;
+
+	return true;
+}
+
+bool BVH::Occluded(const Ray& ray) const {
+	if (_nodes.empty()) {
+		return false;
+	}
+
+	glm::vec3 invDir = glm::vec3(1.0f / ray.dir.x, 1.0f / ray.dir.y, 1.0f / ray.dir.z);
+	RECORD_ACCESS(&_nodes[0], sizeof(LinearBVHNode));
+	COUNT_RAY_STAT(aabbTests, 1);
+	if (!AABBIntersectRay(_nodes[0], ray, invDir)) {
+		return false;
+	}
+
+	return OccludedSubtree(ray, invDir, 0);
+}
+
+bool BVH::OccludedSubtree(const Ray& ray, const glm::vec3& invDir, uint32_t rootNode) const {
+	uint32_t toVisitOffset = 0;
+	uint32_t currentNodeIndex = rootNode;
+	uint32_t nodesToVisit[BVH_STACK_SIZE];
+
+	// Unlike closest hit, children are tested from their parent. Children the ray misses are
+	// never pushed, and whichever one the ray enters first is walked first since occluders
+	// close to the surface are the common case for shadow rays.
+	while (true) {
+		const LinearBVHNode& node = _nodes[currentNodeIndex];
+		COUNT_RAY_STAT(nodesVisited, 1);
+
+		uint32_t numPrimitives = (node.numPrimitives_and_axis >> 16);
+		if (numPrimitives > 0) {
+			for (uint32_t i = 0; i < numPrimitives; i += 1) {
+				if (OccludedTriangle(node.offset + i, ray)) {
+					return true;
+				}
+			}
+		}
+		else {
+			uint32_t nearChild = currentNodeIndex + 1;
+			uint32_t farChild = node.offset;
+			RECORD_ACCESS(&_nodes[nearChild], sizeof(LinearBVHNode));
+			RECORD_ACCESS(&_nodes[farChild], sizeof(LinearBVHNode));
+			COUNT_RAY_STAT(aabbTests, 2);
+
+			float tNear, tFar;
+			bool hitNear = AABBEntryDistance(_nodes[nearChild], ray, invDir, tNear);
+			bool hitFar = AABBEntryDistance(_nodes[farChild], ray, invDir, tFar);
+
+			if (hitNear && hitFar) {
+				if (tFar < tNear) {
+					std::swap(nearChild, farChild);
+				}
+
+				if (toVisitOffset < BVH_STACK_SIZE) {
+					nodesToVisit[toVisitOffset++] = farChild;
+				}
+				else if (OccludedSubtree(ray, invDir, farChild)) {
+					return true;
+				}
+				currentNodeIndex = nearChild;
+				continue;
+			}
+			if (hitNear || hitFar) {
+				currentNodeIndex = hitNear ? nearChild : farChild;
+				continue;
+			}
+		}
+
+		if (toVisitOffset == 0) {
+			break;
+		}
+		currentNodeIndex = nodesToVisit[--toVisitOffset];
+	}
+
+	return false;
+}
+
+// Moller Trumbore like IntersectTriangle, without writing anything back
+bool BVH::OccludedTriangle(uint32_t triangleIndex, const Ray& ray) const {
+	const GPUTriangle& triangle = _triangles[triangleIndex];
+	RECORD_ACCESS(&triangle, sizeof(GPUTriangle));
+	RECORD_ACCESS(&_vertices[triangle.indices[0]], sizeof(glm::vec4));
+	RECORD_ACCESS(&_vertices[triangle.indices[1]], sizeof(glm::vec4));
+	RECORD_ACCESS(&_vertices[triangle.indices[2]], sizeof(glm::vec4));
+	COUNT_RAY_STAT(triangleTests, 1);
+	glm::vec3 a = glm::vec3(_vertices[triangle.indices[0]].position_and_u);
+	glm::vec3 a_to_b = glm::vec3(_vertices[triangle.indices[1]].position_and_u) - a;
+	glm::vec3 a_to_c = glm::vec3(_vertices[triangle.indices[2]].position_and_u) - a;
+
+	glm::vec3 pVec = glm::cross(ray.dir, a_to_c);
+	float det = glm::dot(a_to_b, pVec);
+	if (std::fabs(det) < REALLY_SMALL_NUMBER) return false;
+	float invDet = 1.0f / det;
+
+	glm::vec3 uVec = ray.pos - a;
+	float u = glm::dot(uVec, pVec) * invDet;
+	if (u < 0.0f || u > 1.0f) return false;
+
+	glm::vec3 vVec = glm::cross(uVec, a_to_b);
+	float v = glm::dot(ray.dir, vVec) * invDet;
+	if (v < 0.0f || u + v > 1.0f) return false;
+
+	float t = glm::dot(a_to_c, vVec) * invDet;
+	if (t < 0.0f || t > ray.tMax) return false;
+
+	return !PassesThrough(triangleIndex, u, v);
+}
+
+bool BVH::PassesThrough(uint32_t triangleIndex, float u, float v) const {
+	if (!_opacity || !_opacity->AlphaTested(triangleIndex)) {
+		return false;
+	}
+
+	COUNT_RAY_STAT(alphaTests, 1);
+	MicroOpacity opacity = _opacity->Lookup(triangleIndex, u, v);
+	if (opacity != MicroOpacity::Unknown) {
+		return opacity == MicroOpacity::Transparent;
+	}
+
+	COUNT_RAY_STAT(alphaFetches, 1);
+	return _opacity->SampleTransparent(triangleIndex, u, v);
+}
+
+void BVH::Occluded(const Ray* rays, uint32_t count, bool* occluded) const {
+	const uint32_t packetSize = 4;
+
+	// Rays are gathered into a packet per octant. A full packet is traced right away, whatever
+	// is left over at the end is padded out with copies of its first ray.
+	uint32_t pending[8][packetSize];
+	uint32_t numPending[8] = { 0 };
+
+	RayPacket<packetSize> packet;
+	for (uint32_t i = 0; i <= count; i += 1) {
+		bool flush = (i == count);
+		int32_t octant = flush ? 0 : RayOctant(rays[i]);
+		if (!flush) {
+			pending[octant][numPending[octant]++] = i;
+		}
+
+		for (int32_t o = 0; o < 8; o += 1) {
+			if (!flush && (o != octant || numPending[o] < packetSize)) {
+				continue;
+			}
+			if (numPending[o] == 0) {
+				continue;
+			}
+
+			if (numPending[o] == 1) {
+				occluded[pending[o][0]] = Occluded(rays[pending[o][0]]);
+			}
+			else {
+				for (uint32_t lane = 0; lane < packetSize; lane += 1) {
+					packet.SetRay(lane, rays[pending[o][lane < numPending[o] ? lane : 0]]);
+				}
+
+				uint32_t mask = OccludedPacket<packetSize>(packet, FullMask<packetSize>() >> (packetSize - numPending[o]));
+				for (uint32_t lane = 0; lane < numPending[o]; lane += 1) {
+					occluded[pending[o][lane]] = (mask >> lane) & 1;
+				}
+			}
+			numPending[o] = 0;
+		}
+	}
+}
+
+template <uint32_t N>
+void BVH::IntersectPacket(RayPacket<N>& packet) const {
+	if (_nodes.empty()) {
+		return;
+	}
+
+	// A packet only makes sense if every ray visits children in the same order.
+	// Otherwise, the packet has already diverged and each ray goes on its own.
+	alignas(16) float invX[N];
+	alignas(16) float invY[N];
+	alignas(16) float invZ[N];
+	PacketInterval interval;
+	if (!SetupPacket<N>(packet, invX, invY, invZ, interval)) {
+		for (uint32_t i = 0; i < N; i += 1) {
+			Ray ray = packet.GetRay(i);
+			TriangleHit hit = packet.GetHit(i);
+			if (IntersectSubtree(ray, hit, 0)) {
+				packet.SetHit(i, ray, hit);
+			}
+		}
+		return;
+	}
+	const glm::ivec3& dirIsNeg = interval.dirIsNeg;
+
+	struct StackEntry {
+		uint32_t node;
+		uint32_t mask;
+	};
+
+	uint32_t toVisitOffset = 0;
+	StackEntry nodesToVisit[BVH_STACK_SIZE];
+	uint32_t currentNodeIndex = 0;
+	uint32_t activeMask = FullMask<N>();
+
+	while (true) {
+		const LinearBVHNode& node = _nodes[currentNodeIndex];
+		RECORD_ACCESS(&node, sizeof(LinearBVHNode));
+		COUNT_RAY_STAT(nodesVisited, 1);
+
+		uint32_t hitMask = 0;
+		if (IntervalIntersect(node, interval)) {
+			hitMask = IntersectPacketAABB<N>(node, packet, invX, invY, invZ, activeMask);
+		}
+
+		if (hitMask != 0) {
+			uint32_t numPrimitives = (node.numPrimitives_and_axis >> 16);
+
+			// Diverged. Finish this subtree one ray at a time.
+			if (CountBits(hitMask) < PACKET_MIN_ACTIVE_RAYS) {
+				for (uint32_t lane = 0; lane < N; lane += 1) {
+					if ((hitMask >> lane) & 1) {
+						Ray ray = packet.GetRay(lane);
+						TriangleHit hit = packet.GetHit(lane);
+						if (IntersectSubtree(ray, hit, currentNodeIndex)) {
+							packet.SetHit(lane, ray, hit);
+						}
+					}
+				}
+			}
+			// Leaf node. Every active ray checks every triangle.
+			else if (numPrimitives > 0) {
+				for (uint32_t i = 0; i < numPrimitives; i += 1) {
+					IntersectPacketTriangle<N>(node.offset + i, packet, hitMask);
+				}
+			}
+			// Interior node. All rays share a direction sign, so they all agree on the near child.
+			else {
+				uint32_t nearChild = currentNodeIndex + 1;
+				uint32_t farChild = node.offset;
+				if (dirIsNeg[(node.numPrimitives_and_axis & 0xFFFF)] > 0) {
+					std::swap(nearChild, farChild);
+				}
+
+				if (toVisitOffset < BVH_STACK_SIZE) {
+					nodesToVisit[toVisitOffset++] = StackEntry{ farChild, hitMask };
+				}
+				else {
+					for (uint32_t lane = 0; lane < N; lane += 1) {
+						if ((hitMask >> lane) & 1) {
+							Ray ray = packet.GetRay(lane);
+							TriangleHit hit = packet.GetHit(lane);
+							if (IntersectSubtree(ray, hit, farChild)) {
+								packet.SetHit(lane, ray, hit);
+							}
+						}
+					}
+				}
+
+				currentNodeIndex = nearChild;
+				activeMask = hitMask;
+				continue;
+			}
+		}
+
+		if (toVisitOffset == 0) {
+			break;
+		}
+		toVisitOffset -= 1;
+		currentNodeIndex = nodesToVisit[toVisitOffset].node;
+		activeMask = nodesToVisit[toVisitOffset].mask;
+	}
+}
+
+template <uint32_t N>
+uint32_t BVH::IntersectPacketAABB(const LinearBVHNode& node, const RayPacket<N>& packet, const float* invX, const float* invY, const float* invZ, uint32_t mask) const {
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 minX = _mm_set1_ps(node.boundsMin.x);
+	const __m128 minY = _mm_set1_ps(node.boundsMin.y);
+	const __m128 minZ = _mm_set1_ps(node.boundsMin.z);
+	const __m128 maxX = _mm_set1_ps(node.boundsMax.x);
+	const __m128 maxY = _mm_set1_ps(node.boundsMax.y);
+	const __m128 maxZ = _mm_set1_ps(node.boundsMax.z);
+	COUNT_RAY_STAT(aabbTests, CountBits(mask));
+
+	uint32_t hitMask = 0;
+	for (uint32_t group = 0; group < N / 4; group += 1) {
+		uint32_t lane = group * 4;
+		if (((mask >> lane) & 0xF) == 0) {
+			continue;
+		}
+
+		__m128 posX = _mm_load_ps(packet.posX + lane);
+		__m128 posY = _mm_load_ps(packet.posY + lane);
+		__m128 posZ = _mm_load_ps(packet.posZ + lane);
+		__m128 inverseX = _mm_load_ps(invX + lane);
+		__m128 inverseY = _mm_load_ps(invY + lane);
+		__m128 inverseZ = _mm_load_ps(invZ + lane);
+
+		__m128 t1x = _mm_mul_ps(_mm_sub_ps(minX, posX), inverseX);
+		__m128 t2x = _mm_mul_ps(_mm_sub_ps(maxX, posX), inverseX);
+		__m128 t1y = _mm_mul_ps(_mm_sub_ps(minY, posY), inverseY);
+		__m128 t2y = _mm_mul_ps(_mm_sub_ps(maxY, posY), inverseY);
+		__m128 t1z = _mm_mul_ps(_mm_sub_ps(minZ, posZ), inverseZ);
+		__m128 t2z = _mm_mul_ps(_mm_sub_ps(maxZ, posZ), inverseZ);
+
+		__m128 tMin = _mm_max_ps(_mm_max_ps(_mm_min_ps(t1x, t2x), _mm_min_ps(t1y, t2y)), _mm_min_ps(t1z, t2z));
+		__m128 tMax = _mm_min_ps(_mm_min_ps(_mm_max_ps(t1x, t2x), _mm_max_ps(t1y, t2y)), _mm_max_ps(t1z, t2z));
+
+		__m128 hit = _mm_and_ps(
+			_mm_cmpge_ps(tMax, _mm_max_ps(zero, tMin)),
+			_mm_cmplt_ps(tMin, _mm_load_ps(packet.tMax + lane)));
+
+		hitMask |= static_cast<uint32_t>(_mm_movemask_ps(hit)) << lane;
+	}
+
+	return hitMask & mask;
+}
+
+template <uint32_t N>
+uint32_t BVH::IntersectPacketTriangle(uint32_t triangleIndex, RayPacket<N>& packet, uint32_t mask) const {
+	const GPUTriangle& triangle = _triangles[triangleIndex];
+	RECORD_ACCESS(&triangle, sizeof(GPUTriangle));
+	RECORD_ACCESS(&_vertices[triangle.indices[0]], sizeof(glm::vec4));
+	RECORD_ACCESS(&_vertices[triangle.indices[1]], sizeof(glm::vec4));
+	RECORD_ACCESS(&_vertices[triangle.indices[2]], sizeof(glm::vec4));
+	COUNT_RAY_STAT(triangleTests, CountBits(mask));
+	glm::vec3 a = glm::vec3(_vertices[triangle.indices[0]].position_and_u);
+	glm::vec3 a_to_b = glm::vec3(_vertices[triangle.indices[1]].position_and_u) - a;
+	glm::vec3 a_to_c = glm::vec3(_vertices[triangle.indices[2]].position_and_u) - a;
+
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 epsilon = _mm_set1_ps(REALLY_SMALL_NUMBER);
+	const __m128 signMask = _mm_set1_ps(-0.0f);
+
+	const __m128 ax = _mm_set1_ps(a.x);
+	const __m128 ay = _mm_set1_ps(a.y);
+	const __m128 az = _mm_set1_ps(a.z);
+	const __m128 e1x = _mm_set1_ps(a_to_b.x);
+	const __m128 e1y = _mm_set1_ps(a_to_b.y);
+	const __m128 e1z = _mm_set1_ps(a_to_b.z);
+	const __m128 e2x = _mm_set1_ps(a_to_c.x);
+	const __m128 e2y = _mm_set1_ps(a_to_c.y);
+	const __m128 e2z = _mm_set1_ps(a_to_c.z);
+
+	uint32_t hitMask = 0;
+	for (uint32_t group = 0; group < N / 4; group += 1) {
+		uint32_t lane = group * 4;
+		uint32_t groupMask = (mask >> lane) & 0xF;
+		if (groupMask == 0) {
+			continue;
+		}
+
+		__m128 dx = _mm_load_ps(packet.dirX + lane);
+		__m128 dy = _mm_load_ps(packet.dirY + lane);
+		__m128 dz = _mm_load_ps(packet.dirZ + lane);
+
+		// pVec = cross(dir, a_to_c)
+		__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+		__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+		__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+
+		__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+		__m128 invDet = _mm_div_ps(one, det);
+
+		// uVec = pos - a
+		__m128 ux = _mm_sub_ps(_mm_load_ps(packet.posX + lane), ax);
+		__m128 uy = _mm_sub_ps(_mm_load_ps(packet.posY + lane), ay);
+		__m128 uz = _mm_sub_ps(_mm_load_ps(packet.posZ + lane), az);
+		__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ux, px), _mm_mul_ps(uy, py)), _mm_mul_ps(uz, pz)), invDet);
+
+		// vVec = cross(uVec, a_to_b)
+		__m128 qx = _mm_sub_ps(_mm_mul_ps(uy, e1z), _mm_mul_ps(uz, e1y));
+		__m128 qy = _mm_sub_ps(_mm_mul_ps(uz, e1x), _mm_mul_ps(ux, e1z));
+		__m128 qz = _mm_sub_ps(_mm_mul_ps(ux, e1y), _mm_mul_ps(uy, e1x));
+		__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+
+		__m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+		__m128 tMax = _mm_load_ps(packet.tMax + lane);
+
+		__m128 valid = _mm_cmpge_ps(_mm_andnot_ps(signMask, det), epsilon);
+		valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmple_ps(u, one)));
+		valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(v, zero), _mm_cmple_ps(_mm_add_ps(u, v), one)));
+		valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmpge_ps(t, zero), _mm_cmple_ps(t, tMax)));
+
+		uint32_t hitBits = static_cast<uint32_t>(_mm_movemask_ps(valid)) & groupMask;
+		if (hitBits == 0) {
+			continue;
+		}
+
+		alignas(16) float tValues[4];
+		alignas(16) float uValues[4];
+		alignas(16) float vValues[4];
+		_mm_store_ps(tValues, t);
+		_mm_store_ps(uValues, u);
+		_mm_store_ps(vValues, v);
+
+		if (_opacity && _opacity->AlphaTested(triangleIndex)) {
+			for (uint32_t i = 0; i < 4; i += 1) {
+				if (((hitBits >> i) & 1) && PassesThrough(triangleIndex, uValues[i], vValues[i])) {
+					hitBits &= ~(1u << i);
+				}
+			}
+		}
+		hitMask |= hitBits << lane;
+
+		for (uint32_t i = 0; i < 4; i += 1) {
+			if ((hitBits >> i) & 1) {
+				packet.tMax[lane + i] = tValues[i];
+				packet.triangleIndex[lane + i] = triangleIndex;
+				packet.u[lane + i] = uValues[i];
+				packet.v[lane + i] = vValues[i];
+			}
+		}
+	}
+
+	return hitMask;
+}
+
+template <uint32_t N>
+uint32_t BVH::OccludedPacket(RayPacket<N>& packet, uint32_t activeMask) const {
+	alignas(16) float invX[N];
+	alignas(16) float invY[N];
+	alignas(16) float invZ[N];
+	PacketInterval interval;
+	if (_nodes.empty() || !SetupPacket<N>(packet, invX, invY, invZ, interval)) {
+		uint32_t occludedMask = 0;
+		for (uint32_t lane = 0; lane < N; lane += 1) {
+			if (((activeMask >> lane) & 1) && Occluded(packet.GetRay(lane))) {
+				occludedMask |= 1 << lane;
+			}
+		}
+		return occludedMask;
+	}
+
+	struct StackEntry {
+		uint32_t node;
+		uint32_t mask;
+	};
+
+	uint32_t occludedMask = 0;
+	uint32_t toVisitOffset = 0;
+	StackEntry nodesToVisit[BVH_STACK_SIZE];
+	uint32_t currentNodeIndex = 0;
+	uint32_t currentMask = activeMask;
+
+	while (true) {
+		const LinearBVHNode& node = _nodes[currentNodeIndex];
+		RECORD_ACCESS(&node, sizeof(LinearBVHNode));
+		COUNT_RAY_STAT(nodesVisited, 1);
+
+		// Rays that are already blocked don't need to look any further
+		currentMask &= ~occludedMask;
+
+		uint32_t hitMask = 0;
+		if (currentMask != 0 && IntervalIntersect(node, interval)) {
+			hitMask = IntersectPacketAABB<N>(node, packet, invX, invY, invZ, currentMask);
+		}
+
+		if (hitMask != 0) {
+			uint32_t numPrimitives = (node.numPrimitives_and_axis >> 16);
+
+			if (CountBits(hitMask) < PACKET_MIN_ACTIVE_RAYS) {
+				for (uint32_t lane = 0; lane < N; lane += 1) {
+					if ((hitMask >> lane) & 1) {
+						Ray ray = packet.GetRay(lane);
+						glm::vec3 invDir = glm::vec3(invX[lane], invY[lane], invZ[lane]);
+						if (OccludedSubtree(ray, invDir, currentNodeIndex)) {
+							occludedMask |= 1 << lane;
+						}
+					}
+				}
+			}
+			else if (numPrimitives > 0) {
+				for (uint32_t i = 0; i < numPrimitives && hitMask != 0; i += 1) {
+					uint32_t hits = IntersectPacketTriangle<N>(node.offset + i, packet, hitMask);
+					occludedMask |= hits;
+					hitMask &= ~hits;
+				}
+			}
+			else {
+				uint32_t nearChild = currentNodeIndex + 1;
+				uint32_t farChild = node.offset;
+				if (interval.dirIsNeg[(node.numPrimitives_and_axis & 0xFFFF)] > 0) {
+					std::swap(nearChild, farChild);
+				}
+
+				if (toVisitOffset < BVH_STACK_SIZE) {
+					nodesToVisit[toVisitOffset++] = StackEntry{ farChild, hitMask };
+				}
+				else {
+					for (uint32_t lane = 0; lane < N; lane += 1) {
+						Ray ray = packet.GetRay(lane);
+						if (((hitMask >> lane) & 1) && Occluded(ray)) {
+							occludedMask |= 1 << lane;
+						}
+					}
+				}
+
+				currentNodeIndex = nearChild;
+				currentMask = hitMask;
+				continue;
+			}
+		}
+
+		// Every ray is blocked, nothing left to find
+		if (toVisitOffset == 0 || (occludedMask & activeMask) == activeMask) {
+			break;
+		}
+		toVisitOffset -= 1;
+		currentNodeIndex = nodesToVisit[toVisitOffset].node;
+		currentMask = nodesToVisit[toVisitOffset].mask;
+	}
+
+	return occludedMask & activeMask;
+}
+
+template void BVH::IntersectPacket<4>(RayPacket<4>& packet) const;
+template void BVH::IntersectPacket<8>(RayPacket<8>& packet) const;
+template void BVH::IntersectPacket<16>(RayPacket<16>& packet) const;
@@ -0,0 +1,958 @@
+#include "CPURayTracer.h"
+
+#include "BVH.h"
+#include "CacheSimulator.h"
+#include "Denoiser.h"
+#include "JobSystem.h"
+#include "MemoryManager.h"
+#include "OpacityMicromap.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <unordered_map>
+
+#if PROFILING
+#define COUNT_RAYS(counter, amount) if (RayCounters* counters = BVH::GetRayCounters()) { counters->counter += (amount); }
+#else
+#define COUNT_RAYS(counter, amount)
+#endif
+
+// Shadow rays towards a leaf's lights are tested together this many at a time
+#define SHADOW_RAY_BATCH 16
+
+namespace {
+	// Pixel block each packet covers. Squarish blocks keep the rays coherent.
+	template <uint32_t N> struct PacketShape {};
+	template <> struct PacketShape<4> { static const uint32_t width = 2; };
+	template <> struct PacketShape<8> { static const uint32_t width = 4; };
+	template <> struct PacketShape<16> { static const uint32_t width = 4; };
+
+	inline glm::vec3 UnpackColor(uint32_t packed) {
+		return glm::vec3((packed >> 24) & 0xFF, (packed >> 16) & 0xFF, (packed >> 8) & 0xFF) / 255.0f;
+	}
+
+	// https://nullprogram.com/blog/2018/07/31/
+	inline uint32_t HashBits(uint32_t x) {
+		x ^= x >> 16;
+		x *= 0x7FEB352D;
+		x ^= x >> 15;
+		x *= 0x846CA68B;
+		x ^= x >> 16;
+		return x;
+	}
+
+	inline uint32_t FloatBits(float f) {
+		uint32_t bits;
+		std::memcpy(&bits, &f, sizeof(bits));
+		return bits;
+	}
+}
+
+CPURayTracer::CPURayTracer(
+	const BVH* sceneBVH,
+	const GPUVertex* gpuVertices,
+	const GPUTriangle* gpuTriangles,
+	const GPUMaterial* gpuMaterials,
+	uint32_t renderWidth,
+	uint32_t renderHeight
+) : bvh(sceneBVH), vertices(gpuVertices), triangles(gpuTriangles), materials(gpuMaterials), width(renderWidth), height(renderHeight) {
+
+	numTilesX = (width + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE;
+	numTilesY = (height + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE;
+	pixels = std::vector<uint32_t>(width * height, 0xFF000000);
+
+	radiance = std::vector<glm::vec3>(width * height);
+	rayQueue = std::vector<QueuedRay>(width * height);
+	nextRayQueue.reserve(width * height);
+	sortKeys.reserve(width * height);
+
+	accumulation = std::vector<glm::vec4>(width * height);
+	progressiveTiles = std::vector<ProgressiveTile>(numTilesX * numTilesY);
+	activeTiles.reserve(numTilesX * numTilesY);
+
+#if CPU_DENOISE
+	denoiser = MemoryManager::Allocate<Denoiser>(width, height);
+	noisyColor = std::vector<glm::vec3>(width * height);
+	features = std::vector<PixelFeatures>(width * height);
+#endif
+#if CPU_TRACE_INTERVAL > 1
+	AllocateUpsampleBuffers();
+#endif
+#if CPU_RESTIR || CPU_LIGHTCUTS
+	AllocateResampleBuffers();
+#endif
+}
+
+CPURayTracer::~CPURayTracer() {
+	if (denoiser) {
+		MemoryManager::Free(denoiser);
+	}
+}
+
+void CPURayTracer::SetLights(
+	const PointLightToGPU* lights,
+	const LightTreeView& tree,
+	const glm::vec3& sceneMin,
+	const glm::vec3& sceneMax
+) {
+	pointLights = lights;
+	pointLightTree = tree;
+	minBounds = sceneMin;
+	maxBounds = sceneMax;
+
+	ResetAccumulation();
+}
+
+void CPURayTracer::SetDirectionalLight(const glm::vec3& direction, const glm::vec3& color) {
+	directionalLightDir = direction;
+	directionalLightCol = color;
+}
+
+void CPURayTracer::SetCamera(const glm::mat4& inverseProj, const glm::mat4& inverseView, const glm::vec3& cameraPos) {
+	invProj = inverseProj;
+	invView = inverseView;
+	camPos = cameraPos;
+
+	// invProj[1][1] is tan(fovY / 2)
+	pixelSpreadAngle = std::atan(2.0f * invProj[1][1] / height);
+}
+
+void CPURayTracer::SetTextures(const MaterialTextures* materialTextures) {
+	textures = materialTextures;
+	ResetAccumulation();
+}
+
+bool CPURayTracer::Render() {
+	auto start = std::chrono::high_resolution_clock::now();
+
+	bool traced = true;
+	if (rayStat != RayStat::None) {
+		RenderRayStats();
+	}
+	else {
+#if CPU_PROGRESSIVE
+		traced = RenderProgressive();
+#elif CPU_DENOISE
+		RenderDenoised();
+#elif CPU_TRACE_INTERVAL > 1
+		RenderUpsampled(CPU_TRACE_INTERVAL);
+#elif CPU_RESTIR || CPU_LIGHTCUTS
+		RenderResampled();
+#elif CPU_WAVEFRONT
+		RenderWavefront();
+#else
+		RenderDepthFirst();
+#endif
+	}
+
+	auto stop = std::chrono::high_resolution_clock::now();
+	traceTime = std::chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+	return traced;
+}
+
+void CPURayTracer::RenderDepthFirst() {
+	primaryMode = PrimaryMode::Write;
+	TracePrimaryRays();
+}
+
+void CPURayTracer::RenderTiles(const uint32_t* tileIndices, uint32_t count, uint32_t* output, uint32_t* tileMicroseconds) {
+	primaryMode = PrimaryMode::Write;
+	for (uint32_t i = 0; i < count; i += 1) {
+		auto start = std::chrono::high_resolution_clock::now();
+
+		uint32_t tile = tileIndices[i];
+		TracePrimaryTile(tile);
+
+		uint32_t startX = (tile % numTilesX) * CPU_TILE_SIZE;
+		uint32_t startY = (tile / numTilesX) * CPU_TILE_SIZE;
+		uint32_t endX = std::min(width, startX + CPU_TILE_SIZE);
+		uint32_t endY = std::min(height, startY + CPU_TILE_SIZE);
+		for (uint32_t y = startY; y < endY; y += 1) {
+			std::memcpy(&output[y * width + startX], &pixels[y * width + startX], (endX - startX) * sizeof(uint32_t));
+		}
+
+		if (tileMicroseconds) {
+			auto stop = std::chrono::high_resolution_clock::now();
+			tileMicroseconds[i] = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::microseconds>(stop - start).count());
+		}
+	}
+}
+
+void CPURayTracer::TracePrimaryRays() {
+	JobSystem::ParallelFor(numTilesX * numTilesY, 1, [this](uint32_t begin, uint32_t end) {
+		for (uint32_t tile = begin; tile < end; tile += 1) {
+			TracePrimaryTile(tile);
+		}
+	});
+}
+
+void CPURayTracer::TracePrimaryTile(uint32_t tileIndex, const glm::vec2& jitter) {
+#if RAY_PACKET_SIZE > 0
+	TracePacketTile<RAY_PACKET_SIZE>(tileIndex, jitter);
+#else
+	TraceTile(tileIndex, jitter);
+#endif
+}
+
+Ray CPURayTracer::PrimaryRay(uint32_t x, uint32_t y, const glm::vec2& jitter) const {
+	// Compute our pixel into world space coordinates, same as rayTrace.comp
+	glm::vec2 rayUV = glm::vec2((x + jitter.x) / static_cast<float>(width), (y + jitter.y) / static_cast<float>(height));
+	glm::vec4 rayNDC = glm::vec4(2.0f * rayUV - 1.0f, -1.0f, 1.0f);
+	glm::vec4 rayViewSpace = invProj * rayNDC;
+	rayViewSpace /= rayViewSpace.w;
+	glm::vec3 rayWorldSpace = glm::vec3(invView * rayViewSpace);
+
+	Ray ray;
+	ray.pos = camPos;
+	ray.dir = glm::normalize(rayWorldSpace - camPos);
+	ray.tMax = RAY_MAX_DIST;
+	return ray;
+}
+
+void CPURayTracer::TraceTile(uint32_t tileIndex, const glm::vec2& jitter) {
+	uint32_t startX = (tileIndex % numTilesX) * CPU_TILE_SIZE;
+	uint32_t startY = (tileIndex / numTilesX) * CPU_TILE_SIZE;
+	uint32_t endX = std::min(width, startX + CPU_TILE_SIZE);
+	uint32_t endY = std::min(height, startY + CPU_TILE_SIZE);
+
+	for (uint32_t y = startY; y < endY; y += 1) {
+		for (uint32_t x = startX; x < endX; x += 1) {
+			Ray ray = PrimaryRay(x, y, jitter);
+			TriangleHit hit;
+			bvh->Intersect(ray, hit);
+			FinishPrimary(x, y, ray, hit);
+		}
+	}
+}
+
+template <uint32_t N>
+void CPURayTracer::TracePacketTile(uint32_t tileIndex, const glm::vec2& jitter) {
+	const uint32_t blockWidth = PacketShape<N>::width;
+	const uint32_t blockHeight = N / blockWidth;
+
+	uint32_t startX = (tileIndex % numTilesX) * CPU_TILE_SIZE;
+	uint32_t startY = (tileIndex / numTilesX) * CPU_TILE_SIZE;
+	uint32_t endX = std::min(width, startX + CPU_TILE_SIZE);
+	uint32_t endY = std::min(height, startY + CPU_TILE_SIZE);
+
+	RayPacket<N> packet;
+	for (uint32_t blockY = startY; blockY < endY; blockY += blockHeight) {
+		for (uint32_t blockX = startX; blockX < endX; blockX += blockWidth) {
+
+			// Lanes hanging off the edge of the screen repeat the last pixel and are never written
+			for (uint32_t lane = 0; lane < N; lane += 1) {
+				uint32_t x = std::min(endX - 1, blockX + lane % blockWidth);
+				uint32_t y = std::min(endY - 1, blockY + lane / blockWidth);
+				packet.SetRay(lane, PrimaryRay(x, y, jitter));
+			}
+
+			bvh->IntersectPacket<N>(packet);
+
+			for (uint32_t lane = 0; lane < N; lane += 1) {
+				uint32_t x = blockX + lane % blockWidth;
+				uint32_t y = blockY + lane / blockWidth;
+				if (x < endX && y < endY) {
+					FinishPrimary(x, y, packet.GetRay(lane), packet.GetHit(lane));
+				}
+			}
+		}
+	}
+}
+
+void CPURayTracer::FinishPrimary(uint32_t x, uint32_t y, const Ray& ray, const TriangleHit& hit) {
+	uint32_t pixel = y * width + x;
+
+	if (primaryMode == PrimaryMode::Write) {
+		WritePixel(x, y, glm::clamp(Shade(ray, hit), glm::vec3(0.0f), glm::vec3(1.0f)));
+		return;
+	}
+
+	if (primaryMode == PrimaryMode::Denoise) {
+		noisyColor[pixel] = Shade(ray, hit);
+		StoreFeatures(pixel, ray, hit);
+		return;
+	}
+
+	if (primaryMode == PrimaryMode::Sparse) {
+		sparseColor[pixel] = glm::clamp(Shade(ray, hit), glm::vec3(0.0f), glm::vec3(1.0f));
+		sparseDepth[pixel] = hit.triangleIndex == NO_HIT ? RAY_MAX_DIST : ray.tMax;
+		return;
+	}
+
+	if (primaryMode == PrimaryMode::Resample) {
+		resampleColor[pixel] = Shade(ray, hit, false);
+		StoreSurface(pixel, ray, hit);
+		return;
+	}
+
+	if (primaryMode == PrimaryMode::Accumulate) {
+		glm::vec3 color = glm::clamp(Shade(ray, hit), glm::vec3(0.0f), glm::vec3(1.0f));
+		float luminance = glm::dot(color, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+		accumulation[pixel] += glm::vec4(color, luminance * luminance);
+		return;
+	}
+
+	QueuedRay& queued = rayQueue[pixel];
+	queued.pixel = NO_HIT;
+	radiance[pixel] = glm::vec3(0, 0, 0);
+
+	queued.coneWidth = 0.0f;
+	if (hit.triangleIndex != NO_HIT && ShadeHit(ray, hit, queued.coneWidth, radiance[pixel], queued.ray, queued.multiplier)) {
+		queued.pixel = pixel;
+	}
+}
+
+glm::vec3 CPURayTracer::Shade(Ray ray, TriangleHit hit, bool primaryPointLights) const {
+	glm::vec3 finalColor = glm::vec3(0, 0, 0);
+	glm::vec3 multiplier = glm::vec3(1, 1, 1);
+	float coneWidth = 0.0f;
+
+	for (uint32_t i = 0; i < CPU_RAY_DEPTH; i += 1) {
+		if (i > 0) {
+			COUNT_RAYS(bounces, 1);
+			hit = TriangleHit();
+			bvh->Intersect(ray, hit);
+		}
+
+		// We did not intersect. No need to continue.
+		if (hit.triangleIndex == NO_HIT) {
+			break;
+		}
+
+		glm::vec3 color;
+		Ray reflection;
+		glm::vec3 reflectance;
+		bool reflects = ShadeHit(ray, hit, coneWidth, color, reflection, reflectance, primaryPointLights || i > 0);
+		finalColor += multiplier * color;
+
+		// There is no specular on this intersection. So no need for reflection.
+		if (!reflects) {
+			break;
+		}
+		ray = reflection;
+		multiplier = reflectance;
+	}
+
+	return finalColor;
+}
+
+bool CPURayTracer::ShadeHit(const Ray& ray, const TriangleHit& hit, float& coneWidth, glm::vec3& color, Ray& reflection, glm::vec3& reflectance, bool pointLighting) const {
+	Intersection intersection;
+	GetIntersection(ray, hit, intersection, coneWidth);
+	coneWidth = intersection.coneWidth;
+
+	glm::vec3 baseDiffuse;
+	glm::vec3 baseSpecular;
+	SurfaceColors(intersection, baseDiffuse, baseSpecular);
+	color = DirectionalLighting(intersection, baseDiffuse, baseSpecular);
+	if (pointLighting) {
+		color += PointLighting(intersection, baseDiffuse, baseSpecular);
+	}
+
+	uint32_t m = materials[intersection.materialIndex].specular;
+	if (m == 0) {
+		return false;
+	}
+
+	reflection.dir = ray.dir - 2.0f * intersection.normal * glm::dot(ray.dir, intersection.normal);
+	reflection.pos = intersection.point + SMALL_NUMBER * reflection.dir;
+	reflection.tMax = RAY_MAX_DIST;
+
+	reflectance = UnpackColor(m);
+	return true;
+}
+
+void CPURayTracer::GetIntersection(const Ray& ray, const TriangleHit& hit, Intersection& intersection, float coneWidth) const {
+	const GPUTriangle& triangle = triangles[hit.triangleIndex];
+	const GPUVertex& a = vertices[triangle.indices[0]];
+	const GPUVertex& b = vertices[triangle.indices[1]];
+	const GPUVertex& c = vertices[triangle.indices[2]];
+
+	float u = hit.u;
+	float v = hit.v;
+	float w = 1.0f - u - v;
+
+	intersection.point = ray.pos + ray.tMax * ray.dir;
+	intersection.normal = glm::normalize(w * glm::vec3(a.normal_and_v) + u * glm::vec3(b.normal_and_v) + v * glm::vec3(c.normal_and_v));
+	intersection.uvs =
+		w * glm::vec2(a.position_and_u.w, a.normal_and_v.w) +
+		u * glm::vec2(b.position_and_u.w, b.normal_and_v.w) +
+		v * glm::vec2(c.position_and_u.w, c.normal_and_v.w);
+	intersection.materialIndex = triangle.materialIndex;
+	intersection.triangleIndex = hit.triangleIndex;
+
+	// Ray cone LOD, "Texture Level of Detail Strategies for Real-Time Ray Tracing" (Ray Tracing Gems ch. 20).
+	// The cone keeps its spread through reflections, treating every mirror as flat.
+	intersection.coneWidth = coneWidth + pixelSpreadAngle * ray.tMax;
+
+	glm::vec2 uvA = glm::vec2(a.position_and_u.w, a.normal_and_v.w);
+	glm::vec2 uvAB = glm::vec2(b.position_and_u.w, b.normal_and_v.w) - uvA;
+	glm::vec2 uvAC = glm::vec2(c.position_and_u.w, c.normal_and_v.w) - uvA;
+	float uvArea = std::fabs(uvAB.x * uvAC.y - uvAB.y * uvAC.x);
+	float worldArea = glm::length(glm::cross(glm::vec3(b.position_and_u) - glm::vec3(a.position_and_u), glm::vec3(c.position_and_u) - glm::vec3(a.position_and_u)));
+
+	float cosine = std::fmax(std::fabs(glm::dot(intersection.normal, ray.dir)), SMALL_NUMBER);
+	intersection.surfaceLOD = 0.5f * std::log2(std::fmax(uvArea, REALLY_SMALL_NUMBER) / std::fmax(worldArea, REALLY_SMALL_NUMBER)) +
+		std::log2(std::fmax(intersection.coneWidth, REALLY_SMALL_NUMBER) / cosine);
+}
+
+void CPURayTracer::SurfaceColors(const Intersection& intersection, glm::vec3& baseDiffuse, glm::vec3& baseSpecular) const {
+	const GPUMaterial& mat = materials[intersection.materialIndex];
+	baseDiffuse = UnpackColor(mat.diffuse);
+	baseSpecular = UnpackColor(mat.specular);
+
+	if (textures == nullptr) {
+		return;
+	}
+
+	const MaterialTextures& matTextures = textures[intersection.materialIndex];
+	if (matTextures.diffuse) {
+		baseDiffuse *= glm::vec3(matTextures.diffuse->Sample(intersection.uvs, intersection.surfaceLOD));
+	}
+
+	bool usingSpecular = ((mat.usingNormal_Specular_Alpha >> 16) & 0xFF) > 0;
+	if (usingSpecular && matTextures.specular) {
+		baseSpecular *= matTextures.specular->Sample(intersection.uvs, intersection.surfaceLOD).x;
+	}
+}
+
+glm::vec3 CPURayTracer::DirectionalLighting(const Intersection& intersection, const glm::vec3& baseDiffuse, const glm::vec3& baseSpecular) const {
+	glm::vec3 outColor = glm::vec3(0, 0, 0);
+
+	// First, calculate if our light is even in the same direction.
+	float nDotL = glm::dot(intersection.normal, -directionalLightDir);
+	if (nDotL <= 0.0f) {
+		return outColor;
+	}
+
+	// Shadow
+	Ray ray;
+	ray.pos = intersection.point + SMALL_NUMBER * intersection.normal;
+	ray.dir = -directionalLightDir;
+	ray.tMax = RAY_MAX_DIST;
+	if (Shadowed(ray)) {
+		return outColor;
+	}
+
+	const GPUMaterial& mat = materials[intersection.materialIndex];
+
+	// Diffuse
+	glm::vec3 diffuseColor = directionalLightCol * baseDiffuse * nDotL;
+
+	// Specular
+	glm::vec3 eye = glm::normalize(camPos - intersection.point);
+	glm::vec3 h = glm::normalize(-directionalLightDir + eye);
+	float spec = std::pow(std::fmax(glm::dot(h, intersection.normal), 0.0f), mat.specularExponent);
+	glm::vec3 specularColor = baseSpecular * spec;
+
+	return diffuseColor + specularColor;
+}
+
+glm::vec3 CPURayTracer::PointLighting(const Intersection& intersection, const glm::vec3& baseDiffuse, const glm::vec3& baseSpecular) const {
+	if (primaryMode == PrimaryMode::Resample) {
+		return ResampledPointLighting(intersection, baseDiffuse, baseSpecular);
+	}
+
+	glm::vec3 outColor = glm::vec3(0, 0, 0);
+	if (pointLights == nullptr || pointLightTree.nodes == nullptr) {
+		return outColor;
+	}
+
+	ShadingSurface surface;
+	surface.position = intersection.point;
+	surface.normal = intersection.normal;
+	surface.baseDiffuse = baseDiffuse;
+	surface.baseSpecular = baseSpecular;
+	surface.specularExponent = materials[intersection.materialIndex].specularExponent;
+
+	const LightTreeNode& leaf = pointLightTree.Leaf(intersection.point);
+	const uint32_t* leafLights = pointLightTree.lightIndices + leaf.offset;
+
+	// One light stands in for all of the leaf's, so it counts that many times. Lights facing
+	// away just add nothing.
+	uint32_t begin = 0;
+	uint32_t end = leaf.numPointLights;
+	float lightWeight = 1.0f;
+	if (sampleOneLight && leaf.numPointLights > 1) {
+		begin = PickLight(intersection.point, leaf.numPointLights);
+		end = begin + 1;
+		lightWeight = static_cast<float>(leaf.numPointLights);
+	}
+
+	// Shadow rays towards every light facing us, tested together a batch at a time
+	uint32_t lightIndices[SHADOW_RAY_BATCH];
+	Ray shadowRays[SHADOW_RAY_BATCH];
+	bool occluded[SHADOW_RAY_BATCH];
+	uint32_t numShadowRays = 0;
+
+	auto lightBatch = [&]() {
+		Shadowed(shadowRays, numShadowRays, occluded);
+		for (uint32_t j = 0; j < numShadowRays; j += 1) {
+			if (occluded[j]) {
+				continue;
+			}
+
+			outColor += PointLightColor(pointLights[lightIndices[j]], surface, shadowRays[j].dir, shadowRays[j].tMax + SMALL_NUMBER);
+		}
+		numShadowRays = 0;
+	};
+
+	for (uint32_t i = begin; i < end; i += 1) {
+		uint32_t index = leafLights[i];
+
+		glm::vec3 toLight = glm::vec3(pointLights[index].position_and_radius) - intersection.point;
+		float dist = glm::length(toLight);
+		if (dist < SMALL_NUMBER || glm::dot(intersection.normal, toLight) <= 0.0f) {
+			continue;
+		}
+
+		Ray& ray = shadowRays[numShadowRays];
+		ray.pos = intersection.point + SMALL_NUMBER * intersection.normal;
+		ray.dir = toLight / dist;
+		ray.tMax = dist - SMALL_NUMBER;
+		lightIndices[numShadowRays++] = index;
+
+		if (numShadowRays == SHADOW_RAY_BATCH) {
+			lightBatch();
+		}
+	}
+	lightBatch();
+
+	return lightWeight * outColor;
+}
+
+glm::vec3 CPURayTracer::PointLightColor(const PointLightToGPU& light, const ShadingSurface& surface, const glm::vec3& dir, float dist) const {
+	float nDotL = std::fmax(0.0f, glm::dot(surface.normal, dir));
+
+	// Diffuse
+	glm::vec3 diffuseColor = surface.baseDiffuse * glm::vec3(light.color_and_luminance) * nDotL;
+
+	// Specular
+	glm::vec3 eye = glm::normalize(camPos - surface.position);
+	glm::vec3 h = glm::normalize(dir + eye);
+	float spec = std::pow(std::fmax(glm::dot(h, surface.normal), 0.0f), surface.specularExponent);
+	glm::vec3 specularColor = surface.baseSpecular * spec;
+
+	// Total color
+	float attenuation = light.color_and_luminance.w / (1 + 1 * dist + 2 * dist * dist);
+	return attenuation * (diffuseColor + specularColor);
+}
+
+uint32_t CPURayTracer::PickLight(const glm::vec3& point, uint32_t count) const {
+	return HitSeed(point) % count;
+}
+
+uint32_t CPURayTracer::HitSeed(const glm::vec3& point) const {
+	// Hashing the hit instead of carrying a random number generator down through shading
+	return HashBits(FloatBits(point.x) ^ HashBits(FloatBits(point.y) ^ HashBits(FloatBits(point.z) ^ HashBits(frameIndex))));
+}
+
+bool CPURayTracer::Shadowed(const Ray& ray) const {
+	COUNT_RAYS(shadowRays, 1);
+	if (closestHitShadows) {
+		Ray closestRay = ray;
+		TriangleHit hit;
+		return bvh->Intersect(closestRay, hit);
+	}
+	return bvh->Occluded(ray);
+}
+
+void CPURayTracer::Shadowed(const Ray* rays, uint32_t count, bool* occluded) const {
+	if (closestHitShadows) {
+		for (uint32_t i = 0; i < count; i += 1) {
+			occluded[i] = Shadowed(rays[i]);
+		}
+		return;
+	}
+	COUNT_RAYS(shadowRays, count);
+	bvh->Occluded(rays, count, occluded);
+}
+
+void CPURayTracer::WritePixel(uint32_t x, uint32_t y, const glm::vec3& color) {
+	glm::uvec3 c = glm::uvec3(color * 255.0f + 0.5f);
+	pixels[y * width + x] = (0xFF << 24) | (c.b << 16) | (c.g << 8) | c.r;
+}
+
+long long CPURayTracer::TimePrimaryRays(bool shortStack) const {
+	auto start = std::chrono::high_resolution_clock::now();
+
+	JobSystem::ParallelFor(width * height, width, [this, shortStack](uint32_t begin, uint32_t end) {
+		for (uint32_t i = begin; i < end; i += 1) {
+			Ray ray = PrimaryRay(i % width, i / width);
+			TriangleHit hit;
+			if (shortStack) {
+				bvh->IntersectShortStack(ray, hit);
+			}
+			else {
+				bvh->Intersect(ray, hit);
+			}
+		}
+	});
+
+	auto stop = std::chrono::high_resolution_clock::now();
+	return std::chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+}
+
+template <uint32_t N>
+long long CPURayTracer::TimePrimaryPackets() const {
+	const uint32_t blockWidth = PacketShape<N>::width;
+	const uint32_t blockHeight = N / blockWidth;
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	uint32_t blockRows = (height + blockHeight - 1) / blockHeight;
+	JobSystem::ParallelFor(blockRows, 1, [this, blockWidth, blockHeight](uint32_t begin, uint32_t end) {
+		RayPacket<N> packet;
+		for (uint32_t row = begin; row < end; row += 1) {
+			for (uint32_t blockX = 0; blockX < width; blockX += blockWidth) {
+				for (uint32_t lane = 0; lane < N; lane += 1) {
+					uint32_t x = std::min(width - 1, blockX + lane % blockWidth);
+					uint32_t y = std::min(height - 1, row * blockHeight + lane / blockWidth);
+					packet.SetRay(lane, PrimaryRay(x, y));
+				}
+				bvh->IntersectPacket<N>(packet);
+			}
+		}
+	});
+
+	auto stop = std::chrono::high_resolution_clock::now();
+	return std::chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+}
+
+void CPURayTracer::BenchmarkPrimaryRays(uint32_t iterations) {
+	long long singleTime = 0;
+	long long packet4Time = 0;
+	long long packet8Time = 0;
+	long long packet16Time = 0;
+	long long shortStackTime = 0;
+
+	for (uint32_t i = 0; i < iterations; i += 1) {
+		singleTime += TimePrimaryRays();
+		shortStackTime += TimePrimaryRays(true);
+		packet4Time += TimePrimaryPackets<4>();
+		packet8Time += TimePrimaryPackets<8>();
+		packet16Time += TimePrimaryPackets<16>();
+	}
+
+	// Rays per microsecond is millions of rays per second
+	double rays = static_cast<double>(width) * height * iterations;
+	fprintf(stderr, "\nCPU Primary Rays -- %ux%u, %u threads, %u iterations\n", width, height, JobSystem::NumThreads(), iterations);
+	fprintf(stderr, "CPU Primary Rays -- Single: %.2f Mrays/s\n", rays / std::max(1LL, singleTime));
+	fprintf(stderr, "CPU Primary Rays -- Packet 4: %.2f Mrays/s (%.2fx)\n", rays / std::max(1LL, packet4Time), singleTime / static_cast<double>(std::max(1LL, packet4Time)));
+	fprintf(stderr, "CPU Primary Rays -- Packet 8: %.2f Mrays/s (%.2fx)\n", rays / std::max(1LL, packet8Time), singleTime / static_cast<double>(std::max(1LL, packet8Time)));
+	fprintf(stderr, "CPU Primary Rays -- Packet 16: %.2f Mrays/s (%.2fx)\n", rays / std::max(1LL, packet16Time), singleTime / static_cast<double>(std::max(1LL, packet16Time)));
+
+	// The short stack has to land on exactly the same hits as the full one
+	std::atomic<uint32_t> mismatches(0);
+	JobSystem::ParallelFor(width * height, width, [this, &mismatches](uint32_t begin, uint32_t end) {
+		for (uint32_t i = begin; i < end; i += 1) {
+			Ray fullRay = PrimaryRay(i % width, i / width);
+			Ray shortRay = fullRay;
+			TriangleHit fullHit;
+			TriangleHit shortHit;
+			bvh->Intersect(fullRay, fullHit);
+			bvh->IntersectShortStack(shortRay, shortHit);
+			if (fullHit.triangleIndex != shortHit.triangleIndex || fullRay.tMax != shortRay.tMax) {
+				mismatches += 1;
+			}
+		}
+	});
+	fprintf(stderr, "CPU Primary Rays -- Short stack: %.2f Mrays/s (%.2fx), %u mismatches\n", rays / std::max(1LL, shortStackTime),
+		singleTime / static_cast<double>(std::max(1LL, shortStackTime)), mismatches.load());
+}
+
+void CPURayTracer::BenchmarkShadows(uint32_t iterations) {
+	fprintf(stderr, "\nCPU Shadows -- %ux%u, %u threads, %u iterations\n", width, height, JobSystem::NumThreads(), iterations);
+
+	// Whole frames, only the kind of shadow ray changes
+	{
+		long long closestHitTime = 0;
+		long long occludedTime = 0;
+		for (uint32_t i = 0; i < iterations; i += 1) {
+			closestHitShadows = true;
+			auto start = std::chrono::high_resolution_clock::now();
+			RenderDepthFirst();
+			auto middle = std::chrono::high_resolution_clock::now();
+			closestHitShadows = false;
+			RenderDepthFirst();
+			auto stop = std::chrono::high_resolution_clock::now();
+
+			closestHitTime += std::chrono::duration_cast<std::chrono::microseconds>(middle - start).count();
+			occludedTime += std::chrono::duration_cast<std::chrono::microseconds>(stop - middle).count();
+		}
+
+		fprintf(stderr, "CPU Shadows -- Closest hit frame (ms): %.2f\n", closestHitTime / 1000.0f / iterations);
+		fprintf(stderr, "CPU Shadows -- Occluded frame (ms): %.2f (%.2fx)\n", occludedTime / 1000.0f / iterations,
+			closestHitTime / static_cast<double>(std::max(1LL, occludedTime)));
+	}
+
+	// Shadow rays on their own, towards the directional light from every primary hit
+	std::vector<Ray> shadowRays;
+	for (uint32_t y = 0; y < height; y += 1) {
+		for (uint32_t x = 0; x < width; x += 1) {
+			Ray ray = PrimaryRay(x, y);
+			TriangleHit hit;
+			if (!bvh->Intersect(ray, hit)) {
+				continue;
+			}
+
+			Intersection intersection;
+			GetIntersection(ray, hit, intersection);
+			if (glm::dot(intersection.normal, -directionalLightDir) <= 0.0f) {
+				continue;
+			}
+
+			Ray shadowRay;
+			shadowRay.pos = intersection.point + SMALL_NUMBER * intersection.normal;
+			shadowRay.dir = -directionalLightDir;
+			shadowRay.tMax = RAY_MAX_DIST;
+			shadowRays.push_back(shadowRay);
+		}
+	}
+	if (shadowRays.empty()) {
+		fprintf(stderr, "CPU Shadows -- Nothing lit in view\n");
+		return;
+	}
+
+	uint32_t numRays = static_cast<uint32_t>(shadowRays.size());
+	std::vector<uint8_t> closestResults(numRays);
+	std::vector<uint8_t> occludedResults(numRays);
+	std::unique_ptr<bool[]> batchedResults(new bool[numRays]);
+
+	long long closestHitTime = 0;
+	long long occludedTime = 0;
+	long long batchedTime = 0;
+	for (uint32_t i = 0; i < iterations; i += 1) {
+		auto start = std::chrono::high_resolution_clock::now();
+		JobSystem::ParallelFor(numRays, width, [this, &shadowRays, &closestResults](uint32_t begin, uint32_t end) {
+			for (uint32_t r = begin; r < end; r += 1) {
+				Ray ray = shadowRays[r];
+				TriangleHit hit;
+				closestResults[r] = bvh->Intersect(ray, hit);
+			}
+		});
+		auto closestStop = std::chrono::high_resolution_clock::now();
+		JobSystem::ParallelFor(numRays, width, [this, &shadowRays, &occludedResults](uint32_t begin, uint32_t end) {
+			for (uint32_t r = begin; r < end; r += 1) {
+				occludedResults[r] = bvh->Occluded(shadowRays[r]);
+			}
+		});
+		auto occludedStop = std::chrono::high_resolution_clock::now();
+		JobSystem::ParallelFor(numRays, width, [this, &shadowRays, &batchedResults](uint32_t begin, uint32_t end) {
+			bvh->Occluded(&shadowRays[begin], end - begin, &batchedResults[begin]);
+		});
+		auto batchedStop = std::chrono::high_resolution_clock::now();
+
+		closestHitTime += std::chrono::duration_cast<std::chrono::microseconds>(closestStop - start).count();
+		occludedTime += std::chrono::duration_cast<std::chrono::microseconds>(occludedStop - closestStop).count();
+		batchedTime += std::chrono::duration_cast<std::chrono::microseconds>(batchedStop - occludedStop).count();
+	}
+
+	uint32_t mismatches = 0;
+	uint32_t numOccluded = 0;
+	for (uint32_t r = 0; r < numRays; r += 1) {
+		mismatches += (closestResults[r] != occludedResults[r]) || (occludedResults[r] != batchedResults[r]);
+		numOccluded += occludedResults[r];
+	}
+
+	// Rays per microsecond is millions of rays per second
+	double rays = static_cast<double>(numRays) * iterations;
+	fprintf(stderr, "CPU Shadows -- Shadow rays: %u, %.1f%% occluded, %u mismatches\n", numRays, 100.0f * numOccluded / numRays, mismatches);
+	fprintf(stderr, "CPU Shadows -- Closest hit: %.2f Mrays/s\n", rays / std::max(1LL, closestHitTime));
+	fprintf(stderr, "CPU Shadows -- Occluded: %.2f Mrays/s (%.2fx)\n", rays / std::max(1LL, occludedTime), closestHitTime / static_cast<double>(std::max(1LL, occludedTime)));
+	fprintf(stderr, "CPU Shadows -- Occluded batched: %.2f Mrays/s (%.2fx)\n", rays / std::max(1LL, batchedTime), closestHitTime / static_cast<double>(std::max(1LL, batchedTime)));
+}
+
+void CPURayTracer::BenchmarkOpacityMicromap(OpacityMicromap* micromap, uint32_t iterations) {
+	fprintf(stderr, "\nCPU Opacity Micromap -- %ux%u, %u threads, %u iterations\n", width, height, JobSystem::NumThreads(), iterations);
+	if (micromap == nullptr || bvh->GetOpacityMicromap() != micromap) {
+		fprintf(stderr, "CPU Opacity Micromap -- Not the BVH's micromap\n");
+		return;
+	}
+#if !PROFILING
+	fprintf(stderr, "CPU Opacity Micromap -- Texture reads are only counted with PROFILING\n");
+#endif
+
+	// Closest hit triangle per pixel, and whether the directional light is blocked from it
+	std::vector<uint32_t> results[2];
+	long long times[2] = { 0, 0 };
+	uint64_t alphaTests[2] = { 0, 0 };
+	uint64_t alphaFetches[2] = { 0, 0 };
+
+	for (uint32_t mode = 0; mode < 2; mode += 1) {
+		micromap->useMicromap = (mode == 1);
+		results[mode] = std::vector<uint32_t>(width * height * 2);
+		std::atomic<uint64_t> tests(0);
+		std::atomic<uint64_t> fetches(0);
+
+		for (uint32_t i = 0; i < iterations; i += 1) {
+			auto start = std::chrono::high_resolution_clock::now();
+			JobSystem::ParallelFor(width * height, width, [this, mode, &results, &tests, &fetches](uint32_t begin, uint32_t end) {
+				RayCounters counters;
+				BVH::SetRayCounters(&counters);
+				for (uint32_t p = begin; p < end; p += 1) {
+					Ray ray = PrimaryRay(p % width, p / width);
+					TriangleHit hit;
+					results[mode][p * 2] = hit.triangleIndex;
+					if (!bvh->Intersect(ray, hit)) {
+						continue;
+					}
+					results[mode][p * 2] = hit.triangleIndex;
+
+					Intersection intersection;
+					GetIntersection(ray, hit, intersection);
+					Ray shadowRay;
+					shadowRay.pos = intersection.point + SMALL_NUMBER * intersection.normal;
+					shadowRay.dir = -directionalLightDir;
+					shadowRay.tMax = RAY_MAX_DIST;
+					results[mode][p * 2 + 1] = bvh->Occluded(shadowRay);
+				}
+				BVH::SetRayCounters(nullptr);
+				tests += counters.alphaTests;
+				fetches += counters.alphaFetches;
+			});
+			auto stop = std::chrono::high_resolution_clock::now();
+			times[mode] += std::chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+		}
+
+		alphaTests[mode] = tests / iterations;
+		alphaFetches[mode] = fetches / iterations;
+	}
+	micromap->useMicromap = true;
+
+	uint32_t mismatches = 0;
+	for (uint32_t p = 0; p < width * height * 2; p += 1) {
+		mismatches += results[0][p] != results[1][p];
+	}
+
+	fprintf(stderr, "CPU Opacity Micromap -- Alpha tested hits per frame: %llu, %u mismatches\n",
+		static_cast<unsigned long long>(alphaTests[1]), mismatches);
+	fprintf(stderr, "CPU Opacity Micromap -- Texture every hit: %.2f ms, %llu texture reads\n",
+		times[0] / 1000.0f / iterations, static_cast<unsigned long long>(alphaFetches[0]));
+	fprintf(stderr, "CPU Opacity Micromap -- Micromap: %.2f ms (%.2fx), %llu texture reads, %.1f%% eliminated\n",
+		times[1] / 1000.0f / iterations, times[0] / static_cast<double>(std::max(1LL, times[1])),
+		static_cast<unsigned long long>(alphaFetches[1]),
+		alphaFetches[0] > 0 ? 100.0 * (alphaFetches[0] - alphaFetches[1]) / alphaFetches[0] : 0.0);
+}
+
+void CPURayTracer::BenchmarkTextures(uint32_t iterations) {
+	fprintf(stderr, "\nCPU Textures -- %ux%u, 1 thread, %u iterations\n", width, height, iterations);
+	if (textures == nullptr) {
+		fprintf(stderr, "CPU Textures -- No textures set\n");
+		return;
+	}
+
+	struct TextureLookup {
+		const TiledTexture* texture;
+		glm::vec2 uv;
+		float surfaceLOD;
+	};
+
+	// Diffuse lookups in the order depth first tracing makes them. Primary hits are coherent,
+	// first bounces jump all over the scene.
+	std::vector<TextureLookup> primaryLookups;
+	std::vector<TextureLookup> bounceLookups;
+	for (uint32_t y = 0; y < height; y += 1) {
+		for (uint32_t x = 0; x < width; x += 1) {
+			Ray ray = PrimaryRay(x, y);
+			TriangleHit hit;
+			if (!bvh->Intersect(ray, hit)) {
+				continue;
+			}
+
+			float coneWidth = 0.0f;
+			glm::vec3 color;
+			Ray reflection;
+			glm::vec3 reflectance;
+			Intersection intersection;
+			GetIntersection(ray, hit, intersection);
+			if (textures[intersection.materialIndex].diffuse) {
+				primaryLookups.push_back(TextureLookup{ textures[intersection.materialIndex].diffuse, intersection.uvs, intersection.surfaceLOD });
+			}
+
+			if (!ShadeHit(ray, hit, coneWidth, color, reflection, reflectance)) {
+				continue;
+			}
+			TriangleHit bounceHit;
+			if (!bvh->Intersect(reflection, bounceHit)) {
+				continue;
+			}
+
+			GetIntersection(reflection, bounceHit, intersection, coneWidth);
+			if (textures[intersection.materialIndex].diffuse) {
+				bounceLookups.push_back(TextureLookup{ textures[intersection.materialIndex].diffuse, intersection.uvs, intersection.surfaceLOD });
+			}
+		}
+	}
+
+	// Row by row copies of every texture we look at
+	std::vector<std::unique_ptr<TiledTexture> > linearTextures;
+	std::unordered_map<const TiledTexture*, const TiledTexture*> linearCopies;
+	for (const std::vector<TextureLookup>* lookups : { &primaryLookups, &bounceLookups }) {
+		for (const TextureLookup& lookup : *lookups) {
+			if (linearCopies.find(lookup.texture) == linearCopies.end()) {
+				linearTextures.push_back(std::unique_ptr<TiledTexture>(new TiledTexture(*lookup.texture, TextureLayout::Linear)));
+				linearCopies[lookup.texture] = linearTextures.back().get();
+			}
+		}
+	}
+
+	auto timeLookups = [&linearCopies, iterations](const std::vector<TextureLookup>& lookups, bool linear) {
+		glm::vec4 sum = glm::vec4(0.0f);
+		auto start = std::chrono::high_resolution_clock::now();
+		for (uint32_t i = 0; i < iterations; i += 1) {
+			for (const TextureLookup& lookup : lookups) {
+				const TiledTexture* texture = linear ? linearCopies.at(lookup.texture) : lookup.texture;
+				sum += texture->Sample(lookup.uv, lookup.surfaceLOD);
+			}
+		}
+		auto stop = std::chrono::high_resolution_clock::now();
+
+		// Keeps the lookups from being thrown away
+		volatile float keep = sum.x + sum.y + sum.z;
+		(void)keep;
+		return std::chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+	};
+
+	const char* names[2] = { "Primary", "Bounce" };
+	const std::vector<TextureLookup>* lookupSets[2] = { &primaryLookups, &bounceLookups };
+	for (uint32_t set = 0; set < 2; set += 1) {
+		const std::vector<TextureLookup>& lookups = *lookupSets[set];
+		if (lookups.empty()) {
+			fprintf(stderr, "CPU Textures -- %s: no textured hits\n", names[set]);
+			continue;
+		}
+
+		long long linearTime = timeLookups(lookups, true);
+		long long tiledTime = timeLookups(lookups, false);
+
+		// Lookups per microsecond is millions of lookups per second
+		double numLookups = static_cast<double>(lookups.size()) * iterations;
+		fprintf(stderr, "CPU Textures -- %s lookups: %zu\n", names[set], lookups.size());
+		fprintf(stderr, "CPU Textures -- %s linear: %.2f Mlookups/s\n", names[set], numLookups / std::max(1LL, linearTime));
+		fprintf(stderr, "CPU Textures -- %s tiled: %.2f Mlookups/s (%.2fx)\n", names[set], numLookups / std::max(1LL, tiledTime),
+			linearTime / static_cast<double>(std::max(1LL, tiledTime)));
+
+#if PROFILING
+		// 32kb L1 and 256kb L2, one pass over the lookups
+		for (bool linear : { true, false }) {
+			CacheSimulator l2(256 * 1024, 8);
+			CacheSimulator l1(32 * 1024, 8, &l2);
+			TiledTexture::SetCacheSimulator(&l1);
+			for (const TextureLookup& lookup : lookups) {
+				const TiledTexture* texture = linear ? linearCopies.at(lookup.texture) : lookup.texture;
+				texture->Sample(lookup.uv, lookup.surfaceLOD);
+			}
+			TiledTexture::SetCacheSimulator(nullptr);
+
+			fprintf(stderr, "CPU Textures -- %s %s L1 misses/lookup: %.3f, L2 misses/lookup: %.3f\n", names[set], linear ? "linear" : "tiled",
+				l1.misses / static_cast<double>(lookups.size()), l2.misses / static_cast<double>(lookups.size()));
+		}
+#endif
+	}
+}
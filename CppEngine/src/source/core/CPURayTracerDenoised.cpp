@@ -0,0 +1,201 @@
+#include "CPURayTracer.h"
+
+#include "Denoiser.h"
+#include "JobSystem.h"
+#include "MemoryManager.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+
+// Denoised path of the CPU tracer. Every hit shades one point light from its cell instead of
+// all of them, which is up to 15 times fewer shadow rays but leaves the image noisy. The noisy
+// color goes to the Denoiser together with the primary hit's position, normal, depth and albedo.
+
+// One light frames the benchmark runs through temporal accumulation
+#define DENOISER_BENCHMARK_FRAMES 8
+
+namespace {
+	// Root mean squared error and PSNR of image against reference. image is clamped to [0, 1]
+	// first, like it would be on screen.
+	inline void ImageError(const glm::vec3* image, const std::vector<glm::vec3>& reference, float& rmse, float& psnr) {
+		double squaredError = 0.0;
+		for (uint32_t i = 0; i < reference.size(); i += 1) {
+			glm::vec3 difference = glm::clamp(image[i], glm::vec3(0.0f), glm::vec3(1.0f)) - reference[i];
+			squaredError += glm::dot(difference, difference);
+		}
+
+		double meanSquaredError = squaredError / (3.0 * reference.size());
+		rmse = static_cast<float>(std::sqrt(meanSquaredError));
+		psnr = meanSquaredError > 0.0 ? static_cast<float>(-10.0 * std::log10(meanSquaredError)) : INFINITY;
+	}
+
+	inline long long Microseconds(std::chrono::high_resolution_clock::time_point start, std::chrono::high_resolution_clock::time_point stop) {
+		return std::chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+	}
+}
+
+void CPURayTracer::RenderDenoised() {
+	// Lighting changes make all of the history wrong, camera moves are what reprojection is for
+	if (accumulationDirty || directionalLightDir != lastDirectionalLightDir || directionalLightCol != lastDirectionalLightCol) {
+		denoiser->ResetHistory();
+	}
+	accumulationDirty = false;
+	lastDirectionalLightDir = directionalLightDir;
+	lastDirectionalLightCol = directionalLightCol;
+
+	TraceNoisyFrame(true);
+	denoiser->Denoise(noisyColor.data(), features.data(), ViewProjection(), noisyColor.data());
+
+	JobSystem::ParallelFor(height, 1, [this](uint32_t begin, uint32_t end) {
+		for (uint32_t y = begin; y < end; y += 1) {
+			for (uint32_t x = 0; x < width; x += 1) {
+				WritePixel(x, y, noisyColor[y * width + x]);
+			}
+		}
+	});
+}
+
+void CPURayTracer::TraceNoisyFrame(bool oneLight) {
+	primaryMode = PrimaryMode::Denoise;
+	sampleOneLight = oneLight;
+	frameIndex += 1;
+
+	TracePrimaryRays();
+
+	sampleOneLight = false;
+}
+
+void CPURayTracer::StoreFeatures(uint32_t pixel, const Ray& ray, const TriangleHit& hit) {
+	PixelFeatures& f = features[pixel];
+
+	if (hit.triangleIndex == NO_HIT) {
+		f.position = ray.pos + RAY_MAX_DIST * ray.dir;
+		f.normal = glm::vec3(0.0f);
+		f.albedo = glm::vec3(1.0f);
+		f.depth = RAY_MAX_DIST;
+		return;
+	}
+
+	Intersection intersection;
+	GetIntersection(ray, hit, intersection);
+	glm::vec3 baseSpecular;
+	SurfaceColors(intersection, f.albedo, baseSpecular);
+
+	f.position = intersection.point;
+	f.normal = intersection.normal;
+	f.depth = ray.tMax;
+}
+
+glm::mat4 CPURayTracer::ViewProjection() const {
+	// PrimaryRay goes from ndc to world through invView * invProj
+	return glm::inverse(invView * invProj);
+}
+
+void CPURayTracer::BenchmarkDenoiser(uint32_t iterations) {
+	fprintf(stderr, "\nCPU Denoiser -- %ux%u, %u threads, %u iterations\n", width, height, JobSystem::NumThreads(), iterations);
+
+	// Only kept around between frames with CPU_DENOISE
+	bool ownsDenoiser = denoiser == nullptr;
+	if (ownsDenoiser) {
+		denoiser = MemoryManager::Allocate<Denoiser>(width, height);
+		noisyColor = std::vector<glm::vec3>(width * height);
+		features = std::vector<PixelFeatures>(width * height);
+	}
+	glm::mat4 viewProj = ViewProjection();
+
+	// Every light shaded is what one light samples average out to, so that is the reference
+	auto referenceStart = std::chrono::high_resolution_clock::now();
+	TraceNoisyFrame(false);
+	auto referenceStop = std::chrono::high_resolution_clock::now();
+	std::vector<glm::vec3> reference(width * height);
+	for (uint32_t i = 0; i < reference.size(); i += 1) {
+		reference[i] = glm::clamp(noisyColor[i], glm::vec3(0.0f), glm::vec3(1.0f));
+	}
+
+	auto noisyStart = std::chrono::high_resolution_clock::now();
+	TraceNoisyFrame(true);
+	auto noisyStop = std::chrono::high_resolution_clock::now();
+
+	float rmse, psnr;
+	ImageError(noisyColor.data(), reference, rmse, psnr);
+	fprintf(stderr, "CPU Denoiser -- Every light frame (ms): %.2f\n", Microseconds(referenceStart, referenceStop) / 1000.0f);
+	fprintf(stderr, "CPU Denoiser -- One light frame (ms): %.2f\n", Microseconds(noisyStart, noisyStop) / 1000.0f);
+	fprintf(stderr, "CPU Denoiser -- One light: RMSE %.4f, PSNR %.2f dB\n", rmse, psnr);
+
+	// Spatial filter on its own, the same noisy frame every time
+	denoiser->temporal = false;
+	std::vector<glm::vec3> denoised(width * height);
+	std::vector<glm::vec3> simdDenoised;
+	long long simdFilterTime = 0;
+	for (bool simd : { true, false }) {
+		denoiser->simd = simd;
+
+		long long loadTime = 0;
+		long long varianceTime = 0;
+		long long filterTime = 0;
+		long long resolveTime = 0;
+		for (uint32_t i = 0; i < iterations; i += 1) {
+			denoiser->Denoise(noisyColor.data(), features.data(), viewProj, denoised.data());
+			loadTime += denoiser->loadTime;
+			varianceTime += denoiser->varianceTime;
+			filterTime += denoiser->filterTime;
+			resolveTime += denoiser->resolveTime;
+		}
+
+		const char* name = simd ? "SIMD" : "Scalar";
+		ImageError(denoised.data(), reference, rmse, psnr);
+		fprintf(stderr, "CPU Denoiser -- %s load/variance/filter/resolve (ms): %.2f / %.2f / %.2f / %.2f\n", name, loadTime / 1000.0f / iterations,
+			varianceTime / 1000.0f / iterations, filterTime / 1000.0f / iterations, resolveTime / 1000.0f / iterations);
+
+		if (simd) {
+			fprintf(stderr, "CPU Denoiser -- Denoised: RMSE %.4f, PSNR %.2f dB\n", rmse, psnr);
+			simdDenoised = denoised;
+			simdFilterTime = filterTime;
+			continue;
+		}
+
+		// FastExp against std::exp is all that should differ
+		float maxDifference = 0.0f;
+		for (uint32_t i = 0; i < denoised.size(); i += 1) {
+			glm::vec3 difference = glm::abs(denoised[i] - simdDenoised[i]);
+			maxDifference = std::fmax(maxDifference, std::fmax(difference.x, std::fmax(difference.y, difference.z)));
+		}
+		fprintf(stderr, "CPU Denoiser -- SIMD filter %.2fx scalar, max difference %.5f\n",
+			filterTime / static_cast<double>(std::max(1LL, simdFilterTime)), maxDifference);
+	}
+	denoiser->simd = true;
+
+	// Temporal, with the camera held still and new light picks every frame. Averaging the noisy
+	// frames without any filtering is what accumulation alone would get.
+	denoiser->temporal = true;
+	denoiser->ResetHistory();
+	std::vector<glm::vec3> averaged(width * height, glm::vec3(0.0f));
+	long long temporalTime = 0;
+	for (uint32_t frame = 0; frame < DENOISER_BENCHMARK_FRAMES; frame += 1) {
+		TraceNoisyFrame(true);
+		for (uint32_t i = 0; i < averaged.size(); i += 1) {
+			averaged[i] += noisyColor[i] / static_cast<float>(DENOISER_BENCHMARK_FRAMES);
+		}
+
+		denoiser->Denoise(noisyColor.data(), features.data(), viewProj, denoised.data());
+		temporalTime += denoiser->temporalTime;
+
+		if (frame == 0 || frame + 1 == DENOISER_BENCHMARK_FRAMES) {
+			ImageError(denoised.data(), reference, rmse, psnr);
+			fprintf(stderr, "CPU Denoiser -- Temporal frame %u: RMSE %.4f, PSNR %.2f dB\n", frame + 1, rmse, psnr);
+		}
+	}
+	ImageError(averaged.data(), reference, rmse, psnr);
+	fprintf(stderr, "CPU Denoiser -- Reprojection (ms): %.2f\n", temporalTime / 1000.0f / DENOISER_BENCHMARK_FRAMES);
+	fprintf(stderr, "CPU Denoiser -- %u one light frames averaged: RMSE %.4f, PSNR %.2f dB\n", DENOISER_BENCHMARK_FRAMES, rmse, psnr);
+
+	denoiser->ResetHistory();
+	if (ownsDenoiser) {
+		MemoryManager::Free(denoiser);
+		denoiser = nullptr;
+		noisyColor = std::vector<glm::vec3>();
+		features = std::vector<PixelFeatures>();
+	}
+}
@@ -0,0 +1,142 @@
+#include "CPURayTracer.h"
+
+#include "JobSystem.h"
+
+#include <algorithm>
+#include <cmath>
+
+// Progressive path of the CPU tracer. While the camera and lights stay where they are, every
+// frame adds jittered samples to a float buffer instead of tracing the same image again.
+// Each tile keeps an estimate of how noisy it still is, so new samples go where they are
+// needed and converged tiles stop costing anything.
+
+// Keeps dark pixels from dominating the relative error
+#define PROGRESSIVE_ERROR_BIAS 0.1f
+
+namespace {
+	// Low discrepancy sub pixel positions, https://en.wikipedia.org/wiki/Halton_sequence
+	inline float RadicalInverse(uint32_t index, uint32_t base) {
+		float result = 0.0f;
+		float fraction = 1.0f / base;
+		while (index > 0) {
+			result += (index % base) * fraction;
+			index /= base;
+			fraction /= base;
+		}
+		return result;
+	}
+
+	inline glm::vec2 SubpixelJitter(uint32_t sampleIndex) {
+		return glm::vec2(RadicalInverse(sampleIndex + 1, 2), RadicalInverse(sampleIndex + 1, 3));
+	}
+}
+
+void CPURayTracer::ResetAccumulation() {
+	accumulationDirty = true;
+}
+
+bool CPURayTracer::SceneChanged() {
+	bool changed =
+		accumulationDirty ||
+		invProj != lastInvProj ||
+		invView != lastInvView ||
+		directionalLightDir != lastDirectionalLightDir ||
+		directionalLightCol != lastDirectionalLightCol;
+
+	lastInvProj = invProj;
+	lastInvView = invView;
+	lastDirectionalLightDir = directionalLightDir;
+	lastDirectionalLightCol = directionalLightCol;
+	accumulationDirty = false;
+
+	return changed;
+}
+
+uint32_t CPURayTracer::SamplesThisFrame(const ProgressiveTile& tile) const {
+	if (tile.samples >= PROGRESSIVE_MAX_SAMPLES) {
+		return 0;
+	}
+	// Too few samples to trust the error estimate yet
+	if (tile.samples < PROGRESSIVE_MIN_SAMPLES) {
+		return 1;
+	}
+	if (tile.error < PROGRESSIVE_ERROR_THRESHOLD) {
+		return 0;
+	}
+
+	// The noisier the tile, the more samples it gets this frame
+	uint32_t samples = static_cast<uint32_t>(tile.error / PROGRESSIVE_ERROR_THRESHOLD);
+	samples = std::min(samples, static_cast<uint32_t>(PROGRESSIVE_MAX_SAMPLES_PER_FRAME));
+	return std::min(samples, PROGRESSIVE_MAX_SAMPLES - tile.samples);
+}
+
+bool CPURayTracer::RenderProgressive() {
+	primaryMode = PrimaryMode::Accumulate;
+
+	if (SceneChanged()) {
+		std::fill(accumulation.begin(), accumulation.end(), glm::vec4(0.0f));
+		std::fill(progressiveTiles.begin(), progressiveTiles.end(), ProgressiveTile());
+	}
+
+	activeTiles.clear();
+	tilesConverged = 0;
+	for (uint32_t tile = 0; tile < progressiveTiles.size(); tile += 1) {
+		if (SamplesThisFrame(progressiveTiles[tile]) > 0) {
+			activeTiles.push_back(tile);
+		}
+		else {
+			tilesConverged += 1;
+		}
+	}
+
+	tilesTraced = static_cast<uint32_t>(activeTiles.size());
+	if (activeTiles.empty()) {
+		return false;
+	}
+
+	// Noisiest tiles first so the long jobs don't end up last
+	std::sort(activeTiles.begin(), activeTiles.end(), [this](uint32_t a, uint32_t b) {
+		return progressiveTiles[a].error > progressiveTiles[b].error;
+	});
+
+	JobSystem::ParallelFor(static_cast<uint32_t>(activeTiles.size()), 1, [this](uint32_t begin, uint32_t end) {
+		for (uint32_t i = begin; i < end; i += 1) {
+			uint32_t tile = activeTiles[i];
+			TraceProgressiveTile(tile, SamplesThisFrame(progressiveTiles[tile]));
+		}
+	});
+
+	return true;
+}
+
+void CPURayTracer::TraceProgressiveTile(uint32_t tileIndex, uint32_t numSamples) {
+	ProgressiveTile& tile = progressiveTiles[tileIndex];
+
+	for (uint32_t i = 0; i < numSamples; i += 1) {
+		TracePrimaryTile(tileIndex, SubpixelJitter(tile.samples));
+		tile.samples += 1;
+	}
+
+	uint32_t startX = (tileIndex % numTilesX) * CPU_TILE_SIZE;
+	uint32_t startY = (tileIndex / numTilesX) * CPU_TILE_SIZE;
+	uint32_t endX = std::min(width, startX + CPU_TILE_SIZE);
+	uint32_t endY = std::min(height, startY + CPU_TILE_SIZE);
+
+	// Resolve the tile and estimate its error as the average relative standard error of the mean
+	float invSamples = 1.0f / tile.samples;
+	float error = 0.0f;
+	for (uint32_t y = startY; y < endY; y += 1) {
+		for (uint32_t x = startX; x < endX; x += 1) {
+			const glm::vec4& sum = accumulation[y * width + x];
+			glm::vec3 mean = glm::vec3(sum) * invSamples;
+
+			float luminance = glm::dot(mean, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+			float variance = std::fmax(0.0f, sum.w * invSamples - luminance * luminance);
+			error += std::sqrt(variance * invSamples) / (luminance + PROGRESSIVE_ERROR_BIAS);
+
+			WritePixel(x, y, mean);
+		}
+	}
+
+	tile.error = error / ((endX - startX) * (endY - startY));
+}
@@ -0,0 +1,735 @@
+#include "CPURayTracer.h"
+
+#include "BVH.h"
+#include "JobSystem.h"
+
+#include "glm/gtc/constants.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+
+// Resampled path of the CPU tracer. Instead of a shadow ray for every light in the hit's tree
+// leaf, each primary hit draws RESTIR_CANDIDATES lights in proportion to their luminance and
+// keeps one of them with weighted reservoir sampling, picking lights by how much they would
+// light the hit if nothing was in the way. The kept light gets one shadow ray, and a shadowed one
+// is zeroed so neighbours don't reuse it. Each reservoir is then merged with its pixel's reservoir
+// from the last frame and with a few neighbours', which adds up to thousands of candidates per
+// pixel. The final light gets one more shadow ray, so primary hits always trace two, however many
+// lights there are. Merging uses the biased weights from the paper, without re-checking a borrowed
+// light's visibility at our surface.
+// Lightcuts skip reservoirs altogether. Every hit starts from the light tree's root as one
+// cluster shaded like a single light at its representative, and keeps splitting whichever
+// cluster could be the most wrong until none could be off by more than LIGHTCUT_ERROR_RATIO of
+// the total. A child that shares its parent's representative reuses its shadow ray.
+
+// Surfaces further apart than this fraction of the hit distance, or facing more than about 25
+// degrees apart, don't share reservoirs
+#define RESTIR_DEPTH_THRESHOLD 0.1f
+#define RESTIR_NORMAL_THRESHOLD 0.9f
+
+// Frames the benchmark lets history build up for before measuring. Reference pixels are every
+// this many in x and y, and average this many independent resampled estimates.
+#define RESTIR_BENCHMARK_WARMUP 4
+#define RESTIR_REFERENCE_STRIDE 16
+#define RESTIR_REFERENCE_SAMPLES 1024
+
+namespace {
+	// PCG, https://www.reedbeta.com/blog/hash-functions-for-gpu-rendering/
+	inline float NextRandom(uint32_t& state) {
+		state = state * 747796405u + 2891336453u;
+		uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+		word = (word >> 22u) ^ word;
+		return (word >> 8) * (1.0f / 16777216.0f);
+	}
+
+	inline uint32_t PixelSeed(uint32_t pixel, uint32_t frame, uint32_t pass) {
+		uint32_t state = (pixel * 0x9E3779B9u) ^ (frame * 0x85EBCA6Bu) ^ (pass * 0xC2B2AE35u);
+		NextRandom(state);
+		NextRandom(state);
+		return state;
+	}
+
+	inline float Luminance(const glm::vec3& color) {
+		return glm::dot(color, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+	}
+
+	// Direction and distance to the light, false if it is behind the surface
+	inline bool LightDirection(const PointLightToGPU& light, const ShadingSurface& surface, glm::vec3& dir, float& dist) {
+		glm::vec3 toLight = glm::vec3(light.position_and_radius) - surface.position;
+		dist = glm::length(toLight);
+		if (dist < SMALL_NUMBER || glm::dot(surface.normal, toLight) <= 0.0f) {
+			return false;
+		}
+		dir = toLight / dist;
+		return true;
+	}
+
+	// Keeps the candidate with probability weight / weightSum
+	inline void AddSample(LightReservoir& reservoir, uint32_t light, float targetPdf, float weight, float count, float random) {
+		reservoir.weightSum += weight;
+		reservoir.count += count;
+		if (weight > 0.0f && random * reservoir.weightSum < weight) {
+			reservoir.light = light;
+			reservoir.targetPdf = targetPdf;
+		}
+	}
+
+	// Merges a reservoir built for another surface. targetPdf is its light's at ours, count
+	// is how many candidates it is allowed to count for.
+	inline void MergeReservoir(LightReservoir& reservoir, const LightReservoir& other, float targetPdf, float count, float random) {
+		AddSample(reservoir, other.light, targetPdf, targetPdf * other.contributionWeight * count, count, random);
+	}
+
+	inline void FinishReservoir(LightReservoir& reservoir) {
+		reservoir.contributionWeight = reservoir.targetPdf > 0.0f ? reservoir.weightSum / (reservoir.count * reservoir.targetPdf) : 0.0f;
+	}
+
+	inline bool SimilarSurface(const ShadingSurface& a, const ShadingSurface& b) {
+		return b.depth < RAY_MAX_DIST &&
+			std::fabs(a.depth - b.depth) < RESTIR_DEPTH_THRESHOLD * a.depth &&
+			glm::dot(a.normal, b.normal) > RESTIR_NORMAL_THRESHOLD;
+	}
+}
+
+void CPURayTracer::SetManyLights(const PointLightToGPU* lights, uint32_t count) {
+	manyLights = lights;
+	numManyLights = count;
+
+	BuildLightAliases();
+	lightTree.Build(lights, count);
+
+	reservoirHistoryValid = false;
+	ResetAccumulation();
+}
+
+void CPURayTracer::UpdateManyLights() {
+	// Reservoirs weigh their lights again wherever they are now, so history stays
+	lightTree.Update();
+	BuildLightAliases();
+}
+
+void CPURayTracer::BuildLightAliases() {
+	const PointLightToGPU* lights = manyLights;
+	uint32_t count = numManyLights;
+
+	lightPdfs = std::vector<float>(count);
+	lightAliases = std::vector<LightAlias>(count);
+
+	double totalPower = 0.0;
+	for (uint32_t i = 0; i < count; i += 1) {
+		totalPower += lights[i].color_and_luminance.w * Luminance(glm::vec3(lights[i].color_and_luminance));
+	}
+
+	// Lights are split into ones drawn less than uniform and more than uniform. Every small one
+	// fills the rest of its slot with a large one until there are none left.
+	std::vector<float> scaled(count);
+	std::vector<uint32_t> small;
+	std::vector<uint32_t> large;
+	for (uint32_t i = 0; i < count; i += 1) {
+		float power = lights[i].color_and_luminance.w * Luminance(glm::vec3(lights[i].color_and_luminance));
+		lightPdfs[i] = totalPower > 0.0 ? static_cast<float>(power / totalPower) : 1.0f / count;
+		scaled[i] = lightPdfs[i] * count;
+		lightAliases[i].alias = i;
+		(scaled[i] < 1.0f ? small : large).push_back(i);
+	}
+
+	while (!small.empty() && !large.empty()) {
+		uint32_t s = small.back();
+		small.pop_back();
+		uint32_t l = large.back();
+		large.pop_back();
+
+		lightAliases[s].threshold = scaled[s];
+		lightAliases[s].alias = l;
+		scaled[l] -= 1.0f - scaled[s];
+		(scaled[l] < 1.0f ? small : large).push_back(l);
+	}
+}
+
+void CPURayTracer::AllocateResampleBuffers() {
+	resampleColor = std::vector<glm::vec3>(width * height);
+	directLighting = std::vector<glm::vec3>(width * height);
+	surfaces = std::vector<ShadingSurface>(width * height);
+	lastSurfaces = std::vector<ShadingSurface>(width * height);
+	reservoirs = std::vector<LightReservoir>(width * height);
+	lastReservoirs = std::vector<LightReservoir>(width * height);
+	spatialReservoirs = std::vector<LightReservoir>(width * height);
+	reservoirHistoryValid = false;
+}
+
+void CPURayTracer::RenderResampled() {
+	// Anything behind ResetAccumulation can change how lights are weighed. The directional light
+	// isn't in the reservoirs and camera moves are what reprojection is for.
+	if (accumulationDirty) {
+		reservoirHistoryValid = false;
+	}
+	accumulationDirty = false;
+
+	primaryMode = PrimaryMode::Resample;
+	frameIndex += 1;
+	TracePrimaryRays();
+
+	if (resampleTemporal && reservoirHistoryValid && !lightcuts) {
+		JobSystem::ParallelFor(height, 1, [this](uint32_t begin, uint32_t end) {
+			ResampleTemporalRows(begin, end);
+		});
+	}
+	if (resampleSpatial && !lightcuts) {
+		JobSystem::ParallelFor(height, 1, [this](uint32_t begin, uint32_t end) {
+			ResampleSpatialRows(begin, end);
+		});
+		reservoirs.swap(spatialReservoirs);
+	}
+
+	JobSystem::ParallelFor(height, 1, [this](uint32_t begin, uint32_t end) {
+		ShadeResampledRows(begin, end);
+	});
+
+	lastReservoirs.swap(reservoirs);
+	lastSurfaces.swap(surfaces);
+	lastViewProj = ViewProjection();
+	reservoirHistoryValid = true;
+}
+
+void CPURayTracer::StoreSurface(uint32_t pixel, const Ray& ray, const TriangleHit& hit) {
+	ShadingSurface& surface = surfaces[pixel];
+	LightReservoir& reservoir = reservoirs[pixel];
+	reservoir = LightReservoir();
+
+	if (hit.triangleIndex == NO_HIT) {
+		surface.depth = RAY_MAX_DIST;
+		return;
+	}
+
+	Intersection intersection;
+	GetIntersection(ray, hit, intersection);
+	SurfaceColors(intersection, surface.baseDiffuse, surface.baseSpecular);
+
+	surface.position = intersection.point;
+	surface.normal = intersection.normal;
+	surface.specularExponent = materials[intersection.materialIndex].specularExponent;
+	surface.depth = ray.tMax;
+
+	if (lightcuts) {
+		return;
+	}
+
+	uint32_t seed = PixelSeed(pixel, frameIndex, 0);
+	reservoir = SampleLights(surface, seed);
+
+	// A shadowed pick still counts its candidates, but gives nothing to whoever merges it
+	if (reservoir.light != NO_HIT && !LightVisible(manyLights[reservoir.light], surface)) {
+		reservoir.contributionWeight = 0.0f;
+	}
+}
+
+LightReservoir CPURayTracer::SampleLights(const ShadingSurface& surface, uint32_t& seed) const {
+	LightReservoir reservoir;
+	if (numManyLights == 0) {
+		return reservoir;
+	}
+
+	bool useTree = sampleLightTree && lightTree.NumLights() == numManyLights;
+	uint32_t numCandidates = useTree ? treeCandidates : resampleCandidates;
+	for (uint32_t i = 0; i < numCandidates; i += 1) {
+		uint32_t light;
+		float sourcePdf;
+		if (useTree) {
+			// Nothing in the tree can light the surface, which still counts as a candidate
+			light = lightTree.Sample(surface.position, surface.normal, NextRandom(seed), sourcePdf);
+			if (light == NO_HIT) {
+				AddSample(reservoir, light, 0.0f, 0.0f, 1.0f, NextRandom(seed));
+				continue;
+			}
+		}
+		else {
+			uint32_t slot = std::min(static_cast<uint32_t>(NextRandom(seed) * numManyLights), numManyLights - 1);
+			light = NextRandom(seed) < lightAliases[slot].threshold ? slot : lightAliases[slot].alias;
+			sourcePdf = lightPdfs[light];
+		}
+
+		float targetPdf = TargetPdf(light, surface);
+		AddSample(reservoir, light, targetPdf, targetPdf / sourcePdf, 1.0f, NextRandom(seed));
+	}
+
+	FinishReservoir(reservoir);
+	return reservoir;
+}
+
+float CPURayTracer::TargetPdf(uint32_t light, const ShadingSurface& surface) const {
+	glm::vec3 dir;
+	float dist;
+	if (light == NO_HIT || !LightDirection(manyLights[light], surface, dir, dist)) {
+		return 0.0f;
+	}
+	return Luminance(PointLightColor(manyLights[light], surface, dir, dist));
+}
+
+bool CPURayTracer::LightVisible(const PointLightToGPU& light, const ShadingSurface& surface) const {
+	Ray ray;
+	float dist;
+	if (!LightDirection(light, surface, ray.dir, dist)) {
+		return false;
+	}
+
+	ray.pos = surface.position + SMALL_NUMBER * surface.normal;
+	ray.tMax = dist - SMALL_NUMBER;
+	return !Shadowed(ray);
+}
+
+void CPURayTracer::ResampleTemporalRows(uint32_t begin, uint32_t end) {
+	for (uint32_t y = begin; y < end; y += 1) {
+		for (uint32_t x = 0; x < width; x += 1) {
+			uint32_t pixel = y * width + x;
+			const ShadingSurface& surface = surfaces[pixel];
+			if (surface.depth >= RAY_MAX_DIST) {
+				continue;
+			}
+
+			// Where our surface was on screen last frame, same as ReconstructRows
+			glm::vec4 clip = lastViewProj * glm::vec4(surface.position, 1.0f);
+			if (clip.w <= 0.0f) {
+				continue;
+			}
+			glm::vec2 lastPixel = (glm::vec2(clip) / clip.w * 0.5f + 0.5f) * glm::vec2(width, height);
+			int32_t lastX = static_cast<int32_t>(std::floor(lastPixel.x + 0.5f));
+			int32_t lastY = static_cast<int32_t>(std::floor(lastPixel.y + 0.5f));
+			if (lastX < 0 || lastY < 0 || lastX >= static_cast<int32_t>(width) || lastY >= static_cast<int32_t>(height)) {
+				continue;
+			}
+
+			// Depths are from different camera positions, so compare where the surfaces are instead
+			uint32_t last = lastY * width + lastX;
+			const ShadingSurface& lastSurface = lastSurfaces[last];
+			if (lastSurface.depth >= RAY_MAX_DIST ||
+				glm::length(lastSurface.position - surface.position) > RESTIR_DEPTH_THRESHOLD * surface.depth ||
+				glm::dot(lastSurface.normal, surface.normal) <= RESTIR_NORMAL_THRESHOLD) {
+				continue;
+			}
+
+			// Capping the history keeps a light that moved or got covered from hanging around
+			LightReservoir& current = reservoirs[pixel];
+			const LightReservoir& previous = lastReservoirs[last];
+			float historyCount = std::fmin(previous.count, RESTIR_HISTORY_LIMIT * std::fmax(current.count, 1.0f));
+
+			uint32_t seed = PixelSeed(pixel, frameIndex, 1);
+			LightReservoir merged;
+			MergeReservoir(merged, current, current.targetPdf, current.count, NextRandom(seed));
+			MergeReservoir(merged, previous, TargetPdf(previous.light, surface), historyCount, NextRandom(seed));
+			FinishReservoir(merged);
+			current = merged;
+		}
+	}
+}
+
+void CPURayTracer::ResampleSpatialRows(uint32_t begin, uint32_t end) {
+	for (uint32_t y = begin; y < end; y += 1) {
+		for (uint32_t x = 0; x < width; x += 1) {
+			uint32_t pixel = y * width + x;
+			const ShadingSurface& surface = surfaces[pixel];
+			const LightReservoir& current = reservoirs[pixel];
+			LightReservoir& merged = spatialReservoirs[pixel];
+			merged = LightReservoir();
+
+			if (surface.depth >= RAY_MAX_DIST) {
+				continue;
+			}
+
+			uint32_t seed = PixelSeed(pixel, frameIndex, 2);
+			MergeReservoir(merged, current, current.targetPdf, current.count, NextRandom(seed));
+
+			for (uint32_t i = 0; i < RESTIR_SPATIAL_NEIGHBOURS; i += 1) {
+				float radius = RESTIR_SPATIAL_RADIUS * std::sqrt(NextRandom(seed));
+				float angle = 2.0f * glm::pi<float>() * NextRandom(seed);
+				int32_t neighbourX = static_cast<int32_t>(x) + static_cast<int32_t>(std::floor(radius * std::cos(angle) + 0.5f));
+				int32_t neighbourY = static_cast<int32_t>(y) + static_cast<int32_t>(std::floor(radius * std::sin(angle) + 0.5f));
+				if (neighbourX < 0 || neighbourY < 0 || neighbourX >= static_cast<int32_t>(width) || neighbourY >= static_cast<int32_t>(height)) {
+					continue;
+				}
+
+				uint32_t neighbour = neighbourY * width + neighbourX;
+				if (neighbour == pixel || !SimilarSurface(surface, surfaces[neighbour])) {
+					continue;
+				}
+
+				const LightReservoir& other = reservoirs[neighbour];
+				MergeReservoir(merged, other, TargetPdf(other.light, surface), other.count, NextRandom(seed));
+			}
+
+			FinishReservoir(merged);
+		}
+	}
+}
+
+void CPURayTracer::ShadeResampledRows(uint32_t begin, uint32_t end) {
+	for (uint32_t y = begin; y < end; y += 1) {
+		for (uint32_t x = 0; x < width; x += 1) {
+			uint32_t pixel = y * width + x;
+			const ShadingSurface& surface = surfaces[pixel];
+			const LightReservoir& reservoir = reservoirs[pixel];
+
+			glm::vec3 lighting = glm::vec3(0.0f);
+			glm::vec3 dir;
+			float dist;
+			if (lightcuts && surface.depth < RAY_MAX_DIST) {
+				lighting = LightcutLighting(surface);
+			}
+			else if (!lightcuts && reservoir.light != NO_HIT && reservoir.contributionWeight > 0.0f &&
+				LightDirection(manyLights[reservoir.light], surface, dir, dist) && LightVisible(manyLights[reservoir.light], surface)) {
+				lighting = reservoir.contributionWeight * PointLightColor(manyLights[reservoir.light], surface, dir, dist);
+			}
+
+			directLighting[pixel] = lighting;
+			WritePixel(x, y, glm::clamp(resampleColor[pixel] + lighting, glm::vec3(0.0f), glm::vec3(1.0f)));
+		}
+	}
+}
+
+glm::vec3 CPURayTracer::ResampledPointLighting(const Intersection& intersection, const glm::vec3& baseDiffuse, const glm::vec3& baseSpecular) const {
+	if (numManyLights == 0) {
+		return glm::vec3(0.0f);
+	}
+
+	ShadingSurface surface;
+	surface.position = intersection.point;
+	surface.normal = intersection.normal;
+	surface.baseDiffuse = baseDiffuse;
+	surface.baseSpecular = baseSpecular;
+	surface.specularExponent = materials[intersection.materialIndex].specularExponent;
+
+	if (lightcuts) {
+		return LightcutLighting(surface);
+	}
+
+	uint32_t seed = HitSeed(intersection.point);
+	LightReservoir reservoir = SampleLights(surface, seed);
+
+	glm::vec3 dir;
+	float dist;
+	if (reservoir.light == NO_HIT || !LightDirection(manyLights[reservoir.light], surface, dir, dist) || !LightVisible(manyLights[reservoir.light], surface)) {
+		return glm::vec3(0.0f);
+	}
+	return reservoir.contributionWeight * PointLightColor(manyLights[reservoir.light], surface, dir, dist);
+}
+
+
+glm::vec3 CPURayTracer::LightcutLighting(const ShadingSurface& surface, uint32_t* cutSize) const {
+	const std::vector<LightBVHNode>& nodes = lightTree.GetNodes();
+	if (nodes.empty()) {
+		return glm::vec3(0.0f);
+	}
+
+	struct Cluster {
+		uint32_t node;
+		float errorBound;
+		glm::vec3 estimate;
+		bool visible;
+	};
+
+	// Shaded like a single light at its representative. Visibility is passed in when it is
+	// already known from the representative's last cluster.
+	enum class Visibility { Unknown, Visible, Shadowed };
+	auto evaluate = [this, &nodes, &surface](uint32_t node, Visibility visibility) {
+		Cluster cluster;
+		cluster.node = node;
+		cluster.errorBound = nodes[node].numLights > 1 ? lightTree.ErrorBound(node, surface) : 0.0f;
+		cluster.estimate = glm::vec3(0.0f);
+		cluster.visible = false;
+
+		PointLightToGPU light = lightTree.ClusterLight(node);
+		glm::vec3 dir;
+		float dist;
+		if (!LightDirection(light, surface, dir, dist)) {
+			return cluster;
+		}
+
+		cluster.visible = visibility == Visibility::Unknown ? LightVisible(light, surface) : visibility == Visibility::Visible;
+		if (cluster.visible) {
+			cluster.estimate = PointLightColor(light, surface, dir, dist);
+		}
+		return cluster;
+	};
+
+	// Clusters that could still be refined, as a max heap on their error bound. Single lights
+	// are exact and never go in.
+	Cluster heap[LIGHTCUT_MAX_SIZE];
+	uint32_t heapSize = 0;
+	auto byErrorBound = [](const Cluster& a, const Cluster& b) { return a.errorBound < b.errorBound; };
+
+	Cluster root = evaluate(0, Visibility::Unknown);
+	glm::vec3 total = root.estimate;
+	uint32_t size = 1;
+	if (nodes[0].numLights > 1 && root.errorBound > 0.0f) {
+		heap[heapSize++] = root;
+	}
+
+	while (heapSize > 0 && size < LIGHTCUT_MAX_SIZE) {
+		if (heap[0].errorBound <= LIGHTCUT_ERROR_RATIO * Luminance(total)) {
+			break;
+		}
+
+		std::pop_heap(heap, heap + heapSize, byErrorBound);
+		Cluster cluster = heap[--heapSize];
+		total -= cluster.estimate;
+		size += 1;
+
+		const uint32_t children[2] = { cluster.node + 1, nodes[cluster.node].offset };
+		for (uint32_t child : children) {
+			Visibility visibility = Visibility::Unknown;
+			if (nodes[child].representative == nodes[cluster.node].representative) {
+				visibility = cluster.visible ? Visibility::Visible : Visibility::Shadowed;
+			}
+
+			Cluster split = evaluate(child, visibility);
+			total += split.estimate;
+			if (nodes[child].numLights > 1 && split.errorBound > 0.0f) {
+				heap[heapSize++] = split;
+				std::push_heap(heap, heap + heapSize, byErrorBound);
+			}
+		}
+	}
+
+	if (cutSize) {
+		*cutSize = size;
+	}
+	// Taking clusters back out can leave a little rounding below zero
+	return glm::max(total, glm::vec3(0.0f));
+}
+
+std::vector<PointLightToGPU> CPURayTracer::RandomLights(uint32_t count, float totalLuminance, uint32_t& seed) const {
+	std::vector<PointLightToGPU> lights(count);
+	for (PointLightToGPU& light : lights) {
+		glm::vec3 t = glm::vec3(NextRandom(seed), NextRandom(seed), NextRandom(seed));
+		glm::vec3 color = glm::vec3(NextRandom(seed), NextRandom(seed), NextRandom(seed));
+		light.position_and_radius = glm::vec4(glm::mix(minBounds, maxBounds, t), 1.0f);
+		light.color_and_luminance = glm::vec4(0.25f + 0.75f * color, totalLuminance / count);
+	}
+	return lights;
+}
+
+float CPURayTracer::ManyLightsLuminance() const {
+	float totalLuminance = 0.0f;
+	for (uint32_t i = 0; i < numManyLights; i += 1) {
+		totalLuminance += manyLights[i].color_and_luminance.w;
+	}
+	return totalLuminance > 0.0f ? totalLuminance : 32.0f;
+}
+
+void CPURayTracer::BenchmarkManyLights(uint32_t frames) {
+	fprintf(stderr, "\nCPU Many Lights -- %ux%u, %u threads, %u candidates, %u frames after %u warmup\n", width, height,
+		JobSystem::NumThreads(), RESTIR_CANDIDATES, frames, RESTIR_BENCHMARK_WARMUP);
+
+	// Only kept around between frames with CPU_RESTIR or CPU_LIGHTCUTS
+	bool ownsBuffers = reservoirs.empty();
+	if (ownsBuffers) {
+		AllocateResampleBuffers();
+	}
+	const PointLightToGPU* sceneLights = manyLights;
+	uint32_t numSceneLights = numManyLights;
+	bool sceneLightcuts = lightcuts;
+
+	// The scene's total luminance is spread over however many lights, so every count lights it about as brightly
+	float totalLuminance = ManyLightsLuminance();
+
+	struct Setup {
+		const char* name;
+		uint32_t candidates;
+		bool reuse;
+		bool tree;
+		bool cuts;
+	};
+	const Setup setups[] = {
+		{ "One candidate", 1, false, false, false },
+		{ "Resampled", RESTIR_CANDIDATES, false, false, false },
+		{ "Temporal + spatial reuse", RESTIR_CANDIDATES, true, false, false },
+		{ "Light tree candidates", RESTIR_TREE_CANDIDATES, false, true, false },
+		{ "Light tree + reuse", RESTIR_TREE_CANDIDATES, true, true, false },
+		{ "Lightcuts", 0, false, true, true }
+	};
+
+	uint32_t lightSeed = 1;
+	const uint32_t lightCounts[] = { 32, 1000, 100000 };
+	for (uint32_t count : lightCounts) {
+		std::vector<PointLightToGPU> lights = RandomLights(count, totalLuminance, lightSeed);
+		SetManyLights(lights.data(), count);
+
+		// A frame without reuse for the surfaces, which end up in lastSurfaces. The reference
+		// draws from the alias table, so it doesn't lean on the tree it is checking.
+		resampleCandidates = RESTIR_CANDIDATES;
+		resampleTemporal = false;
+		resampleSpatial = false;
+		sampleLightTree = false;
+		lightcuts = false;
+		RenderResampled();
+
+		// Shadowing every light is out of reach at 100,000 of them, so the reference averages
+		// a lot of independent resampled estimates instead, which converges to the same thing
+		std::vector<uint32_t> referencePixels;
+		for (uint32_t y = RESTIR_REFERENCE_STRIDE / 2; y < height; y += RESTIR_REFERENCE_STRIDE) {
+			for (uint32_t x = RESTIR_REFERENCE_STRIDE / 2; x < width; x += RESTIR_REFERENCE_STRIDE) {
+				referencePixels.push_back(y * width + x);
+			}
+		}
+
+		auto referenceStart = std::chrono::high_resolution_clock::now();
+		std::vector<glm::vec3> reference(referencePixels.size(), glm::vec3(0.0f));
+		JobSystem::ParallelFor(static_cast<uint32_t>(referencePixels.size()), 1, [this, &referencePixels, &reference](uint32_t begin, uint32_t end) {
+			for (uint32_t i = begin; i < end; i += 1) {
+				const ShadingSurface& surface = lastSurfaces[referencePixels[i]];
+				if (surface.depth >= RAY_MAX_DIST) {
+					continue;
+				}
+
+				uint32_t seed = PixelSeed(referencePixels[i], 0, 3);
+				for (uint32_t sample = 0; sample < RESTIR_REFERENCE_SAMPLES; sample += 1) {
+					LightReservoir reservoir = SampleLights(surface, seed);
+					glm::vec3 dir;
+					float dist;
+					if (reservoir.light != NO_HIT && LightDirection(manyLights[reservoir.light], surface, dir, dist) && LightVisible(manyLights[reservoir.light], surface)) {
+						reference[i] += reservoir.contributionWeight * PointLightColor(manyLights[reservoir.light], surface, dir, dist);
+					}
+				}
+				reference[i] = glm::clamp(reference[i] / static_cast<float>(RESTIR_REFERENCE_SAMPLES), glm::vec3(0.0f), glm::vec3(1.0f));
+			}
+		});
+		auto referenceStop = std::chrono::high_resolution_clock::now();
+		fprintf(stderr, "CPU Many Lights -- %u lights, reference over %u pixels (ms): %.2f\n", count, static_cast<uint32_t>(referencePixels.size()),
+			std::chrono::duration_cast<std::chrono::microseconds>(referenceStop - referenceStart).count() / 1000.0f);
+
+		for (const Setup& setup : setups) {
+			resampleCandidates = setup.candidates;
+			treeCandidates = setup.candidates;
+			resampleTemporal = setup.reuse;
+			resampleSpatial = setup.reuse;
+			sampleLightTree = setup.tree;
+			lightcuts = setup.cuts;
+			reservoirHistoryValid = false;
+
+			long long frameTime = 0;
+			double squaredError = 0.0;
+			for (uint32_t frame = 0; frame < RESTIR_BENCHMARK_WARMUP + frames; frame += 1) {
+				auto start = std::chrono::high_resolution_clock::now();
+				RenderResampled();
+				auto stop = std::chrono::high_resolution_clock::now();
+
+				if (frame < RESTIR_BENCHMARK_WARMUP) {
+					continue;
+				}
+				frameTime += std::chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+
+				// Clamped like it would be on screen, a light right next to a surface shouldn't drown out the rest
+				for (uint32_t i = 0; i < referencePixels.size(); i += 1) {
+					glm::vec3 difference = glm::clamp(directLighting[referencePixels[i]], glm::vec3(0.0f), glm::vec3(1.0f)) - reference[i];
+					squaredError += glm::dot(difference, difference);
+				}
+			}
+
+			double meanSquaredError = squaredError / (3.0 * std::max<size_t>(1, reference.size()) * frames);
+			float psnr = meanSquaredError > 0.0 ? static_cast<float>(-10.0 * std::log10(meanSquaredError)) : INFINITY;
+			fprintf(stderr, "CPU Many Lights -- %u lights, %s: %.2f ms/frame, RMSE %.4f, PSNR %.2f dB\n", count, setup.name,
+				frameTime / 1000.0f / frames, std::sqrt(meanSquaredError), psnr);
+		}
+
+		// Clusters per cut, which is also about how many shadow rays each hit traced
+		uint64_t cutTotal = 0;
+		uint32_t cutMax = 0;
+		uint32_t numCuts = 0;
+		for (uint32_t pixel : referencePixels) {
+			if (lastSurfaces[pixel].depth >= RAY_MAX_DIST) {
+				continue;
+			}
+			uint32_t cutSize = 0;
+			LightcutLighting(lastSurfaces[pixel], &cutSize);
+			cutTotal += cutSize;
+			cutMax = std::max(cutMax, cutSize);
+			numCuts += 1;
+		}
+		fprintf(stderr, "CPU Many Lights -- %u lights, lightcut size: %.1f average, %u max\n", count, cutTotal / static_cast<float>(std::max(1u, numCuts)), cutMax);
+	}
+
+	resampleCandidates = RESTIR_CANDIDATES;
+	treeCandidates = RESTIR_TREE_CANDIDATES;
+	resampleTemporal = true;
+	resampleSpatial = true;
+	sampleLightTree = true;
+	lightcuts = sceneLightcuts;
+	SetManyLights(sceneLights, numSceneLights);
+	if (ownsBuffers) {
+		resampleColor = std::vector<glm::vec3>();
+		directLighting = std::vector<glm::vec3>();
+		surfaces = std::vector<ShadingSurface>();
+		lastSurfaces = std::vector<ShadingSurface>();
+		reservoirs = std::vector<LightReservoir>();
+		lastReservoirs = std::vector<LightReservoir>();
+		spatialReservoirs = std::vector<LightReservoir>();
+	}
+}
+
+void CPURayTracer::BenchmarkLightBVH(uint32_t iterations) {
+	fprintf(stderr, "\nCPU Light BVH -- %u threads, %u iterations\n", JobSystem::NumThreads(), iterations);
+
+	float totalLuminance = ManyLightsLuminance();
+	float sceneSize = glm::length(maxBounds - minBounds);
+
+	uint32_t seed = 1;
+	const uint32_t lightCounts[] = { 1000, 100000 };
+	for (uint32_t count : lightCounts) {
+		std::vector<PointLightToGPU> lights = RandomLights(count, totalLuminance, seed);
+		LightBVH tree;
+
+		long long buildTimes[2] = { 0, 0 };
+		for (uint32_t parallel = 0; parallel < 2; parallel += 1) {
+			for (uint32_t i = 0; i < iterations; i += 1) {
+				auto start = std::chrono::high_resolution_clock::now();
+				tree.Build(lights.data(), count, parallel == 1);
+				auto stop = std::chrono::high_resolution_clock::now();
+				buildTimes[parallel] += std::chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+			}
+		}
+		fprintf(stderr, "CPU Light BVH -- %u lights, %u nodes. Build (ms): %.2f on one thread, %.2f in parallel (%.2fx)\n", count,
+			static_cast<uint32_t>(tree.GetNodes().size()), buildTimes[0] / 1000.0f / iterations, buildTimes[1] / 1000.0f / iterations,
+			buildTimes[0] / static_cast<double>(std::max(1LL, buildTimes[1])));
+
+		// Every light nudged a little, which a refit handles, then scattered somewhere new, which needs a rebuild
+		float builtCost = tree.Cost();
+		for (PointLightToGPU& light : lights) {
+			glm::vec3 nudge = glm::vec3(NextRandom(seed), NextRandom(seed), NextRandom(seed)) - 0.5f;
+			light.position_and_radius += glm::vec4(0.01f * sceneSize * nudge, 0.0f);
+		}
+		auto refitStart = std::chrono::high_resolution_clock::now();
+		bool rebuilt = tree.Update();
+		auto refitStop = std::chrono::high_resolution_clock::now();
+		fprintf(stderr, "CPU Light BVH -- %u lights nudged: %s in %.2f ms, node area %.2fx\n", count, rebuilt ? "rebuilt" : "refit",
+			std::chrono::duration_cast<std::chrono::microseconds>(refitStop - refitStart).count() / 1000.0f, tree.Cost() / std::fmax(builtCost, REALLY_SMALL_NUMBER));
+
+		builtCost = tree.Cost();
+		std::vector<PointLightToGPU> scattered = RandomLights(count, totalLuminance, seed);
+		for (uint32_t i = 0; i < count; i += 1) {
+			lights[i].position_and_radius = scattered[i].position_and_radius;
+		}
+		auto updateStart = std::chrono::high_resolution_clock::now();
+		rebuilt = tree.Update();
+		auto updateStop = std::chrono::high_resolution_clock::now();
+		fprintf(stderr, "CPU Light BVH -- %u lights scattered: %s in %.2f ms, node area %.2fx\n", count, rebuilt ? "rebuilt" : "refit",
+			std::chrono::duration_cast<std::chrono::microseconds>(updateStop - updateStart).count() / 1000.0f, tree.Cost() / std::fmax(builtCost, REALLY_SMALL_NUMBER));
+
+		// Whatever Sample picks, Pdf should agree on how likely it was
+		float maxDifference = 0.0f;
+		uint32_t numSampled = 0;
+		for (uint32_t i = 0; i < 1000; i += 1) {
+			glm::vec3 point = glm::mix(minBounds, maxBounds, glm::vec3(NextRandom(seed), NextRandom(seed), NextRandom(seed)));
+			glm::vec3 normal = glm::normalize(glm::vec3(NextRandom(seed), NextRandom(seed), NextRandom(seed)) - 0.5f);
+
+			float pdf;
+			uint32_t light = tree.Sample(point, normal, NextRandom(seed), pdf);
+			if (light == NO_HIT) {
+				continue;
+			}
+			maxDifference = std::fmax(maxDifference, std::fabs(tree.Pdf(point, normal, light) - pdf) / pdf);
+			numSampled += 1;
+		}
+		fprintf(stderr, "CPU Light BVH -- %u lights, %u samples: Pdf within %.6f of Sample's pdf\n", count, numSampled, maxDifference);
+	}
+}
@@ -0,0 +1,203 @@
+#include "CPURayTracer.h"
+
+#include "BVH.h"
+#include "JobSystem.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+
+// Ray stats path of the CPU tracer. Every pixel's primary ray and everything it sets off is
+// counted into that pixel's RayCounters by BVH traversal and shading, then the shown count is
+// drawn as a heatmap. Counting only happens with PROFILING, the counters compile out otherwise.
+
+namespace {
+	const char* RayStatName(RayStat stat) {
+		switch (stat) {
+		case RayStat::NodesVisited: return "nodesVisited";
+		case RayStat::AABBTests: return "aabbTests";
+		case RayStat::TriangleTests: return "triangleTests";
+		case RayStat::ShadowRays: return "shadowRays";
+		case RayStat::Bounces: return "bounces";
+		case RayStat::AlphaTests: return "alphaTests";
+		case RayStat::AlphaFetches: return "alphaFetches";
+		default: return "none";
+		}
+	}
+
+	inline uint32_t RayStatValue(const RayCounters& counters, RayStat stat) {
+		switch (stat) {
+		case RayStat::NodesVisited: return counters.nodesVisited;
+		case RayStat::AABBTests: return counters.aabbTests;
+		case RayStat::TriangleTests: return counters.triangleTests;
+		case RayStat::ShadowRays: return counters.shadowRays;
+		case RayStat::Bounces: return counters.bounces;
+		case RayStat::AlphaTests: return counters.alphaTests;
+		case RayStat::AlphaFetches: return counters.alphaFetches;
+		default: return 0;
+		}
+	}
+
+	// 0, 1, 2-3, 4-7, ...
+	inline uint32_t HistogramBucket(uint32_t value) {
+		uint32_t bucket = 0;
+		while (value > 0 && bucket < RAY_STATS_HISTOGRAM_BUCKETS - 1) {
+			value >>= 1;
+			bucket += 1;
+		}
+		return bucket;
+	}
+
+	// Black through blue, green and yellow to red
+	inline glm::vec3 HeatmapColor(uint32_t value, uint32_t scale) {
+		const glm::vec3 ramp[5] = {
+			glm::vec3(0.0f, 0.0f, 0.0f),
+			glm::vec3(0.0f, 0.0f, 1.0f),
+			glm::vec3(0.0f, 1.0f, 0.0f),
+			glm::vec3(1.0f, 1.0f, 0.0f),
+			glm::vec3(1.0f, 0.0f, 0.0f)
+		};
+
+		float t = scale > 0 ? std::min(1.0f, value / static_cast<float>(scale)) * 4.0f : 0.0f;
+		uint32_t segment = std::min(3u, static_cast<uint32_t>(t));
+		return glm::mix(ramp[segment], ramp[segment + 1], t - segment);
+	}
+}
+
+void CPURayTracer::ShowRayStats(RayStat stat) {
+#if !PROFILING
+	if (stat != RayStat::None) {
+		fprintf(stderr, "Ray stats are only counted with PROFILING\n");
+		return;
+	}
+#endif
+
+	// Whatever mode we go back to has been missing frames
+	if (rayStat != RayStat::None && stat == RayStat::None) {
+		ResetAccumulation();
+		upsampleHistoryValid = false;
+		reservoirHistoryValid = false;
+	}
+	rayStat = stat;
+}
+
+void CPURayTracer::RenderRayStats() {
+	rayCounters.assign(width * height, RayCounters());
+	primaryMode = PrimaryMode::Write;
+
+	JobSystem::ParallelFor(numTilesX * numTilesY, 1, [this](uint32_t begin, uint32_t end) {
+		for (uint32_t tile = begin; tile < end; tile += 1) {
+			uint32_t startX = (tile % numTilesX) * CPU_TILE_SIZE;
+			uint32_t startY = (tile / numTilesX) * CPU_TILE_SIZE;
+			uint32_t endX = std::min(width, startX + CPU_TILE_SIZE);
+			uint32_t endY = std::min(height, startY + CPU_TILE_SIZE);
+
+			for (uint32_t y = startY; y < endY; y += 1) {
+				for (uint32_t x = startX; x < endX; x += 1) {
+					BVH::SetRayCounters(&rayCounters[y * width + x]);
+					Ray ray = PrimaryRay(x, y);
+					TriangleHit hit;
+					bvh->Intersect(ray, hit);
+					FinishPrimary(x, y, ray, hit);
+				}
+			}
+			BVH::SetRayCounters(nullptr);
+		}
+	});
+
+	SummarizeRayStats();
+
+	uint32_t scale = rayStatSummaries[static_cast<uint32_t>(rayStat)].percentile99;
+	for (uint32_t y = 0; y < height; y += 1) {
+		for (uint32_t x = 0; x < width; x += 1) {
+			WritePixel(x, y, HeatmapColor(RayStatValue(rayCounters[y * width + x], rayStat), scale));
+		}
+	}
+}
+
+void CPURayTracer::SummarizeRayStats() {
+	std::vector<uint32_t> values(rayCounters.size());
+	for (uint32_t s = 1; s < static_cast<uint32_t>(RayStat::Count); s += 1) {
+		RayStat stat = static_cast<RayStat>(s);
+		RayStatSummary& summary = rayStatSummaries[s];
+		summary = RayStatSummary();
+
+		for (uint32_t i = 0; i < rayCounters.size(); i += 1) {
+			uint32_t value = RayStatValue(rayCounters[i], stat);
+			values[i] = value;
+			summary.total += value;
+			summary.max = std::max(summary.max, value);
+			summary.histogram[HistogramBucket(value)] += 1;
+		}
+
+		if (!values.empty()) {
+			auto percentile = values.begin() + (values.size() - 1) * 99 / 100;
+			std::nth_element(values.begin(), percentile, values.end());
+			summary.percentile99 = *percentile;
+		}
+	}
+}
+
+void CPURayTracer::PrintRayStats() const {
+	if (rayCounters.empty()) {
+		fprintf(stderr, "\nCPU ray stats -- nothing counted yet, see ShowRayStats\n");
+		return;
+	}
+
+	uint32_t numPixels = static_cast<uint32_t>(rayCounters.size());
+	fprintf(stderr, "\nCPU ray stats -- %u pixels\n", numPixels);
+	for (uint32_t s = 1; s < static_cast<uint32_t>(RayStat::Count); s += 1) {
+		const RayStatSummary& summary = rayStatSummaries[s];
+		fprintf(stderr, "  %-14s total %llu, %.2f per pixel, 99th percentile %u, max %u\n",
+			RayStatName(static_cast<RayStat>(s)), static_cast<unsigned long long>(summary.total),
+			summary.total / static_cast<double>(numPixels), summary.percentile99, summary.max);
+
+		// Drop empty buckets off the end
+		uint32_t lastBucket = 0;
+		for (uint32_t b = 0; b < RAY_STATS_HISTOGRAM_BUCKETS; b += 1) {
+			if (summary.histogram[b] > 0) {
+				lastBucket = b;
+			}
+		}
+		for (uint32_t b = 0; b <= lastBucket; b += 1) {
+			uint32_t low = b == 0 ? 0 : 1u << (b - 1);
+			uint32_t high = b == 0 ? 0 : (1u << b) - 1;
+			fprintf(stderr, "    %6u - %-6u %5.1f%%\n", low, high, 100.0f * summary.histogram[b] / numPixels);
+		}
+	}
+}
+
+bool CPURayTracer::WriteRayStatsHeatmaps(const char* prefix) const {
+	if (rayCounters.empty()) {
+		return false;
+	}
+
+	bool written = true;
+	std::vector<uint8_t> row(width * 3);
+	for (uint32_t s = 1; s < static_cast<uint32_t>(RayStat::Count); s += 1) {
+		RayStat stat = static_cast<RayStat>(s);
+		std::string path = std::string(prefix) + RayStatName(stat) + ".ppm";
+
+		FILE* file = fopen(path.c_str(), "wb");
+		if (!file) {
+			fprintf(stderr, "Failed to open %s for ray stats\n", path.c_str());
+			written = false;
+			continue;
+		}
+
+		// PPMs go top row first, our pixels bottom row first
+		fprintf(file, "P6\n%u %u\n255\n", width, height);
+		uint32_t scale = rayStatSummaries[s].percentile99;
+		for (uint32_t y = height; y-- > 0;) {
+			for (uint32_t x = 0; x < width; x += 1) {
+				glm::uvec3 c = glm::uvec3(HeatmapColor(RayStatValue(rayCounters[y * width + x], stat), scale) * 255.0f + 0.5f);
+				row[x * 3 + 0] = static_cast<uint8_t>(c.r);
+				row[x * 3 + 1] = static_cast<uint8_t>(c.g);
+				row[x * 3 + 2] = static_cast<uint8_t>(c.b);
+			}
+			fwrite(row.data(), 1, row.size(), file);
+		}
+		fclose(file);
+	}
+	return written;
+}
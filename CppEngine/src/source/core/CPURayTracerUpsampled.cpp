@@ -0,0 +1,281 @@
+#include "CPURayTracer.h"
+
+#include "BVH.h"
+#include "JobSystem.h"
+
+#include "glm/gtc/matrix_transform.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+
+// Upsampled path of the CPU tracer. Each frame only traces the pixels whose turn it is, in a
+// pattern that moves every frame so every pixel gets traced once per interval. The rest are
+// reprojected from the last frame's output with the camera's motion, using the nearest traced
+// depth around them, and clamped to the colors of their traced neighbours so stale history
+// can't smear across the image.
+
+// Frames the benchmark lets each interval settle for before measuring, and how far the camera
+// turns and slides every frame
+#define UPSAMPLE_BENCHMARK_WARMUP 16
+#define UPSAMPLE_BENCHMARK_TURN 0.005f
+#define UPSAMPLE_BENCHMARK_SLIDE 0.001f
+
+namespace {
+	inline uint32_t PatternSize(uint32_t interval) {
+		return static_cast<uint32_t>(std::sqrt(static_cast<float>(interval)) + 0.5f);
+	}
+
+	// Adds up the squared error of image against reference, both already in [0, 1]
+	inline void AddSquaredError(const std::vector<glm::vec3>& image, const std::vector<glm::vec3>& reference, double& squaredError) {
+		for (uint32_t i = 0; i < reference.size(); i += 1) {
+			glm::vec3 difference = image[i] - reference[i];
+			squaredError += glm::dot(difference, difference);
+		}
+	}
+}
+
+void CPURayTracer::AllocateUpsampleBuffers() {
+	sparseColor = std::vector<glm::vec3>(width * height);
+	sparseDepth = std::vector<float>(width * height);
+	upsampleHistory = std::vector<glm::vec3>(width * height);
+	upsampleOutput = std::vector<glm::vec3>(width * height);
+	upsampleHistoryValid = false;
+}
+
+bool CPURayTracer::IsTraced(uint32_t x, uint32_t y, uint32_t interval, uint32_t phase) const {
+	if (interval == 2) {
+		return ((x + y + phase) & 1) == 0;
+	}
+
+	// One pixel of every n x n block. Stepping n + 1 cells a frame visits the diagonal first
+	// and, being coprime with n * n, every cell once per interval.
+	uint32_t n = PatternSize(interval);
+	uint32_t cell = (y % n) * n + x % n;
+	return cell == (phase * (n + 1)) % interval;
+}
+
+void CPURayTracer::RenderUpsampled(uint32_t interval) {
+	// Lighting changes make all of the history wrong, camera moves are what reprojection is for
+	if (accumulationDirty || directionalLightDir != lastDirectionalLightDir || directionalLightCol != lastDirectionalLightCol) {
+		upsampleHistoryValid = false;
+	}
+	accumulationDirty = false;
+	lastDirectionalLightDir = directionalLightDir;
+	lastDirectionalLightCol = directionalLightCol;
+
+	upsamplePhase = (upsamplePhase + 1) % interval;
+	TraceSparseFrame(interval, upsamplePhase);
+
+	JobSystem::ParallelFor(height, 1, [this, interval](uint32_t begin, uint32_t end) {
+		ReconstructRows(begin, end, interval, upsamplePhase);
+	});
+
+	upsampleHistory.swap(upsampleOutput);
+	lastViewProj = ViewProjection();
+	upsampleHistoryValid = true;
+}
+
+void CPURayTracer::TraceSparseFrame(uint32_t interval, uint32_t phase) {
+	assert(interval == 2 || PatternSize(interval) * PatternSize(interval) == interval);
+
+	primaryMode = PrimaryMode::Sparse;
+	JobSystem::ParallelFor(numTilesX * numTilesY, 1, [this, interval, phase](uint32_t begin, uint32_t end) {
+		for (uint32_t tile = begin; tile < end; tile += 1) {
+			TraceSparseTile(tile, interval, phase);
+		}
+	});
+}
+
+void CPURayTracer::TraceSparseTile(uint32_t tileIndex, uint32_t interval, uint32_t phase) {
+	uint32_t startX = (tileIndex % numTilesX) * CPU_TILE_SIZE;
+	uint32_t startY = (tileIndex / numTilesX) * CPU_TILE_SIZE;
+	uint32_t endX = std::min(width, startX + CPU_TILE_SIZE);
+	uint32_t endY = std::min(height, startY + CPU_TILE_SIZE);
+
+#if RAY_PACKET_SIZE > 0
+	// Traced pixels fill packets in scan order. Lanes past the last one repeat it and are never written.
+	RayPacket<RAY_PACKET_SIZE> packet;
+	glm::uvec2 lanePixels[RAY_PACKET_SIZE];
+	uint32_t numLanes = 0;
+
+	auto tracePacket = [this, &packet, &lanePixels, &numLanes]() {
+		for (uint32_t lane = numLanes; lane < RAY_PACKET_SIZE; lane += 1) {
+			packet.SetRay(lane, packet.GetRay(numLanes - 1));
+		}
+		bvh->IntersectPacket<RAY_PACKET_SIZE>(packet);
+
+		for (uint32_t lane = 0; lane < numLanes; lane += 1) {
+			FinishPrimary(lanePixels[lane].x, lanePixels[lane].y, packet.GetRay(lane), packet.GetHit(lane));
+		}
+		numLanes = 0;
+	};
+
+	for (uint32_t y = startY; y < endY; y += 1) {
+		for (uint32_t x = startX; x < endX; x += 1) {
+			if (!IsTraced(x, y, interval, phase)) {
+				continue;
+			}
+
+			packet.SetRay(numLanes, PrimaryRay(x, y));
+			lanePixels[numLanes] = glm::uvec2(x, y);
+			numLanes += 1;
+			if (numLanes == RAY_PACKET_SIZE) {
+				tracePacket();
+			}
+		}
+	}
+	if (numLanes > 0) {
+		tracePacket();
+	}
+#else
+	for (uint32_t y = startY; y < endY; y += 1) {
+		for (uint32_t x = startX; x < endX; x += 1) {
+			if (!IsTraced(x, y, interval, phase)) {
+				continue;
+			}
+
+			Ray ray = PrimaryRay(x, y);
+			TriangleHit hit;
+			bvh->Intersect(ray, hit);
+			FinishPrimary(x, y, ray, hit);
+		}
+	}
+#endif
+}
+
+void CPURayTracer::ReconstructRows(uint32_t begin, uint32_t end, uint32_t interval, uint32_t phase) {
+	// Far enough out to see traced pixels on every side, 4 for a checkerboard and up to 9 for blocks
+	int32_t reach = interval == 2 ? 1 : static_cast<int32_t>(PatternSize(interval));
+
+	for (uint32_t y = begin; y < end; y += 1) {
+		for (uint32_t x = 0; x < width; x += 1) {
+			uint32_t pixel = y * width + x;
+
+			if (IsTraced(x, y, interval, phase)) {
+				upsampleOutput[pixel] = sparseColor[pixel];
+				WritePixel(x, y, sparseColor[pixel]);
+				continue;
+			}
+
+			// What was traced around us this frame
+			glm::vec3 minColor = glm::vec3(1.0f);
+			glm::vec3 maxColor = glm::vec3(0.0f);
+			glm::vec3 sum = glm::vec3(0.0f);
+			float nearestDepth = RAY_MAX_DIST;
+			uint32_t count = 0;
+
+			int32_t startY = std::max(0, static_cast<int32_t>(y) - reach);
+			int32_t endY = std::min(static_cast<int32_t>(height) - 1, static_cast<int32_t>(y) + reach);
+			int32_t startX = std::max(0, static_cast<int32_t>(x) - reach);
+			int32_t endX = std::min(static_cast<int32_t>(width) - 1, static_cast<int32_t>(x) + reach);
+			for (int32_t sy = startY; sy <= endY; sy += 1) {
+				for (int32_t sx = startX; sx <= endX; sx += 1) {
+					if (!IsTraced(sx, sy, interval, phase)) {
+						continue;
+					}
+
+					uint32_t neighbour = sy * width + sx;
+					minColor = glm::min(minColor, sparseColor[neighbour]);
+					maxColor = glm::max(maxColor, sparseColor[neighbour]);
+					sum += sparseColor[neighbour];
+					nearestDepth = std::fmin(nearestDepth, sparseDepth[neighbour]);
+					count += 1;
+				}
+			}
+
+			glm::vec3 color = count > 0 ? sum / static_cast<float>(count) : glm::vec3(0.0f);
+
+			// Our surface is taken to be the nearest one traced around us, so foreground edges win.
+			// Where it was on screen last frame, PrimaryRay puts pixel x at ndc 2x/width - 1.
+			if (upsampleHistoryValid && count > 0) {
+				Ray ray = PrimaryRay(x, y);
+				glm::vec4 clip = lastViewProj * glm::vec4(ray.pos + nearestDepth * ray.dir, 1.0f);
+				if (clip.w > 0.0f) {
+					glm::vec2 lastPixel = (glm::vec2(clip) / clip.w * 0.5f + 0.5f) * glm::vec2(width, height);
+					int32_t lastX = static_cast<int32_t>(std::floor(lastPixel.x + 0.5f));
+					int32_t lastY = static_cast<int32_t>(std::floor(lastPixel.y + 0.5f));
+
+					if (lastX >= 0 && lastY >= 0 && lastX < static_cast<int32_t>(width) && lastY < static_cast<int32_t>(height)) {
+						color = glm::clamp(upsampleHistory[lastY * width + lastX], minColor, maxColor);
+					}
+				}
+			}
+
+			upsampleOutput[pixel] = color;
+			WritePixel(x, y, color);
+		}
+	}
+}
+
+void CPURayTracer::BenchmarkUpsampling(uint32_t frames) {
+	fprintf(stderr, "\nCPU Upsampling -- %ux%u, %u threads, %u frames after %u warmup\n", width, height, JobSystem::NumThreads(), frames, UPSAMPLE_BENCHMARK_WARMUP);
+
+	// Only kept around between frames with CPU_TRACE_INTERVAL > 1
+	bool ownsBuffers = upsampleHistory.empty();
+	if (ownsBuffers) {
+		AllocateUpsampleBuffers();
+	}
+
+	glm::mat4 startInvView = invView;
+	glm::vec3 startCamPos = camPos;
+	float slide = UPSAMPLE_BENCHMARK_SLIDE * glm::length(maxBounds - minBounds);
+
+	// Turns and slides the camera sideways a little more every frame
+	auto moveCamera = [this, &startInvView, slide](uint32_t frame) {
+		glm::mat4 moved = glm::rotate(startInvView, UPSAMPLE_BENCHMARK_TURN * frame, glm::vec3(0.0f, 1.0f, 0.0f));
+		moved = glm::translate(moved, glm::vec3(slide * frame, 0.0f, 0.0f));
+		SetCamera(invProj, moved, glm::vec3(moved[3]));
+	};
+
+	std::vector<glm::vec3> reference(width * height);
+	long long fullTime = 0;
+
+	const uint32_t intervals[] = { 1, 2, 4, 9, 16 };
+	for (uint32_t interval : intervals) {
+		upsampleHistoryValid = false;
+		upsamplePhase = 0;
+
+		long long frameTime = 0;
+		double squaredError = 0.0;
+		for (uint32_t frame = 0; frame < UPSAMPLE_BENCHMARK_WARMUP + frames; frame += 1) {
+			moveCamera(frame);
+
+			// Every pixel traced into the sparse buffers, which RenderUpsampled is about to overwrite anyway
+			bool measured = frame >= UPSAMPLE_BENCHMARK_WARMUP;
+			if (measured) {
+				TraceSparseFrame(1, 0);
+				reference = sparseColor;
+			}
+
+			auto start = std::chrono::high_resolution_clock::now();
+			RenderUpsampled(interval);
+			auto stop = std::chrono::high_resolution_clock::now();
+
+			if (measured) {
+				frameTime += std::chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+				AddSquaredError(upsampleHistory, reference, squaredError);
+			}
+		}
+
+		if (interval == 1) {
+			fullTime = frameTime;
+		}
+
+		double meanSquaredError = squaredError / (3.0 * width * height * frames);
+		float psnr = meanSquaredError > 0.0 ? static_cast<float>(-10.0 * std::log10(meanSquaredError)) : INFINITY;
+		fprintf(stderr, "CPU Upsampling -- 1/%u of pixels: %.2f ms/frame (%.2fx), RMSE %.4f, PSNR %.2f dB\n", interval,
+			frameTime / 1000.0f / frames, fullTime / static_cast<double>(std::max(1LL, frameTime)), std::sqrt(meanSquaredError), psnr);
+	}
+
+	SetCamera(invProj, startInvView, startCamPos);
+	upsampleHistoryValid = false;
+	if (ownsBuffers) {
+		sparseColor = std::vector<glm::vec3>();
+		sparseDepth = std::vector<float>();
+		upsampleHistory = std::vector<glm::vec3>();
+		upsampleOutput = std::vector<glm::vec3>();
+	}
+}
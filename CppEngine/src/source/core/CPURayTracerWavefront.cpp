@@ -0,0 +1,227 @@
+#include "CPURayTracer.h"
+
+#include "BVH.h"
+#include "CacheSimulator.h"
+#include "JobSystem.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+// Wavefront path of the CPU tracer. Every bounce's reflections are collected into one queue,
+// sorted so rays that start close together and point the same way sit next to each other,
+// then traced in that order. Neighbouring rays walk mostly the same nodes, so the BVH stays
+// in cache instead of every reflection dragging in a fresh part of the tree.
+
+// Origin cells per axis in the sort key, as a power of 2. 3 * 10 bits of Morton code plus
+// 3 bits of octant leaves 31 bits of the 64 bit key for the ray index.
+#define SORT_CELL_BITS 10
+#define SORT_INDEX_BITS 31
+
+#define QUEUE_GRAIN_SIZE 256
+
+namespace {
+	// Spread the low 10 bits of v out to every third bit
+	inline uint32_t SpreadBits(uint32_t v) {
+		v &= 0x3FF;
+		v = (v | (v << 16)) & 0x030000FF;
+		v = (v | (v << 8)) & 0x0300F00F;
+		v = (v | (v << 4)) & 0x030C30C3;
+		v = (v | (v << 2)) & 0x09249249;
+		return v;
+	}
+
+	inline uint64_t RaySortKey(const Ray& ray, const glm::vec3& minBounds, const glm::vec3& invExtent) {
+		const float numCells = static_cast<float>(1 << SORT_CELL_BITS);
+
+		glm::vec3 cell = glm::clamp((ray.pos - minBounds) * invExtent * numCells, glm::vec3(0.0f), glm::vec3(numCells - 1));
+		uint32_t morton =
+			(SpreadBits(static_cast<uint32_t>(cell.z)) << 2) |
+			(SpreadBits(static_cast<uint32_t>(cell.y)) << 1) |
+			SpreadBits(static_cast<uint32_t>(cell.x));
+
+		// Octant first, rays heading different ways visit children in a different order anyway
+		uint32_t octant = (ray.dir.x < 0) | ((ray.dir.y < 0) << 1) | ((ray.dir.z < 0) << 2);
+
+		return (static_cast<uint64_t>(octant) << (3 * SORT_CELL_BITS)) | morton;
+	}
+}
+
+void CPURayTracer::RenderWavefront() {
+	primaryMode = PrimaryMode::Queue;
+
+	// Primary rays shade their hit and leave reflections in rayQueue, indexed by pixel
+	rayQueue.resize(width * height);
+	TracePrimaryRays();
+	CompactQueue(rayQueue);
+
+	for (uint32_t depth = 1; depth < CPU_RAY_DEPTH && !rayQueue.empty(); depth += 1) {
+		SortQueue();
+		TraceQueue(depth + 1 < CPU_RAY_DEPTH);
+
+		rayQueue.swap(nextRayQueue);
+		CompactQueue(rayQueue);
+	}
+
+	ResolveRadiance();
+}
+
+void CPURayTracer::CompactQueue(std::vector<QueuedRay>& queue) const {
+	queue.erase(
+		std::remove_if(queue.begin(), queue.end(), [](const QueuedRay& queued) { return queued.pixel == NO_HIT; }),
+		queue.end()
+	);
+}
+
+void CPURayTracer::SortQueue() {
+	uint32_t numRays = static_cast<uint32_t>(rayQueue.size());
+	sortKeys.resize(numRays);
+
+	glm::vec3 invExtent = 1.0f / glm::max(maxBounds - minBounds, glm::vec3(SMALL_NUMBER));
+
+	JobSystem::ParallelFor(numRays, QUEUE_GRAIN_SIZE, [this, &invExtent](uint32_t begin, uint32_t end) {
+		for (uint32_t i = begin; i < end; i += 1) {
+			sortKeys[i] = (RaySortKey(rayQueue[i].ray, minBounds, invExtent) << SORT_INDEX_BITS) | i;
+		}
+	});
+
+	std::sort(sortKeys.begin(), sortKeys.end());
+
+	const uint64_t indexMask = (1ULL << SORT_INDEX_BITS) - 1;
+	nextRayQueue.resize(numRays);
+	JobSystem::ParallelFor(numRays, QUEUE_GRAIN_SIZE, [this, indexMask](uint32_t begin, uint32_t end) {
+		for (uint32_t i = begin; i < end; i += 1) {
+			nextRayQueue[i] = rayQueue[sortKeys[i] & indexMask];
+		}
+	});
+
+	rayQueue.swap(nextRayQueue);
+}
+
+void CPURayTracer::TraceQueue(bool queueReflections) {
+	uint32_t numRays = static_cast<uint32_t>(rayQueue.size());
+	nextRayQueue.resize(numRays);
+
+	JobSystem::ParallelFor(numRays, QUEUE_GRAIN_SIZE, [this, queueReflections](uint32_t begin, uint32_t end) {
+		TraceQueueRange(begin, end, queueReflections);
+	});
+}
+
+void CPURayTracer::TraceQueueRange(uint32_t begin, uint32_t end, bool queueReflections) {
+	for (uint32_t i = begin; i < end; i += 1) {
+		QueuedRay queued = rayQueue[i];
+		QueuedRay& next = nextRayQueue[i];
+		next.pixel = NO_HIT;
+
+		TriangleHit hit;
+		if (!bvh->Intersect(queued.ray, hit)) {
+			continue;
+		}
+
+		// Every pixel has at most one ray per bounce, so nobody else writes here
+		glm::vec3 color;
+		next.coneWidth = queued.coneWidth;
+		if (ShadeHit(queued.ray, hit, next.coneWidth, color, next.ray, next.multiplier) && queueReflections) {
+			next.pixel = queued.pixel;
+		}
+		radiance[queued.pixel] += queued.multiplier * color;
+	}
+}
+
+void CPURayTracer::ResolveRadiance() {
+	JobSystem::ParallelFor(height, 1, [this](uint32_t begin, uint32_t end) {
+		for (uint32_t y = begin; y < end; y += 1) {
+			for (uint32_t x = 0; x < width; x += 1) {
+				WritePixel(x, y, glm::clamp(radiance[y * width + x], glm::vec3(0.0f), glm::vec3(1.0f)));
+			}
+		}
+	});
+}
+
+void CPURayTracer::BenchmarkBounces(uint32_t iterations) {
+	fprintf(stderr, "\nCPU Bounces -- %ux%u, %u threads, %u iterations\n", width, height, JobSystem::NumThreads(), iterations);
+
+	// Whole frames
+	{
+		long long depthFirstTime = 0;
+		long long wavefrontTime = 0;
+		for (uint32_t i = 0; i < iterations; i += 1) {
+			auto start = std::chrono::high_resolution_clock::now();
+			RenderDepthFirst();
+			auto middle = std::chrono::high_resolution_clock::now();
+			RenderWavefront();
+			auto stop = std::chrono::high_resolution_clock::now();
+
+			depthFirstTime += std::chrono::duration_cast<std::chrono::microseconds>(middle - start).count();
+			wavefrontTime += std::chrono::duration_cast<std::chrono::microseconds>(stop - middle).count();
+		}
+
+		fprintf(stderr, "CPU Bounces -- Depth first frame (ms): %.2f\n", depthFirstTime / 1000.0f / iterations);
+		fprintf(stderr, "CPU Bounces -- Wavefront frame (ms): %.2f\n", wavefrontTime / 1000.0f / iterations);
+	}
+
+	// The first bounce on its own. The same reflections, once in the pixel order depth first
+	// tracing sees them in and once sorted.
+	primaryMode = PrimaryMode::Queue;
+	rayQueue.resize(width * height);
+	TracePrimaryRays();
+	CompactQueue(rayQueue);
+	if (rayQueue.empty()) {
+		fprintf(stderr, "CPU Bounces -- Nothing reflective in view\n");
+		return;
+	}
+
+	std::vector<QueuedRay> pixelOrder = rayQueue;
+	auto sortStart = std::chrono::high_resolution_clock::now();
+	SortQueue();
+	auto sortStop = std::chrono::high_resolution_clock::now();
+	std::vector<QueuedRay> sortedOrder = rayQueue;
+
+	double numRays = static_cast<double>(pixelOrder.size());
+	fprintf(stderr, "CPU Bounces -- Reflection rays: %zu\n", pixelOrder.size());
+	fprintf(stderr, "CPU Bounces -- Sort (ms): %.2f\n", std::chrono::duration_cast<std::chrono::microseconds>(sortStop - sortStart).count() / 1000.0f);
+
+	{
+		long long pixelOrderTime = 0;
+		long long sortedOrderTime = 0;
+		for (uint32_t i = 0; i < iterations; i += 1) {
+			rayQueue = pixelOrder;
+			auto start = std::chrono::high_resolution_clock::now();
+			TraceQueue(false);
+			auto middle = std::chrono::high_resolution_clock::now();
+			rayQueue = sortedOrder;
+			TraceQueue(false);
+			auto stop = std::chrono::high_resolution_clock::now();
+
+			pixelOrderTime += std::chrono::duration_cast<std::chrono::microseconds>(middle - start).count();
+			sortedOrderTime += std::chrono::duration_cast<std::chrono::microseconds>(stop - middle).count();
+		}
+
+		// Rays per microsecond is millions of rays per second
+		fprintf(stderr, "CPU Bounces -- Pixel order: %.2f Mrays/s\n", numRays * iterations / std::max(1LL, pixelOrderTime));
+		fprintf(stderr, "CPU Bounces -- Sorted: %.2f Mrays/s\n", numRays * iterations / std::max(1LL, sortedOrderTime));
+	}
+
+#if PROFILING
+	// Single threaded so one simulated core sees the whole stream, 32kb L1 and 256kb L2
+	{
+		CacheSimulator l2(256 * 1024, 8);
+		CacheSimulator l1(32 * 1024, 8, &l2);
+		BVH::SetCacheSimulator(&l1);
+		nextRayQueue.resize(pixelOrder.size());
+
+		rayQueue = pixelOrder;
+		TraceQueueRange(0, static_cast<uint32_t>(rayQueue.size()), false);
+		fprintf(stderr, "CPU Bounces -- Pixel order L1 misses/ray: %.2f (%.1f%%), L2 misses/ray: %.2f (%.1f%%)\n",
+			l1.misses / numRays, 100.0f * l1.MissRate(), l2.misses / numRays, 100.0f * l2.MissRate());
+
+		l1.Reset();
+		rayQueue = sortedOrder;
+		TraceQueueRange(0, static_cast<uint32_t>(rayQueue.size()), false);
+		fprintf(stderr, "CPU Bounces -- Sorted L1 misses/ray: %.2f (%.1f%%), L2 misses/ray: %.2f (%.1f%%)\n",
+			l1.misses / numRays, 100.0f * l1.MissRate(), l2.misses / numRays, 100.0f * l2.MissRate());
+
+		BVH::SetCacheSimulator(nullptr);
+	}
+#endif
+}
@@ -48,8 +48,10 @@ void Camera::Update(const float& dt) {
 }
 
 void Camera::UpdateFrustumPlanes() {
-	glm::mat4 projViewMat = proj * view;
+	ExtractFrustumPlanes(proj * view, frustumPlanes.data());
+}
 
+void Camera::ExtractFrustumPlanes(const glm::mat4& projViewMat, glm::vec4* planes) {
 	/* http://www8.cs.umu.se/kurser/5DV051/HT12/lab/plane_extraction.pdf */
 	glm::vec4 left = glm::vec4(
 		projViewMat[0][3] + projViewMat[0][0],
@@ -87,12 +89,12 @@ void Camera::UpdateFrustumPlanes() {
 		projViewMat[2][3] - projViewMat[2][2],
 		projViewMat[3][3] - projViewMat[3][2]);
 
-	frustumPlanes[0] = left;
-	frustumPlanes[1] = right;
-	frustumPlanes[2] = bottom;
-	frustumPlanes[3] = top;
-	frustumPlanes[4] = nearPlane;
-	frustumPlanes[5] = farPlane;
+	planes[0] = left;
+	planes[1] = right;
+	planes[2] = bottom;
+	planes[3] = top;
+	planes[4] = nearPlane;
+	planes[5] = farPlane;
 
 }
 
@@ -0,0 +1,377 @@
+#include "Denoiser.h"
+
+#include "JobSystem.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+#include <emmintrin.h>
+
+#define DENOISER_ROW_GRAIN 8
+
+namespace {
+	// B3 spline, the à-trous kernel is this in x times this in y
+	const float kernel[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+	// e^x for x <= 0, good to about 1e-4. 2^(x log2(e)) with the integer part going straight into
+	// the exponent bits and a polynomial for the fraction.
+	inline __m128 FastExp(__m128 x) {
+		const __m128 one = _mm_set1_ps(1.0f);
+
+		__m128 t = _mm_mul_ps(_mm_max_ps(x, _mm_set1_ps(-80.0f)), _mm_set1_ps(1.442695041f));
+
+		// Truncation rounds negatives up, step back down to the floor
+		__m128 whole = _mm_cvtepi32_ps(_mm_cvttps_epi32(t));
+		whole = _mm_sub_ps(whole, _mm_and_ps(_mm_cmpgt_ps(whole, t), one));
+		__m128 f = _mm_sub_ps(t, whole);
+
+		// Taylor series of 2^f on [0, 1)
+		__m128 p = _mm_set1_ps(0.001333355f);
+		p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.009618129f));
+		p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.05550411f));
+		p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.2402265f));
+		p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.6931472f));
+		p = _mm_add_ps(_mm_mul_ps(p, f), one);
+
+		__m128i exponent = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(whole), _mm_set1_epi32(127)), 23);
+		return _mm_mul_ps(p, _mm_castsi128_ps(exponent));
+	}
+
+	inline float Luminance(const glm::vec3& color) {
+		return glm::dot(color, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+	}
+
+	inline long long Microseconds(std::chrono::high_resolution_clock::time_point start, std::chrono::high_resolution_clock::time_point stop) {
+		return std::chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+	}
+}
+
+Denoiser::Denoiser(uint32_t renderWidth, uint32_t renderHeight) : width(renderWidth), height(renderHeight) {
+	uint32_t numPixels = width * height;
+
+	for (ColorPlanes& planes : colors) {
+		planes.r = std::vector<float>(numPixels);
+		planes.g = std::vector<float>(numPixels);
+		planes.b = std::vector<float>(numPixels);
+		planes.variance = std::vector<float>(numPixels);
+	}
+	normalX = std::vector<float>(numPixels);
+	normalY = std::vector<float>(numPixels);
+	normalZ = std::vector<float>(numPixels);
+	depth = std::vector<float>(numPixels);
+	albedo = std::vector<glm::vec3>(numPixels);
+
+	for (History* history : { &lastHistory, &nextHistory }) {
+		history->lighting = std::vector<glm::vec3>(numPixels);
+		history->position = std::vector<glm::vec3>(numPixels);
+		history->normal = std::vector<glm::vec3>(numPixels);
+		history->length = std::vector<float>(numPixels, 0.0f);
+	}
+}
+
+void Denoiser::ResetHistory() {
+	historyValid = false;
+}
+
+void Denoiser::Denoise(const glm::vec3* color, const PixelFeatures* features, const glm::mat4& viewProj, glm::vec3* output) {
+	auto loadStart = std::chrono::high_resolution_clock::now();
+	JobSystem::ParallelFor(height, DENOISER_ROW_GRAIN, [this, color, features](uint32_t begin, uint32_t end) {
+		LoadRows(begin, end, color, features);
+	});
+
+	auto temporalStart = std::chrono::high_resolution_clock::now();
+	if (temporal) {
+		JobSystem::ParallelFor(height, DENOISER_ROW_GRAIN, [this, features](uint32_t begin, uint32_t end) {
+			ReprojectRows(begin, end, features);
+		});
+		std::swap(lastHistory, nextHistory);
+		lastViewProj = viewProj;
+		historyValid = true;
+	}
+	else {
+		historyValid = false;
+	}
+
+	auto varianceStart = std::chrono::high_resolution_clock::now();
+	JobSystem::ParallelFor(height, DENOISER_ROW_GRAIN, [this](uint32_t begin, uint32_t end) {
+		VarianceRows(begin, end);
+	});
+
+	auto filterStart = std::chrono::high_resolution_clock::now();
+	uint32_t source = 0;
+	for (uint32_t i = 0; i < DENOISER_ITERATIONS; i += 1) {
+		uint32_t step = 1 << i;
+		JobSystem::ParallelFor(height, DENOISER_ROW_GRAIN, [this, step, source](uint32_t begin, uint32_t end) {
+			FilterRows(begin, end, step, source);
+		});
+		source = 1 - source;
+	}
+
+	auto resolveStart = std::chrono::high_resolution_clock::now();
+	JobSystem::ParallelFor(height, DENOISER_ROW_GRAIN, [this, source, output](uint32_t begin, uint32_t end) {
+		ResolveRows(begin, end, source, output);
+	});
+	auto stop = std::chrono::high_resolution_clock::now();
+
+	loadTime = Microseconds(loadStart, temporalStart);
+	temporalTime = Microseconds(temporalStart, varianceStart);
+	varianceTime = Microseconds(varianceStart, filterStart);
+	filterTime = Microseconds(filterStart, resolveStart);
+	resolveTime = Microseconds(resolveStart, stop);
+}
+
+void Denoiser::LoadRows(uint32_t begin, uint32_t end, const glm::vec3* color, const PixelFeatures* features) {
+	ColorPlanes& planes = colors[0];
+
+	for (uint32_t i = begin * width; i < end * width; i += 1) {
+		const PixelFeatures& f = features[i];
+
+		// Lighting without the surface color, put back on in ResolveRows
+		albedo[i] = glm::max(f.albedo, glm::vec3(DENOISER_MIN_ALBEDO));
+		glm::vec3 lighting = color[i] / albedo[i];
+		planes.r[i] = lighting.r;
+		planes.g[i] = lighting.g;
+		planes.b[i] = lighting.b;
+
+		normalX[i] = f.normal.x;
+		normalY[i] = f.normal.y;
+		normalZ[i] = f.normal.z;
+		depth[i] = f.depth;
+	}
+}
+
+void Denoiser::ReprojectRows(uint32_t begin, uint32_t end, const PixelFeatures* features) {
+	ColorPlanes& planes = colors[0];
+
+	for (uint32_t y = begin; y < end; y += 1) {
+		for (uint32_t x = 0; x < width; x += 1) {
+			uint32_t i = y * width + x;
+			const PixelFeatures& f = features[i];
+			glm::vec3 lighting = glm::vec3(planes.r[i], planes.g[i], planes.b[i]);
+
+			// Misses have nothing worth keeping
+			bool missed = f.depth >= RAY_MAX_DIST;
+			nextHistory.position[i] = f.position;
+			nextHistory.normal[i] = f.normal;
+			nextHistory.length[i] = missed ? 0.0f : 1.0f;
+
+			if (!historyValid || missed) {
+				nextHistory.lighting[i] = lighting;
+				continue;
+			}
+
+			// Where this surface was on screen last frame. PrimaryRay puts pixel x at ndc 2x/width - 1.
+			bool reprojected = false;
+			glm::vec4 clip = lastViewProj * glm::vec4(f.position, 1.0f);
+			if (clip.w > 0.0f) {
+				glm::vec2 lastPixel = (glm::vec2(clip) / clip.w * 0.5f + 0.5f) * glm::vec2(width, height);
+				int32_t lastX = static_cast<int32_t>(std::floor(lastPixel.x + 0.5f));
+				int32_t lastY = static_cast<int32_t>(std::floor(lastPixel.y + 0.5f));
+
+				if (lastX >= 0 && lastY >= 0 && lastX < static_cast<int32_t>(width) && lastY < static_cast<int32_t>(height)) {
+					uint32_t last = lastY * width + lastX;
+					reprojected =
+						lastHistory.length[last] > 0.0f &&
+						glm::length(lastHistory.position[last] - f.position) < DENOISER_REPROJECT_DISTANCE * f.depth &&
+						glm::dot(lastHistory.normal[last], f.normal) > DENOISER_REPROJECT_NORMAL;
+
+					if (reprojected) {
+						// Running average until the history is long enough, then an exponential one
+						float length = lastHistory.length[last] + 1.0f;
+						float blend = std::fmax(1.0f / length, DENOISER_MIN_BLEND);
+						lighting = glm::mix(lastHistory.lighting[last], lighting, blend);
+						nextHistory.length[i] = length;
+					}
+				}
+			}
+
+			nextHistory.lighting[i] = lighting;
+			planes.r[i] = lighting.r;
+			planes.g[i] = lighting.g;
+			planes.b[i] = lighting.b;
+		}
+	}
+}
+
+void Denoiser::VarianceRows(uint32_t begin, uint32_t end) {
+	ColorPlanes& planes = colors[0];
+
+	for (uint32_t y = begin; y < end; y += 1) {
+		for (uint32_t x = 0; x < width; x += 1) {
+			float sum = 0.0f;
+			float squaredSum = 0.0f;
+			float count = 0.0f;
+
+			for (uint32_t sy = (y > 0 ? y - 1 : y); sy <= y + 1 && sy < height; sy += 1) {
+				for (uint32_t sx = (x > 0 ? x - 1 : x); sx <= x + 1 && sx < width; sx += 1) {
+					uint32_t q = sy * width + sx;
+					float luminance = Luminance(glm::vec3(planes.r[q], planes.g[q], planes.b[q]));
+					sum += luminance;
+					squaredSum += luminance * luminance;
+					count += 1.0f;
+				}
+			}
+
+			float mean = sum / count;
+			planes.variance[y * width + x] = std::fmax(0.0f, squaredSum / count - mean * mean);
+		}
+	}
+}
+
+void Denoiser::FilterRows(uint32_t begin, uint32_t end, uint32_t step, uint32_t source) {
+	// Groups of 4 only where every tap of every lane is on screen, the edges go one pixel at a time
+	uint32_t reach = 2 * step;
+	uint32_t simdBegin = reach;
+	uint32_t simdEnd = simd && width > 2 * reach + 4 ? width - reach - 3 : simdBegin;
+
+	for (uint32_t y = begin; y < end; y += 1) {
+		uint32_t x = 0;
+		for (; x < simdBegin && x < width; x += 1) {
+			FilterPixel(x, y, step, source);
+		}
+		for (; x < simdEnd; x += 4) {
+			FilterPixels4(x, y, step, source);
+		}
+		for (; x < width; x += 1) {
+			FilterPixel(x, y, step, source);
+		}
+	}
+}
+
+void Denoiser::FilterPixel(uint32_t x, uint32_t y, uint32_t step, uint32_t source) {
+	const float invSigmaNormal2 = 1.0f / (DENOISER_SIGMA_NORMAL * DENOISER_SIGMA_NORMAL);
+	const float invSigmaDepth2 = 1.0f / (DENOISER_SIGMA_DEPTH * DENOISER_SIGMA_DEPTH);
+
+	const ColorPlanes& in = colors[source];
+	ColorPlanes& out = colors[1 - source];
+
+	uint32_t p = y * width + x;
+	glm::vec3 color = glm::vec3(in.r[p], in.g[p], in.b[p]);
+	float luminance = Luminance(color);
+	float invSigmaLuminance = 1.0f / (DENOISER_SIGMA_LUMINANCE * std::sqrt(in.variance[p]) + SMALL_NUMBER);
+	glm::vec3 normal = glm::vec3(normalX[p], normalY[p], normalZ[p]);
+	float invDepth = 1.0f / std::fmax(depth[p], SMALL_NUMBER);
+
+	glm::vec3 sum = glm::vec3(0.0f);
+	float varianceSum = 0.0f;
+	float weightSum = 0.0f;
+	for (int32_t ky = -2; ky <= 2; ky += 1) {
+		int32_t sy = static_cast<int32_t>(y) + ky * static_cast<int32_t>(step);
+		if (sy < 0 || sy >= static_cast<int32_t>(height)) {
+			continue;
+		}
+
+		for (int32_t kx = -2; kx <= 2; kx += 1) {
+			int32_t sx = static_cast<int32_t>(x) + kx * static_cast<int32_t>(step);
+			if (sx < 0 || sx >= static_cast<int32_t>(width)) {
+				continue;
+			}
+
+			uint32_t q = sy * width + sx;
+			glm::vec3 sampleColor = glm::vec3(in.r[q], in.g[q], in.b[q]);
+			glm::vec3 normalDelta = glm::vec3(normalX[q], normalY[q], normalZ[q]) - normal;
+			float depthDelta = (depth[q] - depth[p]) * invDepth;
+
+			float weight = kernel[kx + 2] * kernel[ky + 2] * std::exp(-(
+				std::fabs(Luminance(sampleColor) - luminance) * invSigmaLuminance +
+				glm::dot(normalDelta, normalDelta) * invSigmaNormal2 +
+				depthDelta * depthDelta * invSigmaDepth2
+			));
+			sum += weight * sampleColor;
+			varianceSum += weight * weight * in.variance[q];
+			weightSum += weight;
+		}
+	}
+
+	// The center tap always has full weight, so weightSum is never 0
+	glm::vec3 filtered = sum / weightSum;
+	out.r[p] = filtered.r;
+	out.g[p] = filtered.g;
+	out.b[p] = filtered.b;
+	out.variance[p] = varianceSum / (weightSum * weightSum);
+}
+
+void Denoiser::FilterPixels4(uint32_t x, uint32_t y, uint32_t step, uint32_t source) {
+	const __m128 invSigmaNormal = _mm_set1_ps(1.0f / (DENOISER_SIGMA_NORMAL * DENOISER_SIGMA_NORMAL));
+	const __m128 invSigmaDepth = _mm_set1_ps(1.0f / (DENOISER_SIGMA_DEPTH * DENOISER_SIGMA_DEPTH));
+	const __m128 lumR = _mm_set1_ps(0.2126f);
+	const __m128 lumG = _mm_set1_ps(0.7152f);
+	const __m128 lumB = _mm_set1_ps(0.0722f);
+	const __m128 signMask = _mm_set1_ps(-0.0f);
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 zero = _mm_setzero_ps();
+
+	const ColorPlanes& in = colors[source];
+	ColorPlanes& out = colors[1 - source];
+
+	uint32_t p = y * width + x;
+	__m128 luminance = _mm_add_ps(_mm_add_ps(
+		_mm_mul_ps(_mm_loadu_ps(&in.r[p]), lumR),
+		_mm_mul_ps(_mm_loadu_ps(&in.g[p]), lumG)),
+		_mm_mul_ps(_mm_loadu_ps(&in.b[p]), lumB));
+	__m128 invSigmaLuminance = _mm_div_ps(one, _mm_add_ps(
+		_mm_mul_ps(_mm_set1_ps(DENOISER_SIGMA_LUMINANCE), _mm_sqrt_ps(_mm_loadu_ps(&in.variance[p]))),
+		_mm_set1_ps(SMALL_NUMBER)));
+	__m128 nx = _mm_loadu_ps(&normalX[p]);
+	__m128 ny = _mm_loadu_ps(&normalY[p]);
+	__m128 nz = _mm_loadu_ps(&normalZ[p]);
+	__m128 z = _mm_loadu_ps(&depth[p]);
+	__m128 invZ = _mm_div_ps(one, _mm_max_ps(z, _mm_set1_ps(SMALL_NUMBER)));
+
+	__m128 sumR = zero; __m128 sumG = zero; __m128 sumB = zero;
+	__m128 varianceSum = zero;
+	__m128 weightSum = zero;
+	for (int32_t ky = -2; ky <= 2; ky += 1) {
+		int32_t sy = static_cast<int32_t>(y) + ky * static_cast<int32_t>(step);
+		if (sy < 0 || sy >= static_cast<int32_t>(height)) {
+			continue;
+		}
+
+		for (int32_t kx = -2; kx <= 2; kx += 1) {
+			uint32_t q = sy * width + x + kx * static_cast<int32_t>(step);
+
+			__m128 sr = _mm_loadu_ps(&in.r[q]);
+			__m128 sg = _mm_loadu_ps(&in.g[q]);
+			__m128 sb = _mm_loadu_ps(&in.b[q]);
+
+			__m128 sampleLuminance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(sr, lumR), _mm_mul_ps(sg, lumG)), _mm_mul_ps(sb, lumB));
+			__m128 luminanceDistance = _mm_andnot_ps(signMask, _mm_sub_ps(sampleLuminance, luminance));
+
+			__m128 dnx = _mm_sub_ps(_mm_loadu_ps(&normalX[q]), nx);
+			__m128 dny = _mm_sub_ps(_mm_loadu_ps(&normalY[q]), ny);
+			__m128 dnz = _mm_sub_ps(_mm_loadu_ps(&normalZ[q]), nz);
+			__m128 normalDistance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dnx, dnx), _mm_mul_ps(dny, dny)), _mm_mul_ps(dnz, dnz));
+
+			__m128 dz = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(&depth[q]), z), invZ);
+			__m128 depthDistance = _mm_mul_ps(dz, dz);
+
+			__m128 exponent = _mm_add_ps(_mm_add_ps(
+				_mm_mul_ps(luminanceDistance, invSigmaLuminance),
+				_mm_mul_ps(normalDistance, invSigmaNormal)),
+				_mm_mul_ps(depthDistance, invSigmaDepth));
+			__m128 weight = _mm_mul_ps(_mm_set1_ps(kernel[kx + 2] * kernel[ky + 2]), FastExp(_mm_sub_ps(zero, exponent)));
+
+			sumR = _mm_add_ps(sumR, _mm_mul_ps(weight, sr));
+			sumG = _mm_add_ps(sumG, _mm_mul_ps(weight, sg));
+			sumB = _mm_add_ps(sumB, _mm_mul_ps(weight, sb));
+			varianceSum = _mm_add_ps(varianceSum, _mm_mul_ps(_mm_mul_ps(weight, weight), _mm_loadu_ps(&in.variance[q])));
+			weightSum = _mm_add_ps(weightSum, weight);
+		}
+	}
+
+	__m128 invWeightSum = _mm_div_ps(one, weightSum);
+	_mm_storeu_ps(&out.r[p], _mm_mul_ps(sumR, invWeightSum));
+	_mm_storeu_ps(&out.g[p], _mm_mul_ps(sumG, invWeightSum));
+	_mm_storeu_ps(&out.b[p], _mm_mul_ps(sumB, invWeightSum));
+	_mm_storeu_ps(&out.variance[p], _mm_mul_ps(varianceSum, _mm_mul_ps(invWeightSum, invWeightSum)));
+}
+
+void Denoiser::ResolveRows(uint32_t begin, uint32_t end, uint32_t source, glm::vec3* output) const {
+	const ColorPlanes& planes = colors[source];
+
+	for (uint32_t i = begin * width; i < end * width; i += 1) {
+		glm::vec3 lighting = glm::vec3(planes.r[i], planes.g[i], planes.b[i]);
+		output[i] = glm::clamp(lighting * albedo[i], glm::vec3(0.0f), glm::vec3(1.0f));
+	}
+}
@@ -0,0 +1,159 @@
+#include "FrustumCuller.h"
+
+#include "JobSystem.h"
+#include "Bounds.h"
+
+#include "glm/gtc/matrix_transform.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <random>
+
+namespace {
+	// What RendererSystem::ShouldFrustumCull did for one box
+	inline bool ScalarVisible(const glm::vec3& minPoint, const glm::vec3& maxPoint, const glm::vec4* planes) {
+		int success = 0;
+		for (int j = 0; j < 6; j++) {
+			float val = fmax(minPoint.x * planes[j].x, maxPoint.x * planes[j].x)
+				+ fmax(minPoint.y * planes[j].y, maxPoint.y * planes[j].y)
+				+ fmax(minPoint.z * planes[j].z, maxPoint.z * planes[j].z)
+				+ planes[j].w;
+			success += (val > 0);
+		}
+		return success == 6;
+	}
+
+	// World box around the 8 corners of a local box, the way Bounds::Min and Max find it
+	inline void CornerBounds(const glm::vec3& localMin, const glm::vec3& localMax, const glm::mat4& model, glm::vec3& worldMin, glm::vec3& worldMax) {
+		worldMin = glm::vec3(INFINITY);
+		worldMax = glm::vec3(-INFINITY);
+		for (uint32_t corner = 0; corner < 8; corner += 1) {
+			glm::vec4 p = model * glm::vec4(
+				(corner & 1) ? localMax.x : localMin.x,
+				(corner & 2) ? localMax.y : localMin.y,
+				(corner & 4) ? localMax.z : localMin.z,
+				1.0f);
+			worldMin = glm::min(worldMin, glm::vec3(p));
+			worldMax = glm::max(worldMax, glm::vec3(p));
+		}
+	}
+}
+
+void FrustumCuller::Resize(uint32_t numBoxes) {
+	count = numBoxes;
+
+	size_t padded = (static_cast<size_t>(count) + 3) & ~static_cast<size_t>(3);
+	minX.resize(padded, 0.0f); minY.resize(padded, 0.0f); minZ.resize(padded, 0.0f);
+	maxX.resize(padded, 0.0f); maxY.resize(padded, 0.0f); maxZ.resize(padded, 0.0f);
+	visible.resize(padded, 0);
+}
+
+void FrustumCuller::Cull(const glm::vec4* planes) {
+	auto startTime = std::chrono::high_resolution_clock::now();
+
+	uint32_t numGroups = static_cast<uint32_t>(visible.size() / 4);
+	JobSystem::ParallelFor(numGroups, FRUSTUM_CULL_CHUNK_BOXES / 4, [this, planes](uint32_t begin, uint32_t end) {
+		CullGroups(planes, begin, end);
+	});
+
+	auto endTime = std::chrono::high_resolution_clock::now();
+	cullTime = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime).count();
+}
+
+void FrustumCuller::CullGroups(const glm::vec4* planes, uint32_t begin, uint32_t end) {
+	Planes4 splat;
+	SplatPlanes(planes, splat);
+
+	for (uint32_t group = begin; group < end; group += 1) {
+		uint32_t box = group * 4;
+		int mask = Visible4(splat, minX.data() + box, minY.data() + box, minZ.data() + box, maxX.data() + box, maxY.data() + box, maxZ.data() + box);
+		for (uint32_t lane = 0; lane < 4; lane += 1) {
+			visible[box + lane] = (box + lane < count) ? static_cast<uint8_t>((mask >> lane) & 1) : 0;
+		}
+	}
+}
+
+void FrustumCuller::Benchmark(const glm::vec4* planes, const glm::vec3& eye, uint32_t iterations) {
+	fprintf(stderr, "\nCPU Frustum Culling -- %u threads, %u iterations\n", JobSystem::NumThreads(), iterations);
+
+	std::mt19937 rng(11);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+	const uint32_t counts[3] = { 10000, 100000, 1000000 };
+	for (uint32_t numBoxes : counts) {
+		// Meshes up to 4 across, turned every which way, within 200 of the camera
+		std::vector<glm::vec3> localMin(numBoxes), localMax(numBoxes);
+		std::vector<glm::mat4> models(numBoxes);
+		for (uint32_t i = 0; i < numBoxes; i += 1) {
+			glm::vec3 extent = glm::vec3(unit(rng), unit(rng), unit(rng)) * 2.0f + 0.05f;
+			localMin[i] = -extent;
+			localMax[i] = extent;
+			glm::vec3 axis = glm::vec3(unit(rng), unit(rng), unit(rng)) + 0.01f;
+			glm::vec3 position = eye + (glm::vec3(unit(rng), unit(rng), unit(rng)) * 2.0f - 1.0f) * 200.0f;
+			models[i] = glm::rotate(glm::translate(glm::mat4(1.0f), position), unit(rng) * 6.2831853f, glm::normalize(axis));
+		}
+
+		FrustumCuller culler;
+		culler.Resize(numBoxes);
+		std::vector<glm::vec3> worldMin(numBoxes), worldMax(numBoxes);
+		std::vector<uint8_t> scalarVisible(numBoxes);
+
+		long long cornerTime = 0;
+		long long arvoTime = 0;
+		long long scalarTime = 0;
+		long long singleTime = 0;
+		long long parallelTime = 0;
+		for (uint32_t i = 0; i < iterations; i += 1) {
+			auto start = std::chrono::high_resolution_clock::now();
+			for (uint32_t box = 0; box < numBoxes; box += 1) {
+				CornerBounds(localMin[box], localMax[box], models[box], worldMin[box], worldMax[box]);
+			}
+			auto transformed = std::chrono::high_resolution_clock::now();
+			for (uint32_t box = 0; box < numBoxes; box += 1) {
+				scalarVisible[box] = ScalarVisible(worldMin[box], worldMax[box], planes) ? 1 : 0;
+			}
+			auto scalarDone = std::chrono::high_resolution_clock::now();
+
+			for (uint32_t box = 0; box < numBoxes; box += 1) {
+				culler.SetBounds(box, worldMin[box], worldMax[box]);
+			}
+			auto singleStart = std::chrono::high_resolution_clock::now();
+			culler.CullGroups(planes, 0, static_cast<uint32_t>(culler.visible.size() / 4));
+			auto singleDone = std::chrono::high_resolution_clock::now();
+			culler.Cull(planes);
+
+			// Arvo's boxes come out the same up to rounding, then whether they change what's visible
+			auto arvoStart = std::chrono::high_resolution_clock::now();
+			for (uint32_t box = 0; box < numBoxes; box += 1) {
+				Bounds(localMin[box].x, localMin[box].y, localMin[box].z, localMax[box].x, localMax[box].y, localMax[box].z).Transform(models[box], worldMin[box], worldMax[box]);
+			}
+			auto arvoDone = std::chrono::high_resolution_clock::now();
+			arvoTime += std::chrono::duration_cast<std::chrono::microseconds>(arvoDone - arvoStart).count();
+
+			cornerTime += std::chrono::duration_cast<std::chrono::microseconds>(transformed - start).count();
+			scalarTime += std::chrono::duration_cast<std::chrono::microseconds>(scalarDone - transformed).count();
+			singleTime += std::chrono::duration_cast<std::chrono::microseconds>(singleDone - singleStart).count();
+			parallelTime += culler.cullTime;
+		}
+
+		uint32_t numVisible = 0;
+		uint32_t different = 0;
+		for (uint32_t box = 0; box < numBoxes; box += 1) {
+			numVisible += scalarVisible[box];
+			different += (culler.Visible(box) ? 1 : 0) != scalarVisible[box] ? 1 : 0;
+		}
+
+		uint32_t arvoDifferent = 0;
+		for (uint32_t box = 0; box < numBoxes; box += 1) {
+			arvoDifferent += (ScalarVisible(worldMin[box], worldMax[box], planes) ? 1 : 0) != scalarVisible[box] ? 1 : 0;
+		}
+
+		fprintf(stderr, "CPU Frustum Culling -- %u boxes, %u visible: Corners (us): %.1f, one at a time (us): %.1f, SSE (us): %.1f, SSE on every thread (us): %.1f, %u different\n",
+			numBoxes, numVisible, cornerTime / static_cast<float>(iterations), scalarTime / static_cast<float>(iterations),
+			singleTime / static_cast<float>(iterations), parallelTime / static_cast<float>(iterations), different);
+		fprintf(stderr, "CPU Frustum Culling -- Arvo's bounds (us): %.1f, %u visible different from corners\n",
+			arvoTime / static_cast<float>(iterations), arvoDifferent);
+	}
+}
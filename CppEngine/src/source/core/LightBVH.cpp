@@ -0,0 +1,437 @@
+#include "LightBVH.h"
+
+#include "JobSystem.h"
+
+#include "glm/gtc/constants.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+	inline float Luminance(const glm::vec3& color) {
+		return glm::dot(color, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+	}
+
+	inline float SafeSqrt(float x) {
+		return std::sqrt(std::fmax(x, 0.0f));
+	}
+
+	// cos(a - b) and sin(a - b), with a - b clamped to at least 0
+	inline float CosSubClamped(float sinA, float cosA, float sinB, float cosB) {
+		return cosA > cosB ? 1.0f : cosA * cosB + sinA * sinB;
+	}
+
+	inline float SinSubClamped(float sinA, float cosA, float sinB, float cosB) {
+		return cosA > cosB ? 0.0f : sinA * cosB - cosA * sinB;
+	}
+
+	// Spreads the low 10 bits out to every third bit
+	inline uint32_t ExpandBits(uint32_t v) {
+		v = (v * 0x00010001u) & 0xFF0000FFu;
+		v = (v * 0x00000101u) & 0x0F00F00Fu;
+		v = (v * 0x00000011u) & 0xC30C30C3u;
+		v = (v * 0x00000005u) & 0x49249249u;
+		return v;
+	}
+
+	inline uint32_t MortonCode(const glm::vec3& unit) {
+		glm::uvec3 cell = glm::uvec3(glm::clamp(unit, glm::vec3(0.0f), glm::vec3(1.0f)) * 1023.0f);
+		return (ExpandBits(cell.x) << 2) | (ExpandBits(cell.y) << 1) | ExpandBits(cell.z);
+	}
+
+	// The same node always picks the same representative, so refits don't flicker
+	inline float NodeRandom(uint32_t node) {
+		uint32_t x = node * 0x9E3779B9u;
+		x ^= x >> 16;
+		x *= 0x7FEB352D;
+		x ^= x >> 15;
+		x *= 0x846CA68B;
+		x ^= x >> 16;
+		return (x >> 8) * (1.0f / 16777216.0f);
+	}
+
+	// Rotates v about the unit axis k, Rodrigues' formula
+	inline glm::vec3 Rotate(const glm::vec3& v, const glm::vec3& k, float angle) {
+		float c = std::cos(angle);
+		float s = std::sin(angle);
+		return v * c + glm::cross(k, v) * s + k * glm::dot(k, v) * (1.0f - c);
+	}
+
+	// Smallest cone holding both, PBRT v4's DirectionCone::Union
+	inline void UnionCones(const LightBVHNode& a, const LightBVHNode& b, glm::vec3& axis, float& cosTheta) {
+		const float pi = glm::pi<float>();
+		float thetaA = std::acos(glm::clamp(a.cosThetaO, -1.0f, 1.0f));
+		float thetaB = std::acos(glm::clamp(b.cosThetaO, -1.0f, 1.0f));
+		float thetaD = std::acos(glm::clamp(glm::dot(a.axis, b.axis), -1.0f, 1.0f));
+
+		// One already holds the other
+		if (std::fmin(thetaD + thetaB, pi) <= thetaA) {
+			axis = a.axis;
+			cosTheta = a.cosThetaO;
+			return;
+		}
+		if (std::fmin(thetaD + thetaA, pi) <= thetaB) {
+			axis = b.axis;
+			cosTheta = b.cosThetaO;
+			return;
+		}
+
+		float thetaO = 0.5f * (thetaA + thetaD + thetaB);
+		glm::vec3 rotationAxis = glm::cross(a.axis, b.axis);
+		if (thetaO >= pi || glm::dot(rotationAxis, rotationAxis) < REALLY_SMALL_NUMBER) {
+			axis = a.axis;
+			cosTheta = -1.0f;
+			return;
+		}
+
+		// a's axis turned towards b's until the cone reaches both far edges
+		axis = glm::normalize(Rotate(a.axis, glm::normalize(rotationAxis), thetaO - thetaA));
+		cosTheta = std::cos(thetaO);
+	}
+}
+
+void LightBVH::Build(const PointLightToGPU* lights, uint32_t count, bool parallel) {
+	_lights = lights;
+	_numLights = count;
+	_parallel = parallel;
+
+	_nodes = std::vector<LightBVHNode>(count > 0 ? 2 * count - 1 : 0);
+	_keys = std::vector<uint64_t>(count);
+	_leafOfLight = std::vector<uint32_t>(count);
+	_subtrees.clear();
+	_topNodes.clear();
+	_builtCost = 0;
+
+	if (count == 0) {
+		return;
+	}
+
+	glm::vec3 minPosition = glm::vec3(INFINITY);
+	glm::vec3 maxPosition = glm::vec3(-INFINITY);
+	for (uint32_t i = 0; i < count; i += 1) {
+		minPosition = glm::min(minPosition, glm::vec3(lights[i].position_and_radius));
+		maxPosition = glm::max(maxPosition, glm::vec3(lights[i].position_and_radius));
+	}
+	glm::vec3 extent = glm::max(maxPosition - minPosition, glm::vec3(REALLY_SMALL_NUMBER));
+
+	uint32_t grainSize = parallel ? LIGHT_BVH_SUBTREE_SIZE : count;
+	JobSystem::ParallelFor(count, grainSize, [this, &minPosition, &extent](uint32_t begin, uint32_t end) {
+		for (uint32_t i = begin; i < end; i += 1) {
+			uint32_t code = MortonCode((glm::vec3(_lights[i].position_and_radius) - minPosition) / extent);
+			_keys[i] = (static_cast<uint64_t>(code) << 32) | i;
+		}
+	});
+	SortLights(parallel);
+
+	// Split the top of the tree here until every range is short enough for one thread
+	std::vector<Subtree> pending;
+	pending.push_back({ 0, 0, count, NO_HIT });
+	while (!pending.empty()) {
+		Subtree subtree = pending.back();
+		pending.pop_back();
+
+		if (!parallel || subtree.end - subtree.begin <= LIGHT_BVH_SUBTREE_SIZE) {
+			_subtrees.push_back(subtree);
+			continue;
+		}
+
+		uint32_t split = FindSplit(subtree.begin, subtree.end);
+		uint32_t second = subtree.node + 2 * (split - subtree.begin);
+
+		LightBVHNode& node = _nodes[subtree.node];
+		node.offset = second;
+		node.numLights = subtree.end - subtree.begin;
+		node.parent = subtree.parent;
+		_topNodes.push_back(subtree.node);
+
+		pending.push_back({ subtree.node + 1, subtree.begin, split, subtree.node });
+		pending.push_back({ second, split, subtree.end, subtree.node });
+	}
+
+	JobSystem::ParallelFor(static_cast<uint32_t>(_subtrees.size()), 1, [this](uint32_t begin, uint32_t end) {
+		for (uint32_t i = begin; i < end; i += 1) {
+			BuildSubtree(_subtrees[i].node, _subtrees[i].begin, _subtrees[i].end, _subtrees[i].parent);
+		}
+	});
+
+	// Nodes were split after their parents, so going backwards sums children up first
+	for (auto node = _topNodes.rbegin(); node != _topNodes.rend(); ++node) {
+		SetInterior(*node);
+	}
+
+	_builtCost = Cost();
+}
+
+void LightBVH::SortLights(bool parallel) {
+	if (!parallel || _numLights <= LIGHT_BVH_SUBTREE_SIZE) {
+		std::sort(_keys.begin(), _keys.end());
+		return;
+	}
+
+	// Sort chunks on their own, then merge neighbouring runs in rounds until one is left
+	uint32_t numChunks = std::min(4 * JobSystem::NumThreads(), (_numLights + LIGHT_BVH_SUBTREE_SIZE - 1) / LIGHT_BVH_SUBTREE_SIZE);
+	uint32_t chunkSize = (_numLights + numChunks - 1) / numChunks;
+
+	JobSystem::ParallelFor(numChunks, 1, [this, chunkSize](uint32_t begin, uint32_t end) {
+		for (uint32_t chunk = begin; chunk < end; chunk += 1) {
+			uint32_t first = std::min(_numLights, chunk * chunkSize);
+			uint32_t last = std::min(_numLights, first + chunkSize);
+			std::sort(_keys.begin() + first, _keys.begin() + last);
+		}
+	});
+
+	for (uint32_t runSize = chunkSize; runSize < _numLights; runSize *= 2) {
+		uint32_t numMerges = (_numLights + 2 * runSize - 1) / (2 * runSize);
+		JobSystem::ParallelFor(numMerges, 1, [this, runSize](uint32_t begin, uint32_t end) {
+			for (uint32_t merge = begin; merge < end; merge += 1) {
+				uint32_t first = merge * 2 * runSize;
+				uint32_t middle = std::min(_numLights, first + runSize);
+				uint32_t last = std::min(_numLights, first + 2 * runSize);
+				std::inplace_merge(_keys.begin() + first, _keys.begin() + middle, _keys.begin() + last);
+			}
+		});
+	}
+}
+
+uint32_t LightBVH::FindSplit(uint32_t begin, uint32_t end) const {
+	uint32_t firstCode = static_cast<uint32_t>(_keys[begin] >> 32);
+	uint32_t lastCode = static_cast<uint32_t>(_keys[end - 1] >> 32);
+
+	// Lights in the same Morton cell are split down the middle
+	if (firstCode == lastCode) {
+		return (begin + end) / 2;
+	}
+
+	uint32_t bit = 31;
+	while ((((firstCode ^ lastCode) >> bit) & 1) == 0) {
+		bit -= 1;
+	}
+
+	// Everything shares the bits above, so the range is sorted into 0s then 1s at this one
+	auto split = std::partition_point(_keys.begin() + begin, _keys.begin() + end, [bit](uint64_t key) {
+		return ((key >> (32 + bit)) & 1) == 0;
+	});
+	return static_cast<uint32_t>(split - _keys.begin());
+}
+
+void LightBVH::BuildSubtree(uint32_t node, uint32_t begin, uint32_t end, uint32_t parent) {
+	_nodes[node].parent = parent;
+
+	if (end - begin == 1) {
+		SetLeaf(node, static_cast<uint32_t>(_keys[begin] & 0xFFFFFFFF));
+		return;
+	}
+
+	uint32_t split = FindSplit(begin, end);
+	uint32_t second = node + 2 * (split - begin);
+	_nodes[node].offset = second;
+	_nodes[node].numLights = end - begin;
+
+	BuildSubtree(node + 1, begin, split, node);
+	BuildSubtree(second, split, end, node);
+	SetInterior(node);
+}
+
+void LightBVH::SetLeaf(uint32_t node, uint32_t light) {
+	const PointLightToGPU& p = _lights[light];
+	LightBVHNode& leaf = _nodes[node];
+
+	leaf.boundsMin = glm::vec3(p.position_and_radius);
+	leaf.boundsMax = glm::vec3(p.position_and_radius);
+	leaf.intensity = glm::vec3(p.color_and_luminance) * p.color_and_luminance.w;
+	leaf.luminance = p.color_and_luminance.w;
+	leaf.power = Luminance(leaf.intensity);
+	leaf.axis = glm::vec3(0.0f, 0.0f, 1.0f);
+	leaf.cosThetaO = -1.0f;
+	leaf.cosThetaE = 0.0f;
+	leaf.representative = light;
+	leaf.numLights = 1;
+	leaf.offset = light;
+
+	_leafOfLight[light] = node;
+}
+
+void LightBVH::SetInterior(uint32_t node) {
+	LightBVHNode& n = _nodes[node];
+	const LightBVHNode& a = _nodes[node + 1];
+	const LightBVHNode& b = _nodes[n.offset];
+
+	n.boundsMin = glm::min(a.boundsMin, b.boundsMin);
+	n.boundsMax = glm::max(a.boundsMax, b.boundsMax);
+	n.intensity = a.intensity + b.intensity;
+	n.luminance = a.luminance + b.luminance;
+	n.power = a.power + b.power;
+	UnionCones(a, b, n.axis, n.cosThetaO);
+	n.cosThetaE = std::fmin(a.cosThetaE, b.cosThetaE);
+	n.representative = NodeRandom(node) * n.power < a.power ? a.representative : b.representative;
+}
+
+void LightBVH::Refit() {
+	JobSystem::ParallelFor(static_cast<uint32_t>(_subtrees.size()), 1, [this](uint32_t begin, uint32_t end) {
+		for (uint32_t i = begin; i < end; i += 1) {
+			RefitSubtree(_subtrees[i]);
+		}
+	});
+
+	for (auto node = _topNodes.rbegin(); node != _topNodes.rend(); ++node) {
+		SetInterior(*node);
+	}
+}
+
+void LightBVH::RefitSubtree(const Subtree& subtree) {
+	// Children always come after their parent, so backwards is bottom up
+	uint32_t end = subtree.node + 2 * (subtree.end - subtree.begin) - 1;
+	for (uint32_t node = end; node-- > subtree.node;) {
+		if (_nodes[node].numLights == 1) {
+			SetLeaf(node, _nodes[node].offset);
+		}
+		else {
+			SetInterior(node);
+		}
+	}
+}
+
+bool LightBVH::Update() {
+	Refit();
+	if (Cost() <= LIGHT_BVH_REBUILD_RATIO * _builtCost) {
+		return false;
+	}
+
+	Build(_lights, _numLights, _parallel);
+	return true;
+}
+
+float LightBVH::Cost() const {
+	double cost = 0.0;
+	for (const LightBVHNode& node : _nodes) {
+		glm::vec3 d = node.boundsMax - node.boundsMin;
+		cost += 2.0 * (d.x * d.y + d.y * d.z + d.z * d.x);
+	}
+	return static_cast<float>(cost);
+}
+
+float LightBVH::Importance(const LightBVHNode& node, const glm::vec3& point, const glm::vec3& normal) const {
+	glm::vec3 center = 0.5f * (node.boundsMin + node.boundsMax);
+	float radius = 0.5f * glm::length(node.boundsMax - node.boundsMin);
+	glm::vec3 toPoint = point - center;
+	float dist = glm::length(toPoint);
+	glm::vec3 dir = dist > 0.0f ? toPoint / dist : node.axis;
+
+	// Half angle of the cone from point holding the bounds, all of them from inside
+	float cosThetaB = -1.0f;
+	if (dist > radius) {
+		cosThetaB = SafeSqrt(1.0f - (radius * radius) / (dist * dist));
+	}
+	float sinThetaB = SafeSqrt(1.0f - cosThetaB * cosThetaB);
+
+	// Smallest angle between point and any direction the lights emit in
+	float cosThetaW = glm::dot(node.axis, dir);
+	float sinThetaW = SafeSqrt(1.0f - cosThetaW * cosThetaW);
+	float sinThetaO = SafeSqrt(1.0f - node.cosThetaO * node.cosThetaO);
+	float cosThetaX = CosSubClamped(sinThetaW, cosThetaW, sinThetaO, node.cosThetaO);
+	float sinThetaX = SinSubClamped(sinThetaW, cosThetaW, sinThetaO, node.cosThetaO);
+	float cosThetaP = CosSubClamped(sinThetaX, cosThetaX, sinThetaB, cosThetaB);
+	if (cosThetaP <= node.cosThetaE) {
+		return 0.0f;
+	}
+
+	// Smallest angle between the normal and any light, only the side it faces is lit
+	float cosThetaI = -glm::dot(dir, normal);
+	float sinThetaI = SafeSqrt(1.0f - cosThetaI * cosThetaI);
+	float cosThetaIP = CosSubClamped(sinThetaI, cosThetaI, sinThetaB, cosThetaB);
+	if (cosThetaIP <= 0.0f) {
+		return 0.0f;
+	}
+
+	float d = std::fmax(dist, radius);
+	return node.power * cosThetaP * cosThetaIP / (1 + 1 * d + 2 * d * d);
+}
+
+uint32_t LightBVH::Sample(const glm::vec3& point, const glm::vec3& normal, float random, float& pdf) const {
+	pdf = 0.0f;
+	if (_nodes.empty()) {
+		return NO_HIT;
+	}
+
+	uint32_t node = 0;
+	float probability = 1.0f;
+	while (_nodes[node].numLights > 1) {
+		uint32_t first = node + 1;
+		uint32_t second = _nodes[node].offset;
+		float firstImportance = Importance(_nodes[first], point, normal);
+		float secondImportance = Importance(_nodes[second], point, normal);
+		if (firstImportance + secondImportance <= 0.0f) {
+			return NO_HIT;
+		}
+
+		// random is stretched back out to [0, 1) for the next level down
+		float firstProbability = firstImportance / (firstImportance + secondImportance);
+		if (random < firstProbability) {
+			node = first;
+			random = std::fmin(random / firstProbability, 0.99999994f);
+			probability *= firstProbability;
+		}
+		else {
+			node = second;
+			random = std::fmin((random - firstProbability) / (1.0f - firstProbability), 0.99999994f);
+			probability *= 1.0f - firstProbability;
+		}
+	}
+
+	pdf = probability;
+	return _nodes[node].offset;
+}
+
+float LightBVH::Pdf(const glm::vec3& point, const glm::vec3& normal, uint32_t light) const {
+	if (light >= _numLights) {
+		return 0.0f;
+	}
+
+	// The same choices Sample makes, from the leaf up
+	float probability = 1.0f;
+	uint32_t node = _leafOfLight[light];
+	while (_nodes[node].parent != NO_HIT) {
+		uint32_t parent = _nodes[node].parent;
+		float firstImportance = Importance(_nodes[parent + 1], point, normal);
+		float secondImportance = Importance(_nodes[_nodes[parent].offset], point, normal);
+		if (firstImportance + secondImportance <= 0.0f) {
+			return 0.0f;
+		}
+
+		probability *= (node == parent + 1 ? firstImportance : secondImportance) / (firstImportance + secondImportance);
+		node = parent;
+	}
+	return probability;
+}
+
+float LightBVH::ErrorBound(uint32_t node, const ShadingSurface& surface) const {
+	const LightBVHNode& n = _nodes[node];
+
+	// The corner furthest along the normal is the last one to drop below the surface
+	glm::vec3 corner = glm::vec3(
+		surface.normal.x > 0.0f ? n.boundsMax.x : n.boundsMin.x,
+		surface.normal.y > 0.0f ? n.boundsMax.y : n.boundsMin.y,
+		surface.normal.z > 0.0f ? n.boundsMax.z : n.boundsMin.z
+	);
+	float height = glm::dot(surface.normal, corner - surface.position);
+	if (height <= 0.0f) {
+		return 0.0f;
+	}
+
+	// Nothing in the bounds is closer than d or higher above the surface than that corner, so
+	// n dot l is at most height / d. The specular lobe is at most 1.
+	float d = glm::length(glm::clamp(surface.position, n.boundsMin, n.boundsMax) - surface.position);
+	float nDotL = d > height ? height / d : 1.0f;
+	glm::vec3 bound = nDotL * n.intensity * surface.baseDiffuse + n.luminance * surface.baseSpecular;
+	return Luminance(bound) / (1 + 1 * d + 2 * d * d);
+}
+
+PointLightToGPU LightBVH::ClusterLight(uint32_t node) const {
+	const LightBVHNode& n = _nodes[node];
+
+	// Color times luminance comes back out to the summed intensity in the tracer's shading
+	PointLightToGPU cluster;
+	cluster.position_and_radius = _lights[n.representative].position_and_radius;
+	cluster.color_and_luminance = glm::vec4(n.luminance > 0.0f ? n.intensity / n.luminance : glm::vec3(0.0f), n.luminance);
+	return cluster;
+}
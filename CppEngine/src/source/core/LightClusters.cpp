@@ -0,0 +1,333 @@
+#include "LightClusters.h"
+
+#include "JobSystem.h"
+#include "SpotLightBounds.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <random>
+
+// Lights per chunk before a build is worth splitting further
+#define CLUSTER_CHUNK_LIGHTS 256
+// Froxel boxes grow by this much of their size, so a pixel the GPU puts right on a boundary
+// still finds every light the CPU would have given either side of it
+#define CLUSTER_EPSILON 0.001f
+
+namespace {
+	inline float AxisDistance(float p, float boundsMin, float boundsMax) {
+		return std::max(boundsMin - p, 0.0f) + std::max(p - boundsMax, 0.0f);
+	}
+
+	inline uint32_t ChunkStart(uint32_t count, uint32_t numChunks, uint32_t chunk) {
+		return static_cast<uint32_t>(static_cast<uint64_t>(count) * chunk / numChunks);
+	}
+
+	inline int32_t Clamp(int32_t v, int32_t low, int32_t high) {
+		return std::min(std::max(v, low), high);
+	}
+}
+
+void LightClusters::Build(
+	const glm::vec4* lights,
+	uint32_t count,
+	const SpotLightToGPU* spotLights,
+	uint32_t numSpotLights,
+	const glm::mat4& view,
+	const glm::mat4& proj,
+	float nearPlane,
+	float farPlane
+) {
+	auto start = std::chrono::high_resolution_clock::now();
+
+	viewMatrix = view;
+	projScale = glm::vec2(proj[0][0], proj[1][1]);
+	nearDepth = nearPlane;
+	farDepth = farPlane;
+
+	float logRange = std::log(farPlane / nearPlane);
+	sliceScale = CLUSTER_SLICES / logRange;
+	sliceBias = -CLUSTER_SLICES * std::log(nearPlane) / logRange;
+	for (uint32_t s = 0; s <= CLUSTER_SLICES; s += 1) {
+		sliceDepths[s] = nearPlane * std::pow(farPlane / nearPlane, s / static_cast<float>(CLUSTER_SLICES));
+	}
+
+	// View space x and y each froxel spans, from its tile's NDC at both ends of its slice
+	for (uint32_t s = 0; s < CLUSTER_SLICES; s += 1) {
+		float d0 = sliceDepths[s] * (1.0f - CLUSTER_EPSILON);
+		float d1 = sliceDepths[s + 1] * (1.0f + CLUSTER_EPSILON);
+		for (uint32_t t = 0; t < CLUSTER_TILES_X; t += 1) {
+			float a = t * 2.0f / CLUSTER_TILES_X - 1.0f - CLUSTER_EPSILON;
+			float b = (t + 1) * 2.0f / CLUSTER_TILES_X - 1.0f + CLUSTER_EPSILON;
+			tileBoundsX[s][t] = glm::vec2(std::min(a * d0, a * d1), std::max(b * d0, b * d1)) / projScale.x;
+		}
+		for (uint32_t t = 0; t < CLUSTER_TILES_Y; t += 1) {
+			float a = t * 2.0f / CLUSTER_TILES_Y - 1.0f - CLUSTER_EPSILON;
+			float b = (t + 1) * 2.0f / CLUSTER_TILES_Y - 1.0f + CLUSTER_EPSILON;
+			tileBoundsY[s][t] = glm::vec2(std::min(a * d0, a * d1), std::max(b * d0, b * d1)) / projScale.y;
+		}
+	}
+
+	// Spot lights are numbered on from the point lights, so both go through the same passes
+	buildLights = lights;
+	buildCount = count;
+	buildSpotLights = spotLights;
+	uint32_t numLights = count + numSpotLights;
+
+	uint32_t numChunks = std::min((numLights + CLUSTER_CHUNK_LIGHTS - 1) / CLUSTER_CHUNK_LIGHTS, JobSystem::NumThreads() * 2);
+	chunkCounts.resize(numChunks);
+
+	// Counted first, then each light goes through again straight into its place. Finding a
+	// light's froxels twice is cheaper than writing every pair out and reading it back.
+	JobSystem::ParallelFor(numChunks, 1, [this, numLights, numChunks](uint32_t begin, uint32_t end) {
+		for (uint32_t chunk = begin; chunk < end; chunk += 1) {
+			std::vector<uint32_t>& counts = chunkCounts[chunk];
+			counts.assign(NUM_CLUSTERS * 2, 0);
+			for (uint32_t light = ChunkStart(numLights, numChunks, chunk); light < ChunkStart(numLights, numChunks, chunk + 1); light += 1) {
+				uint32_t kind = light < buildCount ? 0 : 1;
+				ForEachCluster(light, [&counts, kind](uint32_t cluster) {
+					counts[cluster * 2 + kind] += 1;
+				});
+			}
+		}
+	});
+
+	// Each chunk's counts turn into where its first light of each cluster goes, point lights
+	// ahead of spot lights
+	clusters.resize(NUM_CLUSTERS);
+	uint32_t total = 0;
+	for (uint32_t cluster = 0; cluster < NUM_CLUSTERS; cluster += 1) {
+		clusters[cluster].offset = total;
+		for (uint32_t kind = 0; kind < 2; kind += 1) {
+			uint32_t first = total;
+			for (uint32_t chunk = 0; chunk < numChunks; chunk += 1) {
+				uint32_t n = chunkCounts[chunk][cluster * 2 + kind];
+				chunkCounts[chunk][cluster * 2 + kind] = total;
+				total += n;
+			}
+			(kind == 0 ? clusters[cluster].numPointLights : clusters[cluster].numSpotLights) = total - first;
+		}
+	}
+
+	lightIndices.resize(total);
+	JobSystem::ParallelFor(numChunks, 1, [this, numLights, numChunks](uint32_t begin, uint32_t end) {
+		for (uint32_t chunk = begin; chunk < end; chunk += 1) {
+			std::vector<uint32_t>& next = chunkCounts[chunk];
+			for (uint32_t light = ChunkStart(numLights, numChunks, chunk); light < ChunkStart(numLights, numChunks, chunk + 1); light += 1) {
+				uint32_t kind = light < buildCount ? 0 : 1;
+				uint32_t index = light - kind * buildCount;
+				ForEachCluster(light, [this, &next, kind, index](uint32_t cluster) {
+					lightIndices[next[cluster * 2 + kind]++] = index;
+				});
+			}
+		}
+	});
+
+	buildLights = nullptr;
+	buildSpotLights = nullptr;
+
+	auto stop = std::chrono::high_resolution_clock::now();
+	buildTime = std::chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+}
+
+template <typename Emit>
+void LightClusters::ForEachCluster(uint32_t light, Emit emit) const {
+	if (light < buildCount) {
+		const glm::vec4& p = buildLights[light];
+		glm::vec3 center = glm::vec3(viewMatrix * glm::vec4(glm::vec3(p), 1.0f));
+		ForEachCluster(center, p.w, [](const glm::vec3&, const glm::vec3&) { return true; }, emit);
+		return;
+	}
+
+	// The sphere around the cone finds the froxels, then the cone has to reach each one
+	SpotLightBounds cone(buildSpotLights[light - buildCount], viewMatrix);
+	ForEachCluster(cone.sphereCenter, cone.sphereRadius, [&cone](const glm::vec3& froxelMin, const glm::vec3& froxelMax) {
+		return cone.TouchesSphere((froxelMin + froxelMax) * 0.5f, glm::length(froxelMax - froxelMin) * 0.5f);
+	}, emit);
+}
+
+template <typename Touches, typename Emit>
+void LightClusters::ForEachCluster(const glm::vec3& center, float radius, Touches touches, Emit emit) const {
+	const int32_t numTiles[2] = { CLUSTER_TILES_X, CLUSTER_TILES_Y };
+
+	float depth = -center.z;
+	float radiusSq = radius * radius;
+
+	if (depth + radius < nearDepth || depth - radius > farDepth) {
+		return;
+	}
+	float nearest = std::max(depth - radius, nearDepth);
+	float farthest = std::min(depth + radius, farDepth);
+
+	// Froxels the sphere's view space box could project into, and one more each side for
+	// the froxel tests below to settle. Negative x and y are widest up close, positive ones
+	// far away.
+	int32_t tileMin[2];
+	int32_t tileMax[2];
+	bool offScreen = false;
+	for (uint32_t axis = 0; axis < 2; axis += 1) {
+		float low = center[axis] - radius;
+		float high = center[axis] + radius;
+		float ndcLow = projScale[axis] * low / (low < 0.0f ? nearest : farthest);
+		float ndcHigh = projScale[axis] * high / (high > 0.0f ? nearest : farthest);
+		offScreen = offScreen || ndcHigh < -1.0f || ndcLow > 1.0f;
+
+		tileMin[axis] = Clamp(static_cast<int32_t>(std::floor((ndcLow * 0.5f + 0.5f) * numTiles[axis])) - 1, 0, numTiles[axis] - 1);
+		tileMax[axis] = Clamp(static_cast<int32_t>(std::floor((ndcHigh * 0.5f + 0.5f) * numTiles[axis])) + 1, 0, numTiles[axis] - 1);
+	}
+	if (offScreen) {
+		return;
+	}
+
+	int32_t sliceMin = Clamp(static_cast<int32_t>(std::floor(std::log(nearest) * sliceScale + sliceBias)) - 1, 0, CLUSTER_SLICES - 1);
+	int32_t sliceMax = Clamp(static_cast<int32_t>(std::floor(std::log(farthest) * sliceScale + sliceBias)) + 1, 0, CLUSTER_SLICES - 1);
+
+	// Then the sphere against each froxel's view space box
+	for (int32_t slice = sliceMin; slice <= sliceMax; slice += 1) {
+		float d0 = sliceDepths[slice] * (1.0f - CLUSTER_EPSILON);
+		float d1 = sliceDepths[slice + 1] * (1.0f + CLUSTER_EPSILON);
+		float dz = AxisDistance(depth, d0, d1);
+		float dzSq = dz * dz;
+		if (dzSq > radiusSq) {
+			continue;
+		}
+
+		for (int32_t ty = tileMin[1]; ty <= tileMax[1]; ty += 1) {
+			const glm::vec2& y = tileBoundsY[slice][ty];
+			float dy = AxisDistance(center.y, y.x, y.y);
+			float dyzSq = dzSq + dy * dy;
+			if (dyzSq > radiusSq) {
+				continue;
+			}
+
+			for (int32_t tx = tileMin[0]; tx <= tileMax[0]; tx += 1) {
+				const glm::vec2& x = tileBoundsX[slice][tx];
+				float dx = AxisDistance(center.x, x.x, x.y);
+				if (dyzSq + dx * dx > radiusSq || !touches(glm::vec3(x.x, y.x, -d1), glm::vec3(x.y, y.y, -d0))) {
+					continue;
+				}
+
+				emit(static_cast<uint32_t>((slice * CLUSTER_TILES_Y + ty) * CLUSTER_TILES_X + tx));
+			}
+		}
+	}
+}
+
+uint32_t LightClusters::ClusterIndex(const glm::vec3& viewPos) const {
+	float depth = -viewPos.z;
+	int32_t slice = Clamp(static_cast<int32_t>(std::floor(std::log(depth) * sliceScale + sliceBias)), 0, CLUSTER_SLICES - 1);
+
+	glm::vec2 uv = glm::vec2(viewPos) * projScale / depth * 0.5f + 0.5f;
+	int32_t tx = Clamp(static_cast<int32_t>(std::floor(uv.x * CLUSTER_TILES_X)), 0, CLUSTER_TILES_X - 1);
+	int32_t ty = Clamp(static_cast<int32_t>(std::floor(uv.y * CLUSTER_TILES_Y)), 0, CLUSTER_TILES_Y - 1);
+
+	return (slice * CLUSTER_TILES_Y + ty) * CLUSTER_TILES_X + tx;
+}
+
+void LightClusters::Benchmark(const glm::mat4& view, const glm::mat4& proj, float nearPlane, float farPlane, uint32_t iterations) {
+	fprintf(stderr, "\nCPU Light Clusters -- %d x %d x %d froxels, %u threads, %u iterations\n",
+		CLUSTER_TILES_X, CLUSTER_TILES_Y, CLUSTER_SLICES, JobSystem::NumThreads(), iterations);
+
+	std::mt19937 rng(5);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	glm::mat4 invView = glm::inverse(view);
+	float maxDepth = std::min(farPlane, 50.0f);
+
+	const uint32_t counts[4] = { 100, 1000, 10000, 100000 };
+	for (uint32_t count : counts) {
+		// Spread through the frustum out to maxDepth, with a little hanging off every side
+		std::vector<glm::vec4> lights(count);
+		for (glm::vec4& light : lights) {
+			float depth = nearPlane + (maxDepth - nearPlane) * unit(rng);
+			glm::vec2 ndc = glm::vec2(unit(rng), unit(rng)) * 2.4f - 1.2f;
+			glm::vec3 viewPos = glm::vec3(ndc.x * depth / proj[0][0], ndc.y * depth / proj[1][1], -depth);
+			light = glm::vec4(glm::vec3(invView * glm::vec4(viewPos, 1.0f)), 0.25f + 1.75f * unit(rng));
+		}
+
+		long long total = 0;
+		for (uint32_t i = 0; i < iterations; i += 1) {
+			Build(lights.data(), count, nullptr, 0, view, proj, nearPlane, farPlane);
+			total += buildTime;
+		}
+
+		uint32_t largest = 0;
+		uint64_t overCap = 0;
+		for (const LightCluster& cluster : clusters) {
+			largest = std::max(largest, cluster.numPointLights);
+			overCap += cluster.numPointLights > 1023 ? cluster.numPointLights - 1023 : 0;
+		}
+
+		// Every light touching a point has to be in the point's froxel
+		uint32_t missing = 0;
+		const uint32_t numPoints = 512;
+		for (uint32_t i = 0; i < numPoints; i += 1) {
+			float depth = nearPlane * std::pow(maxDepth / nearPlane, unit(rng));
+			glm::vec2 ndc = glm::vec2(unit(rng), unit(rng)) * 2.0f - 1.0f;
+			glm::vec3 viewPos = glm::vec3(ndc.x * depth / proj[0][0], ndc.y * depth / proj[1][1], -depth);
+			glm::vec3 worldPos = glm::vec3(invView * glm::vec4(viewPos, 1.0f));
+
+			const LightCluster& cluster = clusters[ClusterIndex(viewPos)];
+			const uint32_t* first = lightIndices.data() + cluster.offset;
+			const uint32_t* last = first + cluster.numPointLights;
+			for (uint32_t light = 0; light < count; light += 1) {
+				glm::vec3 toLight = glm::vec3(lights[light]) - worldPos;
+				float radius = lights[light].w;
+				if (glm::dot(toLight, toLight) <= radius * radius && !std::binary_search(first, last, light)) {
+					missing += 1;
+				}
+			}
+		}
+
+		fprintf(stderr, "CPU Light Clusters -- %u lights: Build (us): %.1f, %zu indices, %zu bytes\n",
+			count, total / static_cast<float>(iterations), lightIndices.size(),
+			sizeof(LightCluster) * clusters.size() + sizeof(uint32_t) * lightIndices.size());
+		fprintf(stderr, "CPU Light Clusters -- Largest froxel: %u lights, %llu past 1023 a froxel, %u missing at %u points\n",
+			largest, static_cast<unsigned long long>(overCap), missing, numPoints);
+
+		// The same lights as spot lights pointing every way, 10 to 60 degrees wide
+		std::vector<SpotLightToGPU> spotLights(count);
+		for (uint32_t light = 0; light < count; light += 1) {
+			glm::vec3 direction = glm::vec3(unit(rng), unit(rng), unit(rng)) * 2.0f - 1.0f;
+			direction = glm::dot(direction, direction) > 0.0001f ? glm::normalize(direction) : glm::vec3(0.0f, -1.0f, 0.0f);
+			float outer = glm::radians(10.0f + 50.0f * unit(rng));
+			spotLights[light].position_and_range = lights[light];
+			spotLights[light].direction_and_cos_outer = glm::vec4(direction, std::cos(outer));
+			spotLights[light].color_and_cos_inner = glm::vec4(glm::vec3(1.0f), std::cos(outer * 0.8f));
+		}
+
+		total = 0;
+		for (uint32_t i = 0; i < iterations; i += 1) {
+			Build(nullptr, 0, spotLights.data(), count, view, proj, nearPlane, farPlane);
+			total += buildTime;
+		}
+		size_t coneIndices = lightIndices.size();
+
+		missing = 0;
+		for (uint32_t i = 0; i < numPoints; i += 1) {
+			float depth = nearPlane * std::pow(maxDepth / nearPlane, unit(rng));
+			glm::vec2 ndc = glm::vec2(unit(rng), unit(rng)) * 2.0f - 1.0f;
+			glm::vec3 viewPos = glm::vec3(ndc.x * depth / proj[0][0], ndc.y * depth / proj[1][1], -depth);
+			glm::vec3 worldPos = glm::vec3(invView * glm::vec4(viewPos, 1.0f));
+
+			const LightCluster& cluster = clusters[ClusterIndex(viewPos)];
+			const uint32_t* first = lightIndices.data() + cluster.offset + cluster.numPointLights;
+			const uint32_t* last = first + cluster.numSpotLights;
+			for (uint32_t light = 0; light < count; light += 1) {
+				if (SpotLightBounds(spotLights[light]).Contains(worldPos) && !std::binary_search(first, last, light)) {
+					missing += 1;
+				}
+			}
+		}
+
+		// What culling them by the spheres around their cones would have cost
+		for (uint32_t light = 0; light < count; light += 1) {
+			SpotLightBounds cone(spotLights[light]);
+			lights[light] = glm::vec4(cone.sphereCenter, cone.sphereRadius);
+		}
+		Build(lights.data(), count, nullptr, 0, view, proj, nearPlane, farPlane);
+
+		fprintf(stderr, "CPU Light Clusters -- %u spot lights: Build (us): %.1f, %zu indices, %zu as bounding spheres, %u missing at %u points\n",
+			count, total / static_cast<float>(iterations), coneIndices, lightIndices.size(), missing, numPoints);
+	}
+}
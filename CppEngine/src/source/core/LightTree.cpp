@@ -0,0 +1,984 @@
+#include "LightTree.h"
+
+#include "JobSystem.h"
+#include "SpotLightBounds.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+
+#include <xmmintrin.h>
+
+// A split has to leave octants with at most this fraction of their parent's lights on average
+#define LIGHT_TREE_SPLIT_NUMERATOR 3
+#define LIGHT_TREE_SPLIT_DENOMINATOR 4
+
+namespace {
+	inline float AxisDistance(float p, float boundsMin, float boundsMax) {
+		return std::max(boundsMin - p, 0.0f) + std::max(p - boundsMax, 0.0f);
+	}
+
+	inline bool SphereTouchesBox(const glm::vec4& position_and_radius, const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+		float d = 0.0f;
+		for (uint32_t axis = 0; axis < 3; axis += 1) {
+			float a = AxisDistance(position_and_radius[axis], boundsMin[axis], boundsMax[axis]);
+			d += a * a;
+		}
+		return d <= position_and_radius.w * position_and_radius.w;
+	}
+
+	// Octants of [boundsMin, boundsMax] the sphere touches, one bit each
+	inline uint32_t TouchedOctants(const glm::vec4& position_and_radius, const glm::vec3& boundsMin, const glm::vec3& center, const glm::vec3& boundsMax) {
+		// Squared distance along each axis to the lower and upper half
+		float lower[3];
+		float upper[3];
+		for (uint32_t axis = 0; axis < 3; axis += 1) {
+			float p = position_and_radius[axis];
+			float a = AxisDistance(p, boundsMin[axis], center[axis]);
+			float b = AxisDistance(p, center[axis], boundsMax[axis]);
+			lower[axis] = a * a;
+			upper[axis] = b * b;
+		}
+
+		float radiusSq = position_and_radius.w * position_and_radius.w;
+		uint32_t octants = 0;
+		for (uint32_t octant = 0; octant < 8; octant += 1) {
+			float d = ((octant & 1) ? upper[0] : lower[0]) + ((octant & 2) ? upper[1] : lower[1]) + ((octant & 4) ? upper[2] : lower[2]);
+			octants |= (d <= radiusSq ? 1u : 0u) << octant;
+		}
+		return octants;
+	}
+
+	inline __m128 AxisDistance4(__m128 p, __m128 boundsMin, __m128 boundsMax) {
+		const __m128 zero = _mm_setzero_ps();
+		return _mm_add_ps(_mm_max_ps(_mm_sub_ps(boundsMin, p), zero), _mm_max_ps(_mm_sub_ps(p, boundsMax), zero));
+	}
+
+	// TouchedOctants for 4 spheres at once, a lane each, testing all 4 against one octant per
+	// pass. The distances are summed in the same order, so every mask comes out exactly as
+	// TouchedOctants has it.
+	inline void TouchedOctants4(const glm::vec4* const* spheres, const glm::vec3& boundsMin, const glm::vec3& center, const glm::vec3& boundsMax, uint32_t* octants) {
+		__m128 x = _mm_loadu_ps(&spheres[0]->x);
+		__m128 y = _mm_loadu_ps(&spheres[1]->x);
+		__m128 z = _mm_loadu_ps(&spheres[2]->x);
+		__m128 radius = _mm_loadu_ps(&spheres[3]->x);
+		_MM_TRANSPOSE4_PS(x, y, z, radius);
+		__m128 p[3] = { x, y, z };
+		__m128 radiusSq = _mm_mul_ps(radius, radius);
+
+		__m128 lower[3];
+		__m128 upper[3];
+		for (uint32_t axis = 0; axis < 3; axis += 1) {
+			__m128 a = AxisDistance4(p[axis], _mm_set1_ps(boundsMin[axis]), _mm_set1_ps(center[axis]));
+			__m128 b = AxisDistance4(p[axis], _mm_set1_ps(center[axis]), _mm_set1_ps(boundsMax[axis]));
+			lower[axis] = _mm_mul_ps(a, a);
+			upper[axis] = _mm_mul_ps(b, b);
+		}
+
+		std::fill(octants, octants + 4, 0u);
+		for (uint32_t octant = 0; octant < 8; octant += 1) {
+			__m128 d = _mm_add_ps(
+				_mm_add_ps((octant & 1) ? upper[0] : lower[0], (octant & 2) ? upper[1] : lower[1]),
+				(octant & 4) ? upper[2] : lower[2]);
+			int touched = _mm_movemask_ps(_mm_cmple_ps(d, radiusSq));
+			for (uint32_t lane = 0; lane < 4; lane += 1) {
+				octants[lane] |= static_cast<uint32_t>((touched >> lane) & 1) << octant;
+			}
+		}
+	}
+
+	inline void OctantBounds(uint32_t octant, const glm::vec3& boundsMin, const glm::vec3& center, const glm::vec3& boundsMax, glm::vec3& childMin, glm::vec3& childMax) {
+		for (uint32_t axis = 0; axis < 3; axis += 1) {
+			bool upper = (octant >> axis) & 1;
+			childMin[axis] = upper ? center[axis] : boundsMin[axis];
+			childMax[axis] = upper ? boundsMax[axis] : center[axis];
+		}
+	}
+
+	// Lights bunched up around towns spread over the world, with a few out on their own between them
+	std::vector<glm::vec4> TownLights(uint32_t count, const glm::vec3& boundsMin, const glm::vec3& boundsMax, std::mt19937& rng) {
+		std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+		std::normal_distribution<float> spread(0.0f, 1.0f);
+		glm::vec3 extent = boundsMax - boundsMin;
+
+		const uint32_t numTowns = 24;
+		glm::vec3 towns[numTowns];
+		for (uint32_t t = 0; t < numTowns; t += 1) {
+			towns[t] = boundsMin + extent * glm::vec3(unit(rng), unit(rng) * 0.1f, unit(rng));
+		}
+
+		std::vector<glm::vec4> lights(count);
+		for (glm::vec4& light : lights) {
+			glm::vec3 position;
+			if (unit(rng) < 0.1f) {
+				position = boundsMin + extent * glm::vec3(unit(rng), unit(rng), unit(rng));
+			}
+			else {
+				const glm::vec3& town = towns[static_cast<uint32_t>(unit(rng) * numTowns) % numTowns];
+				position = town + glm::vec3(spread(rng) * 40.0f, std::fabs(spread(rng)) * 8.0f, spread(rng) * 40.0f);
+			}
+			light = glm::vec4(position, 1.0f + 7.0f * unit(rng) * unit(rng));
+		}
+		return lights;
+	}
+
+	// Whether two trees over the same cube have the same nodes with the same lists, wherever
+	// in their arrays they are
+	bool SameNodes(const LightTreeView& a, uint32_t nodeA, const LightTreeView& b, uint32_t nodeB) {
+		const LightTreeNode& first = a.nodes[nodeA];
+		const LightTreeNode& second = b.nodes[nodeB];
+		if (first.numPointLights != second.numPointLights) {
+			return false;
+		}
+		if (first.numPointLights == LIGHT_TREE_INTERIOR) {
+			for (uint32_t octant = 0; octant < 8; octant += 1) {
+				if (!SameNodes(a, first.offset + octant, b, second.offset + octant)) {
+					return false;
+				}
+			}
+			return true;
+		}
+		uint32_t total = first.numPointLights + first.numSpotLights;
+		return first.numSpotLights == second.numSpotLights
+			&& std::equal(a.lightIndices + first.offset, a.lightIndices + first.offset + total, b.lightIndices + second.offset);
+	}
+}
+
+void LightTree::Build(
+	const glm::vec4* lights,
+	uint32_t count,
+	const SpotLightToGPU* spotLights,
+	uint32_t numSpotLights,
+	const glm::vec3& sceneMin,
+	const glm::vec3& sceneMax
+) {
+	auto start = std::chrono::high_resolution_clock::now();
+
+	// A cube, so leaves stay about as deep as they are wide however flat the scene is. The
+	// octants past the scene are empty and stop right away.
+	glm::vec3 extent = sceneMax - sceneMin;
+	sceneBoundsMin = sceneMin;
+	sceneBoundsMax = sceneMax;
+	boundsMin = sceneMin;
+	boundsMax = sceneMin + glm::vec3(std::max(extent.x, std::max(extent.y, extent.z)));
+	buildLights = lights;
+	buildCount = count;
+	buildSpotLights = spotLights;
+	depth = 0;
+
+	nodes.clear();
+	lightIndices.clear();
+	nodes.push_back(LightTreeNode{ 0, 0, 0 });
+	wastedNodes = 0;
+	wastedIndices = 0;
+	treeLights.assign(lights, lights + count);
+	treeSpotLights.assign(spotLights, spotLights + numSpotLights);
+
+	levelLights.clear();
+	for (uint32_t light = 0; light < count + numSpotLights; light += 1) {
+		if (LightOctants(light, boundsMin, boundsMax) != 0) {
+			levelLights.push_back(light);
+		}
+	}
+
+	PendingNode root;
+	root.node = 0;
+	root.boundsMin = boundsMin;
+	root.boundsMax = boundsMax;
+	root.begin = 0;
+	root.count = static_cast<uint32_t>(levelLights.size());
+	level.assign(1, root);
+	nodeCounts.assign(1, root.count);
+	leafCapacity.assign(1, 0);
+	SplitLevels(0);
+
+	buildLights = nullptr;
+	buildSpotLights = nullptr;
+
+	auto stop = std::chrono::high_resolution_clock::now();
+	buildTime = std::chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+}
+
+void LightTree::SplitLevels(uint32_t firstLevel) {
+	// One level at a time. Nodes on it are split in parallel, numbered and given their place in
+	// order, then their lights are written out to the next level or the leaf lists in parallel.
+	for (uint32_t levelIndex = firstLevel; !level.empty(); levelIndex += 1) {
+		uint32_t numPending = static_cast<uint32_t>(level.size());
+		octants.resize(levelLights.size());
+
+		JobSystem::ParallelFor(numPending, 1, [this, levelIndex](uint32_t begin, uint32_t end) {
+			for (uint32_t i = begin; i < end; i += 1) {
+				Split(level[i], levelIndex);
+			}
+		});
+
+		nextLevel.clear();
+		uint32_t numNextLights = 0;
+		for (uint32_t i = 0; i < numPending; i += 1) {
+			PendingNode& pending = level[i];
+			if (!pending.split) {
+				// Point lights are numbered first, so they come first
+				const uint32_t* first = levelLights.data() + pending.begin;
+				uint32_t numPointLights = static_cast<uint32_t>(std::lower_bound(first, first + pending.count, buildCount) - first);
+				pending.output = static_cast<uint32_t>(lightIndices.size());
+				nodes[pending.node] = LightTreeNode{ pending.output, numPointLights, pending.count - numPointLights };
+				leafCapacity[pending.node] = pending.count;
+				lightIndices.resize(lightIndices.size() + pending.count);
+				continue;
+			}
+
+			uint32_t firstChild = static_cast<uint32_t>(nodes.size());
+			nodes[pending.node] = LightTreeNode{ firstChild, LIGHT_TREE_INTERIOR, 0 };
+			nodes.resize(nodes.size() + 8, LightTreeNode{ 0, 0, 0 });
+			nodeCounts.resize(nodes.size());
+			leafCapacity.resize(nodes.size(), 0);
+
+			glm::vec3 center = (pending.boundsMin + pending.boundsMax) * 0.5f;
+			for (uint32_t octant = 0; octant < 8; octant += 1) {
+				PendingNode child;
+				child.node = firstChild + octant;
+				OctantBounds(octant, pending.boundsMin, center, pending.boundsMax, child.boundsMin, child.boundsMax);
+				child.begin = numNextLights;
+				child.count = pending.childCounts[octant];
+				pending.childCounts[octant] = numNextLights;
+				numNextLights += child.count;
+				nodeCounts[child.node] = child.count;
+				nextLevel.push_back(child);
+			}
+			depth = std::max(depth, levelIndex + 1);
+		}
+		nextLights.resize(numNextLights);
+
+		JobSystem::ParallelFor(numPending, 1, [this](uint32_t begin, uint32_t end) {
+			for (uint32_t i = begin; i < end; i += 1) {
+				const PendingNode& pending = level[i];
+				const uint32_t* first = levelLights.data() + pending.begin;
+				if (!pending.split) {
+					uint32_t* output = lightIndices.data() + pending.output;
+					for (uint32_t j = 0; j < pending.count; j += 1) {
+						output[j] = first[j] < buildCount ? first[j] : first[j] - buildCount;
+					}
+					continue;
+				}
+
+				uint32_t next[8];
+				std::copy(pending.childCounts, pending.childCounts + 8, next);
+				for (uint32_t j = 0; j < pending.count; j += 1) {
+					uint32_t mask = octants[pending.begin + j];
+					for (uint32_t octant = 0; octant < 8; octant += 1) {
+						if (mask & (1 << octant)) {
+							nextLights[next[octant]++] = first[j];
+						}
+					}
+				}
+			}
+		});
+
+		level.swap(nextLevel);
+		levelLights.swap(nextLights);
+	}
+}
+
+uint32_t LightTree::LightOctants(uint32_t light, const glm::vec3& nodeMin, const glm::vec3& nodeMax) const {
+	glm::vec3 center = (nodeMin + nodeMax) * 0.5f;
+	if (light < buildCount) {
+		return TouchedOctants(buildLights[light], nodeMin, center, nodeMax);
+	}
+
+	// The sphere around the cone first, then the cone has to reach each octant it leaves
+	SpotLightBounds cone(buildSpotLights[light - buildCount]);
+	uint32_t mask = TouchedOctants(glm::vec4(cone.sphereCenter, cone.sphereRadius), nodeMin, center, nodeMax);
+	float octantRadius = glm::length(nodeMax - nodeMin) * 0.25f;
+	for (uint32_t octant = 0; octant < 8; octant += 1) {
+		if (mask & (1 << octant)) {
+			glm::vec3 childMin;
+			glm::vec3 childMax;
+			OctantBounds(octant, nodeMin, center, nodeMax, childMin, childMax);
+			if (!cone.TouchesSphere((childMin + childMax) * 0.5f, octantRadius)) {
+				mask &= ~(1u << octant);
+			}
+		}
+	}
+	return mask;
+}
+
+void LightTree::Split(PendingNode& pending, uint32_t levelIndex) {
+	pending.split = false;
+	if (!Splits(pending.count, nullptr, levelIndex)) {
+		return;
+	}
+
+	std::fill(pending.childCounts, pending.childCounts + 8, 0);
+	uint32_t end = pending.begin + pending.count;
+	uint32_t j = pending.begin;
+	if (!scalarOctants) {
+		// Point lights come first, 4 at a time while there are 4 of them left
+		glm::vec3 center = (pending.boundsMin + pending.boundsMax) * 0.5f;
+		for (; j + 4 <= end && levelLights[j + 3] < buildCount; j += 4) {
+			const glm::vec4* spheres[4] = {
+				&buildLights[levelLights[j]], &buildLights[levelLights[j + 1]], &buildLights[levelLights[j + 2]], &buildLights[levelLights[j + 3]]
+			};
+			uint32_t masks[4];
+			TouchedOctants4(spheres, pending.boundsMin, center, pending.boundsMax, masks);
+			for (uint32_t lane = 0; lane < 4; lane += 1) {
+				octants[j + lane] = static_cast<uint8_t>(masks[lane]);
+				for (uint32_t octant = 0; octant < 8; octant += 1) {
+					pending.childCounts[octant] += (masks[lane] >> octant) & 1;
+				}
+			}
+		}
+	}
+	for (; j < end; j += 1) {
+		uint32_t mask = LightOctants(levelLights[j], pending.boundsMin, pending.boundsMax);
+		octants[j] = static_cast<uint8_t>(mask);
+		for (uint32_t octant = 0; octant < 8; octant += 1) {
+			pending.childCounts[octant] += (mask >> octant) & 1;
+		}
+	}
+
+	pending.split = Splits(pending.count, pending.childCounts, levelIndex);
+}
+
+bool LightTree::Splits(uint32_t count, const uint32_t* childCounts, uint32_t levelIndex) {
+	if (count <= LIGHT_TREE_LEAF_LIGHTS || levelIndex >= LIGHT_TREE_MAX_DEPTH) {
+		return false;
+	}
+	// Without them, whether it can split at all
+	if (!childCounts) {
+		return true;
+	}
+
+	// Where lights overlap each other, they go into most octants anyway, and splitting those
+	// any further only makes more copies of them. A lookup lands in one octant, so splitting
+	// has to take enough lights off the average one.
+	uint64_t childLights = 0;
+	for (uint32_t octant = 0; octant < 8; octant += 1) {
+		childLights += childCounts[octant];
+	}
+	return childLights * LIGHT_TREE_SPLIT_DENOMINATOR <= static_cast<uint64_t>(count) * 8 * LIGHT_TREE_SPLIT_NUMERATOR;
+}
+
+uint32_t LightTree::DifferencesFrom(const LightTree& other) const {
+	uint32_t differences = 0;
+	size_t sharedNodes = std::min(nodes.size(), other.nodes.size());
+	for (size_t i = 0; i < sharedNodes; i += 1) {
+		differences += std::memcmp(&nodes[i], &other.nodes[i], sizeof(LightTreeNode)) != 0 ? 1 : 0;
+	}
+	size_t sharedIndices = std::min(lightIndices.size(), other.lightIndices.size());
+	for (size_t i = 0; i < sharedIndices; i += 1) {
+		differences += lightIndices[i] != other.lightIndices[i] ? 1 : 0;
+	}
+	differences += static_cast<uint32_t>(std::max(nodes.size(), other.nodes.size()) - sharedNodes);
+	differences += static_cast<uint32_t>(std::max(lightIndices.size(), other.lightIndices.size()) - sharedIndices);
+	return differences;
+}
+
+LightTreeView LightTree::View() const {
+	LightTreeView view;
+	view.nodes = nodes.data();
+	view.lightIndices = lightIndices.data();
+	view.numNodes = static_cast<uint32_t>(nodes.size());
+	view.numLightIndices = static_cast<uint32_t>(lightIndices.size());
+	view.boundsMin = boundsMin;
+	view.boundsMax = boundsMax;
+	return view;
+}
+
+void LightTree::Update(
+	const glm::vec4* lights,
+	uint32_t count,
+	const SpotLightToGPU* spotLights,
+	uint32_t numSpotLights,
+	const std::vector<LightTreeRange>& dirtyLights
+) {
+	auto start = std::chrono::high_resolution_clock::now();
+
+	changedNodes.clear();
+	changedIndices.clear();
+
+	// Lights that went somewhere, and every light only one of the counts has
+	uint32_t oldCount = static_cast<uint32_t>(treeLights.size());
+	uint32_t shared = std::min(count, oldCount);
+	movedLights.clear();
+	for (const LightTreeRange& range : dirtyLights) {
+		for (uint32_t light = range.begin; light < std::min(range.end, shared); light += 1) {
+			if (treeLights[light] != lights[light]) {
+				movedLights.push_back(light);
+			}
+		}
+	}
+	for (uint32_t light = shared; light < std::max(count, oldCount); light += 1) {
+		movedLights.push_back(light);
+	}
+	// Runs are allowed to overlap
+	std::sort(movedLights.begin(), movedLights.end());
+	movedLights.erase(std::unique(movedLights.begin(), movedLights.end()), movedLights.end());
+
+	bool spotLightsChanged = numSpotLights != treeSpotLights.size()
+		|| (numSpotLights > 0 && std::memcmp(spotLights, treeSpotLights.data(), sizeof(SpotLightToGPU) * numSpotLights) != 0);
+	bool wasteful = wastedNodes * 2 > nodes.size() || wastedIndices * 2 > lightIndices.size();
+	if (nodes.empty() || spotLightsChanged || wasteful || movedLights.size() * LIGHT_TREE_REBUILD_FRACTION > std::max(count, oldCount)) {
+		Rebuild(lights, count, spotLights, numSpotLights);
+	}
+	else if (!movedLights.empty()) {
+		buildLights = lights;
+		buildCount = count;
+		buildSpotLights = spotLights;
+		uint32_t numNodes = static_cast<uint32_t>(nodes.size());
+		uint32_t numIndices = static_cast<uint32_t>(lightIndices.size());
+
+		// The root's list is every light touching the cube, as Build has it
+		glm::vec3 center = (boundsMin + boundsMax) * 0.5f;
+		changes.clear();
+		for (uint32_t light : movedLights) {
+			bool inOld = light < oldCount && TouchedOctants(treeLights[light], boundsMin, center, boundsMax) != 0;
+			bool inNew = light < count && TouchedOctants(lights[light], boundsMin, center, boundsMax) != 0;
+			if (inOld || inNew) {
+				changes.push_back(LightChange{ light, inOld, inNew });
+			}
+		}
+
+		updateStack.clear();
+		if (!changes.empty()) {
+			updateStack.push_back(UpdateNode{ 0, boundsMin, boundsMax, 0, 0, static_cast<uint32_t>(changes.size()) });
+		}
+		while (!updateStack.empty()) {
+			UpdateNode update = updateStack.back();
+			updateStack.pop_back();
+
+			int delta = 0;
+			for (uint32_t j = update.begin; j < update.begin + update.count; j += 1) {
+				delta += (changes[j].inNew ? 1 : 0) - (changes[j].inOld ? 1 : 0);
+			}
+			nodeCounts[update.node] += delta;
+
+			if (nodes[update.node].numPointLights == LIGHT_TREE_INTERIOR) {
+				UpdateInterior(update);
+			}
+			else {
+				UpdateLeaf(update);
+			}
+		}
+
+		// Whatever went on the ends goes up too
+		if (nodes.size() > numNodes) {
+			changedNodes.push_back(LightTreeRange{ numNodes, static_cast<uint32_t>(nodes.size()) });
+		}
+		if (lightIndices.size() > numIndices) {
+			changedIndices.push_back(LightTreeRange{ numIndices, static_cast<uint32_t>(lightIndices.size()) });
+		}
+		MergeRanges(changedNodes);
+		MergeRanges(changedIndices);
+
+		treeLights.resize(count);
+		for (uint32_t light : movedLights) {
+			if (light < count) {
+				treeLights[light] = lights[light];
+			}
+		}
+		buildLights = nullptr;
+		buildSpotLights = nullptr;
+	}
+
+	auto stop = std::chrono::high_resolution_clock::now();
+	updateTime = std::chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+}
+
+void LightTree::Rebuild(const glm::vec4* lights, uint32_t count, const SpotLightToGPU* spotLights, uint32_t numSpotLights) {
+	previousNodes.swap(nodes);
+	previousIndices.swap(lightIndices);
+	Build(lights, count, spotLights, numSpotLights, sceneBoundsMin, sceneBoundsMax);
+
+	DiffRanges(previousNodes, nodes, changedNodes);
+	DiffRanges(previousIndices, lightIndices, changedIndices);
+}
+
+void LightTree::UpdateInterior(const UpdateNode& update) {
+	// Each change's octants before and after, where it was and is in this node's list. Kept for
+	// handing the changes down when there aren't too many, worked out again when there are.
+	uint32_t firstChild = nodes[update.node].offset;
+	glm::vec3 center = (update.boundsMin + update.boundsMax) * 0.5f;
+	uint8_t oldOctants[2048];
+	uint8_t newOctants[2048];
+	bool fits = update.count <= 2048;
+	int childDeltas[8] = {};
+	for (uint32_t j = 0; j < update.count; j += 1) {
+		const LightChange& change = changes[update.begin + j];
+		uint32_t before = change.inOld ? TouchedOctants(treeLights[change.light], update.boundsMin, center, update.boundsMax) : 0;
+		uint32_t after = change.inNew ? TouchedOctants(buildLights[change.light], update.boundsMin, center, update.boundsMax) : 0;
+		if (fits) {
+			oldOctants[j] = static_cast<uint8_t>(before);
+			newOctants[j] = static_cast<uint8_t>(after);
+		}
+		for (uint32_t octant = 0; octant < 8; octant += 1) {
+			childDeltas[octant] += static_cast<int>((after >> octant) & 1) - static_cast<int>((before >> octant) & 1);
+		}
+	}
+
+	uint32_t childCounts[8];
+	for (uint32_t octant = 0; octant < 8; octant += 1) {
+		childCounts[octant] = nodeCounts[firstChild + octant] + childDeltas[octant];
+	}
+	if (!Splits(nodeCounts[update.node], childCounts, update.levelIndex)) {
+		// Its old list is every point light in the leaves under it, a light touching a node
+		// always touches one of its octants. Spot lights can miss all of them, so they're
+		// found from the root again.
+		collected.clear();
+		CollectLeaves(update.node, collected);
+		std::sort(collected.begin(), collected.end());
+		collected.erase(std::unique(collected.begin(), collected.end()), collected.end());
+		ApplyChanges(update, collected);
+		SpotLightsReaching(update.boundsMin, update.boundsMax, update.levelIndex, updateSpots);
+		WriteLeaf(update.node);
+		return;
+	}
+
+	for (uint32_t octant = 0; octant < 8; octant += 1) {
+		UpdateNode child;
+		child.node = firstChild + octant;
+		OctantBounds(octant, update.boundsMin, center, update.boundsMax, child.boundsMin, child.boundsMax);
+		child.levelIndex = update.levelIndex + 1;
+		child.begin = static_cast<uint32_t>(changes.size());
+		for (uint32_t j = 0; j < update.count; j += 1) {
+			LightChange change = changes[update.begin + j];
+			uint32_t before = fits ? oldOctants[j] : (change.inOld ? TouchedOctants(treeLights[change.light], update.boundsMin, center, update.boundsMax) : 0);
+			uint32_t after = fits ? newOctants[j] : (change.inNew ? TouchedOctants(buildLights[change.light], update.boundsMin, center, update.boundsMax) : 0);
+			if (((before | after) >> octant) & 1) {
+				changes.push_back(LightChange{ change.light, ((before >> octant) & 1) != 0, ((after >> octant) & 1) != 0 });
+			}
+		}
+		child.count = static_cast<uint32_t>(changes.size()) - child.begin;
+		if (child.count > 0) {
+			updateStack.push_back(child);
+		}
+	}
+}
+
+void LightTree::UpdateLeaf(const UpdateNode& update) {
+	const LightTreeNode node = nodes[update.node];
+	const uint32_t* first = lightIndices.data() + node.offset;
+	collected.assign(first, first + node.numPointLights);
+	updateSpots.assign(first + node.numPointLights, first + node.numPointLights + node.numSpotLights);
+	ApplyChanges(update, collected);
+
+	// Lights moving around inside a big enough leaf can make it split without changing its list
+	uint32_t total = static_cast<uint32_t>(updatePoints.size() + updateSpots.size());
+	bool splits = Splits(total, nullptr, update.levelIndex);
+	if (!splits && updatePoints == collected) {
+		return;
+	}
+
+	if (splits) {
+		// Split it the way Build would, from its new list in build order
+		levelLights.assign(updatePoints.begin(), updatePoints.end());
+		for (uint32_t spotLight : updateSpots) {
+			levelLights.push_back(buildCount + spotLight);
+		}
+		octants.resize(total);
+
+		PendingNode pending;
+		pending.node = update.node;
+		pending.boundsMin = update.boundsMin;
+		pending.boundsMax = update.boundsMax;
+		pending.begin = 0;
+		pending.count = total;
+		Split(pending, update.levelIndex);
+		if (pending.split) {
+			wastedIndices += leafCapacity[update.node];
+			leafCapacity[update.node] = 0;
+			changedNodes.push_back(LightTreeRange{ update.node, update.node + 1 });
+			level.assign(1, pending);
+			SplitLevels(update.levelIndex);
+			return;
+		}
+		if (updatePoints == collected) {
+			return;
+		}
+	}
+	WriteLeaf(update.node);
+}
+
+void LightTree::CollectLeaves(uint32_t node, std::vector<uint32_t>& points) {
+	const LightTreeNode& n = nodes[node];
+	if (n.numPointLights != LIGHT_TREE_INTERIOR) {
+		points.insert(points.end(), lightIndices.begin() + n.offset, lightIndices.begin() + n.offset + n.numPointLights);
+		wastedIndices += leafCapacity[node];
+		leafCapacity[node] = 0;
+		return;
+	}
+	wastedNodes += 8;
+	for (uint32_t octant = 0; octant < 8; octant += 1) {
+		CollectLeaves(n.offset + octant, points);
+	}
+}
+
+void LightTree::ApplyChanges(const UpdateNode& update, const std::vector<uint32_t>& points) {
+	removedLights.clear();
+	addedLights.clear();
+	for (uint32_t j = update.begin; j < update.begin + update.count; j += 1) {
+		const LightChange& change = changes[j];
+		if (change.inOld && !change.inNew) {
+			removedLights.push_back(change.light);
+		}
+		else if (change.inNew && !change.inOld) {
+			addedLights.push_back(change.light);
+		}
+	}
+	std::sort(removedLights.begin(), removedLights.end());
+	std::sort(addedLights.begin(), addedLights.end());
+
+	updatePoints.clear();
+	uint32_t removed = 0;
+	uint32_t added = 0;
+	for (uint32_t light : points) {
+		while (removed < removedLights.size() && removedLights[removed] < light) {
+			removed += 1;
+		}
+		if (removed < removedLights.size() && removedLights[removed] == light) {
+			continue;
+		}
+		while (added < addedLights.size() && addedLights[added] < light) {
+			updatePoints.push_back(addedLights[added++]);
+		}
+		updatePoints.push_back(light);
+	}
+	updatePoints.insert(updatePoints.end(), addedLights.begin() + added, addedLights.end());
+}
+
+void LightTree::SpotLightsReaching(const glm::vec3& nodeMin, const glm::vec3& nodeMax, uint32_t levelIndex, std::vector<uint32_t>& spots) const {
+	spots.clear();
+	glm::vec3 nodeCenter = (nodeMin + nodeMax) * 0.5f;
+	for (uint32_t spotLight = 0; spotLight < treeSpotLights.size(); spotLight += 1) {
+		// Every octant on the way has to be touched by the sphere around the cone, the node too
+		SpotLightBounds cone(treeSpotLights[spotLight]);
+		if (!SphereTouchesBox(glm::vec4(cone.sphereCenter, cone.sphereRadius), nodeMin, nodeMax)) {
+			continue;
+		}
+
+		// Then down the same octants Build went through to get to the node
+		glm::vec3 ancestorMin = boundsMin;
+		glm::vec3 ancestorMax = boundsMax;
+		bool reaches = LightOctants(buildCount + spotLight, ancestorMin, ancestorMax) != 0;
+		for (uint32_t ancestor = 0; ancestor < levelIndex && reaches; ancestor += 1) {
+			glm::vec3 center = (ancestorMin + ancestorMax) * 0.5f;
+			uint32_t octant = 0;
+			for (uint32_t axis = 0; axis < 3; axis += 1) {
+				octant |= (nodeCenter[axis] >= center[axis] ? 1u : 0u) << axis;
+			}
+			reaches = ((LightOctants(buildCount + spotLight, ancestorMin, ancestorMax) >> octant) & 1) != 0;
+			OctantBounds(octant, ancestorMin, center, ancestorMax, ancestorMin, ancestorMax);
+		}
+		if (reaches) {
+			spots.push_back(spotLight);
+		}
+	}
+}
+
+void LightTree::WriteLeaf(uint32_t node) {
+	uint32_t numPointLights = static_cast<uint32_t>(updatePoints.size());
+	uint32_t total = numPointLights + static_cast<uint32_t>(updateSpots.size());
+	assert(total == nodeCounts[node]);
+
+	uint32_t offset = nodes[node].offset;
+	bool fits = nodes[node].numPointLights != LIGHT_TREE_INTERIOR && total <= leafCapacity[node];
+	if (!fits) {
+		// A quarter more than it needs, so a light or two more doesn't move it again
+		wastedIndices += leafCapacity[node];
+		offset = static_cast<uint32_t>(lightIndices.size());
+		leafCapacity[node] = total + total / 4 + 2;
+		lightIndices.resize(offset + leafCapacity[node], 0);
+	}
+
+	std::copy(updatePoints.begin(), updatePoints.end(), lightIndices.begin() + offset);
+	std::copy(updateSpots.begin(), updateSpots.end(), lightIndices.begin() + offset + numPointLights);
+	nodes[node] = LightTreeNode{ offset, numPointLights, total - numPointLights };
+
+	changedNodes.push_back(LightTreeRange{ node, node + 1 });
+	if (fits && total > 0) {
+		changedIndices.push_back(LightTreeRange{ offset, offset + total });
+	}
+}
+
+void LightTree::MergeRanges(std::vector<LightTreeRange>& ranges) {
+	std::sort(ranges.begin(), ranges.end(), [](const LightTreeRange& a, const LightTreeRange& b) {
+		return a.begin < b.begin;
+	});
+
+	uint32_t merged = 0;
+	for (const LightTreeRange& range : ranges) {
+		if (merged > 0 && range.begin <= ranges[merged - 1].end + LIGHT_TREE_UPLOAD_GAP) {
+			ranges[merged - 1].end = std::max(ranges[merged - 1].end, range.end);
+		}
+		else {
+			ranges[merged++] = range;
+		}
+	}
+	ranges.resize(merged);
+}
+
+template <typename T>
+void LightTree::DiffRanges(const std::vector<T>& previous, const std::vector<T>& current, std::vector<LightTreeRange>& ranges) {
+	uint32_t size = static_cast<uint32_t>(current.size());
+	uint32_t shared = static_cast<uint32_t>(std::min(previous.size(), current.size()));
+
+	for (uint32_t i = 0; i < size; i += 1) {
+		if (i < shared && std::memcmp(&previous[i], &current[i], sizeof(T)) == 0) {
+			continue;
+		}
+		if (!ranges.empty() && i - ranges.back().end <= LIGHT_TREE_UPLOAD_GAP) {
+			ranges.back().end = i + 1;
+		}
+		else {
+			ranges.push_back(LightTreeRange{ i, i + 1 });
+		}
+	}
+}
+
+void LightTree::Benchmark(uint32_t iterations) {
+	const uint32_t gridSize = 8;
+	const glm::vec3 worldMin = glm::vec3(-2000.0f, 0.0f, -2000.0f);
+	const glm::vec3 worldMax = glm::vec3(2000.0f, 200.0f, 2000.0f);
+
+	fprintf(stderr, "\nCPU Light Tree -- %.0f x %.0f x %.0f world, %u threads, %u iterations\n",
+		worldMax.x - worldMin.x, worldMax.y - worldMin.y, worldMax.z - worldMin.z, JobSystem::NumThreads(), iterations);
+
+	// The scene's tree goes back the way it was
+	LightTree sceneTree(*this);
+
+	std::mt19937 rng(13);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+	const uint32_t counts[3] = { 1000, 10000, 100000 };
+	for (uint32_t count : counts) {
+		std::vector<glm::vec4> lights = TownLights(count, worldMin, worldMax, rng);
+
+		long long total = 0;
+		for (uint32_t i = 0; i < iterations; i += 1) {
+			Build(lights.data(), count, nullptr, 0, worldMin, worldMax);
+			total += buildTime;
+		}
+
+		// The same build classifying one light at a time, which the SSE one has to match exactly
+		LightTree reference;
+		reference.scalarOctants = true;
+		long long scalarTotal = 0;
+		for (uint32_t i = 0; i < iterations; i += 1) {
+			reference.Build(lights.data(), count, nullptr, 0, worldMin, worldMax);
+			scalarTotal += reference.buildTime;
+		}
+		uint32_t scalarDifferences = DifferencesFrom(reference);
+
+		uint32_t numLeaves = 0;
+		uint32_t largestLeaf = 0;
+		for (const LightTreeNode& node : nodes) {
+			if (node.numPointLights != LIGHT_TREE_INTERIOR) {
+				numLeaves += 1;
+				largestLeaf = std::max(largestLeaf, node.numPointLights);
+			}
+		}
+
+		// The same lights in a uniform grid over the world, the way the light grid had them
+		std::vector<uint32_t> gridCounts(gridSize * gridSize * gridSize, 0);
+		glm::vec3 cellSize = (worldMax - worldMin) / static_cast<float>(gridSize);
+		for (const glm::vec4& light : lights) {
+			for (uint32_t cell = 0; cell < gridCounts.size(); cell += 1) {
+				glm::vec3 cellMin = worldMin + cellSize * glm::vec3(cell % gridSize, (cell / gridSize) % gridSize, cell / (gridSize * gridSize));
+				gridCounts[cell] += SphereTouchesBox(light, cellMin, cellMin + cellSize) ? 1 : 0;
+			}
+		}
+		uint32_t overflowingCells = 0;
+		uint32_t largestCell = 0;
+		for (uint32_t n : gridCounts) {
+			overflowingCells += n > 15 ? 1 : 0;
+			largestCell = std::max(largestCell, n);
+		}
+
+		// Points near lights, where shading actually asks, inside the world like any hit is
+		const uint32_t numPoints = 20000;
+		std::vector<glm::vec3> points(numPoints);
+		for (glm::vec3& point : points) {
+			const glm::vec4& p = lights[static_cast<uint32_t>(unit(rng) * count) % count];
+			point = glm::clamp(glm::vec3(p) + (glm::vec3(unit(rng), unit(rng), unit(rng)) * 2.0f - 1.0f) * p.w, worldMin, worldMax);
+		}
+
+		uint64_t leafLights = 0;
+		uint64_t gridLights = 0;
+		auto lookupStart = std::chrono::high_resolution_clock::now();
+		for (const glm::vec3& point : points) {
+			leafLights += Lookup(point).numPointLights;
+		}
+		auto lookupStop = std::chrono::high_resolution_clock::now();
+		for (const glm::vec3& point : points) {
+			glm::ivec3 cell = glm::clamp(glm::ivec3((point - worldMin) / cellSize), glm::ivec3(0), glm::ivec3(gridSize - 1));
+			gridLights += gridCounts[(cell.z * gridSize + cell.y) * gridSize + cell.x];
+		}
+
+		uint32_t missing = 0;
+		for (uint32_t i = 0; i < 512; i += 1) {
+			const glm::vec3& point = points[i];
+			const LightTreeNode& leaf = Lookup(point);
+			for (uint32_t light = 0; light < count; light += 1) {
+				const glm::vec4& p = lights[light];
+				if (glm::dot(glm::vec3(p) - point, glm::vec3(p) - point) > p.w * p.w) {
+					continue;
+				}
+				const uint32_t* first = lightIndices.data() + leaf.offset;
+				missing += std::binary_search(first, first + leaf.numPointLights, light) ? 0 : 1;
+			}
+		}
+
+		double lookupNs = std::chrono::duration_cast<std::chrono::nanoseconds>(lookupStop - lookupStart).count() / static_cast<double>(numPoints);
+		fprintf(stderr, "CPU Light Tree -- %u lights: Build (us): %.1f, %zu nodes, %u leaves, depth %u, %zu indices, %zu bytes\n",
+			count, total / static_cast<float>(iterations), nodes.size(), numLeaves, depth, lightIndices.size(),
+			sizeof(LightTreeNode) * nodes.size() + sizeof(uint32_t) * lightIndices.size());
+		fprintf(stderr, "CPU Light Tree -- Scalar octants: Build (us): %.1f, %u nodes and indices different from SSE\n",
+			scalarTotal / static_cast<float>(iterations), scalarDifferences);
+		fprintf(stderr, "CPU Light Tree -- Largest leaf: %u lights, lookup (ns): %.1f, %.1f lights a lookup, %u missing at 512 points\n",
+			largestLeaf, lookupNs, leafLights / static_cast<double>(numPoints), missing);
+		fprintf(stderr, "CPU Light Tree -- %u^3 grid: largest cell %u lights, %u cells over 15, %.1f lights a lookup\n",
+			gridSize, largestCell, overflowingCells, gridLights / static_cast<double>(numPoints));
+
+		// The same lights as street lamps, shining down 25 to 60 degrees wide
+		std::vector<SpotLightToGPU> spotLights(count);
+		for (uint32_t light = 0; light < count; light += 1) {
+			float outer = glm::radians(25.0f + 35.0f * unit(rng));
+			spotLights[light].position_and_range = lights[light];
+			spotLights[light].direction_and_cos_outer = glm::vec4(0.0f, -1.0f, 0.0f, std::cos(outer));
+			spotLights[light].color_and_cos_inner = glm::vec4(glm::vec3(1.0f), std::cos(outer * 0.8f));
+		}
+
+		total = 0;
+		for (uint32_t i = 0; i < iterations; i += 1) {
+			Build(nullptr, 0, spotLights.data(), count, worldMin, worldMax);
+			total += buildTime;
+		}
+
+		leafLights = 0;
+		missing = 0;
+		for (uint32_t i = 0; i < numPoints; i += 1) {
+			const LightTreeNode& leaf = Lookup(points[i]);
+			leafLights += leaf.numSpotLights;
+			if (i >= 512) {
+				continue;
+			}
+			const uint32_t* first = lightIndices.data() + leaf.offset + leaf.numPointLights;
+			for (uint32_t light = 0; light < count; light += 1) {
+				if (SpotLightBounds(spotLights[light]).Contains(points[i]) && !std::binary_search(first, first + leaf.numSpotLights, light)) {
+					missing += 1;
+				}
+			}
+		}
+		size_t coneNodes = nodes.size();
+		size_t coneIndices = lightIndices.size();
+
+		// What culling them by the spheres around their cones would have cost
+		for (uint32_t light = 0; light < count; light += 1) {
+			SpotLightBounds cone(spotLights[light]);
+			lights[light] = glm::vec4(cone.sphereCenter, cone.sphereRadius);
+		}
+		Build(lights.data(), count, nullptr, 0, worldMin, worldMax);
+
+		fprintf(stderr, "CPU Light Tree -- %u spot lights: Build (us): %.1f, %zu nodes, %zu indices, %zu nodes and %zu indices as bounding spheres\n",
+			count, total / static_cast<float>(iterations), coneNodes, coneIndices, nodes.size(), lightIndices.size());
+		fprintf(stderr, "CPU Light Tree -- Spot lights: %.1f lights a lookup, %u missing at 512 points\n",
+			leafLights / static_cast<double>(numPoints), missing);
+	}
+
+	*this = std::move(sceneTree);
+}
+
+void LightTree::BenchmarkUpdates(uint32_t frames) {
+	const glm::vec3 worldMin = glm::vec3(-2000.0f, 0.0f, -2000.0f);
+	const glm::vec3 worldMax = glm::vec3(2000.0f, 200.0f, 2000.0f);
+
+	fprintf(stderr, "\nCPU Light Tree Updates -- %.0f x %.0f x %.0f world, %u threads, %u frames\n",
+		worldMax.x - worldMin.x, worldMax.y - worldMin.y, worldMax.z - worldMin.z, JobSystem::NumThreads(), frames);
+
+	LightTree sceneTree(*this);
+
+	std::mt19937 rng(17);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+	const uint32_t counts[2] = { 10000, 100000 };
+	// Percent of the lights moving every frame, then 0 for lights coming and going instead
+	const uint32_t percents[4] = { 1, 10, 100, 0 };
+	for (uint32_t startCount : counts) {
+		for (uint32_t percent : percents) {
+			std::vector<glm::vec4> lights = TownLights(startCount, worldMin, worldMax, rng);
+			Build(lights.data(), startCount, nullptr, 0, worldMin, worldMax);
+
+			LightTree reference;
+			std::vector<LightTreeRange> dirtyLights;
+			long long updateTotal = 0;
+			long long buildTotal = 0;
+			uint64_t uploaded = 0;
+			uint64_t whole = 0;
+			uint32_t different = 0;
+			for (uint32_t frame = 0; frame < frames; frame += 1) {
+				dirtyLights.clear();
+				uint32_t count = static_cast<uint32_t>(lights.size());
+				if (percent > 0) {
+					// Every so many lights, a different set each frame, drifting a little like cars would
+					uint32_t step = 100 / percent;
+					for (uint32_t light = frame % step; light < count; light += step) {
+						glm::vec3 drift = glm::vec3(unit(rng) * 2.0f - 1.0f, 0.0f, unit(rng) * 2.0f - 1.0f) * 2.0f;
+						lights[light] = glm::vec4(glm::clamp(glm::vec3(lights[light]) + drift, worldMin, worldMax), lights[light].w);
+						if (!dirtyLights.empty() && dirtyLights.back().end == light) {
+							dirtyLights.back().end = light + 1;
+						}
+						else {
+							dirtyLights.push_back(LightTreeRange{ light, light + 1 });
+						}
+					}
+				}
+				else {
+					// Half a percent removed the way PointLightPool does it, the last light into
+					// the gap, and as many new ones around towns on the end
+					uint32_t churn = count / 200;
+					for (uint32_t i = 0; i < churn; i += 1) {
+						uint32_t light = static_cast<uint32_t>(unit(rng) * lights.size()) % lights.size();
+						lights[light] = lights.back();
+						lights.pop_back();
+						dirtyLights.push_back(LightTreeRange{ light, light + 1 });
+					}
+					std::vector<glm::vec4> added = TownLights(churn + static_cast<uint32_t>(unit(rng) * 8.0f), worldMin, worldMax, rng);
+					uint32_t firstAdded = static_cast<uint32_t>(lights.size());
+					lights.insert(lights.end(), added.begin(), added.end());
+					count = static_cast<uint32_t>(lights.size());
+					dirtyLights.push_back(LightTreeRange{ firstAdded, count });
+				}
+
+				Update(lights.data(), count, nullptr, 0, dirtyLights);
+				updateTotal += updateTime;
+				for (const LightTreeRange& range : changedNodes) {
+					uploaded += sizeof(LightTreeNode) * (range.end - range.begin);
+				}
+				for (const LightTreeRange& range : changedIndices) {
+					uploaded += sizeof(uint32_t) * (range.end - range.begin);
+				}
+				whole += sizeof(LightTreeNode) * nodes.size() + sizeof(uint32_t) * lightIndices.size();
+
+				reference.Build(lights.data(), count, nullptr, 0, worldMin, worldMax);
+				buildTotal += reference.buildTime;
+				different += SameNodes(View(), 0, reference.View(), 0) ? 0 : 1;
+			}
+
+			char moving[32];
+			if (percent > 0) {
+				snprintf(moving, sizeof(moving), "%u%% moving", percent);
+			}
+			else {
+				snprintf(moving, sizeof(moving), "0.5%% replaced");
+			}
+			fprintf(stderr, "CPU Light Tree Updates -- %u lights, %s: Update (us): %.1f, Build (us): %.1f, %.1f KB uploaded a frame of %.1f KB, %u frames different from Build\n",
+				startCount, moving, updateTotal / static_cast<float>(frames), buildTotal / static_cast<float>(frames),
+				uploaded / 1024.0 / frames, whole / 1024.0 / frames, different);
+		}
+	}
+
+	*this = std::move(sceneTree);
+}
@@ -0,0 +1,415 @@
+#include "OcclusionCuller.h"
+
+#include "JobSystem.h"
+
+#include "glm/gtc/matrix_transform.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <random>
+
+#include <xmmintrin.h>
+
+namespace {
+	// Screen rectangle in pixels and nearest NDC depth of a world box. False when a corner is
+	// behind the near plane, so the box can't be placed on screen.
+	inline bool ProjectBox(const glm::mat4& projView, const glm::vec3& boundsMin, const glm::vec3& boundsMax,
+		glm::vec2& rectMin, glm::vec2& rectMax, float& nearestDepth) {
+
+		// Corners are the min corner plus any of the box's edges, each edge transformed once
+		glm::vec3 extent = boundsMax - boundsMin;
+		glm::vec4 base = projView * glm::vec4(boundsMin, 1.0f);
+		glm::vec4 edgeX = projView[0] * extent.x;
+		glm::vec4 edgeY = projView[1] * extent.y;
+		glm::vec4 edgeZ = projView[2] * extent.z;
+
+		rectMin = glm::vec2(INFINITY);
+		rectMax = glm::vec2(-INFINITY);
+		nearestDepth = INFINITY;
+		for (uint32_t corner = 0; corner < 8; corner += 1) {
+			glm::vec4 p = base;
+			if (corner & 1) p += edgeX;
+			if (corner & 2) p += edgeY;
+			if (corner & 4) p += edgeZ;
+			if (p.z + p.w <= 0.0f) {
+				return false;
+			}
+
+			glm::vec3 ndc = glm::vec3(p) / p.w;
+			rectMin = glm::min(rectMin, glm::vec2(ndc));
+			rectMax = glm::max(rectMax, glm::vec2(ndc));
+			nearestDepth = std::min(nearestDepth, ndc.z);
+		}
+
+		glm::vec2 size = glm::vec2(OCCLUSION_WIDTH, OCCLUSION_HEIGHT);
+		rectMin = (rectMin * 0.5f + 0.5f) * size;
+		rectMax = (rectMax * 0.5f + 0.5f) * size;
+		return true;
+	}
+
+	// Point on the segment where it meets the near plane, z = -w
+	inline glm::vec4 NearIntersection(const glm::vec4& inside, const glm::vec4& outside) {
+		float dInside = inside.z + inside.w;
+		float dOutside = outside.z + outside.w;
+		return glm::mix(inside, outside, dInside / (dInside - dOutside));
+	}
+}
+
+OcclusionCuller::OcclusionCuller() {
+	for (uint32_t level = 0; level < OCCLUSION_HIZ_LEVELS; level += 1) {
+		hiZ[level].resize((OCCLUSION_WIDTH >> level) * (OCCLUSION_HEIGHT >> level), 1.0f);
+	}
+}
+
+void OcclusionCuller::Begin(const glm::mat4& viewProjection) {
+	projView = viewProjection;
+	triangles.clear();
+	for (std::vector<uint32_t>& bin : bins) {
+		bin.clear();
+	}
+	numOccluders = 0;
+}
+
+float OcclusionCuller::ScreenArea(const glm::vec3& boundsMin, const glm::vec3& boundsMax) const {
+	glm::vec2 rectMin, rectMax;
+	float nearestDepth;
+	if (!ProjectBox(projView, boundsMin, boundsMax, rectMin, rectMax, nearestDepth)) {
+		return 1.0f;
+	}
+
+	glm::vec2 size = glm::vec2(OCCLUSION_WIDTH, OCCLUSION_HEIGHT);
+	glm::vec2 extent = glm::max(glm::min(rectMax, size) - glm::max(rectMin, glm::vec2(0.0f)), glm::vec2(0.0f));
+	return (extent.x * extent.y) / (size.x * size.y);
+}
+
+void OcclusionCuller::AddOccluder(const glm::vec3* positions, const uint32_t* indices, uint32_t numIndices, const glm::mat4& model) {
+	glm::mat4 mvp = projView * model;
+
+	// Every vertex once, then the triangles out of them
+	uint32_t numVertices = 0;
+	for (uint32_t i = 0; i < numIndices; i += 1) {
+		numVertices = std::max(numVertices, indices[i] + 1);
+	}
+	clipPositions.resize(numVertices);
+	for (uint32_t i = 0; i < numVertices; i += 1) {
+		clipPositions[i] = mvp * glm::vec4(positions[i], 1.0f);
+	}
+
+	for (uint32_t i = 0; i + 2 < numIndices; i += 3) {
+		AddTriangle(clipPositions[indices[i]], clipPositions[indices[i + 1]], clipPositions[indices[i + 2]]);
+	}
+	numOccluders += 1;
+}
+
+void OcclusionCuller::AddTriangle(const glm::vec4& a, const glm::vec4& b, const glm::vec4& c) {
+	const glm::vec4* v[3] = { &a, &b, &c };
+	uint32_t numInside = 0;
+	uint32_t inside[3];
+	uint32_t outside[3];
+	for (uint32_t i = 0; i < 3; i += 1) {
+		if (v[i]->z + v[i]->w > 0.0f) {
+			inside[numInside] = i;
+			numInside += 1;
+		}
+		else {
+			outside[i - numInside] = i;
+		}
+	}
+
+	if (numInside == 3) {
+		AddScreenTriangle(a, b, c);
+		return;
+	}
+	if (numInside == 0) {
+		return;
+	}
+
+	// One vertex in keeps a smaller triangle, two in leave a quad that's split in two
+	if (numInside == 1) {
+		uint32_t i = inside[0];
+		const glm::vec4& in = *v[i];
+		const glm::vec4& next = *v[(i + 1) % 3];
+		const glm::vec4& prev = *v[(i + 2) % 3];
+		AddScreenTriangle(in, NearIntersection(in, next), NearIntersection(in, prev));
+	}
+	else {
+		uint32_t o = outside[0];
+		const glm::vec4& out = *v[o];
+		const glm::vec4& next = *v[(o + 1) % 3];
+		const glm::vec4& prev = *v[(o + 2) % 3];
+		glm::vec4 nextCut = NearIntersection(next, out);
+		glm::vec4 prevCut = NearIntersection(prev, out);
+		AddScreenTriangle(nextCut, next, prev);
+		AddScreenTriangle(nextCut, prev, prevCut);
+	}
+}
+
+void OcclusionCuller::AddScreenTriangle(const glm::vec4& a, const glm::vec4& b, const glm::vec4& c) {
+	glm::vec2 size = glm::vec2(OCCLUSION_WIDTH, OCCLUSION_HEIGHT);
+	ScreenTriangle t;
+	t.v0 = glm::vec3((glm::vec2(a) / a.w * 0.5f + 0.5f) * size, a.z / a.w);
+	t.v1 = glm::vec3((glm::vec2(b) / b.w * 0.5f + 0.5f) * size, b.z / b.w);
+	t.v2 = glm::vec3((glm::vec2(c) / c.w * 0.5f + 0.5f) * size, c.z / c.w);
+
+	// Both sides are drawn, turned so the edge functions are positive inside
+	float area = (t.v1.x - t.v0.x) * (t.v2.y - t.v0.y) - (t.v1.y - t.v0.y) * (t.v2.x - t.v0.x);
+	if (!(area != 0.0f) || std::isnan(area)) {
+		return;
+	}
+	if (area < 0.0f) {
+		std::swap(t.v1, t.v2);
+	}
+
+	glm::vec2 triMin = glm::min(glm::vec2(t.v0), glm::min(glm::vec2(t.v1), glm::vec2(t.v2)));
+	glm::vec2 triMax = glm::max(glm::vec2(t.v0), glm::max(glm::vec2(t.v1), glm::vec2(t.v2)));
+	if (triMax.x < 0.0f || triMax.y < 0.0f || triMin.x >= size.x || triMin.y >= size.y) {
+		return;
+	}
+
+	uint32_t index = static_cast<uint32_t>(triangles.size());
+	triangles.push_back(t);
+
+	// Clamped before they become ints, clipped triangles can reach far off screen
+	triMin = glm::max(triMin, glm::vec2(0.0f));
+	triMax = glm::min(triMax, size - 1.0f);
+	int tileX0 = static_cast<int>(triMin.x) / OCCLUSION_TILE_WIDTH;
+	int tileY0 = static_cast<int>(triMin.y) / OCCLUSION_TILE_HEIGHT;
+	int tileX1 = static_cast<int>(triMax.x) / OCCLUSION_TILE_WIDTH;
+	int tileY1 = static_cast<int>(triMax.y) / OCCLUSION_TILE_HEIGHT;
+	for (int tileY = tileY0; tileY <= tileY1; tileY += 1) {
+		for (int tileX = tileX0; tileX <= tileX1; tileX += 1) {
+			bins[tileY * OCCLUSION_TILES_X + tileX].push_back(index);
+		}
+	}
+}
+
+void OcclusionCuller::Rasterize() {
+	auto startTime = std::chrono::high_resolution_clock::now();
+
+	JobSystem::ParallelFor(OCCLUSION_TILES_X * OCCLUSION_TILES_Y, 1, [this](uint32_t begin, uint32_t end) {
+		for (uint32_t tile = begin; tile < end; tile += 1) {
+			RasterizeTile(tile);
+			BuildTileHiZ(tile);
+		}
+	});
+
+	auto endTime = std::chrono::high_resolution_clock::now();
+	rasterTime = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime).count();
+}
+
+void OcclusionCuller::RasterizeTile(uint32_t tile) {
+	int tileX0 = (tile % OCCLUSION_TILES_X) * OCCLUSION_TILE_WIDTH;
+	int tileY0 = (tile / OCCLUSION_TILES_X) * OCCLUSION_TILE_HEIGHT;
+	int tileX1 = tileX0 + OCCLUSION_TILE_WIDTH - 1;
+	int tileY1 = tileY0 + OCCLUSION_TILE_HEIGHT - 1;
+
+	float* depth = hiZ[0].data();
+	for (int y = tileY0; y <= tileY1; y += 1) {
+		std::fill(depth + y * OCCLUSION_WIDTH + tileX0, depth + y * OCCLUSION_WIDTH + tileX1 + 1, 1.0f);
+	}
+
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 laneOffsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+	for (uint32_t index : bins[tile]) {
+		const ScreenTriangle& t = triangles[index];
+
+		// Edge functions a * x + b * y + c, one per edge, positive inside
+		const glm::vec3* v[3] = { &t.v0, &t.v1, &t.v2 };
+		float a[3], b[3], c[3];
+		for (uint32_t e = 0; e < 3; e += 1) {
+			const glm::vec3& from = *v[e];
+			const glm::vec3& to = *v[(e + 1) % 3];
+			a[e] = from.y - to.y;
+			b[e] = to.x - from.x;
+			c[e] = -(a[e] * from.x + b[e] * from.y);
+		}
+
+		// Depth across the triangle's plane
+		float area = (t.v1.x - t.v0.x) * (t.v2.y - t.v0.y) - (t.v1.y - t.v0.y) * (t.v2.x - t.v0.x);
+		float dzdx = ((t.v1.z - t.v0.z) * (t.v2.y - t.v0.y) - (t.v2.z - t.v0.z) * (t.v1.y - t.v0.y)) / area;
+		float dzdy = ((t.v2.z - t.v0.z) * (t.v1.x - t.v0.x) - (t.v1.z - t.v0.z) * (t.v2.x - t.v0.x)) / area;
+		float dzc = t.v0.z - dzdx * t.v0.x - dzdy * t.v0.y;
+
+		// Triangle's pixels in this tile, from the start of their group of 4
+		int x0 = static_cast<int>(std::max<float>(tileX0, std::floor(std::min(t.v0.x, std::min(t.v1.x, t.v2.x)))));
+		int y0 = static_cast<int>(std::max<float>(tileY0, std::floor(std::min(t.v0.y, std::min(t.v1.y, t.v2.y)))));
+		int x1 = static_cast<int>(std::min<float>(tileX1, std::floor(std::max(t.v0.x, std::max(t.v1.x, t.v2.x)))));
+		int y1 = static_cast<int>(std::min<float>(tileY1, std::floor(std::max(t.v0.y, std::max(t.v1.y, t.v2.y)))));
+		x0 &= ~3;
+
+		__m128 a0 = _mm_set1_ps(a[0]), a1 = _mm_set1_ps(a[1]), a2 = _mm_set1_ps(a[2]);
+		__m128 dzdx4 = _mm_set1_ps(dzdx);
+		for (int y = y0; y <= y1; y += 1) {
+			float py = y + 0.5f;
+			__m128 row0 = _mm_set1_ps(b[0] * py + c[0]);
+			__m128 row1 = _mm_set1_ps(b[1] * py + c[1]);
+			__m128 row2 = _mm_set1_ps(b[2] * py + c[2]);
+			__m128 rowZ = _mm_set1_ps(dzdy * py + dzc);
+
+			float* depthRow = depth + y * OCCLUSION_WIDTH;
+			for (int x = x0; x <= x1; x += 4) {
+				__m128 px = _mm_add_ps(_mm_set1_ps(static_cast<float>(x)), laneOffsets);
+				__m128 inside = _mm_and_ps(
+					_mm_and_ps(
+						_mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a0, px), row0), zero),
+						_mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a1, px), row1), zero)),
+					_mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a2, px), row2), zero));
+				if (_mm_movemask_ps(inside) == 0) {
+					continue;
+				}
+
+				__m128 z = _mm_add_ps(_mm_mul_ps(dzdx4, px), rowZ);
+				__m128 old = _mm_loadu_ps(depthRow + x);
+				__m128 nearest = _mm_min_ps(old, z);
+				_mm_storeu_ps(depthRow + x, _mm_or_ps(_mm_and_ps(inside, nearest), _mm_andnot_ps(inside, old)));
+			}
+		}
+	}
+}
+
+void OcclusionCuller::BuildTileHiZ(uint32_t tile) {
+	for (uint32_t level = 1; level < OCCLUSION_HIZ_LEVELS; level += 1) {
+		uint32_t width = OCCLUSION_TILE_WIDTH >> level;
+		uint32_t height = OCCLUSION_TILE_HEIGHT >> level;
+		uint32_t x0 = (tile % OCCLUSION_TILES_X) * width;
+		uint32_t y0 = (tile / OCCLUSION_TILES_X) * height;
+
+		const float* finer = hiZ[level - 1].data();
+		float* coarser = hiZ[level].data();
+		uint32_t finerWidth = OCCLUSION_WIDTH >> (level - 1);
+		uint32_t coarserWidth = OCCLUSION_WIDTH >> level;
+		for (uint32_t y = y0; y < y0 + height; y += 1) {
+			for (uint32_t x = x0; x < x0 + width; x += 1) {
+				const float* texel = finer + (2 * y) * finerWidth + 2 * x;
+				coarser[y * coarserWidth + x] = std::max(
+					std::max(texel[0], texel[1]),
+					std::max(texel[finerWidth], texel[finerWidth + 1]));
+			}
+		}
+	}
+}
+
+bool OcclusionCuller::Occluded(const glm::vec3& boundsMin, const glm::vec3& boundsMax) const {
+	glm::vec2 rectMin, rectMax;
+	float nearestDepth;
+	if (!ProjectBox(projView, boundsMin, boundsMax, rectMin, rectMax, nearestDepth)) {
+		return false;
+	}
+	// Off screen is for the frustum to decide
+	if (rectMax.x < 0.0f || rectMax.y < 0.0f || rectMin.x >= OCCLUSION_WIDTH || rectMin.y >= OCCLUSION_HEIGHT) {
+		return false;
+	}
+
+	// Every pixel the rectangle touches
+	int x0 = static_cast<int>(std::max(0.0f, std::floor(rectMin.x)));
+	int y0 = static_cast<int>(std::max(0.0f, std::floor(rectMin.y)));
+	int x1 = static_cast<int>(std::min(OCCLUSION_WIDTH - 1.0f, std::floor(rectMax.x)));
+	int y1 = static_cast<int>(std::min(OCCLUSION_HEIGHT - 1.0f, std::floor(rectMax.y)));
+
+	// Coarsest level is only needed until the rectangle is at most 4 texels across
+	uint32_t level = 0;
+	while (level + 1 < OCCLUSION_HIZ_LEVELS && ((x1 >> level) - (x0 >> level) >= 4 || (y1 >> level) - (y0 >> level) >= 4)) {
+		level += 1;
+	}
+
+	const float* depth = hiZ[level].data();
+	uint32_t width = OCCLUSION_WIDTH >> level;
+	for (int y = y0 >> level; y <= (y1 >> level); y += 1) {
+		for (int x = x0 >> level; x <= (x1 >> level); x += 1) {
+			if (nearestDepth <= depth[y * width + x]) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+void OcclusionCuller::Benchmark(uint32_t iterations) {
+	const uint32_t numBoxes = 100000;
+	const float wallZ = -20.0f;
+	const float floorY = -4.0f;
+
+	fprintf(stderr, "\nCPU Occlusion Culling -- %ux%u depth, %u threads, %u boxes, %u iterations\n",
+		OCCLUSION_WIDTH, OCCLUSION_HEIGHT, JobSystem::NumThreads(), numBoxes, iterations);
+
+	// Camera at the origin looking down -z, a wall across the middle of the view and a floor
+	// running from behind the camera to past the wall, so it's clipped by the near plane
+	glm::mat4 projView = glm::perspective(glm::radians(60.0f), 2.0f, 0.1f, 200.0f)
+		* glm::lookAt(glm::vec3(0.0f), glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+
+	// 64x32 quads of wall
+	std::vector<glm::vec3> wallPositions;
+	std::vector<uint32_t> wallIndices;
+	const uint32_t quadsX = 64, quadsY = 32;
+	for (uint32_t y = 0; y <= quadsY; y += 1) {
+		for (uint32_t x = 0; x <= quadsX; x += 1) {
+			wallPositions.push_back(glm::vec3(-16.0f + 32.0f * x / quadsX, floorY + 12.0f * y / quadsY, wallZ));
+		}
+	}
+	for (uint32_t y = 0; y < quadsY; y += 1) {
+		for (uint32_t x = 0; x < quadsX; x += 1) {
+			uint32_t corner = y * (quadsX + 1) + x;
+			uint32_t quad[6] = { corner, corner + 1, corner + quadsX + 2, corner, corner + quadsX + 2, corner + quadsX + 1 };
+			wallIndices.insert(wallIndices.end(), quad, quad + 6);
+		}
+	}
+	glm::vec3 floorPositions[4] = {
+		glm::vec3(-200.0f, floorY, 10.0f), glm::vec3(200.0f, floorY, 10.0f),
+		glm::vec3(200.0f, floorY, -200.0f), glm::vec3(-200.0f, floorY, -200.0f)
+	};
+	uint32_t floorIndices[6] = { 0, 1, 2, 0, 2, 3 };
+
+	std::mt19937 rng(29);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	std::vector<glm::vec3> boxMin(numBoxes), boxMax(numBoxes);
+	for (uint32_t i = 0; i < numBoxes; i += 1) {
+		float z = -2.0f - unit(rng) * 58.0f;
+		glm::vec3 center = glm::vec3((unit(rng) * 2.0f - 1.0f) * 0.9f * -z, -8.0f + unit(rng) * 14.0f, z);
+		glm::vec3 extent = glm::vec3(unit(rng), unit(rng), unit(rng)) * 0.5f + 0.05f;
+		boxMin[i] = center - extent;
+		boxMax[i] = center + extent;
+	}
+
+	OcclusionCuller culler;
+	std::vector<uint8_t> occluded(numBoxes);
+	long long binTime = 0;
+	long long rasterTime = 0;
+	long long testTime = 0;
+	for (uint32_t i = 0; i < iterations; i += 1) {
+		auto start = std::chrono::high_resolution_clock::now();
+		culler.Begin(projView);
+		culler.AddOccluder(wallPositions.data(), wallIndices.data(), static_cast<uint32_t>(wallIndices.size()), glm::mat4(1.0f));
+		culler.AddOccluder(floorPositions, floorIndices, 6, glm::mat4(1.0f));
+		auto binned = std::chrono::high_resolution_clock::now();
+		culler.Rasterize();
+
+		auto testStart = std::chrono::high_resolution_clock::now();
+		JobSystem::ParallelFor(numBoxes, 1024, [&](uint32_t begin, uint32_t end) {
+			for (uint32_t box = begin; box < end; box += 1) {
+				occluded[box] = culler.Occluded(boxMin[box], boxMax[box]) ? 1 : 0;
+			}
+		});
+		auto testDone = std::chrono::high_resolution_clock::now();
+
+		binTime += std::chrono::duration_cast<std::chrono::microseconds>(binned - start).count();
+		rasterTime += culler.rasterTime;
+		testTime += std::chrono::duration_cast<std::chrono::microseconds>(testDone - testStart).count();
+	}
+
+	uint32_t numOccluded = 0;
+	uint32_t wrong = 0;
+	for (uint32_t box = 0; box < numBoxes; box += 1) {
+		numOccluded += occluded[box];
+		// Slivers thinner than a pixel can fall between pixel centers, so only count boxes
+		// that reach a pixel or more past the wall's base
+		bool seen = boxMax[box].z > wallZ + 0.25f && boxMax[box].y > floorY + 0.25f;
+		wrong += (occluded[box] && seen) ? 1 : 0;
+	}
+
+	fprintf(stderr, "CPU Occlusion Culling -- %u occluders, %u triangles: Clip and bin (us): %.1f, rasterize and HiZ (us): %.1f, test boxes (us): %.1f\n",
+		culler.NumOccluders(), culler.NumTriangles(), binTime / static_cast<float>(iterations),
+		rasterTime / static_cast<float>(iterations), testTime / static_cast<float>(iterations));
+	fprintf(stderr, "CPU Occlusion Culling -- %u of %u boxes occluded, %u of them in sight\n", numOccluded, numBoxes, wrong);
+}
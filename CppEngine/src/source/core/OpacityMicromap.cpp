@@ -0,0 +1,268 @@
+#include "OpacityMicromap.h"
+
+#include "JobSystem.h"
+#include "RaytracerTypes.h"
+#include "TiledTexture.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <unordered_map>
+
+namespace {
+	inline uint32_t MicroState(const uint32_t* words, uint32_t microTriangle) {
+		return (words[microTriangle >> 4] >> ((microTriangle & 15) * 2)) & 3;
+	}
+
+	inline int32_t Wrap(int32_t x, int32_t size) {
+		x %= size;
+		return x < 0 ? x + size : x;
+	}
+}
+
+OpacityMicromap::TransparentTexels::TransparentTexels(const TiledTexture* alpha) :
+	width(static_cast<int32_t>(alpha->Width())), height(static_cast<int32_t>(alpha->Height())) {
+
+	sums = std::vector<uint32_t>(static_cast<size_t>(width + 1) * (height + 1), 0);
+	for (int32_t y = 0; y < height; y += 1) {
+		uint32_t row = 0;
+		for (int32_t x = 0; x < width; x += 1) {
+			row += alpha->Texel(0, x, y).x < REALLY_SMALL_NUMBER;
+			sums[static_cast<size_t>(y + 1) * (width + 1) + x + 1] = sums[static_cast<size_t>(y) * (width + 1) + x + 1] + row;
+		}
+	}
+}
+
+uint64_t OpacityMicromap::TransparentTexels::CountInside(int32_t x0, int32_t y0, int32_t x1, int32_t y1) const {
+	size_t stride = width + 1;
+	return static_cast<uint64_t>(sums[(y1 + 1) * stride + x1 + 1]) + sums[y0 * stride + x0]
+		- sums[y0 * stride + x1 + 1] - sums[(y1 + 1) * stride + x0];
+}
+
+uint64_t OpacityMicromap::TransparentTexels::Count(int32_t x0, int32_t y0, int32_t x1, int32_t y1) const {
+	// Cut into pieces that each sit inside one repeat of the texture
+	uint64_t count = 0;
+	for (int32_t y = y0; y <= y1;) {
+		int32_t startY = Wrap(y, height);
+		int32_t rows = std::min(y1 - y + 1, height - startY);
+		for (int32_t x = x0; x <= x1;) {
+			int32_t startX = Wrap(x, width);
+			int32_t columns = std::min(x1 - x + 1, width - startX);
+			count += CountInside(startX, startY, startX + columns - 1, startY + rows - 1);
+			x += columns;
+		}
+		y += rows;
+	}
+	return count;
+}
+
+OpacityMicromap::OpacityMicromap(
+	const GPUVertex* gpuVertices,
+	const GPUTriangle* gpuTriangles,
+	uint32_t numTriangles,
+	const MaterialTextures* materialTextures,
+	uint32_t subdivisionLevel
+) :
+	vertices(gpuVertices), triangles(gpuTriangles), textures(materialTextures), level(subdivisionLevel) {
+
+	assert(level <= 8);
+	auto start = std::chrono::high_resolution_clock::now();
+
+	edgeSegments = 1u << level;
+	uint32_t numMicroTriangles = edgeSegments * edgeSegments;
+	wordsPerTriangle = (numMicroTriangles + 15) / 16;
+
+	// Every alpha tested triangle gets its states baked, then the ones that came out all the
+	// same are dropped and the rest packed together
+	offsets = std::vector<uint32_t>(numTriangles, NOT_ALPHA_TESTED);
+	std::vector<uint32_t> alphaTriangles;
+	for (uint32_t i = 0; i < numTriangles; i += 1) {
+		if (textures && textures[triangles[i].materialIndex].alpha) {
+			alphaTriangles.push_back(i);
+		}
+	}
+	numAlphaTriangles = static_cast<uint32_t>(alphaTriangles.size());
+
+	// One table per alpha texture, however many materials share it
+	std::unordered_map<const TiledTexture*, std::unique_ptr<TransparentTexels> > tables;
+	for (uint32_t a = 0; a < numAlphaTriangles; a += 1) {
+		const TiledTexture* alpha = textures[triangles[alphaTriangles[a]].materialIndex].alpha;
+		if (tables.find(alpha) == tables.end()) {
+			tables[alpha] = std::unique_ptr<TransparentTexels>(new TransparentTexels(alpha));
+		}
+	}
+
+	std::vector<uint32_t> baked(alphaTriangles.size() * wordsPerTriangle, 0);
+	JobSystem::ParallelFor(numAlphaTriangles, 16, [&](uint32_t begin, uint32_t end) {
+		const glm::vec2 whole[3] = { glm::vec2(0.0f, 0.0f), glm::vec2(1.0f, 0.0f), glm::vec2(0.0f, 1.0f) };
+		for (uint32_t a = begin; a < end; a += 1) {
+			const TransparentTexels& texels = *tables.at(textures[triangles[alphaTriangles[a]].materialIndex].alpha);
+			BakeMicroTriangles(alphaTriangles[a], whole, 0, MicroOpacity::Unknown, texels, &baked[a * wordsPerTriangle]);
+		}
+	});
+
+	for (uint32_t a = 0; a < numAlphaTriangles; a += 1) {
+		const uint32_t* words = &baked[a * wordsPerTriangle];
+		uint32_t counts[3] = { 0, 0, 0 };
+		for (uint32_t m = 0; m < numMicroTriangles; m += 1) {
+			counts[MicroState(words, m)] += 1;
+		}
+		for (uint32_t c = 0; c < 3; c += 1) {
+			microCounts[c] += counts[c];
+		}
+
+		uint32_t& offset = offsets[alphaTriangles[a]];
+		if (counts[static_cast<uint32_t>(MicroOpacity::Opaque)] == numMicroTriangles) {
+			offset = ALL_OPAQUE;
+			numAllOpaque += 1;
+		}
+		else if (counts[static_cast<uint32_t>(MicroOpacity::Transparent)] == numMicroTriangles) {
+			offset = ALL_TRANSPARENT;
+			numAllTransparent += 1;
+		}
+		else {
+			offset = static_cast<uint32_t>(states.size());
+			states.insert(states.end(), words, words + wordsPerTriangle);
+		}
+	}
+
+	auto stop = std::chrono::high_resolution_clock::now();
+	bakeTime = std::chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+}
+
+OpacityMicromap::OpacityMicromap(
+	const GPUVertex* gpuVertices,
+	const GPUTriangle* gpuTriangles,
+	const MaterialTextures* materialTextures,
+	const uint32_t* bakedOffsets,
+	uint32_t numTriangles,
+	const uint32_t* bakedStates,
+	uint32_t numStates,
+	uint32_t subdivisionLevel
+) :
+	vertices(gpuVertices), triangles(gpuTriangles), textures(materialTextures), level(subdivisionLevel),
+	offsets(bakedOffsets, bakedOffsets + numTriangles), states(bakedStates, bakedStates + numStates) {
+
+	assert(level <= 8);
+	edgeSegments = 1u << level;
+	wordsPerTriangle = (edgeSegments * edgeSegments + 15) / 16;
+}
+
+glm::vec2 OpacityMicromap::TriangleUV(uint32_t triangle, float u, float v) const {
+	const GPUTriangle& tri = triangles[triangle];
+	const GPUVertex& a = vertices[tri.indices[0]];
+	const GPUVertex& b = vertices[tri.indices[1]];
+	const GPUVertex& c = vertices[tri.indices[2]];
+
+	// Same weights as the tracer's hits, u for the second vertex and v for the third
+	glm::vec2 aUV = glm::vec2(a.position_and_u.w, a.normal_and_v.w);
+	glm::vec2 bUV = glm::vec2(b.position_and_u.w, b.normal_and_v.w);
+	glm::vec2 cUV = glm::vec2(c.position_and_u.w, c.normal_and_v.w);
+	return aUV * (1.0f - u - v) + bUV * u + cUV * v;
+}
+
+uint32_t OpacityMicromap::MicroTriangle(float u, float v) const {
+	float fu = u * edgeSegments;
+	float fv = v * edgeSegments;
+	uint32_t j = std::min(edgeSegments - 1, static_cast<uint32_t>(std::max(fv, 0.0f)));
+	uint32_t i = std::min(edgeSegments - 1 - j, static_cast<uint32_t>(std::max(fu, 0.0f)));
+
+	uint32_t micro = j * (2 * edgeSegments - j) + 2 * i;
+	if (i + j + 1 < edgeSegments && (fu - i) + (fv - j) > 1.0f) {
+		micro += 1;
+	}
+	return micro;
+}
+
+MicroOpacity OpacityMicromap::Lookup(uint32_t triangle, float u, float v) const {
+	uint32_t offset = offsets[triangle];
+	if (offset == NOT_ALPHA_TESTED) {
+		return MicroOpacity::Opaque;
+	}
+	if (offset == ALL_OPAQUE) {
+		return useMicromap ? MicroOpacity::Opaque : MicroOpacity::Unknown;
+	}
+	if (offset == ALL_TRANSPARENT) {
+		return useMicromap ? MicroOpacity::Transparent : MicroOpacity::Unknown;
+	}
+	if (!useMicromap) {
+		return MicroOpacity::Unknown;
+	}
+
+	return static_cast<MicroOpacity>(MicroState(&states[offset], MicroTriangle(u, v)));
+}
+
+bool OpacityMicromap::SampleTransparent(uint32_t triangle, float u, float v) const {
+	const TiledTexture* alpha = textures[triangles[triangle].materialIndex].alpha;
+	return alpha->SampleLevel(TriangleUV(triangle, u, v), 0).x < REALLY_SMALL_NUMBER;
+}
+
+void OpacityMicromap::BakeMicroTriangles(uint32_t triangle, const glm::vec2* corners, uint32_t depth, MicroOpacity parent, const TransparentTexels& texels, uint32_t* words) const {
+	// Once a triangle is all one thing so is every part of it, only mixed ones are split and
+	// scanned again
+	MicroOpacity opacity = parent != MicroOpacity::Unknown ? parent : ClassifyMicroTriangle(triangle, corners, texels);
+
+	if (depth == level) {
+		glm::vec2 center = (corners[0] + corners[1] + corners[2]) / 3.0f;
+		uint32_t micro = MicroTriangle(center.x, center.y);
+		words[micro >> 4] |= static_cast<uint32_t>(opacity) << ((micro & 15) * 2);
+		return;
+	}
+
+	// Splitting at the edge midpoints lands on the same grid MicroTriangle indexes
+	glm::vec2 m01 = (corners[0] + corners[1]) * 0.5f;
+	glm::vec2 m12 = (corners[1] + corners[2]) * 0.5f;
+	glm::vec2 m20 = (corners[2] + corners[0]) * 0.5f;
+	const glm::vec2 children[4][3] = {
+		{ corners[0], m01, m20 },
+		{ m01, corners[1], m12 },
+		{ m20, m12, corners[2] },
+		{ m12, m20, m01 }
+	};
+	for (uint32_t c = 0; c < 4; c += 1) {
+		BakeMicroTriangles(triangle, children[c], depth + 1, opacity, texels, words);
+	}
+}
+
+MicroOpacity OpacityMicromap::ClassifyMicroTriangle(uint32_t triangle, const glm::vec2* corners, const TransparentTexels& texels) const {
+	glm::vec2 uvMin = glm::vec2(INFINITY);
+	glm::vec2 uvMax = glm::vec2(-INFINITY);
+	for (uint32_t c = 0; c < 3; c += 1) {
+		glm::vec2 uv = TriangleUV(triangle, corners[c].x, corners[c].y);
+		uvMin = glm::min(uvMin, uv);
+		uvMax = glm::max(uvMax, uv);
+	}
+
+	// Every texel a bilinear lookup anywhere inside could blend, see TiledTexture::SampleLevel.
+	// Whatever is read in between is a weighted average of them.
+	int32_t x0 = static_cast<int32_t>(std::floor(uvMin.x * texels.width - 0.5f));
+	int32_t y0 = static_cast<int32_t>(std::floor(uvMin.y * texels.height - 0.5f));
+	int32_t x1 = static_cast<int32_t>(std::floor(uvMax.x * texels.width - 0.5f)) + 1;
+	int32_t y1 = static_cast<int32_t>(std::floor(uvMax.y * texels.height - 0.5f)) + 1;
+
+	uint64_t transparent = texels.Count(x0, y0, x1, y1);
+	if (transparent == 0) {
+		return MicroOpacity::Opaque;
+	}
+	if (transparent == static_cast<uint64_t>(x1 - x0 + 1) * (y1 - y0 + 1)) {
+		return MicroOpacity::Transparent;
+	}
+	return MicroOpacity::Unknown;
+}
+
+void OpacityMicromap::PrintBakeStats() const {
+	uint64_t numMicroTriangles = microCounts[0] + microCounts[1] + microCounts[2];
+	float toPercent = numMicroTriangles > 0 ? 100.0f / numMicroTriangles : 0.0f;
+
+	fprintf(stderr, "\nCPU Opacity Micromap -- %u of %zu triangles alpha tested, level %u, baked in %.2f ms\n",
+		numAlphaTriangles, offsets.size(), level, bakeTime / 1000.0f);
+	fprintf(stderr, "CPU Opacity Micromap -- Micro triangles %.1f%% opaque, %.1f%% transparent, %.1f%% unknown\n",
+		microCounts[static_cast<uint32_t>(MicroOpacity::Opaque)] * toPercent,
+		microCounts[static_cast<uint32_t>(MicroOpacity::Transparent)] * toPercent,
+		microCounts[static_cast<uint32_t>(MicroOpacity::Unknown)] * toPercent);
+	fprintf(stderr, "CPU Opacity Micromap -- %u triangles all opaque, %u all transparent, %zu bytes of states\n",
+		numAllOpaque, numAllTransparent, states.size() * sizeof(uint32_t));
+}
@@ -0,0 +1,233 @@
+#include "PointLightPool.h"
+
+#include "RenderTypes.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+
+// Radius is where attenuation brings a light's luminance down to this
+#define POINT_LIGHT_CUTOFF 0.005f
+
+namespace {
+	inline uint32_t HandleSlot(PointLightHandle handle) {
+		return handle & (POINT_LIGHT_MAX_LIGHTS - 1);
+	}
+
+	inline uint32_t HandleGeneration(PointLightHandle handle) {
+		return handle >> POINT_LIGHT_SLOT_BITS;
+	}
+
+	inline glm::vec4 ColorAndLuminance(const glm::vec3& color) {
+		return glm::vec4(color, .6f * color.g + .3f * color.r + .1f * color.b);
+	}
+
+	// lum / (1 + 2 * radius * radius) = POINT_LIGHT_CUTOFF, leaving out the linear term
+	inline float Radius(float luminance) {
+		return std::sqrt(luminance / (2.0f * POINT_LIGHT_CUTOFF));
+	}
+}
+
+PointLightHandle PointLightPool::Add(const glm::vec3& position, const glm::vec3& color) {
+	uint32_t slot = freeSlot;
+	if (slot != POINT_LIGHT_INVALID_HANDLE) {
+		freeSlot = slots[slot].index;
+	}
+	else if (slots.size() < POINT_LIGHT_MAX_LIGHTS) {
+		slot = static_cast<uint32_t>(slots.size());
+		slots.push_back(Slot{ 0, 0 });
+	}
+	else {
+		fprintf(stderr, "WARNING. Point light pool is full at %u lights\n", POINT_LIGHT_MAX_LIGHTS);
+		return POINT_LIGHT_INVALID_HANDLE;
+	}
+
+	uint32_t index = Count();
+	slots[slot].index = index;
+
+	glm::vec4 colorAndLuminance = ColorAndLuminance(color);
+	positionsAndRadii.push_back(glm::vec4(position, Radius(colorAndLuminance.w)));
+	colorsAndLuminance.push_back(colorAndLuminance);
+	flags.push_back(0);
+	lightSlots.push_back(slot);
+	dirtyBits.resize((Count() + 63) / 64, 0);
+
+	MarkDirty(index, POINT_LIGHT_MOVED | POINT_LIGHT_RECOLORED);
+	return (slots[slot].generation << POINT_LIGHT_SLOT_BITS) | slot;
+}
+
+bool PointLightPool::Remove(PointLightHandle handle) {
+	uint32_t index = Find(handle);
+	if (index == POINT_LIGHT_INVALID_HANDLE) {
+		return false;
+	}
+
+	// The last light fills the gap, and its slot follows it there
+	uint32_t last = Count() - 1;
+	if (index != last) {
+		positionsAndRadii[index] = positionsAndRadii[last];
+		colorsAndLuminance[index] = colorsAndLuminance[last];
+		lightSlots[index] = lightSlots[last];
+		slots[lightSlots[index]].index = index;
+		MarkDirty(index, POINT_LIGHT_MOVED | POINT_LIGHT_RECOLORED);
+	}
+	dirtyBits[last / 64] &= ~(1ull << (last % 64));
+
+	positionsAndRadii.pop_back();
+	colorsAndLuminance.pop_back();
+	flags.pop_back();
+	lightSlots.pop_back();
+	dirtyBits.resize((Count() + 63) / 64);
+	dirtyFlags |= POINT_LIGHT_MOVED;
+
+	uint32_t slot = HandleSlot(handle);
+	slots[slot].generation = (slots[slot].generation + 1) & ((1u << POINT_LIGHT_GENERATION_BITS) - 1);
+	slots[slot].index = freeSlot;
+	freeSlot = slot;
+	return true;
+}
+
+bool PointLightPool::SetPosition(PointLightHandle handle, const glm::vec3& position) {
+	uint32_t index = Find(handle);
+	if (index == POINT_LIGHT_INVALID_HANDLE) {
+		return false;
+	}
+
+	// Scripts often place every light every frame, only the ones that went somewhere count
+	glm::vec4& p = positionsAndRadii[index];
+	if (p.x != position.x || p.y != position.y || p.z != position.z) {
+		p = glm::vec4(position, p.w);
+		MarkDirty(index, POINT_LIGHT_MOVED);
+	}
+	return true;
+}
+
+bool PointLightPool::SetColor(PointLightHandle handle, const glm::vec3& color) {
+	uint32_t index = Find(handle);
+	if (index == POINT_LIGHT_INVALID_HANDLE) {
+		return false;
+	}
+
+	glm::vec4 colorAndLuminance = ColorAndLuminance(color);
+	if (colorAndLuminance == colorsAndLuminance[index]) {
+		return true;
+	}
+	colorsAndLuminance[index] = colorAndLuminance;
+
+	// A brighter light reaches further, so it has to be culled again
+	float radius = Radius(colorAndLuminance.w);
+	uint8_t what = POINT_LIGHT_RECOLORED;
+	if (radius != positionsAndRadii[index].w) {
+		positionsAndRadii[index].w = radius;
+		what |= POINT_LIGHT_MOVED;
+	}
+	MarkDirty(index, what);
+	return true;
+}
+
+bool PointLightPool::IsValid(PointLightHandle handle) const {
+	return Find(handle) != POINT_LIGHT_INVALID_HANDLE;
+}
+
+uint32_t PointLightPool::Find(PointLightHandle handle) const {
+	uint32_t slot = HandleSlot(handle);
+	if (handle == POINT_LIGHT_INVALID_HANDLE || slot >= slots.size() || slots[slot].generation != HandleGeneration(handle)) {
+		return POINT_LIGHT_INVALID_HANDLE;
+	}
+
+	// A free slot's generation has already moved past every handle given out for it
+	return slots[slot].index;
+}
+
+void PointLightPool::MarkDirty(uint32_t index, uint8_t what) {
+	dirtyBits[index / 64] |= 1ull << (index % 64);
+	flags[index] |= what;
+	dirtyFlags |= what;
+}
+
+void PointLightPool::ClearDirty() {
+	std::fill(flags.begin(), flags.end(), 0);
+	std::fill(dirtyBits.begin(), dirtyBits.end(), 0);
+	dirtyFlags = 0;
+}
+
+size_t PointLightPool::BytesPerLight() const {
+	return 2 * sizeof(glm::vec4) + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(Slot);
+}
+
+void PointLightPool::Benchmark(uint32_t iterations) {
+	const uint32_t count = 100000;
+	const uint32_t movedPerFrame = 1000;
+
+	std::mt19937 rng(17);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+	PointLightPool pool;
+	std::vector<PointLightHandle> handles(count);
+	for (PointLightHandle& handle : handles) {
+		handle = pool.Add(glm::vec3(unit(rng), unit(rng), unit(rng)) * 100.0f, glm::vec3(unit(rng), unit(rng), unit(rng)));
+	}
+	pool.ClearDirty();
+
+	// What the renderers kept before, their own interleaved copy diffed against the scene
+	std::vector<PointLightToGPU> copy(count);
+	for (uint32_t i = 0; i < count; i += 1) {
+		copy[i].position_and_radius = pool.PositionsAndRadii()[i];
+		copy[i].color_and_luminance = pool.ColorsAndLuminance()[i];
+	}
+
+	fprintf(stderr, "\nCPU Point Light Pool -- %u lights, %u moved a frame, %u iterations, %zu bytes a light\n",
+		count, movedPerFrame, iterations, pool.BytesPerLight());
+
+	long long moveTime = 0;
+	long long walkTime = 0;
+	long long diffTime = 0;
+	uint64_t uploaded = 0;
+	uint64_t diffed = 0;
+	for (uint32_t i = 0; i < iterations; i += 1) {
+		auto start = std::chrono::high_resolution_clock::now();
+		for (uint32_t j = 0; j < movedPerFrame; j += 1) {
+			pool.SetPosition(handles[static_cast<uint32_t>(unit(rng) * count) % count], glm::vec3(unit(rng), unit(rng), unit(rng)) * 100.0f);
+		}
+		auto moved = std::chrono::high_resolution_clock::now();
+
+		pool.ForEachDirtyRun(4, [&uploaded](uint32_t begin, uint32_t end) {
+			uploaded += end - begin;
+		});
+		pool.ClearDirty();
+		auto walked = std::chrono::high_resolution_clock::now();
+
+		for (uint32_t j = 0; j < count; j += 1) {
+			PointLightToGPU p;
+			p.position_and_radius = pool.PositionsAndRadii()[j];
+			p.color_and_luminance = pool.ColorsAndLuminance()[j];
+			if (std::memcmp(&p, &copy[j], sizeof(PointLightToGPU)) != 0) {
+				copy[j] = p;
+				diffed += 1;
+			}
+		}
+		auto stop = std::chrono::high_resolution_clock::now();
+
+		moveTime += std::chrono::duration_cast<std::chrono::microseconds>(moved - start).count();
+		walkTime += std::chrono::duration_cast<std::chrono::microseconds>(walked - moved).count();
+		diffTime += std::chrono::duration_cast<std::chrono::microseconds>(stop - walked).count();
+	}
+
+	// Removing a light kills its handle and no other
+	PointLightHandle removed = handles[0];
+	pool.Remove(removed);
+	uint32_t broken = pool.IsValid(removed) ? 1 : 0;
+	for (uint32_t i = 1; i < count; i += 1) {
+		broken += pool.IsValid(handles[i]) ? 0 : 1;
+	}
+	PointLightHandle reused = pool.Add(glm::vec3(0.0f), glm::vec3(1.0f));
+	broken += pool.IsValid(removed) || !pool.IsValid(reused) ? 1 : 0;
+
+	fprintf(stderr, "CPU Point Light Pool -- Moves (us): %.1f, dirty walk (us): %.1f, %.1f lights uploaded a frame\n",
+		moveTime / static_cast<float>(iterations), walkTime / static_cast<float>(iterations), uploaded / static_cast<float>(iterations));
+	fprintf(stderr, "CPU Point Light Pool -- Diffing a copy (us): %.1f, %.1f lights changed a frame, %u broken handles\n",
+		diffTime / static_cast<float>(iterations), diffed / static_cast<float>(iterations), broken);
+}
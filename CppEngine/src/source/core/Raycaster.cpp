@@ -0,0 +1,124 @@
+#include "Raycaster.h"
+
+#include "BVH.h"
+#include "JobSystem.h"
+
+#include <algorithm>
+#include <chrono>
+
+// Small enough to spread a few hundred rays over every thread
+#define RAYCAST_GRAIN_SIZE 64
+#define RAYCAST_PACKET_SIZE 4
+
+Raycaster::Raycaster(
+	const BVH* sceneBVH,
+	const GPUTriangle* gpuTriangles,
+	const uint32_t* materialInstances
+) :
+	bvh(sceneBVH),
+	triangles(gpuTriangles),
+	instances(materialInstances)
+{}
+
+Raycaster::~Raycaster() {
+	// Workers may still be reading our buffers
+	if (tracingDone.valid()) {
+		tracingDone.wait();
+	}
+}
+
+void Raycaster::Frame::Clear() {
+	batches.clear();
+	rays.clear();
+	hits.clear();
+}
+
+void Raycaster::Raycast(const Ray* rays, uint32_t count, RaycastHit* hits) const {
+	JobSystem::ParallelFor(count, RAYCAST_GRAIN_SIZE, [this, rays, hits](uint32_t begin, uint32_t end) {
+		// Neighbouring rays from the same call (a fan, a grid of picks) tend to head the same
+		// way, so try them as packets first. IntersectPacket falls back to single rays if not.
+		RayPacket<RAYCAST_PACKET_SIZE> packet;
+		for (uint32_t first = begin; first < end; first += RAYCAST_PACKET_SIZE) {
+			uint32_t numLanes = std::min(end - first, static_cast<uint32_t>(RAYCAST_PACKET_SIZE));
+			for (uint32_t lane = 0; lane < RAYCAST_PACKET_SIZE; lane += 1) {
+				packet.SetRay(lane, rays[first + (lane < numLanes ? lane : 0)]);
+			}
+			bvh->IntersectPacket<RAYCAST_PACKET_SIZE>(packet);
+
+			for (uint32_t lane = 0; lane < numLanes; lane += 1) {
+				RaycastHit& hit = hits[first + lane];
+				hit = RaycastHit();
+
+				uint32_t triangleIndex = packet.triangleIndex[lane];
+				if (triangleIndex == NO_HIT) {
+					continue;
+				}
+
+				hit.t = packet.tMax[lane];
+				hit.triangleIndex = triangleIndex;
+				hit.materialIndex = triangles[triangleIndex].materialIndex;
+				hit.instanceIndex = instances[hit.materialIndex];
+			}
+		}
+	});
+}
+
+uint32_t Raycaster::Submit(const Ray* rays, uint32_t count) {
+	Batch batch;
+	batch.firstRay = static_cast<uint32_t>(submitted.rays.size());
+	batch.numRays = count;
+
+	submitted.rays.insert(submitted.rays.end(), rays, rays + count);
+	submitted.batches.push_back(batch);
+
+	return submitted.firstBatch + static_cast<uint32_t>(submitted.batches.size()) - 1;
+}
+
+const RaycastHit* Raycaster::GetResults(uint32_t batch, uint32_t& count) const {
+	// Unsigned wrap takes care of ids from before this frame
+	uint32_t index = batch - ready.firstBatch;
+	if (index >= ready.batches.size()) {
+		count = 0;
+		return nullptr;
+	}
+
+	count = ready.batches[index].numRays;
+	return ready.hits.data() + ready.batches[index].firstRay;
+}
+
+void Raycaster::CollectResults() {
+	ready.Clear();
+	if (!tracingDone.valid()) {
+		return;
+	}
+
+	tracingDone.wait();
+	tracingDone = std::future<void>();
+	traceTime = tracingTime;
+
+	std::swap(ready, tracing);
+}
+
+void Raycaster::TraceSubmitted() {
+	uint32_t nextBatch = submitted.firstBatch + static_cast<uint32_t>(submitted.batches.size());
+
+	if (!submitted.batches.empty()) {
+		// Collect was skipped, this can't be overwritten while it's being traced
+		if (tracingDone.valid()) {
+			tracingDone.wait();
+		}
+
+		std::swap(tracing, submitted);
+		tracing.hits.resize(tracing.rays.size());
+
+		tracingDone = JobSystem::Submit([this]() {
+			auto start = std::chrono::high_resolution_clock::now();
+			Raycast(tracing.rays.data(), static_cast<uint32_t>(tracing.rays.size()), tracing.hits.data());
+			auto stop = std::chrono::high_resolution_clock::now();
+			tracingTime = std::chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+		});
+	}
+
+	submitted.Clear();
+	submitted.firstBatch = nextBatch;
+}
@@ -0,0 +1,223 @@
+#include "RenderQueue.h"
+
+#include "JobSystem.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+
+namespace {
+	inline uint64_t Field(uint32_t value, uint32_t bits) {
+		return static_cast<uint64_t>(value) & ((1ull << bits) - 1);
+	}
+
+	// Draws that need a different shader, material or vao than the one before, from the keys
+	inline uint32_t CountStateChanges(const DrawItem* items, uint32_t count) {
+		uint32_t changes = 0;
+		uint64_t last = ~0ull;
+		for (uint32_t i = 0; i < count; i += 1) {
+			uint64_t state = (items[i].key >> RENDER_KEY_DEPTH_BITS) & ((1ull << RENDER_KEY_STATE_BITS) - 1);
+			uint64_t differ = state ^ last;
+			changes += (differ >> (RENDER_KEY_MATERIAL_BITS + RENDER_KEY_VAO_BITS)) != 0 ? 1 : 0;
+			changes += ((differ >> RENDER_KEY_VAO_BITS) & ((1ull << RENDER_KEY_MATERIAL_BITS) - 1)) != 0 ? 1 : 0;
+			changes += (differ & ((1ull << RENDER_KEY_VAO_BITS) - 1)) != 0 ? 1 : 0;
+			last = state;
+		}
+		return changes;
+	}
+}
+
+uint64_t RenderQueue::StateBits(uint32_t shader, uint32_t material, uint32_t vao) {
+	return (Field(shader, RENDER_KEY_SHADER_BITS) << (RENDER_KEY_MATERIAL_BITS + RENDER_KEY_VAO_BITS))
+		| (Field(material, RENDER_KEY_MATERIAL_BITS) << RENDER_KEY_VAO_BITS)
+		| Field(vao, RENDER_KEY_VAO_BITS);
+}
+
+uint64_t RenderQueue::MakeKey(uint32_t pass, uint64_t stateBits, float depth) {
+	const uint32_t maxDepth = (1u << RENDER_KEY_DEPTH_BITS) - 1;
+	uint32_t quantized = static_cast<uint32_t>(std::min(std::max(depth, 0.0f), 1.0f) * maxDepth);
+
+	uint64_t key = static_cast<uint64_t>(pass) << (64 - RENDER_KEY_PASS_BITS);
+	if (pass == RENDER_PASS_TRANSPARENT) {
+		return key | (static_cast<uint64_t>(maxDepth - quantized) << RENDER_KEY_STATE_BITS) | stateBits;
+	}
+	return key | (stateBits << RENDER_KEY_DEPTH_BITS) | quantized;
+}
+
+uint32_t RenderQueue::PassBegin(uint32_t pass) const {
+	uint64_t first = static_cast<uint64_t>(pass) << (64 - RENDER_KEY_PASS_BITS);
+	return static_cast<uint32_t>(std::lower_bound(items.begin(), items.end(), first, [](const DrawItem& item, uint64_t key) {
+		return item.key < key;
+	}) - items.begin());
+}
+
+void RenderQueue::Sort() {
+	auto startTime = std::chrono::high_resolution_clock::now();
+
+	uint32_t count = Size();
+	if (count == 0) {
+		sortTime = 0;
+		return;
+	}
+	scratch.resize(count);
+
+	uint32_t numChunks = (count + RENDER_QUEUE_SORT_CHUNK - 1) / RENDER_QUEUE_SORT_CHUNK;
+	numChunks = std::max(1u, std::min(numChunks, JobSystem::NumThreads()));
+	counts.resize(numChunks * 256);
+
+	// Bits that are not the same in every key, digits without any are already sorted
+	uint64_t differ = 0;
+	for (uint32_t i = 1; i < count; i += 1) {
+		differ |= items[i].key ^ items[0].key;
+	}
+
+	DrawItem* from = items.data();
+	DrawItem* to = scratch.data();
+	for (uint32_t shift = 0; shift < 64; shift += 8) {
+		if (((differ >> shift) & 0xFF) == 0) {
+			continue;
+		}
+
+		JobSystem::ParallelFor(numChunks, 1, [this, from, count, numChunks, shift](uint32_t begin, uint32_t end) {
+			for (uint32_t chunk = begin; chunk < end; chunk += 1) {
+				uint32_t* chunkCounts = counts.data() + chunk * 256;
+				std::fill(chunkCounts, chunkCounts + 256, 0);
+				uint32_t last = static_cast<uint32_t>(static_cast<uint64_t>(count) * (chunk + 1) / numChunks);
+				for (uint32_t i = static_cast<uint32_t>(static_cast<uint64_t>(count) * chunk / numChunks); i < last; i += 1) {
+					chunkCounts[(from[i].key >> shift) & 0xFF] += 1;
+				}
+			}
+		});
+
+		// Where each chunk's first item of each digit goes, after every smaller digit and
+		// after the same digit in earlier chunks, which is what keeps the sort stable
+		uint32_t offset = 0;
+		for (uint32_t digit = 0; digit < 256; digit += 1) {
+			for (uint32_t chunk = 0; chunk < numChunks; chunk += 1) {
+				uint32_t digitCount = counts[chunk * 256 + digit];
+				counts[chunk * 256 + digit] = offset;
+				offset += digitCount;
+			}
+		}
+
+		JobSystem::ParallelFor(numChunks, 1, [this, from, to, count, numChunks, shift](uint32_t begin, uint32_t end) {
+			for (uint32_t chunk = begin; chunk < end; chunk += 1) {
+				uint32_t* offsets = counts.data() + chunk * 256;
+				uint32_t last = static_cast<uint32_t>(static_cast<uint64_t>(count) * (chunk + 1) / numChunks);
+				for (uint32_t i = static_cast<uint32_t>(static_cast<uint64_t>(count) * chunk / numChunks); i < last; i += 1) {
+					to[offsets[(from[i].key >> shift) & 0xFF]++] = from[i];
+				}
+			}
+		});
+		std::swap(from, to);
+	}
+
+	if (from != items.data()) {
+		items.swap(scratch);
+	}
+
+	auto endTime = std::chrono::high_resolution_clock::now();
+	sortTime = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime).count();
+}
+
+void RenderQueue::Benchmark(uint32_t iterations) {
+	fprintf(stderr, "\nCPU Render Queue -- %u threads, %u iterations\n", JobSystem::NumThreads(), iterations);
+
+	std::mt19937 rng(31);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+	const uint32_t counts[4] = { 1000, 10000, 100000, 1000000 };
+	for (uint32_t numDraws : counts) {
+		// 4 shaders, 256 materials, a vao each for up to 4096 meshes, and 1 in 10 transparent
+		std::vector<DrawItem> pushed(numDraws);
+		for (uint32_t i = 0; i < numDraws; i += 1) {
+			uint32_t pass = unit(rng) < 0.1f ? RENDER_PASS_TRANSPARENT : RENDER_PASS_OPAQUE;
+			uint32_t shader = 1 + static_cast<uint32_t>(unit(rng) * 4) % 4;
+			uint32_t material = static_cast<uint32_t>(unit(rng) * 256) % 256;
+			uint32_t vao = 1 + static_cast<uint32_t>(unit(rng) * 4096) % 4096;
+			pushed[i] = DrawItem{ MakeKey(pass, StateBits(shader, material, vao), unit(rng)), i };
+		}
+
+		RenderQueue queue;
+		std::vector<DrawItem> sorted;
+		long long radixTime = 0;
+		long long stdTime = 0;
+		for (uint32_t i = 0; i < iterations; i += 1) {
+			queue.Clear();
+			for (const DrawItem& item : pushed) {
+				queue.Push(item.key, item.index);
+			}
+			queue.Sort();
+			radixTime += queue.sortTime;
+
+			sorted = pushed;
+			auto start = std::chrono::high_resolution_clock::now();
+			std::stable_sort(sorted.begin(), sorted.end(), [](const DrawItem& a, const DrawItem& b) {
+				return a.key < b.key;
+			});
+			auto stop = std::chrono::high_resolution_clock::now();
+			stdTime += std::chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+		}
+
+		uint32_t different = 0;
+		for (uint32_t i = 0; i < numDraws; i += 1) {
+			different += queue[i].index != sorted[i].index ? 1 : 0;
+		}
+		// Opaque draws only, transparent ones have to go in depth order either way
+		uint32_t opaque = queue.PassBegin(RENDER_PASS_TRANSPARENT);
+		std::vector<DrawItem> pushedOpaque;
+		for (const DrawItem& item : pushed) {
+			if (KeyPass(item.key) == RENDER_PASS_OPAQUE) {
+				pushedOpaque.push_back(item);
+			}
+		}
+
+		fprintf(stderr, "CPU Render Queue -- %u draws: Radix sort (us): %.1f, std::stable_sort (us): %.1f, %u in a different place, opaque state changes as pushed %u, sorted %u\n",
+			numDraws, radixTime / static_cast<float>(iterations), stdTime / static_cast<float>(iterations), different,
+			CountStateChanges(pushedOpaque.data(), static_cast<uint32_t>(pushedOpaque.size())), CountStateChanges(sorted.data(), opaque));
+	}
+
+	// Transparent draws back to front, the renderer's old comparison against keys
+	const uint32_t numTransparent = 10000;
+	std::vector<glm::vec3> positions(numTransparent);
+	for (glm::vec3& position : positions) {
+		position = (glm::vec3(unit(rng), unit(rng), unit(rng)) * 2.0f - 1.0f) * 100.0f;
+	}
+	glm::vec3 camPos = glm::vec3(3.0f, 2.0f, 1.0f);
+	const float farPlane = 500.0f;
+
+	long long lengthTime = 0;
+	long long keyTime = 0;
+	RenderQueue queue;
+	for (uint32_t i = 0; i < iterations; i += 1) {
+		std::vector<glm::vec3> byLength = positions;
+		auto start = std::chrono::high_resolution_clock::now();
+		std::sort(byLength.begin(), byLength.end(), [camPos](const glm::vec3& a, const glm::vec3& b) {
+			return glm::length(a - camPos) > glm::length(b - camPos);
+		});
+		auto lengthDone = std::chrono::high_resolution_clock::now();
+
+		queue.Clear();
+		for (uint32_t j = 0; j < numTransparent; j += 1) {
+			queue.Push(MakeKey(RENDER_PASS_TRANSPARENT, StateBits(1, 0, 1), glm::length(positions[j] - camPos) / farPlane), j);
+		}
+		queue.Sort();
+		auto keyDone = std::chrono::high_resolution_clock::now();
+
+		lengthTime += std::chrono::duration_cast<std::chrono::microseconds>(lengthDone - start).count();
+		keyTime += std::chrono::duration_cast<std::chrono::microseconds>(keyDone - lengthDone).count();
+	}
+
+	// Quantizing can only swap draws closer together than a step of depth
+	uint32_t outOfOrder = 0;
+	const float step = farPlane / (1u << RENDER_KEY_DEPTH_BITS);
+	for (uint32_t i = 1; i < numTransparent; i += 1) {
+		float before = glm::length(positions[queue[i - 1].index] - camPos);
+		float after = glm::length(positions[queue[i].index] - camPos);
+		outOfOrder += after > before + step ? 1 : 0;
+	}
+
+	fprintf(stderr, "CPU Render Queue -- %u transparent draws back to front: std::sort with glm::length (us): %.1f, depth keys and radix sort (us): %.1f, %u out of order\n",
+		numTransparent, lengthTime / static_cast<float>(iterations), keyTime / static_cast<float>(iterations), outOfOrder);
+}
@@ -0,0 +1,854 @@
+#include "TileFarm.h"
+
+#include "BVH.h"
+#include "CPURayTracer.h"
+#include "OpacityMicromap.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <numeric>
+#include <unordered_map>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+namespace {
+	// Arrays in the scene file start on their own cache line
+	inline size_t AlignUp(size_t offset) {
+		return (offset + 63) & ~static_cast<size_t>(63);
+	}
+
+#ifndef _WIN32
+#ifdef MSG_NOSIGNAL
+	// A worker that went away shouldn't take us down with SIGPIPE
+	const int SEND_FLAGS = MSG_NOSIGNAL;
+#else
+	const int SEND_FLAGS = 0;
+#endif
+
+	// Sockets can hand back less than was asked for, these keep going until it is all there
+	bool ReadAll(int socket, void* data, size_t size) {
+		uint8_t* bytes = static_cast<uint8_t*>(data);
+		while (size > 0) {
+			ssize_t count = read(socket, bytes, size);
+			if (count < 0 && errno == EINTR) {
+				continue;
+			}
+			if (count <= 0) {
+				return false;
+			}
+			bytes += count;
+			size -= static_cast<size_t>(count);
+		}
+		return true;
+	}
+
+	bool WriteAll(int socket, const void* data, size_t size) {
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		while (size > 0) {
+			ssize_t count = send(socket, bytes, size, SEND_FLAGS);
+			if (count < 0 && errno == EINTR) {
+				continue;
+			}
+			if (count <= 0) {
+				return false;
+			}
+			bytes += count;
+			size -= static_cast<size_t>(count);
+		}
+		return true;
+	}
+
+	// A descriptor crosses a socket as ancillary data on a byte of its own
+	struct FileMessage {
+		char byte = 0;
+		iovec data;
+		msghdr message;
+		alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+
+		FileMessage() {
+			data.iov_base = &byte;
+			data.iov_len = 1;
+			std::memset(&control, 0, sizeof(control));
+			std::memset(&message, 0, sizeof(message));
+			message.msg_iov = &data;
+			message.msg_iovlen = 1;
+			message.msg_control = control;
+			message.msg_controllen = sizeof(control);
+		}
+	};
+
+	bool SendFile(int socket, int file) {
+		FileMessage sent;
+		cmsghdr* header = CMSG_FIRSTHDR(&sent.message);
+		header->cmsg_level = SOL_SOCKET;
+		header->cmsg_type = SCM_RIGHTS;
+		header->cmsg_len = CMSG_LEN(sizeof(int));
+		std::memcpy(CMSG_DATA(header), &file, sizeof(int));
+
+		ssize_t count;
+		do {
+			count = sendmsg(socket, &sent.message, SEND_FLAGS);
+		} while (count < 0 && errno == EINTR);
+		return count == 1;
+	}
+
+	// Our own descriptor for the file, or -1 if none came
+	int ReceiveFile(int socket) {
+		FileMessage received;
+		ssize_t count;
+		do {
+			count = recvmsg(socket, &received.message, 0);
+		} while (count < 0 && errno == EINTR);
+
+		cmsghdr* header = count == 1 ? CMSG_FIRSTHDR(&received.message) : nullptr;
+		if (header == nullptr || header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) {
+			return -1;
+		}
+		int descriptor;
+		std::memcpy(&descriptor, CMSG_DATA(header), sizeof(int));
+		return descriptor;
+	}
+
+	struct PooledWorker {
+		int pid = -1;
+		int socket = -1;
+		// By a running farm
+		bool claimed = false;
+	};
+
+	// Everything ForkWorkers made, handed out to one farm at a time
+	std::vector<PooledWorker> workerPool;
+
+	// For a worker that went away or stopped making sense. Whatever it is doing, it is no use
+	// to the next farm.
+	void Retire(PooledWorker& worker) {
+		if (worker.pid < 0) {
+			return;
+		}
+		close(worker.socket);
+		kill(worker.pid, SIGKILL);
+		waitpid(worker.pid, nullptr, 0);
+		worker.pid = -1;
+		worker.socket = -1;
+	}
+#endif
+}
+
+#ifndef _WIN32
+struct TileFarm::WorkerScene {
+	void* view = nullptr;
+	SceneLayout layout;
+
+	std::vector<std::unique_ptr<TiledTexture> > textures;
+	std::vector<MaterialTextures> materialTextures;
+	std::unique_ptr<OpacityMicromap> micromap;
+	std::unique_ptr<BVH> bvh;
+	std::unique_ptr<CPURayTracer> tracer;
+
+	// What the tracer's lights were last set to
+	LightTreeView tree;
+	bool lightsSet = false;
+
+	~WorkerScene() {
+		// Everything above reads out of the view
+		tracer.reset();
+		bvh.reset();
+		micromap.reset();
+		textures.clear();
+		munmap(view, layout.size);
+	}
+};
+#endif
+
+TileFarm::~TileFarm() {
+	Stop();
+}
+
+void TileFarm::SetCamera(const glm::mat4& inverseProj, const glm::mat4& inverseView, const glm::vec3& cameraPos) {
+	invProj = inverseProj;
+	invView = inverseView;
+	camPos = cameraPos;
+}
+
+void TileFarm::SetDirectionalLight(const glm::vec3& direction, const glm::vec3& color) {
+	directionalLightDir = direction;
+	directionalLightCol = color;
+}
+
+void TileFarm::SetPointLights(const PointLightToGPU* lights, uint32_t count) {
+	scene.pointLights = lights;
+	scene.numPointLights = count;
+	if (!workers.empty() && count > layout.maxPointLights) {
+		Start(scene, width, height, NumWorkers());
+	}
+}
+
+void TileFarm::SetLightTree(const LightTreeView& lightTree) {
+	scene.lightTree = lightTree;
+	if (!workers.empty() && (lightTree.numNodes > layout.maxTreeNodes || lightTree.numLightIndices > layout.maxTreeIndices)) {
+		Start(scene, width, height, NumWorkers());
+	}
+}
+
+#ifdef _WIN32
+
+uint32_t TileFarm::ForkWorkers(uint32_t) {
+	return 0;
+}
+
+void TileFarm::QuitWorkers() {}
+
+bool TileFarm::Start(const TileFarmScene& farmScene, uint32_t renderWidth, uint32_t renderHeight, uint32_t numWorkers) {
+	scene = farmScene;
+	width = renderWidth;
+	height = renderHeight;
+	fprintf(stderr, "Tile Farm -- Workers are forked, there is no farm on this platform. Asked for %u.\n", numWorkers);
+	return false;
+}
+
+void TileFarm::Stop() {}
+
+bool TileFarm::Render() {
+	return false;
+}
+
+#else
+
+uint32_t TileFarm::ForkWorkers(uint32_t numWorkers) {
+	for (uint32_t i = 0; i < numWorkers; i += 1) {
+		int sockets[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) {
+			fprintf(stderr, "Tile Farm -- Couldn't open a socket for worker %u\n", i);
+			break;
+		}
+
+		pid_t pid = fork();
+		if (pid < 0) {
+			fprintf(stderr, "Tile Farm -- Couldn't fork worker %u\n", i);
+			close(sockets[0]);
+			close(sockets[1]);
+			break;
+		}
+		if (pid == 0) {
+			// Holding the other workers' sockets open would keep them from seeing us quit
+			for (const PooledWorker& other : workerPool) {
+				close(other.socket);
+			}
+			close(sockets[0]);
+			WorkerMain(sockets[1]);
+		}
+
+		close(sockets[1]);
+		PooledWorker worker;
+		worker.pid = pid;
+		worker.socket = sockets[0];
+		workerPool.push_back(worker);
+	}
+
+	return static_cast<uint32_t>(workerPool.size());
+}
+
+void TileFarm::QuitWorkers() {
+	Command quit;
+	quit.type = CommandType::Quit;
+	for (const PooledWorker& worker : workerPool) {
+		if (worker.pid >= 0) {
+			WriteAll(worker.socket, &quit, sizeof(quit));
+			close(worker.socket);
+		}
+	}
+	for (const PooledWorker& worker : workerPool) {
+		if (worker.pid >= 0) {
+			waitpid(worker.pid, nullptr, 0);
+		}
+	}
+	workerPool.clear();
+}
+
+bool TileFarm::Start(const TileFarmScene& farmScene, uint32_t renderWidth, uint32_t renderHeight, uint32_t numWorkers) {
+	Stop();
+
+	scene = farmScene;
+	width = renderWidth;
+	height = renderHeight;
+	numTiles = ((width + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE) * ((height + CPU_TILE_SIZE - 1) / CPU_TILE_SIZE);
+	tileCosts = std::vector<uint32_t>(numTiles, 1);
+
+	std::vector<uint32_t> idle;
+	for (uint32_t i = 0; i < workerPool.size() && idle.size() < numWorkers; i += 1) {
+		if (workerPool[i].pid >= 0 && !workerPool[i].claimed) {
+			idle.push_back(i);
+		}
+	}
+	if (idle.size() < numWorkers) {
+		fprintf(stderr, "Tile Farm -- Asked for %u workers, only %zu were forked and free\n", numWorkers, idle.size());
+		return false;
+	}
+
+	if (!MapScene()) {
+		return false;
+	}
+
+	// Each worker gets its own descriptor for the file
+	Command load;
+	load.type = CommandType::Load;
+	for (uint32_t pooled : idle) {
+		workerPool[pooled].claimed = true;
+
+		Worker worker;
+		worker.pooled = pooled;
+		worker.socket = workerPool[pooled].socket;
+		// One that went away is found when Render polls it
+		if (WriteAll(worker.socket, &load, sizeof(load))) {
+			SendFile(worker.socket, sceneFile);
+		}
+		workers.push_back(worker);
+	}
+
+	return true;
+}
+
+void TileFarm::Stop() {
+	Command unload;
+	unload.type = CommandType::Unload;
+	Reply reply;
+	for (Worker& worker : workers) {
+		PooledWorker& pooled = workerPool[worker.pooled];
+		// A batch still out from a frame that was cut short would answer the next farm's first one
+		if (worker.busy && !worker.lost) {
+			worker.lost = !ReadAll(worker.socket, &reply, sizeof(reply));
+		}
+		if (worker.lost || !WriteAll(worker.socket, &unload, sizeof(unload))) {
+			Retire(pooled);
+		}
+		pooled.claimed = false;
+	}
+	workers.clear();
+
+	UnmapScene();
+}
+
+bool TileFarm::MapScene() {
+	std::vector<LinearBVHNode> nodes = scene.bvh->GetLinearBVH();
+	const std::vector<uint32_t>& parents = scene.bvh->GetParents();
+
+	layout.width = width;
+	layout.height = height;
+	layout.numNodes = static_cast<uint32_t>(nodes.size());
+	layout.numVertices = scene.numVertices;
+	layout.numTriangles = scene.numTriangles;
+	layout.numMaterials = scene.numMaterials;
+	layout.maxPointLights = std::max(1u, scene.numPointLights * 2);
+	layout.maxTreeNodes = std::max(1u, scene.lightTree.numNodes * 2);
+	layout.maxTreeIndices = std::max(1u, scene.lightTree.numLightIndices * 2);
+	layout.sceneMin = scene.sceneMin;
+	layout.sceneMax = scene.sceneMax;
+
+	// Materials share textures, each one goes in once
+	std::vector<const TiledTexture*> textures;
+	std::unordered_map<const TiledTexture*, uint32_t> textureIndices;
+	auto textureIndex = [&textures, &textureIndices](const TiledTexture* texture) -> uint32_t {
+		if (texture == nullptr) {
+			return NO_TEXTURE;
+		}
+		auto found = textureIndices.find(texture);
+		if (found != textureIndices.end()) {
+			return found->second;
+		}
+		uint32_t index = static_cast<uint32_t>(textures.size());
+		textures.push_back(texture);
+		textureIndices[texture] = index;
+		return index;
+	};
+	std::vector<MaterialRecord> materialRecords(scene.numMaterials, MaterialRecord{ NO_TEXTURE, NO_TEXTURE, NO_TEXTURE, NO_TEXTURE });
+	for (uint32_t i = 0; i < scene.numMaterials && scene.textures; i += 1) {
+		materialRecords[i].diffuse = textureIndex(scene.textures[i].diffuse);
+		materialRecords[i].specular = textureIndex(scene.textures[i].specular);
+		materialRecords[i].normal = textureIndex(scene.textures[i].normal);
+		materialRecords[i].alpha = textureIndex(scene.textures[i].alpha);
+	}
+	layout.numTextures = static_cast<uint32_t>(textures.size());
+
+	const OpacityMicromap* micromap = scene.opacityMicromap;
+	assert(micromap == nullptr || micromap->Offsets().size() == scene.numTriangles);
+	layout.hasMicromap = micromap ? 1 : 0;
+	layout.micromapLevel = micromap ? micromap->Level() : 0;
+	layout.numMicromapStates = micromap ? static_cast<uint32_t>(micromap->States().size()) : 0;
+	layout.useMicromap = micromap && micromap->useMicromap ? 1 : 0;
+
+	size_t offset = AlignUp(sizeof(SceneLayout));
+	layout.nodes = offset;
+	offset = AlignUp(offset + sizeof(LinearBVHNode) * layout.numNodes);
+	layout.parents = offset;
+	offset = AlignUp(offset + sizeof(uint32_t) * layout.numNodes);
+	layout.vertices = offset;
+	offset = AlignUp(offset + sizeof(GPUVertex) * layout.numVertices);
+	layout.triangles = offset;
+	offset = AlignUp(offset + sizeof(GPUTriangle) * layout.numTriangles);
+	layout.materials = offset;
+	offset = AlignUp(offset + sizeof(GPUMaterial) * layout.numMaterials);
+	layout.textures = offset;
+	offset = AlignUp(offset + sizeof(TextureRecord) * layout.numTextures);
+	layout.materialTextures = offset;
+	offset = AlignUp(offset + sizeof(MaterialRecord) * layout.numMaterials);
+	std::vector<TextureRecord> textureRecords(layout.numTextures);
+	for (uint32_t i = 0; i < layout.numTextures; i += 1) {
+		textureRecords[i].width = textures[i]->Width();
+		textureRecords[i].height = textures[i]->Height();
+		textureRecords[i].sRGB = textures[i]->SRGB() ? 1 : 0;
+		textureRecords[i].layout = textures[i]->Layout();
+		textureRecords[i].texels = offset;
+		textureRecords[i].numTexels = textures[i]->NumTexels();
+		offset = AlignUp(offset + sizeof(uint32_t) * textureRecords[i].numTexels);
+	}
+	layout.micromapOffsets = offset;
+	offset = AlignUp(offset + sizeof(uint32_t) * (micromap ? layout.numTriangles : 0));
+	layout.micromapStates = offset;
+	offset = AlignUp(offset + sizeof(uint32_t) * layout.numMicromapStates);
+	layout.pointLights = offset;
+	offset = AlignUp(offset + sizeof(PointLightToGPU) * layout.maxPointLights);
+	layout.lightTreeNodes = offset;
+	offset = AlignUp(offset + sizeof(LightTreeNode) * layout.maxTreeNodes);
+	layout.lightTreeIndices = offset;
+	offset = AlignUp(offset + sizeof(uint32_t) * layout.maxTreeIndices);
+	layout.pixels = offset;
+	offset = AlignUp(offset + sizeof(uint32_t) * width * height);
+	layout.size = offset;
+
+	char path[] = "/tmp/CppEngineTileFarmXXXXXX";
+	sceneFile = mkstemp(path);
+	if (sceneFile < 0) {
+		fprintf(stderr, "Tile Farm -- Couldn't create the scene file\n");
+		return false;
+	}
+	// Nothing needs the name, the file goes away once the last process holding it is done
+	unlink(path);
+
+	if (ftruncate(sceneFile, static_cast<off_t>(layout.size)) != 0) {
+		fprintf(stderr, "Tile Farm -- Couldn't grow the scene file to %zu bytes\n", layout.size);
+		UnmapScene();
+		return false;
+	}
+	void* view = mmap(nullptr, layout.size, PROT_READ | PROT_WRITE, MAP_SHARED, sceneFile, 0);
+	if (view == MAP_FAILED) {
+		fprintf(stderr, "Tile Farm -- Couldn't map the scene file\n");
+		UnmapScene();
+		return false;
+	}
+	mapping = static_cast<uint8_t*>(view);
+
+	std::memcpy(mapping, &layout, sizeof(SceneLayout));
+	if (layout.numNodes > 0) {
+		std::memcpy(mapping + layout.nodes, nodes.data(), sizeof(LinearBVHNode) * layout.numNodes);
+		std::memcpy(mapping + layout.parents, parents.data(), sizeof(uint32_t) * layout.numNodes);
+	}
+	if (layout.numVertices > 0) {
+		std::memcpy(mapping + layout.vertices, scene.vertices, sizeof(GPUVertex) * layout.numVertices);
+	}
+	if (layout.numTriangles > 0) {
+		std::memcpy(mapping + layout.triangles, scene.triangles, sizeof(GPUTriangle) * layout.numTriangles);
+	}
+	if (layout.numMaterials > 0) {
+		std::memcpy(mapping + layout.materials, scene.materials, sizeof(GPUMaterial) * layout.numMaterials);
+		std::memcpy(mapping + layout.materialTextures, materialRecords.data(), sizeof(MaterialRecord) * layout.numMaterials);
+	}
+	if (layout.numTextures > 0) {
+		std::memcpy(mapping + layout.textures, textureRecords.data(), sizeof(TextureRecord) * layout.numTextures);
+	}
+	for (uint32_t i = 0; i < layout.numTextures; i += 1) {
+		std::memcpy(mapping + textureRecords[i].texels, textures[i]->Texels(), sizeof(uint32_t) * textureRecords[i].numTexels);
+	}
+	if (micromap && layout.numTriangles > 0) {
+		std::memcpy(mapping + layout.micromapOffsets, micromap->Offsets().data(), sizeof(uint32_t) * layout.numTriangles);
+	}
+	if (layout.numMicromapStates > 0) {
+		std::memcpy(mapping + layout.micromapStates, micromap->States().data(), sizeof(uint32_t) * layout.numMicromapStates);
+	}
+
+	pixels = reinterpret_cast<uint32_t*>(mapping + layout.pixels);
+	std::fill(pixels, pixels + width * height, 0xFF000000);
+	return true;
+}
+
+void TileFarm::UnmapScene() {
+	if (mapping) {
+		munmap(mapping, layout.size);
+		mapping = nullptr;
+		pixels = nullptr;
+	}
+	if (sceneFile >= 0) {
+		close(sceneFile);
+		sceneFile = -1;
+	}
+}
+
+void TileFarm::WorkerMain(int socket) {
+	std::unique_ptr<WorkerScene> loaded;
+	Command command;
+	Reply reply;
+	while (ReadAll(socket, &command, sizeof(command)) && command.type != CommandType::Quit) {
+		if (command.type == CommandType::Load) {
+			int file = ReceiveFile(socket);
+			loaded.reset(file >= 0 ? LoadWorkerScene(file) : nullptr);
+			if (file >= 0) {
+				close(file);
+			}
+			if (!loaded) {
+				fprintf(stderr, "Tile Farm -- Worker couldn't load the scene file\n");
+				break;
+			}
+			continue;
+		}
+		if (command.type == CommandType::Unload) {
+			loaded.reset();
+			continue;
+		}
+		if (!loaded) {
+			break;
+		}
+
+		// The coordinator restarts the farm before this frame's lights outgrow the file
+		const SceneLayout& sceneLayout = loaded->layout;
+		assert(command.numPointLights <= sceneLayout.maxPointLights);
+		assert(command.numTreeNodes <= sceneLayout.maxTreeNodes && command.numTreeIndices <= sceneLayout.maxTreeIndices);
+		LightTreeView& tree = loaded->tree;
+		if (!loaded->lightsSet || tree.numNodes != command.numTreeNodes || tree.numLightIndices != command.numTreeIndices ||
+			tree.boundsMin != command.treeMin || tree.boundsMax != command.treeMax) {
+			const uint8_t* file = static_cast<const uint8_t*>(loaded->view);
+			tree.nodes = reinterpret_cast<const LightTreeNode*>(file + sceneLayout.lightTreeNodes);
+			tree.lightIndices = reinterpret_cast<const uint32_t*>(file + sceneLayout.lightTreeIndices);
+			tree.numNodes = command.numTreeNodes;
+			tree.numLightIndices = command.numTreeIndices;
+			tree.boundsMin = command.treeMin;
+			tree.boundsMax = command.treeMax;
+			loaded->tracer->SetLights(
+				reinterpret_cast<const PointLightToGPU*>(file + sceneLayout.pointLights),
+				tree,
+				sceneLayout.sceneMin,
+				sceneLayout.sceneMax
+			);
+			loaded->lightsSet = true;
+		}
+
+		uint32_t* framebuffer = reinterpret_cast<uint32_t*>(static_cast<uint8_t*>(loaded->view) + sceneLayout.pixels);
+		loaded->tracer->SetCamera(command.invProj, command.invView, command.camPos);
+		loaded->tracer->SetDirectionalLight(command.directionalLightDir, command.directionalLightCol);
+		loaded->tracer->RenderTiles(command.tiles, command.numTiles, framebuffer, reply.microseconds);
+
+		reply.numTiles = command.numTiles;
+		std::memcpy(reply.tiles, command.tiles, sizeof(uint32_t) * command.numTiles);
+		if (!WriteAll(socket, &reply, sizeof(reply))) {
+			break;
+		}
+	}
+
+	// Straight out, without running the engine's destructors or atexit handlers a second time
+	loaded.reset();
+	_exit(0);
+}
+
+TileFarm::WorkerScene* TileFarm::LoadWorkerScene(int file) {
+	SceneLayout sceneLayout;
+	if (pread(file, &sceneLayout, sizeof(SceneLayout), 0) != static_cast<ssize_t>(sizeof(SceneLayout))) {
+		return nullptr;
+	}
+	// Our own view of the file, everything below reads out of it
+	void* view = mmap(nullptr, sceneLayout.size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+	if (view == MAP_FAILED) {
+		return nullptr;
+	}
+
+	WorkerScene* loaded = new WorkerScene();
+	loaded->view = view;
+	loaded->layout = sceneLayout;
+
+	const uint8_t* bytes = static_cast<const uint8_t*>(view);
+	const GPUVertex* vertices = reinterpret_cast<const GPUVertex*>(bytes + sceneLayout.vertices);
+	const GPUTriangle* triangles = reinterpret_cast<const GPUTriangle*>(bytes + sceneLayout.triangles);
+	const GPUMaterial* materials = reinterpret_cast<const GPUMaterial*>(bytes + sceneLayout.materials);
+
+	const TextureRecord* textureRecords = reinterpret_cast<const TextureRecord*>(bytes + sceneLayout.textures);
+	for (uint32_t i = 0; i < sceneLayout.numTextures; i += 1) {
+		const TextureRecord& record = textureRecords[i];
+		loaded->textures.push_back(std::unique_ptr<TiledTexture>(new TiledTexture(
+			reinterpret_cast<const uint32_t*>(bytes + record.texels), record.width, record.height, record.sRGB != 0, record.layout
+		)));
+	}
+	auto texture = [loaded](uint32_t index) -> const TiledTexture* {
+		return index == NO_TEXTURE ? nullptr : loaded->textures[index].get();
+	};
+	const MaterialRecord* materialRecords = reinterpret_cast<const MaterialRecord*>(bytes + sceneLayout.materialTextures);
+	loaded->materialTextures.resize(sceneLayout.numMaterials);
+	for (uint32_t i = 0; i < sceneLayout.numMaterials; i += 1) {
+		loaded->materialTextures[i].diffuse = texture(materialRecords[i].diffuse);
+		loaded->materialTextures[i].specular = texture(materialRecords[i].specular);
+		loaded->materialTextures[i].normal = texture(materialRecords[i].normal);
+		loaded->materialTextures[i].alpha = texture(materialRecords[i].alpha);
+	}
+	const MaterialTextures* materialTextures = loaded->materialTextures.empty() ? nullptr : loaded->materialTextures.data();
+
+	if (sceneLayout.hasMicromap) {
+		loaded->micromap.reset(new OpacityMicromap(
+			vertices,
+			triangles,
+			materialTextures,
+			reinterpret_cast<const uint32_t*>(bytes + sceneLayout.micromapOffsets),
+			sceneLayout.numTriangles,
+			reinterpret_cast<const uint32_t*>(bytes + sceneLayout.micromapStates),
+			sceneLayout.numMicromapStates,
+			sceneLayout.micromapLevel
+		));
+		loaded->micromap->useMicromap = sceneLayout.useMicromap != 0;
+	}
+
+	loaded->bvh.reset(new BVH(
+		reinterpret_cast<const LinearBVHNode*>(bytes + sceneLayout.nodes),
+		reinterpret_cast<const uint32_t*>(bytes + sceneLayout.parents),
+		sceneLayout.numNodes,
+		vertices,
+		triangles
+	));
+	loaded->bvh->SetOpacityMicromap(loaded->micromap.get());
+	loaded->tracer.reset(new CPURayTracer(loaded->bvh.get(), vertices, triangles, materials, sceneLayout.width, sceneLayout.height));
+	loaded->tracer->SetTextures(materialTextures);
+	return loaded;
+}
+
+bool TileFarm::Render() {
+	if (workers.empty()) {
+		return false;
+	}
+	auto start = std::chrono::high_resolution_clock::now();
+
+	// Lights may have moved since last frame. No worker is tracing, so none sees them half copied.
+	if (scene.numPointLights > 0) {
+		std::memcpy(mapping + layout.pointLights, scene.pointLights, sizeof(PointLightToGPU) * scene.numPointLights);
+	}
+	if (scene.lightTree.nodes) {
+		std::memcpy(mapping + layout.lightTreeNodes, scene.lightTree.nodes, sizeof(LightTreeNode) * scene.lightTree.numNodes);
+		std::memcpy(mapping + layout.lightTreeIndices, scene.lightTree.lightIndices, sizeof(uint32_t) * scene.lightTree.numLightIndices);
+	}
+
+	PlanBatches();
+
+	uint32_t nextShared = 0;
+	uint32_t numBusy = 0;
+	for (uint32_t i = 0; i < NumWorkers(); i += 1) {
+		workers[i].nextBatch = i;
+		workers[i].microseconds = 0;
+		workers[i].busy = SendBatch(workers[i], nextShared);
+		numBusy += workers[i].busy ? 1 : 0;
+	}
+
+	std::vector<pollfd> sockets(workers.size());
+	bool lostWorker = false;
+	while (numBusy > 0 && !lostWorker) {
+		// poll skips negative descriptors
+		for (uint32_t i = 0; i < NumWorkers(); i += 1) {
+			sockets[i].fd = workers[i].busy ? workers[i].socket : -1;
+			sockets[i].events = POLLIN;
+			sockets[i].revents = 0;
+		}
+		if (poll(sockets.data(), sockets.size(), -1) < 0) {
+			lostWorker = errno != EINTR;
+			continue;
+		}
+
+		for (uint32_t i = 0; i < NumWorkers(); i += 1) {
+			if (sockets[i].revents == 0) {
+				continue;
+			}
+			if (!ReceiveReply(workers[i])) {
+				workers[i].lost = true;
+				lostWorker = true;
+				break;
+			}
+			workers[i].busy = SendBatch(workers[i], nextShared);
+			numBusy -= workers[i].busy ? 0 : 1;
+		}
+	}
+
+	if (lostWorker) {
+		fprintf(stderr, "Tile Farm -- Lost a worker, stopping the farm\n");
+		Stop();
+		return false;
+	}
+
+	long long busiest = 0;
+	long long totalBusy = 0;
+	for (const Worker& worker : workers) {
+		busiest = std::max(busiest, worker.microseconds);
+		totalBusy += worker.microseconds;
+	}
+	imbalance = totalBusy > 0 ? busiest * static_cast<float>(workers.size()) / totalBusy : 1.0f;
+
+	auto stop = std::chrono::high_resolution_clock::now();
+	traceTime = std::chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
+	return true;
+}
+
+bool TileFarm::SendBatch(Worker& worker, uint32_t& nextShared) {
+	uint32_t batch;
+	if (balanceByCost) {
+		batch = nextShared;
+		nextShared += 1;
+	}
+	else {
+		batch = worker.nextBatch;
+		worker.nextBatch += NumWorkers();
+	}
+	if (batch + 1 >= batchStarts.size()) {
+		return false;
+	}
+
+	Command command;
+	command.type = CommandType::Trace;
+	command.numTiles = batchStarts[batch + 1] - batchStarts[batch];
+	command.invProj = invProj;
+	command.invView = invView;
+	command.camPos = camPos;
+	command.directionalLightDir = directionalLightDir;
+	command.directionalLightCol = directionalLightCol;
+	command.numPointLights = scene.numPointLights;
+	command.numTreeNodes = scene.lightTree.numNodes;
+	command.numTreeIndices = scene.lightTree.numLightIndices;
+	command.treeMin = scene.lightTree.boundsMin;
+	command.treeMax = scene.lightTree.boundsMax;
+	std::memcpy(command.tiles, &batchTiles[batchStarts[batch]], sizeof(uint32_t) * command.numTiles);
+
+	// A worker that went away hangs up its socket, which Render finds when it polls for the reply
+	WriteAll(worker.socket, &command, sizeof(command));
+	return true;
+}
+
+bool TileFarm::ReceiveReply(Worker& worker) {
+	Reply reply;
+	if (!ReadAll(worker.socket, &reply, sizeof(reply)) || reply.numTiles > TILE_FARM_BATCH_SIZE) {
+		return false;
+	}
+
+	for (uint32_t i = 0; i < reply.numTiles; i += 1) {
+		if (reply.tiles[i] < numTiles) {
+			tileCosts[reply.tiles[i]] = std::max(1u, reply.microseconds[i]);
+		}
+		worker.microseconds += reply.microseconds[i];
+	}
+	return true;
+}
+
+#endif
+
+void TileFarm::PlanBatches() {
+	batchTiles.resize(numTiles);
+	std::iota(batchTiles.begin(), batchTiles.end(), 0);
+	batchStarts.clear();
+	batchStarts.push_back(0);
+
+	if (!balanceByCost) {
+		for (uint32_t start = TILE_FARM_BATCH_SIZE; start < numTiles; start += TILE_FARM_BATCH_SIZE) {
+			batchStarts.push_back(start);
+		}
+		batchStarts.push_back(numTiles);
+		return;
+	}
+
+	// Most expensive first, which leaves the cheap tiles at the end to even things out with
+	std::stable_sort(batchTiles.begin(), batchTiles.end(), [this](uint32_t a, uint32_t b) {
+		return tileCosts[a] > tileCosts[b];
+	});
+
+	uint64_t remainingCost = 0;
+	for (uint32_t cost : tileCosts) {
+		remainingCost += cost;
+	}
+
+	const uint64_t numSlices = static_cast<uint64_t>(std::max(1u, NumWorkers())) * TILE_FARM_BATCHES_PER_WORKER;
+	uint64_t targetCost = std::max<uint64_t>(1, remainingCost / numSlices);
+	uint64_t batchCost = 0;
+	for (uint32_t i = 0; i < numTiles; i += 1) {
+		uint32_t batchSize = i - batchStarts.back();
+		if (batchSize > 0 && (batchSize == TILE_FARM_BATCH_SIZE || batchCost >= targetCost)) {
+			batchStarts.push_back(i);
+			remainingCost -= batchCost;
+			batchCost = 0;
+			targetCost = std::max<uint64_t>(1, remainingCost / numSlices);
+		}
+		batchCost += tileCosts[batchTiles[i]];
+	}
+	batchStarts.push_back(numTiles);
+}
+
+void TileFarm::BenchmarkScaling(uint32_t maxWorkers, uint32_t frames) {
+	if (workers.empty()) {
+		fprintf(stderr, "\nTile Farm -- Not running, nothing to benchmark\n");
+		return;
+	}
+
+	uint32_t numWorkers = NumWorkers();
+	bool wasBalanced = balanceByCost;
+	frames = std::max(1u, frames);
+	fprintf(stderr, "\nTile Farm -- %ux%u, %u tiles, 1 to %u workers, %u frames after 1 warmup\n", width, height,
+		numTiles, maxWorkers, frames);
+
+	std::vector<uint32_t> workerCounts;
+	for (uint32_t count = 1; count < maxWorkers; count *= 2) {
+		workerCounts.push_back(count);
+	}
+	workerCounts.push_back(std::max(1u, maxWorkers));
+
+	std::vector<uint32_t> reference;
+	long long oneWorker = 0;
+	bool failed = false;
+	for (uint32_t count : workerCounts) {
+		if (failed || !Start(scene, width, height, count)) {
+			break;
+		}
+
+		for (bool balanced : { false, true }) {
+			balanceByCost = balanced;
+
+			// The warmup also measures every tile for the balanced runs to go by
+			long long totalTime = 0;
+			float totalImbalance = 0;
+			failed = !Render();
+			for (uint32_t frame = 0; frame < frames && !failed; frame += 1) {
+				failed = !Render();
+				totalTime += traceTime;
+				totalImbalance += imbalance;
+			}
+			if (failed) {
+				break;
+			}
+
+			if (reference.empty()) {
+				reference.assign(pixels, pixels + width * height);
+				oneWorker = totalTime;
+			}
+			uint32_t differing = 0;
+			for (uint32_t i = 0; i < width * height; i += 1) {
+				differing += pixels[i] != reference[i] ? 1 : 0;
+			}
+
+			fprintf(stderr, "Tile Farm -- %u workers, %s: %.2f ms/frame, %.2fx over 1 worker, imbalance %.2f, %u pixels differ\n",
+				count, balanced ? "cost balanced" : "even split", totalTime / (1000.0f * frames),
+				oneWorker / static_cast<float>(std::max(1ll, totalTime)), totalImbalance / frames, differing);
+		}
+	}
+
+	balanceByCost = wasBalanced;
+	Start(scene, width, height, numWorkers);
+}
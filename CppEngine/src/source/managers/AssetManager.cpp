@@ -18,6 +18,7 @@
 #include "stb/stb_image.h"
 
 #include "BVH.h"
+#include "Raycaster.h"
 
 #include "Component.h"
 #include "ModelRenderer.h"
@@ -35,7 +36,6 @@
 #include "Light.h"
 #include "DirectionalLight.h"
 #include "SpotLight.h"
-#include "PointLight.h"
 #include "AmbientLight.h"
 
 #include "Configuration.h"
@@ -84,6 +84,8 @@ namespace AssetManager {
 	std::vector<GPUVertex>* gpuVertices;
 	std::vector<GPUTriangle>* gpuTriangles;
 	std::vector<GPUMaterial>* gpuMaterials;
+	std::vector<uint32_t>* gpuMaterialInstances;
+	std::vector<MaterialTextures>* cpuMaterialTextures;
 
 	GLuint nullTexture;
 	GLubyte nullData[4] = { 255, 255, 255, 255 };
@@ -106,6 +108,8 @@ namespace AssetManager {
 		gpuVertices = MemoryManager::Allocate<std::vector<GPUVertex>>();
 		gpuTriangles = MemoryManager::Allocate<std::vector<GPUTriangle>>();
 		gpuMaterials = MemoryManager::Allocate<std::vector<GPUMaterial>>();
+		gpuMaterialInstances = MemoryManager::Allocate<std::vector<uint32_t>>();
+		cpuMaterialTextures = MemoryManager::Allocate<std::vector<MaterialTextures>>();
 
 		// Set up our null texture
 		glGenTextures(1, &nullTexture);
@@ -146,6 +150,9 @@ namespace AssetManager {
 		}
 		shaders->clear();
 
+		if (raycaster != nullptr) {
+			MemoryManager::Free(raycaster);
+		}
 		if (bvh != nullptr) {
 			MemoryManager::Free(bvh);
 		}
@@ -188,6 +195,8 @@ namespace AssetManager {
 		MemoryManager::Free(gpuVertices);
 		MemoryManager::Free(gpuTriangles);
 		MemoryManager::Free(gpuMaterials);
+		MemoryManager::Free(gpuMaterialInstances);
+		MemoryManager::Free(cpuMaterialTextures);
 
 	}
 
@@ -287,12 +296,8 @@ namespace AssetManager {
 							tinyMeshes[matID]->tangents.push_back(tangent);
 							tinyMeshes[matID]->bitangents.push_back(bitangent);
 
-							tinyMeshes[matID]->bounds->maxX = maxx;
-							tinyMeshes[matID]->bounds->maxY = maxy;
-							tinyMeshes[matID]->bounds->maxZ = maxz;
-							tinyMeshes[matID]->bounds->minX = minx;
-							tinyMeshes[matID]->bounds->minY = miny;
-							tinyMeshes[matID]->bounds->minZ = minz;
+							tinyMeshes[matID]->bounds->maxPoint = glm::vec3(maxx, maxy, maxz);
+							tinyMeshes[matID]->bounds->minPoint = glm::vec3(minx, miny, minz);
 						} else {
 							std::vector<glm::vec2>::iterator it = std::find(tinyMeshes[matID]->uvs.begin(), tinyMeshes[matID]->uvs.end(), v[k].uv);
 							auto found = std::distance(tinyMeshes[matID]->uvs.begin(), it);
@@ -309,7 +314,6 @@ namespace AssetManager {
 			}
 
 			for (int i = 0; i < tinyMeshes.size(); i++) {
-				tinyMeshes[i]->bounds->Init();
 				vertices[i].clear();
 			}
 
@@ -814,12 +818,7 @@ namespace AssetManager {
 				sscanf(line, "point_light %f %f %f %f %f %f %f %f",
 					&r, &g, &b, &a, &x, &y, &z, &w);
 
-				PointLight p = PointLight(
-					glm::vec4(r, g, b, a),
-					glm::vec4(x, y, z, w)
-				);
-
-				scene->pointLights.push_back(p);
+				scene->pointLights.Add(glm::vec3(x, y, z), glm::vec3(r, g, b));
 			} else {
 				fprintf(stderr, "WARNING. Do not know command: %s\n", command);
 			}
@@ -959,10 +958,10 @@ namespace AssetManager {
 	}
 
 	void PostLoadScene() {
-		if (RAY_TRACING_ENABLED) {
-			AllocateGPUMemory();
-			bvh = MemoryManager::Allocate<BVH>(*gpuVertices, *gpuTriangles, 2, SplitMethod::SAH);
-		}
+		// Game code raycasts against the BVH whichever renderer draws the scene
+		AllocateGPUMemory();
+		bvh = MemoryManager::Allocate<BVH>(*gpuVertices, *gpuTriangles, 2, SplitMethod::SAH);
+		raycaster = MemoryManager::Allocate<Raycaster>(bvh, gpuTriangles->data(), gpuMaterialInstances->data());
 	}
 
 	void LoadTextureToGPU(const std::string texType, const int vecIndex, const int texIndex, Texture* tex) {
@@ -1062,6 +1061,13 @@ namespace AssetManager {
 					gpuTriangles->push_back(tri);
 				}
 				indexOffset += (int32_t)mesh->positions.size();
+				gpuMaterialInstances->push_back(i);
+
+				// Only the ray tracers read materials. Making their textures bindless uploads them
+				// and frees their pixels, which the rasterizer still loads its own way.
+				if (!RAY_TRACING_ENABLED) {
+					continue;
+				}
 
 				GPUMaterial gpuMaterial;
 				bool usingType = false;
@@ -1114,6 +1120,15 @@ namespace AssetManager {
 				);
 
 				gpuMaterials->push_back(gpuMaterial);
+
+#if CPU_RAY_TRACING
+				MaterialTextures cpuTextures;
+				cpuTextures.diffuse = material->diffuseTexture ? material->diffuseTexture->cpuTexture : nullptr;
+				cpuTextures.specular = material->specularTexture ? material->specularTexture->cpuTexture : nullptr;
+				cpuTextures.normal = material->normalTexture ? material->normalTexture->cpuTexture : nullptr;
+				cpuTextures.alpha = material->alphaTexture ? material->alphaTexture->cpuTexture : nullptr;
+				cpuMaterialTextures->push_back(cpuTextures);
+#endif
 			}
 			materialOffset += (int32_t)model->meshes.size();
 		}
@@ -1187,6 +1202,14 @@ namespace AssetManager {
 
 		tex->loadedToGPU = true;
 
+#if CPU_RAY_TRACING
+		// Last chance to read the pixels. Same formats as the glTexImage2D calls above.
+		if (!tex->cpuTexture) {
+			bool rgb = (texType == "diffuse" || texType == "specular" || texType == "normal");
+			tex->cpuTexture = MemoryManager::Allocate<TiledTexture>(tex, rgb ? 3 : 1, texType == "diffuse");
+		}
+#endif
+
 		stbi_image_free(tex->pixels);
 
 		handle = glGetTextureHandleARB(textureIndex);
@@ -1,7 +1,14 @@
 
 #include "Texture.h"
 
-Texture::~Texture() {}
+#include "MemoryManager.h"
+#include "TiledTexture.h"
+
+Texture::~Texture() {
+	if (cpuTexture) {
+		MemoryManager::Free(cpuTexture);
+	}
+}
 
 Texture::Texture(const int& w, const int& h, const int nc, GLubyte* p) {
 	width = w;
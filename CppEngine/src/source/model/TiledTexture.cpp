@@ -0,0 +1,232 @@
+#include "TiledTexture.h"
+
+#include "CacheSimulator.h"
+#include "GlobalMacros.h"
+#include "Texture.h"
+
+#include <algorithm>
+#include <cmath>
+
+#define TEXELS_PER_TILE (TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE)
+
+#if PROFILING
+#define RECORD_ACCESS(address, bytes) if (cacheSimulator) { cacheSimulator->Access(address, bytes); }
+#else
+#define RECORD_ACCESS(address, bytes)
+#endif
+
+namespace {
+	thread_local CacheSimulator* cacheSimulator = nullptr;
+
+	// Morton order inside a tile, x bits land on even bits and y bits on odd ones
+	const uint32_t spreadBits[TEXTURE_TILE_SIZE] = { 0, 1, 4, 5, 16, 17, 20, 21 };
+
+	inline uint32_t TileMorton(uint32_t x, uint32_t y) {
+		return spreadBits[x % TEXTURE_TILE_SIZE] | (spreadBits[y % TEXTURE_TILE_SIZE] << 1);
+	}
+
+	inline float SRGBToLinear(float c) {
+		return c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+	}
+
+	inline float LinearToSRGB(float c) {
+		return c <= 0.0031308f ? c * 12.92f : 1.055f * std::pow(c, 1.0f / 2.4f) - 0.055f;
+	}
+
+	struct SRGBTable {
+		SRGBTable() {
+			for (uint32_t i = 0; i < 256; i += 1) {
+				toLinear[i] = SRGBToLinear(i / 255.0f);
+			}
+		}
+
+		float toLinear[256];
+	};
+	const SRGBTable srgbTable;
+
+	inline uint32_t Pack(const glm::vec4& color) {
+		glm::uvec4 c = glm::uvec4(glm::clamp(color, glm::vec4(0.0f), glm::vec4(1.0f)) * 255.0f + 0.5f);
+		return c.r | (c.g << 8) | (c.b << 16) | (c.a << 24);
+	}
+
+	inline int32_t Wrap(int32_t x, int32_t size) {
+		x %= size;
+		return x < 0 ? x + size : x;
+	}
+}
+
+TiledTexture::TiledTexture(const Texture* texture, uint32_t channels, bool srgb, TextureLayout textureLayout) :
+	sRGB(srgb), layout(textureLayout) {
+
+	AllocateLevels(texture->width, texture->height);
+
+	// Base level. Grey textures read like GL_RED, (r, 0, 0, 1).
+	const MipLevel& base = levels[0];
+	for (uint32_t y = 0; y < base.height; y += 1) {
+		for (uint32_t x = 0; x < base.width; x += 1) {
+			const GLubyte* p = texture->pixels + (static_cast<size_t>(y) * base.width + x) * channels;
+			uint32_t r = p[0];
+			uint32_t g = channels > 1 ? p[1] : 0;
+			uint32_t b = channels > 2 ? p[2] : 0;
+			uint32_t a = channels > 3 ? p[3] : 255;
+			ownedTexels[TexelIndex(base, x, y)] = r | (g << 8) | (b << 16) | (a << 24);
+		}
+	}
+
+	// Box filter each level down from the one above, in linear space like glGenerateMipmap
+	for (uint32_t l = 1; l < levels.size(); l += 1) {
+		const MipLevel& above = levels[l - 1];
+		const MipLevel& level = levels[l];
+
+		for (uint32_t y = 0; y < level.height; y += 1) {
+			for (uint32_t x = 0; x < level.width; x += 1) {
+				uint32_t x0 = std::min(2 * x, above.width - 1);
+				uint32_t x1 = std::min(2 * x + 1, above.width - 1);
+				uint32_t y0 = std::min(2 * y, above.height - 1);
+				uint32_t y1 = std::min(2 * y + 1, above.height - 1);
+
+				glm::vec4 average = 0.25f * (
+					Decode(texels[TexelIndex(above, x0, y0)]) +
+					Decode(texels[TexelIndex(above, x1, y0)]) +
+					Decode(texels[TexelIndex(above, x0, y1)]) +
+					Decode(texels[TexelIndex(above, x1, y1)])
+				);
+
+				if (sRGB) {
+					average = glm::vec4(LinearToSRGB(average.r), LinearToSRGB(average.g), LinearToSRGB(average.b), average.a);
+				}
+				ownedTexels[TexelIndex(level, x, y)] = Pack(average);
+			}
+		}
+	}
+}
+
+TiledTexture::TiledTexture(const TiledTexture& source, TextureLayout textureLayout) :
+	sRGB(source.sRGB), layout(textureLayout) {
+
+	AllocateLevels(source.levels[0].width, source.levels[0].height);
+
+	for (uint32_t l = 0; l < levels.size(); l += 1) {
+		for (uint32_t y = 0; y < levels[l].height; y += 1) {
+			for (uint32_t x = 0; x < levels[l].width; x += 1) {
+				ownedTexels[TexelIndex(levels[l], x, y)] = source.texels[source.TexelIndex(source.levels[l], x, y)];
+			}
+		}
+	}
+}
+
+TiledTexture::TiledTexture(const uint32_t* sourceTexels, uint32_t baseWidth, uint32_t baseHeight, bool srgb, TextureLayout textureLayout) :
+	texels(sourceTexels), sRGB(srgb), layout(textureLayout) {
+
+	LayOutLevels(baseWidth, baseHeight);
+}
+
+void TiledTexture::LayOutLevels(uint32_t baseWidth, uint32_t baseHeight) {
+	resolutionLOD = 0.5f * std::log2(static_cast<float>(baseWidth) * baseHeight);
+
+	size_t offset = 0;
+	uint32_t levelWidth = std::max(1u, baseWidth);
+	uint32_t levelHeight = std::max(1u, baseHeight);
+	while (true) {
+		MipLevel level;
+		level.width = levelWidth;
+		level.height = levelHeight;
+		level.tilesX = (levelWidth + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+		level.offset = offset;
+		levels.push_back(level);
+
+		// Tiles hanging off the edge are padded out to whole tiles
+		if (layout == TextureLayout::Tiled) {
+			uint32_t tilesY = (levelHeight + TEXTURE_TILE_SIZE - 1) / TEXTURE_TILE_SIZE;
+			offset += static_cast<size_t>(level.tilesX) * tilesY * TEXELS_PER_TILE;
+		}
+		else {
+			offset += static_cast<size_t>(levelWidth) * levelHeight;
+		}
+
+		if (levelWidth == 1 && levelHeight == 1) {
+			break;
+		}
+		levelWidth = std::max(1u, levelWidth / 2);
+		levelHeight = std::max(1u, levelHeight / 2);
+	}
+
+	numTexels = offset;
+}
+
+void TiledTexture::AllocateLevels(uint32_t baseWidth, uint32_t baseHeight) {
+	LayOutLevels(baseWidth, baseHeight);
+	ownedTexels = std::vector<uint32_t>(numTexels, 0);
+	texels = ownedTexels.data();
+}
+
+size_t TiledTexture::TexelIndex(const MipLevel& level, uint32_t x, uint32_t y) const {
+	if (layout == TextureLayout::Linear) {
+		return level.offset + static_cast<size_t>(y) * level.width + x;
+	}
+
+	size_t tile = static_cast<size_t>(y / TEXTURE_TILE_SIZE) * level.tilesX + x / TEXTURE_TILE_SIZE;
+	return level.offset + tile * TEXELS_PER_TILE + TileMorton(x, y);
+}
+
+glm::vec4 TiledTexture::Decode(uint32_t texel) const {
+	glm::vec4 color = glm::vec4(texel & 0xFF, (texel >> 8) & 0xFF, (texel >> 16) & 0xFF, (texel >> 24) & 0xFF) / 255.0f;
+	if (sRGB) {
+		color.r = srgbTable.toLinear[texel & 0xFF];
+		color.g = srgbTable.toLinear[(texel >> 8) & 0xFF];
+		color.b = srgbTable.toLinear[(texel >> 16) & 0xFF];
+	}
+	return color;
+}
+
+glm::vec4 TiledTexture::Fetch(const MipLevel& level, uint32_t x, uint32_t y) const {
+	const uint32_t* texel = &texels[TexelIndex(level, x, y)];
+	RECORD_ACCESS(texel, sizeof(uint32_t));
+	return Decode(*texel);
+}
+
+glm::vec4 TiledTexture::Texel(uint32_t level, int32_t x, int32_t y) const {
+	const MipLevel& mip = levels[level];
+	return Fetch(mip, Wrap(x, mip.width), Wrap(y, mip.height));
+}
+
+glm::vec4 TiledTexture::SampleLevel(const glm::vec2& uv, uint32_t level) const {
+	const MipLevel& mip = levels[level];
+
+	// Texel centers sit on the halves
+	float fx = uv.x * mip.width - 0.5f;
+	float fy = uv.y * mip.height - 0.5f;
+	float floorX = std::floor(fx);
+	float floorY = std::floor(fy);
+	float tx = fx - floorX;
+	float ty = fy - floorY;
+
+	uint32_t x0 = Wrap(static_cast<int32_t>(floorX), mip.width);
+	uint32_t y0 = Wrap(static_cast<int32_t>(floorY), mip.height);
+	uint32_t x1 = Wrap(x0 + 1, mip.width);
+	uint32_t y1 = Wrap(y0 + 1, mip.height);
+
+	glm::vec4 c00 = Fetch(mip, x0, y0);
+	glm::vec4 c10 = Fetch(mip, x1, y0);
+	glm::vec4 c01 = Fetch(mip, x0, y1);
+	glm::vec4 c11 = Fetch(mip, x1, y1);
+
+	return glm::mix(glm::mix(c00, c10, tx), glm::mix(c01, c11, tx), ty);
+}
+
+glm::vec4 TiledTexture::Sample(const glm::vec2& uv, float surfaceLOD) const {
+	float maxLevel = static_cast<float>(levels.size() - 1);
+	float lod = glm::clamp(surfaceLOD + resolutionLOD, 0.0f, maxLevel);
+
+	uint32_t level = static_cast<uint32_t>(lod);
+	float t = lod - level;
+	if (t <= 0.0f || level + 1 >= levels.size()) {
+		return SampleLevel(uv, level);
+	}
+
+	return glm::mix(SampleLevel(uv, level), SampleLevel(uv, level + 1), t);
+}
+
+void TiledTexture::SetCacheSimulator(CacheSimulator* simulator) {
+	cacheSimulator = simulator;
+}
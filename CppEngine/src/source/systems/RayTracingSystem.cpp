@@ -9,12 +9,61 @@
 #include "Scene.h"
 #include "BVH.h"
 #include "Camera.h"
-
+#include "CPURayTracer.h"
+#include "OpacityMicromap.h"
+#include "JobSystem.h"
+#include "TileFarm.h"
+#include "LightTree.h"
+#include "SDL_Static_Helper.h"
+
+#include <algorithm>
 #include <cassert>
 
 #include "BVHTypes.h"
 
 
+namespace {
+	// Lights [begin, end) of the pool into the CPU tracer's interleaved copy
+	void CopyPointLights(const PointLightPool& pool, PointLightToGPU* lights, uint32_t begin, uint32_t end) {
+		for (uint32_t i = begin; i < end; i += 1) {
+			lights[i].position_and_radius = pool.PositionsAndRadii()[i];
+			lights[i].color_and_luminance = pool.ColorsAndLuminance()[i];
+		}
+	}
+
+	SpotLightToGPU ToGPU(const SpotLight& s) {
+		float outer = std::min(std::max(s.theta, s.phi), 180.0f);
+		SpotLightToGPU sToGPU;
+		sToGPU.position_and_range = glm::vec4(glm::vec3(s.position), s.range);
+		sToGPU.direction_and_cos_outer = glm::vec4(glm::normalize(glm::vec3(s.direction)), std::cos(glm::radians(outer)));
+		sToGPU.color_and_cos_inner = glm::vec4(glm::vec3(s.color), std::cos(glm::radians(std::min(s.theta, outer))));
+		return sToGPU;
+	}
+
+	// data[begin, end) into the same elements of the bound buffer
+	template <typename T>
+	void UploadRange(GLenum target, const T* data, uint32_t begin, uint32_t end) {
+		glBufferSubData(target, sizeof(T) * begin, sizeof(T) * (end - begin), data + begin);
+	}
+
+	// Regrows the bound buffer by half again when count elements no longer fit, so arrays that
+	// keep getting appended to aren't reallocated every time, otherwise uploads only ranges
+	template <typename T>
+	void UploadArray(GLenum target, const T* data, uint32_t count, uint32_t& capacity, const std::vector<LightTreeRange>& ranges, unsigned long long& memory) {
+		if (count > capacity) {
+			uint32_t grown = count + count / 2;
+			glBufferData(target, sizeof(T) * grown, nullptr, GL_DYNAMIC_DRAW);
+			UploadRange(target, data, 0, count);
+			memory += sizeof(T) * (grown - capacity);
+			capacity = grown;
+			return;
+		}
+		for (const LightTreeRange& range : ranges) {
+			UploadRange(target, data, range.begin, range.end);
+		}
+	}
+}
+
 RayTracingSystem::RayTracingSystem() {}
 
 RayTracingSystem::~RayTracingSystem() {
@@ -22,6 +71,20 @@ RayTracingSystem::~RayTracingSystem() {
 	glDeleteProgram(finalQuadShader);
 
 	glDeleteFramebuffers(1, &finalQuadFBO);
+
+	if (cpuRayTracer) {
+		MemoryManager::Free(cpuRayTracer);
+	}
+	if (tileFarm) {
+		MemoryManager::Free(tileFarm);
+	}
+	if (opacityMicromap) {
+		bvh->SetOpacityMicromap(nullptr);
+		MemoryManager::Free(opacityMicromap);
+	}
+	if (lightTree) {
+		MemoryManager::Free(lightTree);
+	}
 }
 
 void RayTracingSystem::Setup() {
@@ -35,14 +98,16 @@ void RayTracingSystem::Setup() {
 
 	glGenQueries(1, &timeQuery);
 
-	// Set up our vectors of gpu lights
-	pointLightsToGPU.reserve(mainScene->pointLights.size());
-	for (int i = 0; i < mainScene->pointLights.size(); i++) {
-		PointLightToGPU pToGPU = PointLightToGPU{
-			pToGPU.position_and_radius = glm::vec4(glm::vec3(mainScene->pointLights[i].position), mainScene->pointLights[i].radius),
-			pToGPU.color_and_luminance = glm::vec4(mainScene->pointLights[i].color, mainScene->pointLights[i].lum)
-		};
-		pointLightsToGPU.push_back(pToGPU);
+	// Set up our vectors of gpu lights, point lights need none
+	const PointLightPool& pointLights = mainScene->pointLights;
+	uint32_t numPointLights = pointLights.Count();
+#if CPU_RAY_TRACING
+	pointLightsToGPU.resize(numPointLights);
+	CopyPointLights(pointLights, pointLightsToGPU.data(), 0, numPointLights);
+#endif
+	spotLightsToGPU.reserve(mainScene->spotLights.size());
+	for (const SpotLight& s : mainScene->spotLights) {
+		spotLightsToGPU.push_back(ToGPU(s));
 	}
 
 	directionalLightsToGPU.reserve(mainScene->directionalLights.size());
@@ -59,21 +124,38 @@ void RayTracingSystem::Setup() {
 		directionalLightsToGPU.push_back(d);
 	}
 
-	pointLightIndicesSSBOToGPU = std::vector<PointLightIndicesSSBO, MemoryAllocator<PointLightIndicesSSBO> >(GRID_SIZE * GRID_SIZE * GRID_SIZE);
 	std::vector<LinearBVHNode>& nodes = bvh->GetLinearBVH();
+	sceneMin = nodes[0].boundsMin;
+	sceneMax = nodes[0].boundsMax;
 
 	// Initialize our compute shaders and gpu data
 	{
-		bakeLightsComputeShader = util::initComputeShader("bakeLights.comp");
 		rayTraceComputeShader = util::initComputeShader("rayTrace.comp");
 
-		// Constant memory lights
-		glGenBuffers(1, &pointLightsUBO);
-		glBindBuffer(GL_UNIFORM_BUFFER, pointLightsUBO);
-		glBufferData(GL_UNIFORM_BUFFER, sizeof(PointLightToGPU) * pointLightsToGPU.size(), pointLightsToGPU.data(), GL_STATIC_DRAW);
-		glBindBufferBase(GL_UNIFORM_BUFFER, 0, pointLightsUBO);
-		glBindBuffer(GL_UNIFORM_BUFFER, 0);
-		uboMemory += sizeof(PointLightToGPU) * pointLightsToGPU.size();
+		// Lights, as many as the scene has. At least one each so bindings 6 and 10 still get a buffer
+		// when it has none.
+		pointPositionsCapacity = std::max(numPointLights, 1u);
+		glGenBuffers(1, &pointPositionsSSBO);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, pointPositionsSSBO);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(glm::vec4) * pointPositionsCapacity, numPointLights ? pointLights.PositionsAndRadii() : NULL, GL_DYNAMIC_DRAW);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 6, pointPositionsSSBO);
+		ssboMemory += sizeof(glm::vec4) * pointPositionsCapacity;
+
+		pointColorsCapacity = std::max(numPointLights, 1u);
+		glGenBuffers(1, &pointColorsSSBO);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, pointColorsSSBO);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(glm::vec4) * pointColorsCapacity, numPointLights ? pointLights.ColorsAndLuminance() : NULL, GL_DYNAMIC_DRAW);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 10, pointColorsSSBO);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+		ssboMemory += sizeof(glm::vec4) * pointColorsCapacity;
+
+		// Scenes often have none, binding 9 still gets a buffer
+		glGenBuffers(1, &spotLightsSSBO);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, spotLightsSSBO);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(SpotLightToGPU) * std::max<size_t>(spotLightsToGPU.size(), 1), spotLightsToGPU.empty() ? NULL : spotLightsToGPU.data(), GL_STATIC_DRAW);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 9, spotLightsSSBO);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+		ssboMemory += sizeof(SpotLightToGPU) * spotLightsToGPU.size();
 
 		// Material buffer
 		glGenBuffers(1, &materialsUBO);
@@ -155,71 +237,35 @@ void RayTracingSystem::Setup() {
 		glBindFramebuffer(GL_FRAMEBUFFER, 0);
 	}
 
-	// Cull our lights in a 3D grid for faster look-up in our ray tracer
+	// Cull our lights into a tree for faster look-up in our ray tracer
 	{
-
-		// Point light indices as an SSBO to be written to.
-		glGenBuffers(1, &pointLightIndicesSSBO);
-		glBindBuffer(GL_SHADER_STORAGE_BUFFER, pointLightIndicesSSBO);
-		glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(PointLightIndicesSSBO) * GRID_SIZE* GRID_SIZE* GRID_SIZE, NULL, GL_DYNAMIC_DRAW);
-		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, pointLightIndicesSSBO);
-		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
-
-#if PROFILING
-		glBeginQuery(GL_TIME_ELAPSED, timeQuery);
-		LightCull();
-		glEndQuery(GL_TIME_ELAPSED);
-		glGetQueryObjecti64v(timeQuery, GL_QUERY_RESULT, &bakeLightsTime);
-#else
-		LightCull();
+		lightTree = MemoryManager::Allocate<LightTree>();
+		lightTree->Build(pointLights.PositionsAndRadii(), numPointLights, spotLightsToGPU.data(), static_cast<uint32_t>(spotLightsToGPU.size()), sceneMin, sceneMax);
+		bakeLightsTime = lightTree->buildTime * 1000; // ns, to match our GPU timings
+		mainScene->pointLights.ClearDirty();
+
+#if RUN_BENCHMARKS
+		// Leaves the scene's tree as it was
+		lightTree->Benchmark(3);
+		lightTree->BenchmarkUpdates(20);
+		PointLightPool::Benchmark(3);
 #endif
 
-		glBindBuffer(GL_SHADER_STORAGE_BUFFER, pointLightIndicesSSBO);
-		glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(PointLightIndicesSSBO) * GRID_SIZE * GRID_SIZE* GRID_SIZE, pointLightIndicesSSBOToGPU.data());
-		glDeleteBuffers(1, &pointLightIndicesSSBO);
+		lightTreeNodesCapacity = lightTree->NumNodes();
+		glGenBuffers(1, &lightTreeNodesSSBO);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, lightTreeNodesSSBO);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(LightTreeNode) * lightTreeNodesCapacity, lightTree->GetNodes(), GL_DYNAMIC_DRAW);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 7, lightTreeNodesSSBO);
+		ssboMemory += sizeof(LightTreeNode) * lightTreeNodesCapacity;
+
+		// Empty without lights, like the point light buffers
+		lightTreeIndicesCapacity = std::max(lightTree->NumLightIndices(), 1u);
+		glGenBuffers(1, &lightTreeIndicesSSBO);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, lightTreeIndicesSSBO);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(uint32_t) * lightTreeIndicesCapacity, lightTree->NumLightIndices() ? lightTree->GetLightIndices() : NULL, GL_DYNAMIC_DRAW);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 8, lightTreeIndicesSSBO);
 		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
-
-		for (uint32_t i = 0; i < pointLightIndicesSSBOToGPU.size(); ++i) {
-			PointLightIndicesSSBO p = pointLightIndicesSSBOToGPU[i];
-			PointLightIndicesUBO pu;
-			glm::uvec4 vec;
-
-			vec.x = (
-				(p.indices[0] & 0xFF) << 24 |
-				(p.indices[1] & 0xFF) << 16 |
-				(p.indices[2] & 0xFF) << 8 |
-				(p.indices[3] & 0xFF)
-				);
-			vec.y = (
-				(p.indices[4] & 0xFF) << 24 |
-				(p.indices[5] & 0xFF) << 16 |
-				(p.indices[6] & 0xFF) << 8 |
-				(p.indices[7] & 0xFF)
-				);
-			vec.z = (
-				(p.indices[8] & 0xFF) << 24 |
-				(p.indices[9] & 0xFF) << 16 |
-				(p.indices[10] & 0xFF) << 8 |
-				(p.indices[11] & 0xFF)
-				);
-			vec.w = (
-				(p.indices[12] & 0xFF) << 24 |
-				(p.indices[13] & 0xFF) << 16 |
-				(p.indices[14] & 0xFF) << 8 |
-				(p.numLights & 0xFF)
-				);
-
-			pu.indices_and_num_lights = vec;
-			pointLightIndicesUBOToGPU.push_back(pu);
-		}
-
-		glGenBuffers(1, &pointLightIndicesUBO);
-		glBindBuffer(GL_UNIFORM_BUFFER, pointLightIndicesUBO);
-		glBufferData(GL_UNIFORM_BUFFER, sizeof(PointLightIndicesUBO) * GRID_SIZE * GRID_SIZE * GRID_SIZE, pointLightIndicesUBOToGPU.data(), GL_STATIC_DRAW);
-		glBindBufferBase(GL_UNIFORM_BUFFER, 1, pointLightIndicesUBO);
-		glBindBuffer(GL_UNIFORM_BUFFER, 0);
-		uboMemory += sizeof(PointLightIndicesSSBO) * GRID_SIZE * GRID_SIZE * GRID_SIZE;
-
+		ssboMemory += sizeof(uint32_t) * lightTreeIndicesCapacity;
 	}
 
 	// Set up uniforms for our ray trace compute shader
@@ -237,10 +283,9 @@ void RayTracingSystem::Setup() {
 
 		uniMinBounds = glGetUniformLocation(rayTraceComputeShader, "minBounds");
 		uniMaxBounds = glGetUniformLocation(rayTraceComputeShader, "maxBounds");
-		glm::vec3 minBounds = nodes[0].boundsMin;
-		glm::vec3 maxBounds = nodes[0].boundsMax;
-		glUniform3fv(uniMinBounds, 1, glm::value_ptr(minBounds));
-		glUniform3fv(uniMaxBounds, 1, glm::value_ptr(maxBounds));
+		LightTreeView treeView = lightTree->View();
+		glUniform3fv(uniMinBounds, 1, glm::value_ptr(treeView.boundsMin));
+		glUniform3fv(uniMaxBounds, 1, glm::value_ptr(treeView.boundsMax));
 
 		uniDirectionalLightDir = glGetUniformLocation(rayTraceComputeShader, "directionalLightDir");
 		uniDirectionalLightCol = glGetUniformLocation(rayTraceComputeShader, "directionalLightCol");
@@ -248,6 +293,89 @@ void RayTracingSystem::Setup() {
 		glUseProgram(0);
 	}
 
+#if CPU_RAY_TRACING
+	// Alpha tested triangles are baked before anything traces against the BVH on the CPU
+	{
+		opacityMicromap = MemoryManager::Allocate<OpacityMicromap>(
+			AssetManager::gpuVertices->data(),
+			AssetManager::gpuTriangles->data(),
+			static_cast<uint32_t>(AssetManager::gpuTriangles->size()),
+			AssetManager::cpuMaterialTextures->data()
+		);
+		bvh->SetOpacityMicromap(opacityMicromap);
+#if PROFILING
+		opacityMicromap->PrintBakeStats();
+#endif
+	}
+
+	// The CPU tracer reads the same buffers we hand to the GPU
+	{
+		cpuRayTracer = MemoryManager::Allocate<CPURayTracer>(
+			bvh,
+			AssetManager::gpuVertices->data(),
+			AssetManager::gpuTriangles->data(),
+			AssetManager::gpuMaterials->data(),
+			windowWidth,
+			windowHeight
+		);
+		cpuRayTracer->SetLights(pointLightsToGPU.data(), lightTree->View(), sceneMin, sceneMax);
+		cpuRayTracer->SetTextures(AssetManager::cpuMaterialTextures->data());
+		cpuRayTracer->SetManyLights(pointLightsToGPU.data(), static_cast<uint32_t>(pointLightsToGPU.size()));
+
+#if RUN_BENCHMARKS
+		cpuRayTracer->SetCamera(glm::inverse(mainCamera->proj), glm::inverse(mainCamera->view), mainCamera->transform->position);
+		cpuRayTracer->SetDirectionalLight(glm::vec3(mainScene->directionalLights[0].direction), glm::vec3(mainScene->directionalLights[0].color));
+		cpuRayTracer->BenchmarkPrimaryRays(5);
+		cpuRayTracer->BenchmarkBounces(3);
+		cpuRayTracer->BenchmarkShadows(3);
+		cpuRayTracer->BenchmarkOpacityMicromap(opacityMicromap, 3);
+		cpuRayTracer->BenchmarkTextures(3);
+		cpuRayTracer->BenchmarkDenoiser(3);
+		cpuRayTracer->BenchmarkUpsampling(8);
+		cpuRayTracer->BenchmarkManyLights(4);
+		cpuRayTracer->BenchmarkLightBVH(3);
+#endif
+	}
+
+	// Worker processes trace out of their own copy of the same buffers
+	{
+		TileFarmScene farmScene;
+		farmScene.bvh = bvh;
+		farmScene.vertices = AssetManager::gpuVertices->data();
+		farmScene.numVertices = static_cast<uint32_t>(AssetManager::gpuVertices->size());
+		farmScene.triangles = AssetManager::gpuTriangles->data();
+		farmScene.numTriangles = static_cast<uint32_t>(AssetManager::gpuTriangles->size());
+		farmScene.materials = AssetManager::gpuMaterials->data();
+		farmScene.numMaterials = static_cast<uint32_t>(AssetManager::gpuMaterials->size());
+		farmScene.textures = AssetManager::cpuMaterialTextures->data();
+		farmScene.opacityMicromap = opacityMicromap;
+		farmScene.pointLights = pointLightsToGPU.data();
+		farmScene.numPointLights = static_cast<uint32_t>(pointLightsToGPU.size());
+		farmScene.lightTree = lightTree->View();
+		farmScene.sceneMin = sceneMin;
+		farmScene.sceneMax = sceneMax;
+
+#if RUN_BENCHMARKS
+		{
+			TileFarm benchmarkFarm;
+			if (benchmarkFarm.Start(farmScene, windowWidth, windowHeight, 1)) {
+				benchmarkFarm.SetCamera(glm::inverse(mainCamera->proj), glm::inverse(mainCamera->view), mainCamera->transform->position);
+				benchmarkFarm.SetDirectionalLight(glm::vec3(mainScene->directionalLights[0].direction), glm::vec3(mainScene->directionalLights[0].color));
+				benchmarkFarm.BenchmarkScaling(JobSystem::NumThreads(), 5);
+			}
+		}
+#endif
+
+#if CPU_TILE_FARM_WORKERS > 0
+		tileFarm = MemoryManager::Allocate<TileFarm>();
+		if (!tileFarm->Start(farmScene, windowWidth, windowHeight, CPU_TILE_FARM_WORKERS)) {
+			MemoryManager::Free(tileFarm);
+			tileFarm = nullptr;
+		}
+#endif
+	}
+#endif
+
 	// Memory prints
 	{
 		// Max of 65kb of constant/shared memory
@@ -282,16 +410,25 @@ void RayTracingSystem::Render() {
 	view = mainCamera->view;
 	proj = mainCamera->proj;
 
+	// Pick up lights Lua added or moved this frame
+	UpdateLights();
+
 	// Clear our framebuffer
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 	glClearColor(0, 0, 0, 1.0f);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+#if !CPU_RAY_TRACING
+	// The CPU tracer overwrites the whole texture, and keeps the last one if it has nothing new
 	glBindFramebuffer(GL_FRAMEBUFFER, finalQuadFBO);
 	glClearColor(0, 0, 0, 1.0f);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+#endif
 
 	// Next, ray trace our scene
-#if PROFILING
+#if CPU_RAY_TRACING
+	RayTrace();
+	rayTraceTime = (tileFarm && cpuRayTracer->ShownRayStat() == RayStat::None ? tileFarm->traceTime : cpuRayTracer->traceTime) * 1000; // ns, to match our GPU timings
+#elif PROFILING
 	glBeginQuery(GL_TIME_ELAPSED, timeQuery);
 	RayTrace();
 	glEndQuery(GL_TIME_ELAPSED);
@@ -311,30 +448,105 @@ void RayTracingSystem::Render() {
 #endif
 }
 
-void RayTracingSystem::LightCull() {
-
-	glUseProgram(bakeLightsComputeShader);
-
-	uniNumPointLights = glGetUniformLocation(bakeLightsComputeShader, "numPointLights");
-	glUniform1ui(uniNumPointLights, static_cast<unsigned int>(pointLightsToGPU.size()));
+void RayTracingSystem::UpdateLights() {
+	PointLightPool& pointLights = mainScene->pointLights;
+	uint8_t dirty = pointLights.DirtyFlags();
+	if (dirty == 0) {
+		return;
+	}
 
-	uniMinBounds = glGetUniformLocation(bakeLightsComputeShader, "minBounds");
-	uniMaxBounds = glGetUniformLocation(bakeLightsComputeShader, "maxBounds");
+	uint32_t count = pointLights.Count();
+	std::vector<LightTreeRange> dirtyRanges;
+	pointLights.ForEachDirtyRun(LIGHT_TREE_UPLOAD_GAP, [&dirtyRanges](uint32_t begin, uint32_t end) {
+		dirtyRanges.push_back(LightTreeRange{ begin, end });
+	});
+
+	// Adding or removing lights counts as moving them, so the count only changes along with that
+	bool moved = (dirty & POINT_LIGHT_MOVED) != 0;
+	if (moved) {
+		lightTree->Update(pointLights.PositionsAndRadii(), count, spotLightsToGPU.data(), static_cast<uint32_t>(spotLightsToGPU.size()), dirtyRanges);
+		bakeLightsTime = lightTree->updateTime * 1000; // ns, to match our GPU timings
+
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, pointPositionsSSBO);
+		UploadArray(GL_SHADER_STORAGE_BUFFER, pointLights.PositionsAndRadii(), count, pointPositionsCapacity, dirtyRanges, ssboMemory);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, lightTreeNodesSSBO);
+		UploadArray(GL_SHADER_STORAGE_BUFFER, lightTree->GetNodes(), lightTree->NumNodes(), lightTreeNodesCapacity, lightTree->ChangedNodes(), ssboMemory);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, lightTreeIndicesSSBO);
+		UploadArray(GL_SHADER_STORAGE_BUFFER, lightTree->GetLightIndices(), lightTree->NumLightIndices(), lightTreeIndicesCapacity, lightTree->ChangedIndices(), ssboMemory);
+	}
+	if (dirty & POINT_LIGHT_RECOLORED) {
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, pointColorsSSBO);
+		UploadArray(GL_SHADER_STORAGE_BUFFER, pointLights.ColorsAndLuminance(), count, pointColorsCapacity, dirtyRanges, ssboMemory);
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 
-	std::vector<LinearBVHNode>& nodes = bvh->GetLinearBVH();
-	glm::vec3 minBounds = nodes[0].boundsMin;
-	glm::vec3 maxBounds = nodes[0].boundsMax;
-	glUniform3fv(uniMinBounds, 1, glm::value_ptr(minBounds));
-	glUniform3fv(uniMaxBounds, 1, glm::value_ptr(maxBounds));
+#if CPU_RAY_TRACING
+	uint32_t oldCount = static_cast<uint32_t>(pointLightsToGPU.size());
+	pointLightsToGPU.resize(count);
+	for (const LightTreeRange& range : dirtyRanges) {
+		CopyPointLights(pointLights, pointLightsToGPU.data(), range.begin, range.end);
+	}
 
-	glDispatchCompute(GRID_SIZE, GRID_SIZE, GRID_SIZE);
-	glMemoryBarrier(GL_ALL_BARRIER_BITS);
+	// Both the lights and the tree may have moved in memory
+	cpuRayTracer->SetLights(pointLightsToGPU.data(), lightTree->View(), sceneMin, sceneMax);
+	if (count != oldCount) {
+		cpuRayTracer->SetManyLights(pointLightsToGPU.data(), count);
+	}
+	else {
+		cpuRayTracer->UpdateManyLights();
+	}
+	if (tileFarm) {
+		tileFarm->SetPointLights(pointLightsToGPU.data(), count);
+		tileFarm->SetLightTree(lightTree->View());
+	}
+#endif
 
-	glUseProgram(0);
+	pointLights.ClearDirty();
 }
 
 void RayTracingSystem::RayTrace() {
 
+#if CPU_RAY_TRACING
+#if PROFILING
+	// F1 cycles through the ray stats heatmaps and back to the image, F2 prints and saves the last counted frame's
+	bool showKeyDown = SDL_Input::keyboard[SDL_SCANCODE_F1];
+	bool saveKeyDown = SDL_Input::keyboard[SDL_SCANCODE_F2];
+	if (showKeyDown && !rayStatsShowKeyDown) {
+		uint32_t next = (static_cast<uint32_t>(cpuRayTracer->ShownRayStat()) + 1) % static_cast<uint32_t>(RayStat::Count);
+		cpuRayTracer->ShowRayStats(static_cast<RayStat>(next));
+	}
+	if (saveKeyDown && !rayStatsSaveKeyDown) {
+		cpuRayTracer->PrintRayStats();
+		cpuRayTracer->WriteRayStatsHeatmaps("../rayStats_");
+	}
+	rayStatsShowKeyDown = showKeyDown;
+	rayStatsSaveKeyDown = saveKeyDown;
+#endif
+
+	// Ray stats are counted in process
+	if (tileFarm && cpuRayTracer->ShownRayStat() == RayStat::None) {
+		tileFarm->SetCamera(glm::inverse(proj), glm::inverse(view), mainCamera->transform->position);
+		tileFarm->SetDirectionalLight(glm::vec3(mainScene->directionalLights[0].direction), glm::vec3(mainScene->directionalLights[0].color));
+		if (tileFarm->Render()) {
+			glBindTexture(GL_TEXTURE_2D, finalQuadRender);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, windowWidth, windowHeight, GL_RGBA, GL_UNSIGNED_BYTE, tileFarm->GetPixels());
+			glBindTexture(GL_TEXTURE_2D, 0);
+			return;
+		}
+
+		// A worker went away and took the farm with it, carry on in process
+		MemoryManager::Free(tileFarm);
+		tileFarm = nullptr;
+	}
+
+	cpuRayTracer->SetCamera(glm::inverse(proj), glm::inverse(view), mainCamera->transform->position);
+	cpuRayTracer->SetDirectionalLight(glm::vec3(mainScene->directionalLights[0].direction), glm::vec3(mainScene->directionalLights[0].color));
+	if (cpuRayTracer->Render()) {
+		glBindTexture(GL_TEXTURE_2D, finalQuadRender);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, windowWidth, windowHeight, GL_RGBA, GL_UNSIGNED_BYTE, cpuRayTracer->GetPixels());
+		glBindTexture(GL_TEXTURE_2D, 0);
+	}
+#else
 	glUseProgram(rayTraceComputeShader);
 
 	//Set up other uniform variables
@@ -345,6 +557,7 @@ void RayTracingSystem::RayTrace() {
 	glUniform3fv(uniDirectionalLightCol, 1, glm::value_ptr(glm::vec3(mainScene->directionalLights[0].color)));
 
 	glDispatchCompute(NUM_GROUPS_X, NUM_GROUPS_Y, 1);
+#endif
 }
 
 void RayTracingSystem::PostProcess() {
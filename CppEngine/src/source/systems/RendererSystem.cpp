@@ -4,6 +4,7 @@
 #include <chrono>
 #include <cmath>
 #include <algorithm>
+#include <unordered_map>
 #include "glm/gtc/type_ptr.hpp"
 
 #include "Utility.h"
@@ -16,13 +17,18 @@
 #include "Shader.h"
 #include "GameObject.h"
 #include "ModelRenderer.h"
-#include "PointLight.h"
+#include "SpotLight.h"
 #include "DirectionalLight.h"
 #include "Model.h"
 #include "Mesh.h"
 #include "Texture.h"
 #include "Light.h"
 #include "Bounds.h"
+#include "LightClusters.h"
+#include "FrustumCuller.h"
+#include "AABBTree.h"
+#include "OcclusionCuller.h"
+#include "RenderQueue.h"
 
 
 RendererSystem::RendererSystem() {}
@@ -38,13 +44,32 @@ RendererSystem::~RendererSystem() {
 	glDeleteTextures(1, &gBuffer.diffuseSpec);
 	glDeleteTextures(1, &gBuffer.depth);
 
+	glDeleteBuffers(1, &spotLightsSSBO);
+	glDeleteBuffers(1, &clustersSSBO);
+	glDeleteBuffers(1, &clusterIndicesSSBO);
+	if (lightClusters) {
+		MemoryManager::Free(lightClusters);
+	}
+	if (meshTree) {
+		MemoryManager::Free(meshTree);
+	}
+	if (occlusionCuller) {
+		MemoryManager::Free(occlusionCuller);
+	}
+	meshInstances.clear();
+	meshProxies.clear();
+	meshStateBits.clear();
+	boundsVersions.clear();
+
 	for (int i = 0; i < modelRenderers.size(); i++) {
 		modelRenderers[i] = nullptr;
 	}
 	modelRenderers.clear();
 
 	meshesToDraw.clear();
-	transparentToDraw.clear();
+	if (renderQueue) {
+		MemoryManager::Free(renderQueue);
+	}
 }
 
 void RendererSystem::Setup() {
@@ -58,6 +83,29 @@ void RendererSystem::Setup() {
 		}
 	}
 
+	// Every version starts out stale, so the first CullScene moves each mesh to where its
+	// transform has it by then. Materials are numbered in the order they are first seen.
+	meshTree = MemoryManager::Allocate<AABBTree>();
+	renderQueue = MemoryManager::Allocate<RenderQueue>();
+	std::unordered_map<const Material*, uint32_t> materialIds;
+	for (int i = 0; i < modelRenderers.size(); i++) {
+		const Transform* transform = modelRenderers[i]->gameObject->transform;
+		for (int j = 0; j < modelRenderers[i]->numMeshes; j++) {
+			glm::vec3 worldMin, worldMax;
+			modelRenderers[i]->model->meshes[j]->bounds->Transform(transform->model, worldMin, worldMax);
+			meshProxies.push_back(meshTree->Insert(worldMin, worldMax, static_cast<uint32_t>(meshInstances.size())));
+			meshInstances.push_back(MeshInstance{ modelRenderers[i], static_cast<uint32_t>(j) });
+			boundsVersions.push_back(transform->modelVersion - 1);
+
+			const Material* material = modelRenderers[i]->model->materials[j];
+			uint32_t materialId = materialIds.emplace(material, static_cast<uint32_t>(materialIds.size())).first->second;
+			meshStateBits.push_back(RenderQueue::StateBits(material->shader->shaderProgram, materialId, modelRenderers[i]->vaos[j]));
+		}
+	}
+#if OCCLUSION_CULLING
+	occlusionCuller = MemoryManager::Allocate<OcclusionCuller>();
+#endif
+
 	// Set up debugging support
 	glEnable(GL_DEBUG_OUTPUT);
 	glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
@@ -72,14 +120,16 @@ void RendererSystem::Setup() {
 	glEnable(GL_CULL_FACE);
 	glDepthFunc(GL_LEQUAL);
 
-	// Set up our vectors of gpu lights
-	pointLightsToGPU.reserve(mainScene->pointLights.size());
-	for (int i = 0; i < mainScene->pointLights.size(); i++) {
-		PointLightToGPU pToGPU = PointLightToGPU{
-			pToGPU.position_and_radius = glm::vec4(glm::vec3(mainScene->pointLights[i].position), mainScene->pointLights[i].radius),
-			pToGPU.color_and_luminance = glm::vec4(mainScene->pointLights[i].color, mainScene->pointLights[i].lum)
-		};
-		pointLightsToGPU.push_back(pToGPU);
+	// Set up our vectors of gpu lights, point lights need none
+	spotLightsToGPU.reserve(mainScene->spotLights.size());
+	for (int i = 0; i < mainScene->spotLights.size(); i++) {
+		const SpotLight& spot = mainScene->spotLights[i];
+		float outer = std::min(std::max(spot.theta, spot.phi), 180.0f);
+		SpotLightToGPU sToGPU;
+		sToGPU.position_and_range = glm::vec4(glm::vec3(spot.position), spot.range);
+		sToGPU.direction_and_cos_outer = glm::vec4(glm::normalize(glm::vec3(spot.direction)), std::cos(glm::radians(outer)));
+		sToGPU.color_and_cos_inner = glm::vec4(glm::vec3(spot.color), std::cos(glm::radians(std::min(spot.theta, outer))));
+		spotLightsToGPU.push_back(sToGPU);
 	}
 
 	directionalLightsToGPU.reserve(mainScene->directionalLights.size());
@@ -218,17 +268,42 @@ void RendererSystem::Setup() {
 	{
 		tiledComputeShader = util::initComputeShader("tiledLighting.comp");
 
-		glGenBuffers(1, &pointLightsSSBO);
-		glBindBuffer(GL_SHADER_STORAGE_BUFFER, pointLightsSSBO);
-		glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(PointLightToGPU) * pointLightsToGPU.size(), pointLightsToGPU.data(), GL_STATIC_DRAW);
-		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, pointLightsSSBO);
+		// Sized and filled by UploadPointLights, which sees every light as dirty the first time
+		glGenBuffers(1, &pointPositionsSSBO);
+		glGenBuffers(1, &pointColorsSSBO);
+		UploadPointLights();
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, pointPositionsSSBO);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, pointColorsSSBO);
+
+		// Scenes often have none, binding 3 still gets a buffer
+		glGenBuffers(1, &spotLightsSSBO);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, spotLightsSSBO);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(SpotLightToGPU) * std::max<size_t>(spotLightsToGPU.size(), 1), spotLightsToGPU.empty() ? NULL : spotLightsToGPU.data(), GL_STATIC_DRAW);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, spotLightsSSBO);
 		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 
-		glGenBuffers(1, &lightTilesSSBO);
-		glBindBuffer(GL_SHADER_STORAGE_BUFFER, lightTilesSSBO);
-		glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(LightTile) * NUM_GROUPS_X * NUM_GROUPS_Y, NULL, GL_DYNAMIC_DRAW);
-		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, lightTilesSSBO);
+		// Froxel lists are filled in every frame by BuildClusters
+		lightClusters = MemoryManager::Allocate<LightClusters>();
+
+		glGenBuffers(1, &clustersSSBO);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, clustersSSBO);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(LightCluster) * NUM_CLUSTERS, NULL, GL_DYNAMIC_DRAW);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, clustersSSBO);
+
+		glGenBuffers(1, &clusterIndicesSSBO);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, clusterIndicesSSBO);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(uint32_t), NULL, GL_DYNAMIC_DRAW);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, clusterIndicesSSBO);
 		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+#if RUN_BENCHMARKS
+		lightClusters->Benchmark(mainCamera->view, mainCamera->proj, mainCamera->near_plane, mainCamera->far_plane, 3);
+		PointLightPool::Benchmark(3);
+		FrustumCuller::Benchmark(mainCamera->frustumPlanes.data(), mainCamera->transform->position, 3);
+		AABBTree::Benchmark(mainCamera->frustumPlanes.data(), mainCamera->transform->position, 3);
+		OcclusionCuller::Benchmark(3);
+		RenderQueue::Benchmark(3);
+#endif
 	}
 
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
@@ -351,6 +426,7 @@ void RendererSystem::Register(const Component* c) {
 void RendererSystem::Render() {
 
 	totalTriangles = 0;
+	stateChanges = 0;
 	view = mainCamera->view;
 	proj = mainCamera->proj;
 
@@ -366,6 +442,12 @@ void RendererSystem::Render() {
 	auto endTime = std::chrono::high_resolution_clock::now();
 	cullTime = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime).count();
 
+	// Then assign point lights to froxels for the tiled compute and transparent passes
+	startTime = std::chrono::high_resolution_clock::now();
+	BuildClusters();
+	endTime = std::chrono::high_resolution_clock::now();
+	clusterTime = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime).count();
+
 	// Next, do our depth pre-pass as to pre-emptively set our depth values of our opaque geometry
 	// to speed up our transparent pass
 	glBeginQuery(GL_TIME_ELAPSED, timeQuery);
@@ -417,37 +499,117 @@ void RendererSystem::Render() {
 
 void RendererSystem::CullScene() {
 
-	// Get all of our meshes that are not frustum culled. These will be used for later drawing
-	meshesToDraw.clear();
-	transparentToDraw.clear();
-	for (int i = 0; i < modelRenderers.size(); i++) {
+	// Move the meshes whose transform changed since last frame in the tree. Most stay inside
+	// their fat boxes and leave the tree as it is.
+	uint32_t numInstances = static_cast<uint32_t>(meshInstances.size());
+	for (uint32_t i = 0; i < numInstances; i++) {
+		const MeshInstance& instance = meshInstances[i];
+		const Transform* transform = instance.renderer->gameObject->transform;
+		if (transform->modelVersion == boundsVersions[i]) {
+			continue;
+		}
+		boundsVersions[i] = transform->modelVersion;
 
-		glm::mat4 model = modelRenderers[i]->gameObject->transform->model;
-		for (int j = 0; j < modelRenderers[i]->numMeshes; j++) {
+		glm::vec3 worldMin, worldMax;
+		instance.renderer->model->meshes[instance.mesh]->bounds->Transform(transform->model, worldMin, worldMax);
+		meshTree->Move(meshProxies[i], worldMin, worldMax);
+	}
 
-			if (!ShouldFrustumCull(modelRenderers[i]->model->meshes[j], model)) {
+	// Get all of our meshes that are not frustum culled, in tree order, then drop the ones hidden
+	// behind others. These will be used for later drawing
+	frustumVisible.clear();
+	meshTree->QueryFrustum(mainCamera->frustumPlanes.data(), [this](uint32_t i) {
+		frustumVisible.push_back(i);
+	});
+#if OCCLUSION_CULLING
+	CullOccluded();
+#endif
 
-				MeshToDraw m = MeshToDraw{
-					m.mesh = modelRenderers[i]->model->meshes[j],
-					m.material = modelRenderers[i]->model->materials[j],
-					m.model = model,
-					m.vao = modelRenderers[i]->vaos[j],
-					m.shaderProgram = modelRenderers[i]->model->materials[j]->shader->shaderProgram,
-					m.position = modelRenderers[i]->gameObject->transform->position
-				};
+	// Opaque meshes sort by state then front to back, transparent ones back to front by the
+	// distance to their bounds' center
+	meshesToDraw.clear();
+	renderQueue->Clear();
+	glm::vec3 camPos = mainCamera->transform->position;
+	for (uint32_t i : frustumVisible) {
+		ModelRenderer* mr = meshInstances[i].renderer;
+		uint32_t j = meshInstances[i].mesh;
+		MeshToDraw m = MeshToDraw{
+			m.mesh = mr->model->meshes[j],
+			m.material = mr->model->materials[j],
+			m.model = mr->gameObject->transform->model,
+			m.vao = mr->vaos[j],
+			m.shaderProgram = mr->model->materials[j]->shader->shaderProgram
+		};
 
-				if (m.material->isTransparent) {
-					transparentToDraw.push_back(m);
-				} else {
-					meshesToDraw.push_back(m);
-				}
+		glm::vec3 center = 0.5f * (meshTree->BoundsMin(meshProxies[i]) + meshTree->BoundsMax(meshProxies[i]));
+		float depth = glm::length(center - camPos) / mainCamera->far_plane;
+		uint32_t pass = m.material->isTransparent ? RENDER_PASS_TRANSPARENT : RENDER_PASS_OPAQUE;
+		renderQueue->Push(RenderQueue::MakeKey(pass, meshStateBits[i], depth), static_cast<uint32_t>(meshesToDraw.size()));
+		meshesToDraw.push_back(m);
+	}
+	renderQueue->Sort();
 
-			}
+}
 
+void RendererSystem::CullOccluded() {
+	auto startTime = std::chrono::high_resolution_clock::now();
+	occlusionCuller->Begin(mainCamera->proj * mainCamera->view);
+
+	// Low poly opaque meshes that cover the most screen make the best occluders. Alpha tested
+	// ones have holes in them.
+	occluderCandidates.clear();
+	for (uint32_t i : frustumVisible) {
+		const MeshInstance& instance = meshInstances[i];
+		const Material* material = instance.renderer->model->materials[instance.mesh];
+		const Mesh* mesh = instance.renderer->model->meshes[instance.mesh];
+		if (material->isTransparent || material->usingAlpha || mesh->indices.size() / 3 > OCCLUSION_MAX_OCCLUDER_TRIANGLES) {
+			continue;
 		}
 
+		float area = occlusionCuller->ScreenArea(meshTree->BoundsMin(meshProxies[i]), meshTree->BoundsMax(meshProxies[i]));
+		if (area >= OCCLUSION_MIN_OCCLUDER_AREA) {
+			occluderCandidates.push_back(std::make_pair(area, i));
+		}
 	}
+	std::sort(occluderCandidates.begin(), occluderCandidates.end(), [](const std::pair<float, uint32_t>& a, const std::pair<float, uint32_t>& b) {
+		return a.first > b.first;
+	});
+
+	uint32_t numTriangles = 0;
+	uint32_t numOccluders = 0;
+	for (const std::pair<float, uint32_t>& candidate : occluderCandidates) {
+		const MeshInstance& instance = meshInstances[candidate.second];
+		const Mesh* mesh = instance.renderer->model->meshes[instance.mesh];
+		uint32_t meshTriangles = static_cast<uint32_t>(mesh->indices.size() / 3);
+		if (numTriangles + meshTriangles > OCCLUSION_TRIANGLE_BUDGET) {
+			continue;
+		}
 
+		occlusionCuller->AddOccluder(mesh->positions.data(), mesh->indices.data(), static_cast<uint32_t>(mesh->indices.size()),
+			instance.renderer->gameObject->transform->model);
+		numTriangles += meshTriangles;
+		numOccluders += 1;
+		if (numOccluders == OCCLUSION_MAX_OCCLUDERS) {
+			break;
+		}
+	}
+	occlusionCuller->Rasterize();
+
+	// Keep the meshes still in sight, in the same order
+	size_t kept = 0;
+	occludedDraws = 0;
+	for (uint32_t i : frustumVisible) {
+		if (occlusionCuller->Occluded(meshTree->BoundsMin(meshProxies[i]), meshTree->BoundsMax(meshProxies[i]))) {
+			occludedDraws += 1;
+			continue;
+		}
+		frustumVisible[kept] = i;
+		kept += 1;
+	}
+	frustumVisible.resize(kept);
+
+	auto endTime = std::chrono::high_resolution_clock::now();
+	occlusionTime = std::chrono::duration_cast<std::chrono::microseconds>(endTime - startTime).count();
 }
 
 void RendererSystem::OpaqueDepthPrePass() {
@@ -466,16 +628,25 @@ void RendererSystem::OpaqueDepthPrePass() {
 	glUniformMatrix4fv(glGetUniformLocation(shadowMapShader, "projView"), 1, GL_FALSE, glm::value_ptr(proj * view));
 
 	GLint uniModel = glGetUniformLocation(shadowMapShader, "model");
+	stateChanges += 1;
+
+	// Opaque draws only, their vaos are already next to each other
+	uint32_t opaqueEnd = renderQueue->PassBegin(RENDER_PASS_TRANSPARENT);
+	GLuint lastVao = 0;
+	for (uint32_t i = 0; i < opaqueEnd; i++) {
+		const MeshToDraw& draw = meshesToDraw[(*renderQueue)[i].index];
+		if (draw.vao != lastVao) {
+			glBindVertexArray(draw.vao);
+			lastVao = draw.vao;
+			stateChanges += 1;
+		}
 
-	for (int i = 0; i < meshesToDraw.size(); i++) {
-		glBindVertexArray(meshesToDraw[i].vao);
-
-		glUniformMatrix4fv(uniModel, 1, GL_FALSE, glm::value_ptr(meshesToDraw[i].model));
+		glUniformMatrix4fv(uniModel, 1, GL_FALSE, glm::value_ptr(draw.model));
 
-		totalTriangles += static_cast<int>(meshesToDraw[i].mesh->indices.size()) / 3;
+		totalTriangles += static_cast<int>(draw.mesh->indices.size()) / 3;
 
 		// Use our shader and draw our program
-		glDrawElements(GL_TRIANGLES, static_cast<int>(meshesToDraw[i].mesh->indices.size()), GL_UNSIGNED_INT, 0); //Number of vertices
+		glDrawElements(GL_TRIANGLES, static_cast<int>(draw.mesh->indices.size()), GL_UNSIGNED_INT, 0); //Number of vertices
 	}
 
 	// Reset our framebuffer to use our color attachment for the future uses
@@ -484,6 +655,69 @@ void RendererSystem::OpaqueDepthPrePass() {
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
+// Lights the scene changed since last frame go up as they sit in the pool, in runs. Running
+// out of room doubles both buffers and sends every light again.
+void RendererSystem::UploadPointLights() {
+	PointLightPool& pool = mainScene->pointLights;
+	uint32_t count = pool.Count();
+	if (count > pointLightCapacity || pointLightCapacity == 0) {
+		pointLightCapacity = std::max(std::max(count, 2 * pointLightCapacity), 1u);
+
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, pointPositionsSSBO);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(glm::vec4) * pointLightCapacity, NULL, GL_DYNAMIC_DRAW);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(glm::vec4) * count, pool.PositionsAndRadii());
+
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, pointColorsSSBO);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(glm::vec4) * pointLightCapacity, NULL, GL_DYNAMIC_DRAW);
+		glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(glm::vec4) * count, pool.ColorsAndLuminance());
+	}
+	else if (pool.DirtyFlags() != 0) {
+		// A few clean lights between two runs cost less than another call
+		bool moved = (pool.DirtyFlags() & POINT_LIGHT_MOVED) != 0;
+		bool recolored = (pool.DirtyFlags() & POINT_LIGHT_RECOLORED) != 0;
+		pool.ForEachDirtyRun(4, [&pool, this, moved, recolored](uint32_t begin, uint32_t end) {
+			if (moved) {
+				glBindBuffer(GL_SHADER_STORAGE_BUFFER, pointPositionsSSBO);
+				glBufferSubData(GL_SHADER_STORAGE_BUFFER, sizeof(glm::vec4) * begin, sizeof(glm::vec4) * (end - begin), pool.PositionsAndRadii() + begin);
+			}
+			if (recolored) {
+				glBindBuffer(GL_SHADER_STORAGE_BUFFER, pointColorsSSBO);
+				glBufferSubData(GL_SHADER_STORAGE_BUFFER, sizeof(glm::vec4) * begin, sizeof(glm::vec4) * (end - begin), pool.ColorsAndLuminance() + begin);
+			}
+		});
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	pool.ClearDirty();
+}
+
+void RendererSystem::BuildClusters() {
+	UploadPointLights();
+
+	lightClusters->Build(
+		mainScene->pointLights.PositionsAndRadii(),
+		mainScene->pointLights.Count(),
+		spotLightsToGPU.data(),
+		static_cast<uint32_t>(spotLightsToGPU.size()),
+		mainCamera->view,
+		mainCamera->proj,
+		mainCamera->near_plane,
+		mainCamera->far_plane
+	);
+
+	const std::vector<LightCluster>& clusters = lightClusters->GetClusters();
+	const std::vector<uint32_t>& indices = lightClusters->GetLightIndices();
+
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, clustersSSBO);
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(LightCluster) * clusters.size(), clusters.data());
+
+	// The index list is as long as there are overlaps, so it's sized again every frame. An
+	// empty one still gets a buffer so binding 2 is never left without one.
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, clusterIndicesSSBO);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(uint32_t) * std::max<size_t>(indices.size(), 1), indices.empty() ? NULL : indices.data(), GL_STREAM_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
 void RendererSystem::DrawShadows() {
 
 	// Set our viewport for our shadow map and link our depth FBO
@@ -506,27 +740,30 @@ void RendererSystem::DrawShadows() {
 
 	GLint uniModel = glGetUniformLocation(shadowMapShader, "model");
 
-	for (int i = 0; i < meshesToDraw.size(); i++) {
-		glBindVertexArray(meshesToDraw[i].vao);
-
-		glUniformMatrix4fv(uniModel, 1, GL_FALSE, glm::value_ptr(meshesToDraw[i].model));
-
-		totalTriangles += static_cast<int>(meshesToDraw[i].mesh->indices.size()) / 3;
-
-		// Use our shader and draw our program
-		glDrawElements(GL_TRIANGLES, static_cast<int>(meshesToDraw[i].mesh->indices.size()), GL_UNSIGNED_INT, 0); //Number of vertices
-	}
-
-	for (int i = 0; i < transparentToDraw.size(); i++) {
-		glBindVertexArray(transparentToDraw[i].vao);
+	// Only meshes in the light's box can cast into the shadow map, whether the camera sees them
+	// or not. Everything between the light and the box still casts, so its near plane is left out.
+	glm::vec4 lightPlanes[6];
+	Camera::ExtractFrustumPlanes(lightProjView, lightPlanes);
+	lightPlanes[4] = glm::vec4(0.0f, 0.0f, 0.0f, 1.0f);
+
+	GLuint lastVao = 0;
+	stateChanges += 1;
+	meshTree->QueryFrustum(lightPlanes, [this, uniModel, &lastVao](uint32_t i) {
+		ModelRenderer* mr = meshInstances[i].renderer;
+		uint32_t j = meshInstances[i].mesh;
+		if (mr->vaos[j] != lastVao) {
+			glBindVertexArray(mr->vaos[j]);
+			lastVao = mr->vaos[j];
+			stateChanges += 1;
+		}
 
-		glUniformMatrix4fv(uniModel, 1, GL_FALSE, glm::value_ptr(transparentToDraw[i].model));
+		glUniformMatrix4fv(uniModel, 1, GL_FALSE, glm::value_ptr(mr->gameObject->transform->model));
 
-		totalTriangles += static_cast<int>(transparentToDraw[i].mesh->indices.size()) / 3;
+		totalTriangles += static_cast<int>(mr->model->meshes[j]->indices.size()) / 3;
 
 		// Use our shader and draw our program
-		glDrawElements(GL_TRIANGLES, static_cast<int>(transparentToDraw[i].mesh->indices.size()), GL_UNSIGNED_INT, 0); //Number of vertices
-	}
+		glDrawElements(GL_TRIANGLES, static_cast<int>(mr->model->meshes[j]->indices.size()), GL_UNSIGNED_INT, 0); //Number of vertices
+	});
 
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
@@ -543,86 +780,98 @@ void RendererSystem::DeferredToTexture() {
 	glClearColor(0, 0, 0, 1.0f);
 	glClear(GL_COLOR_BUFFER_BIT);
 
-	// All opaque meshes use same shader
-	if (meshesToDraw.size() > 0) {
-		glUseProgram(meshesToDraw[0].shaderProgram);
-	}
-
-	// Draw all of our wanted meshRendereres
-	for (int i = 0; i < meshesToDraw.size(); i++) {
-
-		glBindVertexArray(meshesToDraw[i].vao);
-
-		Material* m = meshesToDraw[i].material;
+	// Opaque draws are sorted by shader, then material, then vao, so each is only bound when the
+	// draw before used a different one. Uniforms belong to the program, so a new program needs
+	// its material set again.
+	uint32_t opaqueEnd = renderQueue->PassBegin(RENDER_PASS_TRANSPARENT);
+	GLuint lastProgram = 0;
+	GLuint lastVao = 0;
+	const Material* lastMaterial = nullptr;
+	for (uint32_t i = 0; i < opaqueEnd; i++) {
+		const MeshToDraw& draw = meshesToDraw[(*renderQueue)[i].index];
+		Material* m = draw.material;
+
+		if (draw.shaderProgram != lastProgram) {
+			glUseProgram(draw.shaderProgram);
+			glUniformMatrix4fv(m->uniView, 1, GL_FALSE, glm::value_ptr(view));
+			glUniformMatrix4fv(m->uniProj, 1, GL_FALSE, glm::value_ptr(proj));
+			lastProgram = draw.shaderProgram;
+			lastMaterial = nullptr;
+			stateChanges += 1;
+		}
 
-		glUniformMatrix4fv(m->uniModel, 1, GL_FALSE, glm::value_ptr(meshesToDraw[i].model));
-		glUniformMatrix4fv(m->uniView, 1, GL_FALSE, glm::value_ptr(view));
-		glUniformMatrix4fv(m->uniProj, 1, GL_FALSE, glm::value_ptr(proj));
+		if (draw.vao != lastVao) {
+			glBindVertexArray(draw.vao);
+			lastVao = draw.vao;
+			stateChanges += 1;
+		}
 
-		glUniform3f(m->uniAmbient, m->ambient.r, m->ambient.g, m->ambient.b);
-		glUniform3f(m->uniDiffuse, m->diffuse.r, m->diffuse.g, m->diffuse.b);
-		glUniform3f(m->uniSpecular, m->specular.r, m->specular.g, m->specular.b);
-		glUniform1f(m->uniSpecularExp, m->specularExponent);
+		glUniformMatrix4fv(m->uniModel, 1, GL_FALSE, glm::value_ptr(draw.model));
 
-		glUniform1i(m->uniUsingNormal, m->usingNormal);
+		if (m != lastMaterial) {
+			lastMaterial = m;
+			stateChanges += 1;
 
+			glUniform3f(m->uniAmbient, m->ambient.r, m->ambient.g, m->ambient.b);
+			glUniform3f(m->uniDiffuse, m->diffuse.r, m->diffuse.g, m->diffuse.b);
+			glUniform3f(m->uniSpecular, m->specular.r, m->specular.g, m->specular.b);
+			glUniform1f(m->uniSpecularExp, m->specularExponent);
 
-		// How could I change the following IF statements to avoid last second state changes?
-		// Could I call specific functions?
+			glUniform1i(m->uniUsingNormal, m->usingNormal);
 
-		glActiveTexture(GL_TEXTURE0 + 0);
-		if (m->diffuseTexture != nullptr) {
-			glBindTexture(GL_TEXTURE_2D, (*AssetManager::diffuseTextures)[m->diffuseIndex]);
-		} else {
-			glBindTexture(GL_TEXTURE_2D, AssetManager::nullTexture);
-		}
-		glUniform1i(m->uniDiffuseTex, 0);
+			glActiveTexture(GL_TEXTURE0 + 0);
+			if (m->diffuseTexture != nullptr) {
+				glBindTexture(GL_TEXTURE_2D, (*AssetManager::diffuseTextures)[m->diffuseIndex]);
+			} else {
+				glBindTexture(GL_TEXTURE_2D, AssetManager::nullTexture);
+			}
+			glUniform1i(m->uniDiffuseTex, 0);
 
-		glActiveTexture(GL_TEXTURE0 + 1);
-		if (m->specularTexture != nullptr) {
-			glBindTexture(GL_TEXTURE_2D, (*AssetManager::specularTextures)[m->specularIndex]);
-		} else {
-			glBindTexture(GL_TEXTURE_2D, AssetManager::nullTexture);
-		}
-		glUniform1i(m->uniSpecularTex, 1);
+			glActiveTexture(GL_TEXTURE0 + 1);
+			if (m->specularTexture != nullptr) {
+				glBindTexture(GL_TEXTURE_2D, (*AssetManager::specularTextures)[m->specularIndex]);
+			} else {
+				glBindTexture(GL_TEXTURE_2D, AssetManager::nullTexture);
+			}
+			glUniform1i(m->uniSpecularTex, 1);
 
-		glActiveTexture(GL_TEXTURE0 + 2);
-		if (m->specularHighLightTexture != nullptr) {
-			glBindTexture(GL_TEXTURE_2D, (*AssetManager::specularHighLightTextures)[m->specularHighLightIndex]);
-		} else {
-			glBindTexture(GL_TEXTURE_2D, AssetManager::nullTexture);
-		}
-		glUniform1i(m->uniSpecularHighLightTex, 2);
+			glActiveTexture(GL_TEXTURE0 + 2);
+			if (m->specularHighLightTexture != nullptr) {
+				glBindTexture(GL_TEXTURE_2D, (*AssetManager::specularHighLightTextures)[m->specularHighLightIndex]);
+			} else {
+				glBindTexture(GL_TEXTURE_2D, AssetManager::nullTexture);
+			}
+			glUniform1i(m->uniSpecularHighLightTex, 2);
 
-		glActiveTexture(GL_TEXTURE0 + 3);
-		if (m->bumpTexture != nullptr) {
-			glBindTexture(GL_TEXTURE_2D, (*AssetManager::bumpTextures)[m->bumpIndex]);
-		} else {
-			glBindTexture(GL_TEXTURE_2D, AssetManager::nullTexture);
-		}
-		glUniform1i(m->uniBumpTex, 3);
+			glActiveTexture(GL_TEXTURE0 + 3);
+			if (m->bumpTexture != nullptr) {
+				glBindTexture(GL_TEXTURE_2D, (*AssetManager::bumpTextures)[m->bumpIndex]);
+			} else {
+				glBindTexture(GL_TEXTURE_2D, AssetManager::nullTexture);
+			}
+			glUniform1i(m->uniBumpTex, 3);
 
-		glActiveTexture(GL_TEXTURE0 + 4);
-		if (m->normalTexture != nullptr) {
-			glBindTexture(GL_TEXTURE_2D, (*AssetManager::normalTextures)[m->normalIndex]);
-		} else {
-			glBindTexture(GL_TEXTURE_2D, AssetManager::nullTexture);
-		}
-		glUniform1i(m->uniNormalTex, 4);
+			glActiveTexture(GL_TEXTURE0 + 4);
+			if (m->normalTexture != nullptr) {
+				glBindTexture(GL_TEXTURE_2D, (*AssetManager::normalTextures)[m->normalIndex]);
+			} else {
+				glBindTexture(GL_TEXTURE_2D, AssetManager::nullTexture);
+			}
+			glUniform1i(m->uniNormalTex, 4);
 
-		glActiveTexture(GL_TEXTURE0 + 5);
-		if (m->displacementTexture != nullptr) {
-			glBindTexture(GL_TEXTURE_2D, (*AssetManager::displacementTextures)[m->displacementIndex]);
-		} else {
-			glBindTexture(GL_TEXTURE_2D, AssetManager::nullTexture);
+			glActiveTexture(GL_TEXTURE0 + 5);
+			if (m->displacementTexture != nullptr) {
+				glBindTexture(GL_TEXTURE_2D, (*AssetManager::displacementTextures)[m->displacementIndex]);
+			} else {
+				glBindTexture(GL_TEXTURE_2D, AssetManager::nullTexture);
+			}
+			glUniform1i(m->uniDisplacementTex, 5);
 		}
-		glUniform1i(m->uniDisplacementTex, 5);
 
-
-		totalTriangles += static_cast<int>(meshesToDraw[i].mesh->indices.size()) / 3;
+		totalTriangles += static_cast<int>(draw.mesh->indices.size()) / 3;
 
 		// Use our shader and draw our program
-		glDrawElements(GL_TRIANGLES, static_cast<int>(meshesToDraw[i].mesh->indices.size()), GL_UNSIGNED_INT, 0); //Number of vertices
+		glDrawElements(GL_TRIANGLES, static_cast<int>(draw.mesh->indices.size()), GL_UNSIGNED_INT, 0); //Number of vertices
 	}
 
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
@@ -655,21 +904,16 @@ void RendererSystem::TiledCompute() {
 	GLint uniCamPos = glGetUniformLocation(tiledComputeShader, "camPos");
 	glUniform3f(uniCamPos, camPos.x, camPos.y, camPos.z);
 
-	GLint uniProjView = glGetUniformLocation(tiledComputeShader, "proj");
-	glUniformMatrix4fv(uniProjView, 1, GL_FALSE, glm::value_ptr(proj));
-	GLint uniView = glGetUniformLocation(tiledComputeShader, "view");
-	glUniformMatrix4fv(uniView, 1, GL_FALSE, glm::value_ptr(view));
-
 	GLint uniInvProj = glGetUniformLocation(tiledComputeShader, "invProj");
 	glUniformMatrix4fv(uniInvProj, 1, GL_FALSE, glm::value_ptr(glm::inverse(proj)));
 	GLint uniInvView = glGetUniformLocation(tiledComputeShader, "invView");
 	glUniformMatrix4fv(uniInvView, 1, GL_FALSE, glm::value_ptr(glm::inverse(view)));
 
-	GLint uniNumPointLights = glGetUniformLocation(tiledComputeShader, "numPointLights");
-	glUniform1ui(uniNumPointLights, static_cast<unsigned int>(pointLightsToGPU.size()));
+	GLint uniNumClusters = glGetUniformLocation(tiledComputeShader, "numClusters");
+	glUniform3ui(uniNumClusters, CLUSTER_TILES_X, CLUSTER_TILES_Y, CLUSTER_SLICES);
+	glUniform1f(glGetUniformLocation(tiledComputeShader, "clusterScale"), lightClusters->SliceScale());
+	glUniform1f(glGetUniformLocation(tiledComputeShader, "clusterBias"), lightClusters->SliceBias());
 
-	//TODO:
-	// Need to decide if this compute shader is an all-in-one or if it will just calculate light tiles
 	glDispatchCompute(NUM_GROUPS_X, NUM_GROUPS_Y, 1);
 	glMemoryBarrier(GL_ALL_BARRIER_BITS);
 }
@@ -734,120 +978,127 @@ void RendererSystem::DrawTransparent() {
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 	glm::vec3 camPos = mainCamera->transform->position;
 
-	// Not worth sorting transparent objects for sponza as each transparent model is not separate. 1 obj has transparent models in multiple locations
-	// But will sort anyways to deal with other models
-	std::sort(transparentToDraw.begin(), transparentToDraw.end(), [camPos](const MeshToDraw& a, const MeshToDraw& b) {
-		return glm::length(a.position - camPos) > glm::length(b.position - camPos);
-	});
-
-	// all transparent objects use same shader
-	if (transparentToDraw.size() > 0) {
-		glUseProgram(transparentToDraw[0].shaderProgram);
-
-		GLint uniCamPos = glGetUniformLocation(transparentToDraw[0].shaderProgram, "camPos");
-		glUniform3f(uniCamPos, camPos.x, camPos.y, camPos.z);
-
-		GLint uniNumTiles = glGetUniformLocation(transparentToDraw[0].shaderProgram, "numTiles");
-		glUniform2i(uniNumTiles, NUM_GROUPS_X, NUM_GROUPS_Y);
-
-		// Directional light
-		GLint lightDir = glGetUniformLocation(transparentToDraw[0].shaderProgram, "directionalLightDir");
-		glUniform3f(lightDir, mainScene->directionalLights[0].direction.x, mainScene->directionalLights[0].direction.y, mainScene->directionalLights[0].direction.z);
-		GLint lightCol = glGetUniformLocation(transparentToDraw[0].shaderProgram, "directionalLightCol");
-		glUniform3f(lightCol, mainScene->directionalLights[0].color.r, mainScene->directionalLights[0].color.g, mainScene->directionalLights[0].color.b);
-
-		// Shadow map stuff
-		glActiveTexture(GL_TEXTURE0 + 8);
-		glBindTexture(GL_TEXTURE_2D, depthMap);
-		glUniform1i(glGetUniformLocation(transparentToDraw[0].shaderProgram, "depthMap"), 8);
-		glUniformMatrix4fv(glGetUniformLocation(transparentToDraw[0].shaderProgram, "directionalLightProjView"), 1, GL_FALSE, glm::value_ptr(lightProjView));
-	}
-
-	// For each of our transparent objects, set up its shader
-	for (int i = 0; i < static_cast<int>(transparentToDraw.size()); i++) {
-
-		glBindVertexArray(transparentToDraw[i].vao);
-
-		Material* m = transparentToDraw[i].material;
+	// Transparent draws come after the opaque ones, back to front. State is still only bound
+	// when it differs from the draw before.
+	uint32_t transparentBegin = renderQueue->PassBegin(RENDER_PASS_TRANSPARENT);
+	GLuint lastProgram = 0;
+	GLuint lastVao = 0;
+	const Material* lastMaterial = nullptr;
+	for (uint32_t i = transparentBegin; i < renderQueue->Size(); i++) {
+		const MeshToDraw& draw = meshesToDraw[(*renderQueue)[i].index];
+		Material* m = draw.material;
+
+		if (draw.shaderProgram != lastProgram) {
+			glUseProgram(draw.shaderProgram);
+			glUniformMatrix4fv(m->uniView, 1, GL_FALSE, glm::value_ptr(view));
+			glUniformMatrix4fv(m->uniProj, 1, GL_FALSE, glm::value_ptr(proj));
+			lastProgram = draw.shaderProgram;
+			lastMaterial = nullptr;
+			stateChanges += 1;
+
+			GLint uniCamPos = glGetUniformLocation(draw.shaderProgram, "camPos");
+			glUniform3f(uniCamPos, camPos.x, camPos.y, camPos.z);
+
+			GLint uniNumClusters = glGetUniformLocation(draw.shaderProgram, "numClusters");
+			glUniform3ui(uniNumClusters, CLUSTER_TILES_X, CLUSTER_TILES_Y, CLUSTER_SLICES);
+			glUniform1f(glGetUniformLocation(draw.shaderProgram, "clusterScale"), lightClusters->SliceScale());
+			glUniform1f(glGetUniformLocation(draw.shaderProgram, "clusterBias"), lightClusters->SliceBias());
+
+			// Directional light
+			GLint lightDir = glGetUniformLocation(draw.shaderProgram, "directionalLightDir");
+			glUniform3f(lightDir, mainScene->directionalLights[0].direction.x, mainScene->directionalLights[0].direction.y, mainScene->directionalLights[0].direction.z);
+			GLint lightCol = glGetUniformLocation(draw.shaderProgram, "directionalLightCol");
+			glUniform3f(lightCol, mainScene->directionalLights[0].color.r, mainScene->directionalLights[0].color.g, mainScene->directionalLights[0].color.b);
+
+			// Shadow map stuff
+			glActiveTexture(GL_TEXTURE0 + 8);
+			glBindTexture(GL_TEXTURE_2D, depthMap);
+			glUniform1i(glGetUniformLocation(draw.shaderProgram, "depthMap"), 8);
+			glUniformMatrix4fv(glGetUniformLocation(draw.shaderProgram, "directionalLightProjView"), 1, GL_FALSE, glm::value_ptr(lightProjView));
+		}
 
-		glUniformMatrix4fv(m->uniModel, 1, GL_FALSE, glm::value_ptr(transparentToDraw[i].model));
-		glUniformMatrix4fv(m->uniView, 1, GL_FALSE, glm::value_ptr(view));
-		glUniformMatrix4fv(m->uniProj, 1, GL_FALSE, glm::value_ptr(proj));
+		if (draw.vao != lastVao) {
+			glBindVertexArray(draw.vao);
+			lastVao = draw.vao;
+			stateChanges += 1;
+		}
 
-		glUniform3f(m->uniAmbient, m->ambient.r, m->ambient.g, m->ambient.b);
-		glUniform3f(m->uniDiffuse, m->diffuse.r, m->diffuse.g, m->diffuse.b);
-		glUniform3f(m->uniSpecular, m->specular.r, m->specular.g, m->specular.b);
-		glUniform1f(m->uniSpecularExp, m->specularExponent);
-		glUniform1f(m->uniOpacity, m->opacity);
+		glUniformMatrix4fv(m->uniModel, 1, GL_FALSE, glm::value_ptr(draw.model));
 
-		glUniform1i(m->uniUsingBump, m->usingBump);
-		glUniform1i(m->uniUsingNormal, m->usingNormal);
+		if (m != lastMaterial) {
+			lastMaterial = m;
+			stateChanges += 1;
 
+			glUniform3f(m->uniAmbient, m->ambient.r, m->ambient.g, m->ambient.b);
+			glUniform3f(m->uniDiffuse, m->diffuse.r, m->diffuse.g, m->diffuse.b);
+			glUniform3f(m->uniSpecular, m->specular.r, m->specular.g, m->specular.b);
+			glUniform1f(m->uniSpecularExp, m->specularExponent);
+			glUniform1f(m->uniOpacity, m->opacity);
 
-		// How could I change the following IF statements to avoid last second state changes?
-		// Could I call specific functions?
+			glUniform1i(m->uniUsingBump, m->usingBump);
+			glUniform1i(m->uniUsingNormal, m->usingNormal);
 
-		glActiveTexture(GL_TEXTURE0 + 0);
-		if (m->diffuseTexture != nullptr) {
-			glBindTexture(GL_TEXTURE_2D, (*AssetManager::diffuseTextures)[m->diffuseIndex]);
-		} else {
-			glBindTexture(GL_TEXTURE_2D, AssetManager::nullTexture);
-		}
-		glUniform1i(m->uniDiffuseTex, 0);
+			glActiveTexture(GL_TEXTURE0 + 0);
+			if (m->diffuseTexture != nullptr) {
+				glBindTexture(GL_TEXTURE_2D, (*AssetManager::diffuseTextures)[m->diffuseIndex]);
+			} else {
+				glBindTexture(GL_TEXTURE_2D, AssetManager::nullTexture);
+			}
+			glUniform1i(m->uniDiffuseTex, 0);
 
-		glActiveTexture(GL_TEXTURE0 + 1);
-		if (m->specularTexture != nullptr) {
-			glBindTexture(GL_TEXTURE_2D, (*AssetManager::specularTextures)[m->specularIndex]);
-		} else {
-			glBindTexture(GL_TEXTURE_2D, AssetManager::nullTexture);
-		}
-		glUniform1i(m->uniSpecularTex, 1);
+			glActiveTexture(GL_TEXTURE0 + 1);
+			if (m->specularTexture != nullptr) {
+				glBindTexture(GL_TEXTURE_2D, (*AssetManager::specularTextures)[m->specularIndex]);
+			} else {
+				glBindTexture(GL_TEXTURE_2D, AssetManager::nullTexture);
+			}
+			glUniform1i(m->uniSpecularTex, 1);
 
-		glActiveTexture(GL_TEXTURE0 + 2);
-		if (m->specularHighLightTexture != nullptr) {
-			glBindTexture(GL_TEXTURE_2D, (*AssetManager::specularHighLightTextures)[m->specularHighLightIndex]);
-		} else {
-			glBindTexture(GL_TEXTURE_2D, AssetManager::nullTexture);
-		}
-		glUniform1i(m->uniSpecularHighLightTex, 2);
+			glActiveTexture(GL_TEXTURE0 + 2);
+			if (m->specularHighLightTexture != nullptr) {
+				glBindTexture(GL_TEXTURE_2D, (*AssetManager::specularHighLightTextures)[m->specularHighLightIndex]);
+			} else {
+				glBindTexture(GL_TEXTURE_2D, AssetManager::nullTexture);
+			}
+			glUniform1i(m->uniSpecularHighLightTex, 2);
 
-		glActiveTexture(GL_TEXTURE0 + 3);
-		if (m->bumpTexture != nullptr) {
-			glBindTexture(GL_TEXTURE_2D, (*AssetManager::bumpTextures)[m->bumpIndex]);
-		} else {
-			glBindTexture(GL_TEXTURE_2D, AssetManager::nullTexture);
-		}
-		glUniform1i(m->uniBumpTex, 3);
+			glActiveTexture(GL_TEXTURE0 + 3);
+			if (m->bumpTexture != nullptr) {
+				glBindTexture(GL_TEXTURE_2D, (*AssetManager::bumpTextures)[m->bumpIndex]);
+			} else {
+				glBindTexture(GL_TEXTURE_2D, AssetManager::nullTexture);
+			}
+			glUniform1i(m->uniBumpTex, 3);
 
-		glActiveTexture(GL_TEXTURE0 + 4);
-		if (m->normalTexture != nullptr) {
-			glBindTexture(GL_TEXTURE_2D, (*AssetManager::normalTextures)[m->normalIndex]);
-		} else {
-			glBindTexture(GL_TEXTURE_2D, AssetManager::nullTexture);
-		}
-		glUniform1i(m->uniNormalTex, 4);
+			glActiveTexture(GL_TEXTURE0 + 4);
+			if (m->normalTexture != nullptr) {
+				glBindTexture(GL_TEXTURE_2D, (*AssetManager::normalTextures)[m->normalIndex]);
+			} else {
+				glBindTexture(GL_TEXTURE_2D, AssetManager::nullTexture);
+			}
+			glUniform1i(m->uniNormalTex, 4);
 
-		glActiveTexture(GL_TEXTURE0 + 5);
-		if (m->displacementTexture != nullptr) {
-			glBindTexture(GL_TEXTURE_2D, (*AssetManager::displacementTextures)[m->displacementIndex]);
-		} else {
-			glBindTexture(GL_TEXTURE_2D, AssetManager::nullTexture);
-		}
-		glUniform1i(m->uniDisplacementTex, 5);
+			glActiveTexture(GL_TEXTURE0 + 5);
+			if (m->displacementTexture != nullptr) {
+				glBindTexture(GL_TEXTURE_2D, (*AssetManager::displacementTextures)[m->displacementIndex]);
+			} else {
+				glBindTexture(GL_TEXTURE_2D, AssetManager::nullTexture);
+			}
+			glUniform1i(m->uniDisplacementTex, 5);
 
-		glActiveTexture(GL_TEXTURE0 + 6);
-		if (m->alphaTexture != nullptr) {
-			glBindTexture(GL_TEXTURE_2D, (*AssetManager::alphaTextures)[m->alphaIndex]);
-		} else {
-			glBindTexture(GL_TEXTURE_2D, AssetManager::nullTexture);
+			glActiveTexture(GL_TEXTURE0 + 6);
+			if (m->alphaTexture != nullptr) {
+				glBindTexture(GL_TEXTURE_2D, (*AssetManager::alphaTextures)[m->alphaIndex]);
+			} else {
+				glBindTexture(GL_TEXTURE_2D, AssetManager::nullTexture);
+			}
+			glUniform1i(m->uniAlphaTex, 6);
 		}
-		glUniform1i(m->uniAlphaTex, 6);
-
 
-		totalTriangles += static_cast<int>(transparentToDraw[i].mesh->indices.size()) / 3;
+		totalTriangles += static_cast<int>(draw.mesh->indices.size()) / 3;
 
 		// Use our shader and draw our program
-		glDrawElements(GL_TRIANGLES, static_cast<int>(transparentToDraw[i].mesh->indices.size()), GL_UNSIGNED_INT, 0); //Number of vertices
+		glDrawElements(GL_TRIANGLES, static_cast<int>(draw.mesh->indices.size()), GL_UNSIGNED_INT, 0); //Number of vertices
 	}
 
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
@@ -877,36 +1128,3 @@ void RendererSystem::PostProcess() {
 	glDrawArrays(GL_TRIANGLES, 0, 6); //Number of vertices
 }
 
-bool RendererSystem::ShouldFrustumCull(const Mesh* mesh, const glm::mat4& model) const {
-
-	// Not dereferencing and caching bounds moved my ModelRendererSystem::Render call from 10.11% 
-	// of total time used to 8.66%. Insignificant change, could be randomness or difference in view
-	glm::vec3 maxPoint = mesh->bounds->Max(model);
-	glm::vec3 minPoint = mesh->bounds->Min(model);
-
-	/* https://fgiesen.wordpress.com/2010/10/17/view-frustum-culling/
-	* Method 4
-		Switched to this method instead of checking each bounding box point
-		because I ran into issues with large meshes. I would be looking
-		directly at the mesh and all of its bounds points are ouside the
-		frustum. So even though it is right in front of me, it is culled
-		due to only checking it's extremes.
-
-		Checks if every plane can "see" the most likely point. If every plane can see
-		at least one point that means our mesh is at least partially visible.
-	*/
-	int success = 0;
-	for (int j = 0; j < 6; j++) {
-		float val = fmax(minPoint.x * mainCamera->frustumPlanes[j].x, maxPoint.x * mainCamera->frustumPlanes[j].x)
-			+ fmax(minPoint.y * mainCamera->frustumPlanes[j].y, maxPoint.y * mainCamera->frustumPlanes[j].y)
-			+ fmax(minPoint.z * mainCamera->frustumPlanes[j].z, maxPoint.z * mainCamera->frustumPlanes[j].z)
-			+ mainCamera->frustumPlanes[j].w;
-		success += (val > 0);
-	}
-
-	if (success == 6) {
-		return false;
-	}
-
-	return true;
-}
@@ -0,0 +1,71 @@
+#include "CacheSimulator.h"
+
+#include <algorithm>
+
+#define CACHE_LINE_SIZE 64
+#define EMPTY_LINE 0xFFFFFFFFFFFFFFFF
+
+CacheSimulator::CacheSimulator(uint32_t sizeBytes, uint32_t ways, CacheSimulator* next) : nextLevel(next) {
+	numWays = std::max(1u, ways);
+	numSets = std::max(1u, sizeBytes / (CACHE_LINE_SIZE * numWays));
+
+	tags = std::vector<uint64_t>(numSets * numWays, EMPTY_LINE);
+	lastUsed = std::vector<uint64_t>(numSets * numWays, 0);
+}
+
+void CacheSimulator::Access(const void* address, size_t bytes) {
+	uint64_t start = reinterpret_cast<uintptr_t>(address) / CACHE_LINE_SIZE;
+	uint64_t end = (reinterpret_cast<uintptr_t>(address) + std::max(static_cast<size_t>(1), bytes) - 1) / CACHE_LINE_SIZE;
+
+	for (uint64_t line = start; line <= end; line += 1) {
+		AccessLine(line);
+	}
+}
+
+bool CacheSimulator::AccessLine(uint64_t line) {
+	clock += 1;
+
+	uint32_t set = static_cast<uint32_t>(line % numSets);
+	uint64_t* setTags = &tags[set * numWays];
+	uint64_t* setLastUsed = &lastUsed[set * numWays];
+
+	uint32_t victim = 0;
+	for (uint32_t way = 0; way < numWays; way += 1) {
+		if (setTags[way] == line) {
+			setLastUsed[way] = clock;
+			hits += 1;
+			return true;
+		}
+
+		if (setLastUsed[way] < setLastUsed[victim]) {
+			victim = way;
+		}
+	}
+
+	// Miss. Evict the least recently used line.
+	misses += 1;
+	setTags[victim] = line;
+	setLastUsed[victim] = clock;
+
+	if (nextLevel) {
+		nextLevel->AccessLine(line);
+	}
+	return false;
+}
+
+void CacheSimulator::Reset() {
+	std::fill(tags.begin(), tags.end(), EMPTY_LINE);
+	std::fill(lastUsed.begin(), lastUsed.end(), 0);
+	clock = 0;
+	hits = 0;
+	misses = 0;
+
+	if (nextLevel) {
+		nextLevel->Reset();
+	}
+}
+
+float CacheSimulator::MissRate() const {
+	uint64_t total = hits + misses;
+	return total > 0 ? misses / static_cast<float>(total) : 0.0f;
+}
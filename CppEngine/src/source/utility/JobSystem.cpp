@@ -0,0 +1,152 @@
+#include "JobSystem.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace JobSystem {
+
+	namespace detail {
+		std::vector<std::thread> workers;
+		std::deque<std::function<void()> > jobs;
+		std::mutex jobMutex;
+		std::condition_variable jobCondition;
+		bool running = false;
+
+		void WorkerLoop() {
+			while (true) {
+				std::function<void()> job;
+				{
+					std::unique_lock<std::mutex> lock(jobMutex);
+					jobCondition.wait(lock, [] { return !running || !jobs.empty(); });
+					if (!running && jobs.empty()) {
+						return;
+					}
+					job = std::move(jobs.front());
+					jobs.pop_front();
+				}
+				job();
+			}
+		}
+
+		void Push(std::function<void()> job) {
+			{
+				std::lock_guard<std::mutex> lock(jobMutex);
+				jobs.push_back(std::move(job));
+			}
+			jobCondition.notify_one();
+		}
+
+		// Shared between the caller and helpers so a late helper never touches a dead stack frame
+		struct ParallelForState {
+			std::atomic<uint32_t> nextChunk{ 0 };
+			std::atomic<uint32_t> chunksDone{ 0 };
+			uint32_t numChunks = 0;
+			uint32_t count = 0;
+			uint32_t grainSize = 1;
+			std::function<void(uint32_t, uint32_t)> func;
+			std::mutex doneMutex;
+			std::condition_variable doneCondition;
+		};
+
+		void RunChunks(ParallelForState& state) {
+			uint32_t chunk;
+			while ((chunk = state.nextChunk.fetch_add(1)) < state.numChunks) {
+				uint32_t begin = chunk * state.grainSize;
+				uint32_t end = std::min(state.count, begin + state.grainSize);
+				state.func(begin, end);
+
+				if (state.chunksDone.fetch_add(1) + 1 == state.numChunks) {
+					std::lock_guard<std::mutex> lock(state.doneMutex);
+					state.doneCondition.notify_all();
+				}
+			}
+		}
+	}
+
+	void Init(uint32_t numThreads) {
+		if (detail::running) {
+			return;
+		}
+
+		if (numThreads == 0) {
+			uint32_t hardwareThreads = std::thread::hardware_concurrency();
+			numThreads = hardwareThreads > 1 ? hardwareThreads - 1 : 0;
+		}
+
+		detail::running = true;
+		detail::workers.reserve(numThreads);
+		for (uint32_t i = 0; i < numThreads; i += 1) {
+			detail::workers.push_back(std::thread(detail::WorkerLoop));
+		}
+	}
+
+	void CleanUp() {
+		{
+			std::lock_guard<std::mutex> lock(detail::jobMutex);
+			detail::running = false;
+		}
+		detail::jobCondition.notify_all();
+
+		for (size_t i = 0; i < detail::workers.size(); i += 1) {
+			detail::workers[i].join();
+		}
+		detail::workers.clear();
+	}
+
+	uint32_t NumThreads() {
+		return static_cast<uint32_t>(detail::workers.size()) + 1;
+	}
+
+	void ParallelFor(uint32_t count, uint32_t grainSize, const std::function<void(uint32_t, uint32_t)>& func) {
+		if (count == 0) {
+			return;
+		}
+		grainSize = std::max(1u, grainSize);
+		uint32_t numChunks = (count + grainSize - 1) / grainSize;
+
+		// Not worth waking anyone up
+		if (numChunks == 1 || detail::workers.empty()) {
+			for (uint32_t begin = 0; begin < count; begin += grainSize) {
+				func(begin, std::min(count, begin + grainSize));
+			}
+			return;
+		}
+
+		std::shared_ptr<detail::ParallelForState> state = std::make_shared<detail::ParallelForState>();
+		state->numChunks = numChunks;
+		state->count = count;
+		state->grainSize = grainSize;
+		state->func = func;
+
+		uint32_t numHelpers = std::min(static_cast<uint32_t>(detail::workers.size()), numChunks - 1);
+		for (uint32_t i = 0; i < numHelpers; i += 1) {
+			detail::Push([state]() { detail::RunChunks(*state); });
+		}
+
+		// Help out, then wait for any chunks still in flight on other threads
+		detail::RunChunks(*state);
+
+		std::unique_lock<std::mutex> lock(state->doneMutex);
+		state->doneCondition.wait(lock, [&state] { return state->chunksDone.load() == state->numChunks; });
+	}
+
+	std::future<void> Submit(std::function<void()> job) {
+		std::shared_ptr<std::packaged_task<void()> > task = std::make_shared<std::packaged_task<void()> >(std::move(job));
+		std::future<void> result = task->get_future();
+
+		if (detail::workers.empty()) {
+			(*task)();
+		}
+		else {
+			detail::Push([task]() { (*task)(); });
+		}
+
+		return result;
+	}
+}
@@ -0,0 +1,130 @@
+#include "LightTree.h"
+#include "JobSystem.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+// Builds light trees over random lights and checks them against the scalar octant test, brute
+// force lookups and a fresh Build after updates. Exits with 1 on any mismatch.
+
+namespace {
+	const glm::vec3 worldMin = glm::vec3(-500.0f, 0.0f, -500.0f);
+	const glm::vec3 worldMax = glm::vec3(500.0f, 100.0f, 500.0f);
+
+	// Clumps of small lights, a few spread out on their own and a few big enough to cover most
+	// of the world, some hanging outside it
+	std::vector<glm::vec4> RandomLights(uint32_t count, std::mt19937& rng) {
+		std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+		std::normal_distribution<float> spread(0.0f, 1.0f);
+		glm::vec3 extent = worldMax - worldMin;
+
+		const uint32_t numClumps = 6;
+		glm::vec3 clumps[numClumps];
+		for (uint32_t c = 0; c < numClumps; c += 1) {
+			clumps[c] = worldMin + extent * glm::vec3(unit(rng), unit(rng), unit(rng));
+		}
+
+		std::vector<glm::vec4> lights(count);
+		for (glm::vec4& light : lights) {
+			float kind = unit(rng);
+			if (kind < 0.01f) {
+				light = glm::vec4(worldMin + extent * glm::vec3(unit(rng), unit(rng), unit(rng)), 300.0f * unit(rng));
+			}
+			else if (kind < 0.2f) {
+				light = glm::vec4(worldMin - extent * 0.1f + extent * 1.2f * glm::vec3(unit(rng), unit(rng), unit(rng)), 1.0f + 15.0f * unit(rng));
+			}
+			else {
+				const glm::vec3& clump = clumps[static_cast<uint32_t>(unit(rng) * numClumps) % numClumps];
+				light = glm::vec4(clump + glm::vec3(spread(rng), spread(rng), spread(rng)) * 20.0f, 1.0f + 7.0f * unit(rng) * unit(rng));
+			}
+		}
+		return lights;
+	}
+
+	// Lights whose sphere holds point that aren't in the leaf Lookup finds for it
+	uint32_t MissingLights(const LightTree& tree, const std::vector<glm::vec4>& lights, const glm::vec3& point) {
+		const LightTreeNode& leaf = tree.Lookup(point);
+		const uint32_t* first = tree.GetLightIndices() + leaf.offset;
+		uint32_t missing = 0;
+		for (uint32_t light = 0; light < lights.size(); light += 1) {
+			glm::vec3 toLight = glm::vec3(lights[light]) - point;
+			if (glm::dot(toLight, toLight) <= lights[light].w * lights[light].w) {
+				missing += std::binary_search(first, first + leaf.numPointLights, light) ? 0 : 1;
+			}
+		}
+		return missing;
+	}
+
+	// Whether the leaves holding point list the same lights in both trees
+	bool SameLeaf(const LightTree& a, const LightTree& b, const glm::vec3& point) {
+		const LightTreeNode& leafA = a.Lookup(point);
+		const LightTreeNode& leafB = b.Lookup(point);
+		const uint32_t* firstA = a.GetLightIndices() + leafA.offset;
+		const uint32_t* firstB = b.GetLightIndices() + leafB.offset;
+		return leafA.numPointLights == leafB.numPointLights
+			&& leafA.numSpotLights == leafB.numSpotLights
+			&& std::equal(firstA, firstA + leafA.numPointLights + leafA.numSpotLights, firstB);
+	}
+}
+
+int main() {
+	JobSystem::Init();
+	std::mt19937 rng(40);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	uint32_t failures = 0;
+
+	const uint32_t counts[5] = { 0, 3, 9, 1000, 20000 };
+	for (uint32_t count : counts) {
+		std::vector<glm::vec4> lights = RandomLights(count, rng);
+
+		LightTree tree;
+		tree.Build(lights.data(), count, nullptr, 0, worldMin, worldMax);
+		LightTree reference;
+		reference.scalarOctants = true;
+		reference.Build(lights.data(), count, nullptr, 0, worldMin, worldMax);
+		uint32_t differences = tree.DifferencesFrom(reference);
+
+		uint32_t missing = 0;
+		for (uint32_t i = 0; i < 256; i += 1) {
+			glm::vec3 point = worldMin + (worldMax - worldMin) * glm::vec3(unit(rng), unit(rng), unit(rng));
+			missing += MissingLights(tree, lights, point);
+		}
+
+		// A few frames of lights drifting, some removed and some added, against a fresh Build
+		uint32_t differentLeaves = 0;
+		for (uint32_t frame = 0; frame < 4 && count > 0; frame += 1) {
+			std::vector<LightTreeRange> dirty;
+			for (uint32_t light = 0; light < count; light += 1) {
+				if (unit(rng) < 0.05f) {
+					lights[light] += glm::vec4(glm::vec3(unit(rng), unit(rng), unit(rng)) * 40.0f - 20.0f, 0.0f);
+					dirty.push_back(LightTreeRange{ light, light + 1 });
+				}
+			}
+			std::vector<glm::vec4> added = RandomLights(count / 50 + 1, rng);
+			uint32_t removed = std::min(static_cast<uint32_t>(lights.size()), count / 50 + 1);
+			uint32_t firstChanged = static_cast<uint32_t>(lights.size()) - removed;
+			lights.resize(firstChanged);
+			lights.insert(lights.end(), added.begin(), added.end());
+			dirty.push_back(LightTreeRange{ firstChanged, static_cast<uint32_t>(lights.size()) });
+
+			tree.Update(lights.data(), static_cast<uint32_t>(lights.size()), nullptr, 0, dirty);
+			LightTree rebuilt;
+			rebuilt.Build(lights.data(), static_cast<uint32_t>(lights.size()), nullptr, 0, worldMin, worldMax);
+			for (uint32_t i = 0; i < 256; i += 1) {
+				glm::vec3 point = worldMin + (worldMax - worldMin) * glm::vec3(unit(rng), unit(rng), unit(rng));
+				differentLeaves += SameLeaf(tree, rebuilt, point) ? 0 : 1;
+				missing += MissingLights(tree, lights, point);
+			}
+		}
+
+		bool passed = differences == 0 && missing == 0 && differentLeaves == 0;
+		failures += passed ? 0 : 1;
+		fprintf(stderr, "%s: %u lights, %u nodes and indices different from scalar, %u missing, %u leaves different after Update\n",
+			passed ? "PASS" : "FAIL", count, differences, missing, differentLeaves);
+	}
+
+	JobSystem::CleanUp();
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,137 @@
+#include "LightClusters.h"
+#include "LightTree.h"
+#include "SpotLightBounds.h"
+#include "JobSystem.h"
+
+#include "glm/gtc/matrix_transform.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+// Checks spot light culling against brute force: SpotLightBounds against boxes, froxels in
+// LightClusters and leaves in LightTree. A light that reaches a point has to be kept for it
+// every time. Exits with 1 on any miss.
+
+namespace {
+	// Pointing every way, 5 to 100 degrees wide, so some are wider than a half space
+	std::vector<SpotLightToGPU> RandomSpotLights(uint32_t count, const glm::vec3& boundsMin, const glm::vec3& boundsMax, std::mt19937& rng) {
+		std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+		std::vector<SpotLightToGPU> spotLights(count);
+		for (SpotLightToGPU& light : spotLights) {
+			glm::vec3 direction = glm::vec3(unit(rng), unit(rng), unit(rng)) * 2.0f - 1.0f;
+			direction = glm::dot(direction, direction) > 0.0001f ? glm::normalize(direction) : glm::vec3(0.0f, -1.0f, 0.0f);
+			float outer = glm::radians(5.0f + 95.0f * unit(rng));
+			glm::vec3 position = boundsMin + (boundsMax - boundsMin) * glm::vec3(unit(rng), unit(rng), unit(rng));
+			light.position_and_range = glm::vec4(position, 0.5f + 9.5f * unit(rng));
+			light.direction_and_cos_outer = glm::vec4(direction, std::cos(outer));
+			light.color_and_cos_inner = glm::vec4(glm::vec3(1.0f), std::cos(outer * 0.8f));
+		}
+		return spotLights;
+	}
+
+	// Boxes some points of the cone are in that TouchesBox rejects, and cone points outside
+	// the bounding sphere
+	uint32_t CheckBounds(std::mt19937& rng) {
+		std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+		const glm::vec3 boundsMin = glm::vec3(-10.0f);
+		const glm::vec3 boundsMax = glm::vec3(10.0f);
+		std::vector<SpotLightToGPU> spotLights = RandomSpotLights(2000, boundsMin, boundsMax, rng);
+
+		uint32_t misses = 0;
+		for (const SpotLightToGPU& light : spotLights) {
+			SpotLightBounds cone(light);
+			for (uint32_t b = 0; b < 64; b += 1) {
+				glm::vec3 corner = boundsMin + (boundsMax - boundsMin) * glm::vec3(unit(rng), unit(rng), unit(rng));
+				glm::vec3 boxMin = corner;
+				glm::vec3 boxMax = corner + glm::vec3(unit(rng), unit(rng), unit(rng)) * 4.0f;
+				bool touches = cone.TouchesBox(boxMin, boxMax);
+				for (uint32_t s = 0; s < 32; s += 1) {
+					glm::vec3 point = boxMin + (boxMax - boxMin) * glm::vec3(unit(rng), unit(rng), unit(rng));
+					if (!cone.Contains(point)) {
+						continue;
+					}
+					glm::vec3 toCenter = point - cone.sphereCenter;
+					bool inSphere = glm::dot(toCenter, toCenter) <= cone.sphereRadius * cone.sphereRadius * 1.0001f;
+					misses += (touches && inSphere) ? 0 : 1;
+				}
+			}
+		}
+		return misses;
+	}
+
+	// Spot lights reaching a point in the frustum that aren't in its froxel
+	uint32_t CheckClusters(std::mt19937& rng) {
+		std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+		const float nearPlane = 0.1f;
+		const float farPlane = 100.0f;
+		glm::mat4 view = glm::lookAt(glm::vec3(3.0f, 4.0f, 20.0f), glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+		glm::mat4 proj = glm::perspective(glm::radians(60.0f), 16.0f / 9.0f, nearPlane, farPlane);
+		glm::mat4 invView = glm::inverse(view);
+		std::vector<SpotLightToGPU> spotLights = RandomSpotLights(3000, glm::vec3(-20.0f), glm::vec3(20.0f), rng);
+		uint32_t count = static_cast<uint32_t>(spotLights.size());
+
+		LightClusters clusters;
+		clusters.Build(nullptr, 0, spotLights.data(), count, view, proj, nearPlane, farPlane);
+
+		uint32_t misses = 0;
+		for (uint32_t i = 0; i < 2048; i += 1) {
+			float depth = nearPlane * std::pow(50.0f / nearPlane, unit(rng));
+			glm::vec2 ndc = glm::vec2(unit(rng), unit(rng)) * 2.0f - 1.0f;
+			glm::vec3 viewPos = glm::vec3(ndc.x * depth / proj[0][0], ndc.y * depth / proj[1][1], -depth);
+			glm::vec3 worldPos = glm::vec3(invView * glm::vec4(viewPos, 1.0f));
+
+			const LightCluster& cluster = clusters.GetClusters()[clusters.ClusterIndex(viewPos)];
+			const uint32_t* first = clusters.GetLightIndices().data() + cluster.offset + cluster.numPointLights;
+			const uint32_t* last = first + cluster.numSpotLights;
+			for (uint32_t light = 0; light < count; light += 1) {
+				if (SpotLightBounds(spotLights[light]).Contains(worldPos) && !std::binary_search(first, last, light)) {
+					misses += 1;
+				}
+			}
+		}
+		return misses;
+	}
+
+	// Spot lights reaching a point in the tree's cube that aren't in its leaf
+	uint32_t CheckTree(std::mt19937& rng) {
+		std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+		const glm::vec3 worldMin = glm::vec3(-100.0f, 0.0f, -100.0f);
+		const glm::vec3 worldMax = glm::vec3(100.0f, 20.0f, 100.0f);
+		std::vector<SpotLightToGPU> spotLights = RandomSpotLights(5000, worldMin, worldMax, rng);
+		uint32_t count = static_cast<uint32_t>(spotLights.size());
+
+		LightTree tree;
+		tree.Build(nullptr, 0, spotLights.data(), count, worldMin, worldMax);
+
+		uint32_t misses = 0;
+		for (uint32_t i = 0; i < 2048; i += 1) {
+			glm::vec3 point = worldMin + (worldMax - worldMin) * glm::vec3(unit(rng), unit(rng), unit(rng));
+			const LightTreeNode& leaf = tree.Lookup(point);
+			const uint32_t* first = tree.GetLightIndices() + leaf.offset + leaf.numPointLights;
+			const uint32_t* last = first + leaf.numSpotLights;
+			for (uint32_t light = 0; light < count; light += 1) {
+				if (SpotLightBounds(spotLights[light]).Contains(point) && !std::binary_search(first, last, light)) {
+					misses += 1;
+				}
+			}
+		}
+		return misses;
+	}
+}
+
+int main() {
+	JobSystem::Init();
+	std::mt19937 rng(44);
+
+	uint32_t bounds = CheckBounds(rng);
+	uint32_t clusters = CheckClusters(rng);
+	uint32_t tree = CheckTree(rng);
+	fprintf(stderr, "%s: cone against box %u misses\n", bounds == 0 ? "PASS" : "FAIL", bounds);
+	fprintf(stderr, "%s: cone against froxel %u misses\n", clusters == 0 ? "PASS" : "FAIL", clusters);
+	fprintf(stderr, "%s: cone against light tree leaf %u misses\n", tree == 0 ? "PASS" : "FAIL", tree);
+
+	JobSystem::CleanUp();
+	return bounds == 0 && clusters == 0 && tree == 0 ? 0 : 1;
+}